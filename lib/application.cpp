@@ -22,11 +22,13 @@
 #include <xkbcommon/xkbcommon-x11.h>
 #include <xkbcommon/xkbcommon.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <cassert>
 #include <cmath>
 #include <xcb/xinput.h>
 #include <xcb/xcb.h>
 #include <poll.h>
+#include <cerrno>
 
 #define explicit dont_use_cxx_explicit
 
@@ -68,38 +70,119 @@ update_keymap(struct ClientKeyboard *kbd) {
     return -1;
 }
 
-void timeout_stop_and_remove_timeout(App *app, Timeout *timeout) {
-    for (int timeout_index = 0; timeout_index < app->timeouts.size(); timeout_index++) {
-        Timeout *t = app->timeouts[timeout_index];
-        if (t == timeout) {
-            if (t->client) {
-                // printf("Timeout Removed: client = %s, fd = %d\n", t->client->name.data(), t->file_descriptor);
-            } else {
-                // printf("Timeout Removed: noclient, fd = %d\n", t->file_descriptor);
-            }
-            app->timeouts.erase(app->timeouts.begin() + timeout_index);
-            // remove from polled_descriptors
-            for (int i = 0; i < app->descriptors_being_polled.size(); i++) {
-                if (app->descriptors_being_polled[i].file_descriptor == timeout->file_descriptor) {
-                    app->descriptors_being_polled.erase(app->descriptors_being_polled.begin() + i);
-                    break;
-                }
-            }
-            close(timeout->file_descriptor);
-            delete timeout;
-            return;
-        }
+static int64_t
+monotonic_time_in_ns() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+timeout_heap_swap(App *app, int a, int b) {
+    std::swap(app->timeouts[a], app->timeouts[b]);
+    app->timeouts[a]->heap_index = a;
+    app->timeouts[b]->heap_index = b;
+}
+
+static void
+timeout_heap_sift_up(App *app, int index) {
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (app->timeouts[parent]->expires_at <= app->timeouts[index]->expires_at)
+            break;
+        timeout_heap_swap(app, parent, index);
+        index = parent;
+    }
+}
+
+static void
+timeout_heap_sift_down(App *app, int index) {
+    int size = app->timeouts.size();
+    while (true) {
+        int smallest = index;
+        int left = index * 2 + 1;
+        int right = index * 2 + 2;
+        if (left < size && app->timeouts[left]->expires_at < app->timeouts[smallest]->expires_at)
+            smallest = left;
+        if (right < size && app->timeouts[right]->expires_at < app->timeouts[smallest]->expires_at)
+            smallest = right;
+        if (smallest == index)
+            break;
+        timeout_heap_swap(app, smallest, index);
+        index = smallest;
+    }
+}
+
+static bool
+timeout_is_scheduled(App *app, Timeout *timeout) {
+    return timeout->heap_index >= 0 && timeout->heap_index < app->timeouts.size() &&
+           app->timeouts[timeout->heap_index] == timeout;
+}
+
+// Arms the shared timerfd for whichever timeout expires first, or disarms it if there are none left
+static void
+timeout_arm_timer(App *app) {
+    if (app->timer_fd == -1)
+        return;
+    struct itimerspec time = {0};
+    if (!app->timeouts.empty()) {
+        int64_t expires_at = app->timeouts[0]->expires_at;
+        // An it_value of zero would disarm the timer, so the earliest we can ask for is 1ns
+        if (expires_at <= 0)
+            expires_at = 1;
+        time.it_value.tv_sec = expires_at / 1000000000;
+        time.it_value.tv_nsec = expires_at % 1000000000;
     }
+    timerfd_settime(app->timer_fd, TFD_TIMER_ABSTIME, &time, nullptr);
 }
 
-void timeout_add(App *app, Timeout *t) {
-    if (t->client) {
-        // printf("Timeout added: client = %s, fd = %d\n", t->client->name.data(), t->file_descriptor);
+static void
+timeout_heap_remove(App *app, Timeout *timeout) {
+    if (!timeout_is_scheduled(app, timeout))
+        return;
+    int index = timeout->heap_index;
+    int last = app->timeouts.size() - 1;
+    if (index != last) {
+        timeout_heap_swap(app, index, last);
+        app->timeouts.pop_back();
+        timeout_heap_sift_down(app, index);
+        timeout_heap_sift_up(app, index);
     } else {
-        // printf("Timeout added: noclient, fd = %d\n", t->file_descriptor);
+        app->timeouts.pop_back();
     }
-    
-    app->timeouts.push_back(t);
+    timeout->heap_index = -1;
+}
+
+static void
+timeout_schedule(App *app, Timeout *timeout, int64_t expires_at) {
+    timeout_heap_remove(app, timeout);
+    timeout->expires_at = expires_at;
+    timeout->heap_index = app->timeouts.size();
+    app->timeouts.push_back(timeout);
+    timeout_heap_sift_up(app, timeout->heap_index);
+}
+
+static int64_t
+timeout_ms_to_ns(float timeout_ms) {
+    return (int64_t) ((double) timeout_ms * 1000000);
+}
+
+static void
+timeout_free(App *app, Timeout *timeout) {
+    app->live_timeouts.erase(timeout);
+    delete timeout;
+}
+
+// Removes the timeout from the schedule and frees it unless its function is currently running, in which case it's
+// freed by timeout_poll_wakeup once the function returns
+static void
+timeout_stop_and_remove_timeout(App *app, Timeout *timeout) {
+    if (timeout == app->timeout_being_dispatched) {
+        timeout->kill = true;
+        return;
+    }
+    timeout_heap_remove(app, timeout);
+    timeout_free(app, timeout);
 }
 
 static int
@@ -289,14 +372,56 @@ bool poll_descriptor(App *app, int file_descriptor, int events, void (*function)
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    if (!app || !app->running) return false;
+    if (!app || !app->running || app->epoll_fd == -1) return false;
     
-    PolledDescriptor polled = {file_descriptor, std::string(text), function, user_data};
-    app->descriptors_being_polled.push_back(polled);
+    // Registering a descriptor again replaces what it had
+    remove_polled_descriptor(app, file_descriptor);
+    
+    auto polled = new PolledDescriptor;
+    polled->file_descriptor = file_descriptor;
+    polled->text = std::string(text);
+    polled->function = function;
+    polled->user_data = user_data;
+    polled->id = app->next_descriptor_id++;
+    
+    struct epoll_event event = {};
+    event.events = events ? events : EPOLLIN | EPOLLPRI;
+    event.data.u64 = polled->id;
+    
+    if (epoll_ctl(app->epoll_fd, EPOLL_CTL_ADD, file_descriptor, &event) == -1) {
+        perror("epoll_ctl");
+        delete polled;
+        return false;
+    }
+    
+    app->descriptors_being_polled[file_descriptor] = polled;
+    app->descriptors_by_id[polled->id] = polled;
     
     return true;
 }
 
+bool remove_polled_descriptor(App *app, int file_descriptor) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    if (!app) return false;
+    
+    auto it = app->descriptors_being_polled.find(file_descriptor);
+    if (it == app->descriptors_being_polled.end())
+        return false;
+    
+    // Fails if the descriptor was closed first. Epoll has then either forgotten it, or (when a dup of it is still open
+    // somewhere) keeps reporting it under an id that dispatch won't find anymore.
+    if (app->epoll_fd != -1)
+        epoll_ctl(app->epoll_fd, EPOLL_CTL_DEL, file_descriptor, nullptr);
+    
+    // Events for it still in app_main's ready list are skipped, since the id is gone
+    app->descriptors_by_id.erase(it->second->id);
+    delete it->second;
+    app->descriptors_being_polled.erase(it);
+    return true;
+}
+
 static xcb_visualtype_t *
 get_alpha_visualtype(xcb_screen_t *s) {
 #ifdef TRACY_ENABLE
@@ -335,43 +460,50 @@ get_visualtype(xcb_screen_t *s) {
 
 void xcb_poll_wakeup(App *app, int fd, void *);
 
+static void frame_scheduler_wakeup(App *app, int fd, void *);
+
 void timeout_poll_wakeup(App *app, int fd, void *) {
     std::lock_guard lock(app->thread_mutex);
     
-    bool keep_running = false;
-    for (int timeout_index = 0; timeout_index < app->timeouts.size(); timeout_index++) {
-        Timeout *timeout = app->timeouts[timeout_index];
-        if (timeout->file_descriptor == fd) {
-            if (timeout->kill) {
-                keep_running = false;
-                timeout_stop_and_remove_timeout(app, timeout);
-                break;
-            }
-            
-            if (timeout->function) {
-                timeout->function(app, timeout->client, timeout, timeout->user_data);
-            }
-            if ((keep_running = timeout->keep_running))
+    // Fails with EAGAIN if the timer was re-armed since epoll woke us up, the heap is looked at either way
+    uint64_t expirations;
+    read(fd, &expirations, sizeof(expirations));
+    
+    int64_t now = monotonic_time_in_ns();
+    while (!app->timeouts.empty() && app->timeouts[0]->expires_at <= now) {
+        Timeout *timeout = app->timeouts[0];
+        timeout_heap_remove(app, timeout);
+        
+        if (timeout->kill) {
+            timeout_free(app, timeout);
+            continue;
+        }
+        
+        if (timeout->function) {
+            app->timeout_being_dispatched = timeout;
+            timeout->function(app, timeout->client, timeout, timeout->user_data);
+            app->timeout_being_dispatched = nullptr;
+        }
+        
+        if (timeout->kill) {
+            timeout_free(app, timeout);
+        } else if (timeout_is_scheduled(app, timeout)) {
+            // The function called app_timeout_replace on itself
+        } else if (timeout->keep_running) {
+            int64_t next = timeout->expires_at + timeout_ms_to_ns(timeout->interval_ms);
+            // Don't try to catch up on firings we missed, just like a periodic timerfd wouldn't
+            if (next <= now)
+                next = now + timeout_ms_to_ns(timeout->interval_ms);
+            timeout_schedule(app, timeout, next);
+            // An interval of zero means "as soon as possible", so leave it for the next wakeup instead of spinning
+            if (timeout->interval_ms == 0)
                 break;
-            
-            timeout_stop_and_remove_timeout(app, timeout);
-            break;
+        } else {
+            timeout_free(app, timeout);
         }
     }
     
-    int BUFFER_SIZE = 400;
-    char buffer[BUFFER_SIZE];
-    read(fd, buffer, BUFFER_SIZE);
-    
-    if (keep_running)
-        return;
-    
-    for (int i = 0; i < app->descriptors_being_polled.size(); i++) {
-        if (app->descriptors_being_polled[i].file_descriptor == fd) {
-            app->descriptors_being_polled.erase(app->descriptors_being_polled.begin() + i);
-            return;
-        }
-    }
+    timeout_arm_timer(app);
 }
 
 App::App() {
@@ -624,7 +756,27 @@ App *app_new() {
     
     xcb_flush(app->connection);
     
-    poll_descriptor(app, xcb_get_file_descriptor(app->connection), POLLIN, xcb_poll_wakeup, nullptr, "XCB");
+    app->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (app->epoll_fd == -1) {
+        perror("epoll_create1");
+        return nullptr;
+    }
+    
+    poll_descriptor(app, xcb_get_file_descriptor(app->connection), EPOLLIN, xcb_poll_wakeup, nullptr, "XCB");
+    
+    app->frame_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (app->frame_event_fd == -1 ||
+        !poll_descriptor(app, app->frame_event_fd, EPOLLIN, frame_scheduler_wakeup, nullptr, "Frame scheduler")) {
+        perror("eventfd");
+        return nullptr;
+    }
+    
+    // Non-blocking: the timer can be re-armed between epoll saying it's readable and the read, which resets it
+    app->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (app->timer_fd == -1 || !poll_descriptor(app, app->timer_fd, EPOLLIN, timeout_poll_wakeup, nullptr, "Timeouts")) {
+        perror("timerfd_create");
+        return nullptr;
+    }
     
     auto atom_cookie = xcb_intern_atom(app->connection, 1, strlen("WM_PROTOCOLS"), "WM_PROTOCOLS");
     xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(app->connection, atom_cookie, NULL);
@@ -989,6 +1141,8 @@ void destroy_client(App *app, AppClient *client) {
     delete client->bounds;
     if (client->auto_delete_root)
         delete client->root;
+    if (client->damage)
+        cairo_region_destroy(client->damage);
     cairo_destroy(client->cr);
     xcb_free_colormap(app->connection, client->colormap);
     xcb_cursor_context_free(client->ctx);
@@ -1093,20 +1247,91 @@ void desktops_change(App *app, long desktop_index) {
     xcb_flush(app->connection);
 }
 
+static void queue_frame(App *app, AppClient *client);
+
 void request_refresh(App *app, AppClient *client) {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    if (app == nullptr || client == nullptr || client->refresh_already_queued)
+    if (app == nullptr || client == nullptr || app->frame_event_fd == -1)
+        return;
+    client->full_repaint_queued = true;
+    queue_frame(app, client);
+}
+
+void client_damage(AppClient *client, const Bounds &bounds) {
+    // Grown by a pixel and rounded outwards so antialiased edges are covered
+    cairo_rectangle_int_t rect;
+    rect.x = (int) std::floor(bounds.x) - 1;
+    rect.y = (int) std::floor(bounds.y) - 1;
+    rect.width = (int) std::ceil(bounds.x + bounds.w) + 1 - rect.x;
+    rect.height = (int) std::ceil(bounds.y + bounds.h) + 1 - rect.y;
+    if (rect.width <= 0 || rect.height <= 0)
         return;
-    client->refresh_already_queued = true;
+    
+    if (client->damage == nullptr) {
+        client->damage = cairo_region_create_rectangle(&rect);
+    } else {
+        cairo_region_union_rectangle(client->damage, &rect);
+    }
+}
 
-    std::thread t([app, client]() {
-        std::lock_guard lock(app->running_mutex);
+void request_partial_refresh(App *app, AppClient *client, Container *container) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    if (app == nullptr || client == nullptr || container == nullptr || app->frame_event_fd == -1)
+        return;
+    client_damage(client, container->real_bounds);
+    queue_frame(app, client);
+}
+
+static void
+queue_frame(App *app, AppClient *client) {
+    if (client->refresh_already_queued.exchange(true)) {
+        client->frame_stats.requests_coalesced++;
+        return;
+    }
+    client->refresh_requested_time = get_current_time_in_ms();
+    
+    uint64_t one = 1;
+    write(app->frame_event_fd, &one, sizeof(one));
+}
+
+static void
+frame_timeout_fired(App *app, AppClient *client, Timeout *, void *) {
+    client->frame_timeout = nullptr;
+    if (client->refresh_already_queued)
         client_paint(app, client);
-        client->refresh_already_queued = false;
-    });
-    t.detach();
+}
+
+// Paints every client with a queued refresh, or if a client painted too recently, delays it until its next frame
+static void
+frame_scheduler_wakeup(App *app, int fd, void *) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+    
+    long now = get_current_time_in_ms();
+    for (auto client: app->clients) {
+        if (!client->refresh_already_queued || client->frame_timeout)
+            continue;
+        // The next animation frame will satisfy the request
+        if (client->animations_running > 0)
+            continue;
+        
+        long frame_interval = client->fps > 0 ? (long) (1000 / client->fps) : 0;
+        long since_last_paint = now - client->last_repaint_time;
+        if (since_last_paint >= frame_interval) {
+            client_paint(app, client);
+        } else {
+            client->frame_timeout = app_timeout_create(app, client, frame_interval - since_last_paint,
+                                                       frame_timeout_fired, nullptr,
+                                                       const_cast<char *>(__PRETTY_FUNCTION__));
+        }
+    }
 }
 
 void client_animation_paint(App *app, AppClient *client, Timeout *, void *user_data);
@@ -1199,30 +1424,20 @@ void client_close(App *app, AppClient *client) {
         }
     }
     
-    app->timeouts.erase(std::remove_if(app->timeouts.begin(),
-                                       app->timeouts.end(),
-                                       [client](Timeout *timeout) {
-                                           auto *timeout_client = (AppClient *) timeout->client;
-                                           bool remove = timeout_client == client;
-        
-                                           if (remove) {
-                                               close(timeout->file_descriptor);
-                                               for (int i = 0; i < client->app->descriptors_being_polled.size(); i++) {
-                                                   if (client->app->descriptors_being_polled[i].file_descriptor ==
-                                                       timeout->file_descriptor) {
-                                                       client->app->descriptors_being_polled.erase(
-                                                               client->app->descriptors_being_polled.begin() + i);
-                                                       break;
-                                                   }
-                                               }
-                                               delete timeout;
-                                           }
-                                           if (remove != (timeout_client == client)) {
-                                               // printf("----> Previously would've resulted in an error\n");
-                                           }
-                                           return remove;
-                                       }), app->timeouts.end());
+    // Removing from the heap reorders it, so collect first and remove after
+    std::vector<Timeout *> client_timeouts;
+    for (auto timeout: app->timeouts)
+        if (timeout->client == client)
+            client_timeouts.push_back(timeout);
+    for (auto timeout: client_timeouts)
+        timeout_stop_and_remove_timeout(app, timeout);
+    if (app->timeout_being_dispatched && app->timeout_being_dispatched->client == client)
+        app->timeout_being_dispatched->kill = true;
+    timeout_arm_timer(app);
     
+    for (auto &animation: client->animations)
+        if (animation.damage)
+            animation.damage->animation_damage_client = nullptr;
     client->animations.clear();
     client->animations.shrink_to_fit();
     
@@ -1256,6 +1471,9 @@ void client_close(App *app, AppClient *client) {
     }
     
     delete client;
+    
+    // The root is gone, hand the slabs it emptied back in one go
+    container_pool_trim();
 }
 
 void client_close_threaded(App *app, AppClient *client) {
@@ -1268,6 +1486,7 @@ void client_replace_root(App *app, AppClient *client, Container *new_root) {
     if (valid_client(app, client)) {
         delete client->root;
         client->root = new_root;
+        container_pool_trim();
     }
 }
 
@@ -1280,14 +1499,84 @@ void client_layout(App *app, AppClient *client) {
     }
 }
 
+// The paint_cached container currently being painted into its offscreen surface
+static Container *container_being_cached = nullptr;
+
+static void
+paint_container_cached(App *app, AppClient *client, Container *container) {
+    int x = (int) std::floor(container->real_bounds.x);
+    int y = (int) std::floor(container->real_bounds.y);
+    int w = (int) std::ceil(container->real_bounds.x + container->real_bounds.w) - x;
+    int h = (int) std::ceil(container->real_bounds.y + container->real_bounds.h) - y;
+    if (w <= 0 || h <= 0)
+        return;
+    
+    if (client->paint_region) {
+        cairo_rectangle_int_t rect = {x, y, w, h};
+        if (cairo_region_contains_rectangle(client->paint_region, &rect) == CAIRO_REGION_OVERLAP_OUT)
+            return;
+    }
+    
+    bool owned_by_cache = true;
+    // The subtree is painted into the surface at its exact position less whole pixels, then put back at those whole
+    // pixels, so what lands in the window is what painting it directly gives
+    double real_x = container->real_bounds.x;
+    double real_y = container->real_bounds.y;
+    cairo_surface_t *surface = paint_cache_lookup(container, real_x, real_y, w, h, client->dpi());
+    if (!surface) {
+        surface = cairo_surface_create_similar(cairo_get_target(client->cr), CAIRO_CONTENT_COLOR_ALPHA, w, h);
+        cairo_t *cache_cr = cairo_create(surface);
+        cairo_translate(cache_cr, -x, -y);
+        
+        // Paint the whole subtree, regardless of damage, into the surface instead of the window
+        cairo_t *client_cr = client->cr;
+        cairo_region_t *paint_region = client->paint_region;
+        Container *previously_being_cached = container_being_cached;
+        client->cr = cache_cr;
+        client->paint_region = nullptr;
+        container_being_cached = container;
+        
+        paint_container(app, client, container);
+        
+        container_being_cached = previously_being_cached;
+        client->paint_region = paint_region;
+        client->cr = client_cr;
+        cairo_destroy(cache_cr);
+        
+        owned_by_cache = paint_cache_store(container, surface, real_x, real_y, w, h, client->dpi());
+    }
+    
+    cairo_save(client->cr);
+    cairo_set_source_surface(client->cr, surface, x, y);
+    cairo_paint(client->cr);
+    cairo_restore(client->cr);
+    
+    if (!owned_by_cache)
+        cairo_surface_destroy(surface);
+}
+
 void paint_container(App *app, AppClient *client, Container *container) {
     if (container == nullptr || !container->exists) {
         return;
     }
     
     if (valid_client(app, client)) {
+        if (container->paint_cached && client->cr && container_being_cached != container) {
+            paint_container_cached(app, client, container);
+            return;
+        }
+        
         if (container->when_paint && client->cr) {
-            container->when_paint(client, client->cr, container);
+            bool damaged = true;
+            if (client->paint_region) {
+                cairo_rectangle_int_t rect = {(int) std::floor(container->real_bounds.x),
+                                              (int) std::floor(container->real_bounds.y),
+                                              (int) std::ceil(container->real_bounds.w) + 1,
+                                              (int) std::ceil(container->real_bounds.h) + 1};
+                damaged = cairo_region_contains_rectangle(client->paint_region, &rect) != CAIRO_REGION_OVERLAP_OUT;
+            }
+            if (damaged)
+                container->when_paint(client, client->cr, container);
         }
     
         if (!container->automatically_paint_children) {
@@ -1312,17 +1601,7 @@ void paint_container(App *app, AppClient *client, Container *container) {
             if (s->bottom && s->bottom->exists)
                 paint_container(app, client, s->bottom);
         } else {
-            // What we already do
-            // TODO: check if any childrens z_index is non zero first as an optimization
-            // so we don't have to sort if we don't need it Only sort render_order
-            // indexes by z_index rather than the actual children list themselves
-            std::vector<int> render_order;
-            for (int i = 0; i < container->children.size(); i++) {
-                render_order.push_back(i);
-            }
-            std::sort(render_order.begin(), render_order.end(), [container](int a, int b) -> bool {
-                return container->children[a]->z_index < container->children[b]->z_index;
-            });
+            const std::vector<int> &render_order = container_render_order(container);
         
             if (container->clip_children) {
                 for (auto index: render_order) {
@@ -1362,11 +1641,49 @@ void client_paint(App *app, AppClient *client, bool force_repaint) {
 #endif
     if (valid_client(app, client)) {
         if (client->cr && client->root) {
+            long now = get_current_time_in_ms();
+            // Cleared before painting so that a request made while we paint queues another frame
+            if (client->refresh_already_queued.exchange(false)) {
+                long latency = now - client->refresh_requested_time;
+                long frame_interval = client->fps > 0 ? (long) (1000 / client->fps) : 0;
+                if (latency > frame_interval)
+                    client->frame_stats.frames_dropped++;
+                client->frame_stats.requests_painted++;
+                client->frame_stats.total_latency_ms += latency;
+                if (latency > client->frame_stats.max_latency_ms)
+                    client->frame_stats.max_latency_ms = latency;
+#ifdef TRACY_ENABLE
+                TracyPlot("Refresh latency (ms)", (int64_t) latency);
+#endif
+            }
+            client->last_repaint_time = now;
+            client->frame_stats.frames_painted++;
+            
+            // Only repaint the damaged area if nothing asked for everything to be repainted
+            bool full_repaint = client->full_repaint_queued.exchange(false) || force_repaint;
+            cairo_region_t *damage = client->damage;
+            client->damage = nullptr;
+            if (full_repaint && damage) {
+                cairo_region_destroy(damage);
+                damage = nullptr;
+            }
+            
             {
 #ifdef TRACY_ENABLE
                 ZoneScopedN("paint");
 #endif
                 cairo_save(client->cr);
+                if (damage) {
+                    int rectangles = cairo_region_num_rectangles(damage);
+                    for (int i = 0; i < rectangles; i++) {
+                        cairo_rectangle_int_t rect;
+                        cairo_region_get_rectangle(damage, i, &rect);
+                        cairo_rectangle(client->cr, rect.x, rect.y, rect.width, rect.height);
+                    }
+                    // The group pushed below is only as large as the clip, which is where the savings come from
+                    cairo_clip(client->cr);
+                    client->paint_region = damage;
+                }
                 cairo_push_group(client->cr);
                 
                 paint_container(app, client, client->root);
@@ -1375,6 +1692,10 @@ void client_paint(App *app, AppClient *client, bool force_repaint) {
                 cairo_set_operator(client->cr, CAIRO_OPERATOR_SOURCE);
                 cairo_paint(client->cr);
                 cairo_restore(client->cr);
+                
+                client->paint_region = nullptr;
+                if (damage)
+                    cairo_region_destroy(damage);
             }
             
             {
@@ -2247,71 +2568,32 @@ void app_main(App *app) {
         return;
     }
     
-    int MAX_POLLING_EVENTS_AT_THE_SAME_TIME = 1000;
-    pollfd fds[MAX_POLLING_EVENTS_AT_THE_SAME_TIME];
+    const int MAX_EVENTS_PER_WAKEUP = 64;
+    struct epoll_event events[MAX_EVENTS_PER_WAKEUP];
     
     app->running = true;
     app->running_mutex.unlock();
     while (app->running) {
-        // set all fds to 0
-        memset(fds, 0, sizeof(fds));
-        for (int i = 0; i < app->descriptors_being_polled.size(); i++) {
-            fds[i].fd = app->descriptors_being_polled[i].file_descriptor;
-            fds[i].events = POLLIN | POLLPRI;
-        }
-        
-        int num_ready = poll(fds, app->descriptors_being_polled.size(), -1);
+        int num_ready = epoll_wait(app->epoll_fd, events, MAX_EVENTS_PER_WAKEUP, -1);
         if (num_ready < 0) {
-            perror("poll");
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
             exit(1);
         }
         
         std::lock_guard m(app->running_mutex);
         app->loop++;
         
-        for (int i = 0; i < app->descriptors_being_polled.size(); i++) {
-            if (fds[i].revents & POLLPRI) {
-                bool found = false;
-                for (const auto &polled: app->descriptors_being_polled) {
-                    if (fds[i].fd == polled.file_descriptor) {
-                        found = true;
-                        if (polled.function) {
-                            polled.function(app, polled.file_descriptor, polled.user_data);
-                        }
-                    }
-                }
-                if (!found) {
-                    for (int x = 0; x < app->descriptors_being_polled.size(); x++) {
-                        if (app->descriptors_being_polled[x].file_descriptor == fds[x].fd) {
-                            app->descriptors_being_polled.erase(app->descriptors_being_polled.begin() + x);
-                            break;
-                        }
-                    }
-                    close(fds[i].fd);
-                }
-            }
-        }
-        
-        for (int i = 0; i < app->descriptors_being_polled.size(); i++) {
-            if (fds[i].revents & POLLIN) {
-                bool found = false;
-                for (const auto &polled: app->descriptors_being_polled) {
-                    if (fds[i].fd == polled.file_descriptor) {
-                        found = true;
-                        if (polled.function) {
-                            polled.function(app, polled.file_descriptor, polled.user_data);
-                        }
-                    }
-                }
-                if (!found) {
-                    for (int x = 0; x < app->descriptors_being_polled.size(); x++) {
-                        if (app->descriptors_being_polled[x].file_descriptor == fds[x].fd) {
-                            app->descriptors_being_polled.erase(app->descriptors_being_polled.begin() + x);
-                            break;
-                        }
-                    }
-                    close(fds[i].fd);
-                }
+        // Level triggered, so anything not handled because the array was full will simply be reported next wakeup
+        for (int i = 0; i < num_ready; i++) {
+            // A previous callback in this same batch might have removed this registration
+            auto found = app->descriptors_by_id.find(events[i].data.u64);
+            if (found == app->descriptors_by_id.end())
+                continue;
+            PolledDescriptor *polled = found->second;
+            if (polled->function) {
+                polled->function(app, polled->file_descriptor, polled->user_data);
             }
         }
         
@@ -2353,22 +2635,35 @@ void app_clean(App *app) {
     
     cleanup_cached_fonts();
     cleanup_cached_atoms();
+    paint_cache_clear();
     
-    for (auto t: app->timeouts) {
-        for (int i = 0; i < app->descriptors_being_polled.size(); i++) {
-            if (app->descriptors_being_polled[i].file_descriptor == t->file_descriptor) {
-                app->descriptors_being_polled.erase(app->descriptors_being_polled.begin() + i);
-                break;
-            }
-        }
-        close(t->file_descriptor);
+    for (auto t: app->timeouts)
         delete t;
-    }
     app->timeouts.clear();
+    app->live_timeouts.clear();
     app->timeouts.shrink_to_fit();
     
+    if (app->frame_event_fd != -1) {
+        remove_polled_descriptor(app, app->frame_event_fd);
+        close(app->frame_event_fd);
+        app->frame_event_fd = -1;
+    }
+    
+    if (app->timer_fd != -1) {
+        remove_polled_descriptor(app, app->timer_fd);
+        close(app->timer_fd);
+        app->timer_fd = -1;
+    }
+    
+    for (auto &pair: app->descriptors_being_polled)
+        delete pair.second;
     app->descriptors_being_polled.clear();
-    app->descriptors_being_polled.shrink_to_fit();
+    app->descriptors_by_id.clear();
+    
+    if (app->epoll_fd != -1) {
+        close(app->epoll_fd);
+        app->epoll_fd = -1;
+    }
     
     if (app->device) {
         cairo_device_finish(app->device);
@@ -2378,11 +2673,23 @@ void app_clean(App *app) {
     xcb_disconnect(app->connection);
 }
 
-void
+// Another animation can still damage a container whose previous one just went away
+static void
+mark_damaged_containers(AppClient *client) {
+    for (auto &animation: client->animations)
+        if (animation.damage)
+            animation.damage->animation_damage_client = client;
+}
+
+static void
 client_create_animation(App *app, AppClient *client, double *value, double delay, double length, easingFunction easing,
-                        double target, void (*finished)(AppClient *), bool relayout) {
+                        double target, void (*finished)(AppClient *), bool relayout, Container *damage) {
     for (auto &animation: client->animations) {
         if (animation.value == value) {
+            if (animation.damage)
+                animation.damage->animation_damage_client = nullptr;
+            animation.damage = damage;
+            mark_damaged_containers(client);
             animation.delay = delay;
             animation.length = length;
             animation.easing = easing;
@@ -2405,11 +2712,39 @@ client_create_animation(App *app, AppClient *client, double *value, double delay
     animation.start_value = *value;
     animation.finished = finished;
     animation.relayout = relayout;
+    animation.damage = damage;
     client->animations.push_back(animation);
+    if (damage)
+        damage->animation_damage_client = client;
     
     client_register_animation(app, client);
 }
 
+void client_forget_damaging_animations(AppClient *client, Container *container) {
+    // Can be called from inside the animation loop (a finished callback deleting containers), so only mark them
+    for (auto &animation: client->animations) {
+        if (animation.damage != container || animation.value == nullptr)
+            continue;
+        animation.damage = nullptr;
+        animation.value = nullptr;
+        if (!animation.done)
+            client_unregister_animation(client->app, client);
+        animation.done = true;
+    }
+    container->animation_damage_client = nullptr;
+}
+
+void
+client_create_animation(App *app, AppClient *client, double *value, double delay, double length, easingFunction easing,
+                        double target, void (*finished)(AppClient *), bool relayout) {
+    client_create_animation(app, client, value, delay, length, easing, target, finished, relayout, nullptr);
+}
+
+void client_create_animation_damaging(App *app, AppClient *client, Container *damage, double *value, double delay,
+                                      double length, easingFunction easing, double target) {
+    client_create_animation(app, client, value, delay, length, easing, target, nullptr, false, damage);
+}
+
 void
 client_create_animation(App *app, AppClient *client, double *value, double delay, double length, easingFunction easing,
                         double target) {
@@ -2439,7 +2774,11 @@ bool app_timeout_stop(App *app,
     if (timeout == nullptr)
         return false;
     if (app == nullptr || !app->running) return false;
-    timeout->kill = true;
+    // Already fired, stopped, or closed along with its client
+    if (app->live_timeouts.find(timeout) == app->live_timeouts.end())
+        return false;
+    timeout_stop_and_remove_timeout(app, timeout);
+    timeout_arm_timer(app);
     return true;
 }
 
@@ -2452,32 +2791,18 @@ Timeout *app_timeout_replace(App *app,
         return nullptr;
     }
     if (app == nullptr || !app->running || !timeout_function) return nullptr;
-    struct itimerspec time = {0};
-    // The division done below converts the timeout_ms into seconds and nanoseconds
-    time.it_interval.tv_sec = timeout_ms / 1000;
-    time.it_interval.tv_nsec = std::fmod(timeout_ms, 1000) * 1000000;
-    time.it_value.tv_sec = timeout_ms / 1000;
-    time.it_value.tv_nsec = std::fmod(timeout_ms, 1000) * 1000000;
-    
-    // If the caller of this function passed in a zero,
-    // they probably expected the function to execute as soon as possible,
-    // but based on documentation, the timer will never go off if it_value.tv_sec and it_value.tv_nsec
-    // are both set to zero.
-    // To have the function behave more like what the caller probably expected,
-    // we do what we do below and give the timer the smallest possible increment.
-    if (timeout_ms == 0) {
-        time.it_value.tv_nsec = 1;
-    }
-    
-    if (timerfd_settime(timeout->file_descriptor, 0, &time, nullptr) != 0) {
+    if (app->live_timeouts.find(timeout) == app->live_timeouts.end())
         return nullptr;
-    }
     
     timeout->function = timeout_function;
     timeout->client = client;
     timeout->user_data = user_data;
     timeout->keep_running = false;
     timeout->kill = false;
+    timeout->interval_ms = timeout_ms;
+    
+    timeout_schedule(app, timeout, monotonic_time_in_ns() + timeout_ms_to_ns(timeout_ms));
+    timeout_arm_timer(app);
     
     return timeout;
 }
@@ -2486,55 +2811,22 @@ Timeout *
 app_timeout_create(App *app, AppClient *client, float timeout_ms,
                    void (*timeout_function)(App *, AppClient *, Timeout *, void *), void *user_data,
                    char *text) {
-    if (app == nullptr || !app->running || !timeout_function) return nullptr;
-    int timeout_file_descriptor = timerfd_create(CLOCK_REALTIME, 0);
-    if (timeout_file_descriptor == -1) { // error with timerfd_create
-        return nullptr;
-    }
+    if (app == nullptr || !app->running || !timeout_function || app->timer_fd == -1) return nullptr;
     
-    bool success = poll_descriptor(app, timeout_file_descriptor, EPOLLIN, timeout_poll_wakeup, nullptr, "Timeout");
-    if (!success) { // error with poll_descriptor
-        for (int i = 0; i < app->descriptors_being_polled.size(); i++) {
-            if (app->descriptors_being_polled[i].file_descriptor == timeout_file_descriptor) {
-                app->descriptors_being_polled.erase(app->descriptors_being_polled.begin() + i);
-                break;
-            }
-        }
-        close(timeout_file_descriptor);
-        return nullptr;
-    }
     auto timeout = new Timeout;
+    app->live_timeouts.insert(timeout);
     timeout->function = timeout_function;
     timeout->client = client;
-    timeout->file_descriptor = timeout_file_descriptor;
     timeout->user_data = user_data;
     timeout->keep_running = false;
     timeout->text = std::string(text);
     timeout->kill = false;
-    timeout_add(app, timeout);
+    timeout->interval_ms = timeout_ms;
     
-    struct itimerspec time = {0};
-    // The division done below converts the timeout_ms into seconds and nanoseconds
-    time.it_interval.tv_sec = timeout_ms / 1000;
-    time.it_interval.tv_nsec = std::fmod(timeout_ms, 1000) * 1000000;
-    time.it_value.tv_sec = timeout_ms / 1000;
-    time.it_value.tv_nsec = std::fmod(timeout_ms, 1000) * 1000000;
-    
-    // If the caller of this function passed in a zero,
-    // they probably expected the function to execute as soon as possible,
-    // but based on documentation, the timer will never go off if it_value.tv_sec and it_value.tv_nsec
-    // are both set to zero.
-    // To have the function behave more like what the caller probably expected,
-    // we do what we do below and give the timer the smallest possible increment.
-    if (timeout_ms == 0) {
-        time.it_value.tv_nsec = 1;
-    }
-    
-    int settime_success = timerfd_settime(timeout_file_descriptor, 0, &time, nullptr);
-    if (settime_success != 0) { // error with timerfd_settime
-        delete timeout;
-        return nullptr;
-    }
+    // A timeout_ms of zero means the caller wants the function executed as soon as possible, which happens naturally
+    // here since the expiration will already be in the past by the time the timer is armed
+    timeout_schedule(app, timeout, monotonic_time_in_ns() + timeout_ms_to_ns(timeout_ms));
+    timeout_arm_timer(app);
     
     return timeout;
 }
@@ -2602,6 +2894,9 @@ void client_animation_paint(App *app, AppClient *client, Timeout *timeout, void
 #endif
     if (!app || !app->running) return;
     
+    // If every animation only changes what a known container paints, only those containers need repainting
+    bool partial = false;
+    
     {
 #ifdef TRACY_ENABLE
         ZoneScopedN("update animating values");
@@ -2609,8 +2904,17 @@ void client_animation_paint(App *app, AppClient *client, Timeout *timeout, void
         long now = get_current_time_in_ms();
         
         bool wants_to_relayout = false;
+        partial = !client->animations.empty();
         
         for (auto &animation: client->animations) {
+            if (animation.value == nullptr)
+                continue;
+            if (animation.damage) {
+                client_damage(client, animation.damage->real_bounds);
+            } else {
+                partial = false;
+            }
+
             long elapsed_time = now - (animation.start_time + animation.delay);
             if (elapsed_time < 0)
                 elapsed_time = 0;
@@ -2625,6 +2929,7 @@ void client_animation_paint(App *app, AppClient *client, Timeout *timeout, void
     
             if (animation.relayout)
                 wants_to_relayout = true;
+
             
             if (animation.done) {
                 *animation.value = animation.target;
@@ -2640,19 +2945,23 @@ void client_animation_paint(App *app, AppClient *client, Timeout *timeout, void
             handle_mouse_motion(app, client, client->mouse_current_x, client->mouse_current_y);
         }
         
+        for (auto &animation: client->animations)
+            if (animation.done && animation.damage)
+                animation.damage->animation_damage_client = nullptr;
         client->animations.erase(std::remove_if(client->animations.begin(),
                                                 client->animations.end(),
                                                 [](const ClientAnimation &data) {
                                                     return data.done;
                                                 }), client->animations.end());
         client->animations.shrink_to_fit();
+        mark_damaged_containers(client);
     }
     
     {
 #ifdef TRACY_ENABLE
         ZoneScopedN("paint");
 #endif
-        client_paint(app, client, true);
+        client_paint(app, client, !partial);
     }
     
     {
@@ -15,6 +15,8 @@
 #include <mutex>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <sys/epoll.h>
 #include <thread>
 #include <xcb/xcb.h>
@@ -79,8 +81,6 @@ struct client_animations {
 struct Handler;
 
 struct Timeout {
-    int file_descriptor;
-    
     void (*function)(App *, AppClient *, Timeout *, void *user_data);
     
     AppClient *client = nullptr;
@@ -91,6 +91,15 @@ struct Timeout {
     
     bool kill = false;
     std::string text;
+    
+    // How long between firings, used to reschedule when keep_running is set
+    float interval_ms = 0;
+    
+    // When the timeout should fire next in nanoseconds on CLOCK_MONOTONIC
+    int64_t expires_at = 0;
+    
+    // Position inside App::timeouts, -1 when it isn't scheduled
+    int heap_index = -1;
 };
 
 struct PolledDescriptor {
@@ -102,6 +111,10 @@ struct PolledDescriptor {
     
     void *user_data = nullptr;
     
+    // What epoll hands back with the events instead of a pointer. Never reused, so an event that was already in
+    // app_main's ready list when its registration went away finds nothing, not freed memory.
+    uint64_t id = 0;
+    
     ~PolledDescriptor() {
 //        if (user_data) {
 //            free(user_data);
@@ -139,11 +152,30 @@ struct App {
     
     xcb_screen_t *screen = nullptr;
 
-//    int epoll_fd = -1;
-    std::vector<PolledDescriptor> descriptors_being_polled;
+    int epoll_fd = -1;
+    
+    std::unordered_map<int, PolledDescriptor *> descriptors_being_polled;
+    
+    // The same registrations by PolledDescriptor::id, which is what dispatch goes by
+    std::unordered_map<uint64_t, PolledDescriptor *> descriptors_by_id;
+    uint64_t next_descriptor_id = 1;
+    
+    // Written to by request_refresh so that painting always happens on the main loop
+    int frame_event_fd = -1;
     
+    // Every Timeout shares this single timerfd which is always armed for the earliest one
+    int timer_fd = -1;
+    
+    // Binary min-heap ordered by Timeout::expires_at
     std::vector<Timeout *> timeouts;
     
+    // The Timeout whose function is currently executing, if any
+    Timeout *timeout_being_dispatched = nullptr;
+    
+    // Every Timeout not yet freed. Callers keep Timeout pointers around after they fired or their client closed, so
+    // app_timeout_stop and app_timeout_replace check against this instead of touching freed memory.
+    std::unordered_set<Timeout *> live_timeouts;
+    
     int loop = 0;
     
     // TODO: move atoms into their own things
@@ -190,6 +222,11 @@ void client_hide(App *app, AppClient *client_entity);
 
 void request_refresh(App *app, AppClient *client_entity);
 
+// Like request_refresh, but only the bounds of the container need to be repainted. Must be called from the main loop.
+void request_partial_refresh(App *app, AppClient *client_entity, Container *container);
+
+void client_damage(AppClient *client_entity, const Bounds &bounds);
+
 void client_register_animation(App *app, AppClient *client_entity);
 
 void client_create_animation(App *app, AppClient *client_entity, double *value, double delay, double length,
@@ -208,6 +245,14 @@ void
 client_create_animation(App *app, AppClient *client, double *value, double delay, double length, easingFunction easing,
                         double target, bool relayout);
 
+// Same as client_create_animation, but while every running animation of the client has a damage container,
+// animation frames only repaint the bounds of those containers
+void client_create_animation_damaging(App *app, AppClient *client, Container *damage, double *value, double delay,
+                                      double length, easingFunction easing, double target);
+
+// Drops the animations that damage container, since what they animate usually lives in its user_data
+void client_forget_damaging_animations(AppClient *client, Container *container);
+
 void client_unregister_animation(App *app, AppClient *client_entity);
 
 void client_close(App *app, AppClient *client_entity);
@@ -280,9 +325,13 @@ update_keymap(struct ClientKeyboard *kbd);
 
 void paint_container(App *app, AppClient *client, Container *container);
 
+// Calls function from app_main whenever file_descriptor has events. It has to be removed with remove_polled_descriptor
+// before it's closed: epoll only forgets about a descriptor on its own once every copy of it (dups, forks) is closed.
 bool poll_descriptor(App *app, int file_descriptor, int events, void (*function)(App *, int, void *), void *user_data,
                      char* text);
 
+bool remove_polled_descriptor(App *app, int file_descriptor);
+
 Subprocess *
 command_with_client(AppClient *client, const std::string &c, int timeout_in_ms, void (*function)(Subprocess *),
                     void *user_data);
@@ -4,13 +4,59 @@
 #include "../src/components.h"
 #include "../src/config.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
 #include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+// How deep into layout calls we are, 0 means the next call is the outermost one which starts a new pass
+static int layout_depth = 0;
+
+// Incremented at the start of every outermost layout call
+static long layout_pass = 0;
+
+// Hands out LayoutCache::serial
+static long layout_serial_counter = 0;
+
+// The serial of the container whose children are currently being laid out
+static long current_layout_serial = 0;
+
+// If the container whose children are currently being laid out moves them afterwards (ALIGN_CENTER)
+static bool parent_moves_children = false;
+
+// Invalidates the reserved_width and reserved_height memos whenever a layout callback could have changed what they
+// depend on
+static long reserved_generation = 0;
+
+static bool
+reserved_memo_usable(Container *box) {
+    auto &cache = box->layout_cache;
+    if (layout_depth == 0)
+        return false;
+    if (cache.reserved_generation != reserved_generation) {
+        cache.reserved_generation = reserved_generation;
+        cache.reserved_w_set = false;
+        cache.reserved_h_set = false;
+    }
+    return true;
+}
 
 // Sum of non filler child height and spacing
 double
 reserved_height(Container *box) {
+    if (box->type & layout_type::virtual_list)
+        return virtual_list_height((VirtualList *) box);
+    
+    bool memo = reserved_memo_usable(box);
+    if (memo && box->layout_cache.reserved_h_set)
+        return box->layout_cache.reserved_h;
+    
     double space = 0;
     for (auto child: box->children) {
         if (!child->exists)
@@ -32,6 +78,10 @@ reserved_height(Container *box) {
         space += box->spacing;
     }
     space -= box->spacing;// Remove spacing after last child
+    if (memo) {
+        box->layout_cache.reserved_h = space;
+        box->layout_cache.reserved_h_set = true;
+    }
     return space;
 }
 
@@ -43,6 +93,10 @@ true_height(Container *box) {
 
 double
 actual_true_height(Container *box) {
+    // Most rows of a virtual list aren't laid out so the children can't be used
+    if (box->type & layout_type::virtual_list)
+        return virtual_list_height((VirtualList *) box) + box->wanted_pad.y + box->wanted_pad.h;
+    
     // set space to the distance between the lowest y of child and the hightest y+h of child
     double lowest_y = 0;
     double highest_y = 0;
@@ -124,8 +178,10 @@ void layout_vbox(AppClient *client, cairo_t *cr, Container *container, const Bou
             double target_w = child->wanted_pad.x + child->wanted_pad.w;
             double target_h = child->wanted_pad.y + child->wanted_pad.h;
     
-            if (child->before_layout)
+            if (child->before_layout) {
                 child->before_layout(client, child, bounds, &target_w, &target_h);
+                reserved_generation++;
+            }
     
             if (child->wanted_bounds.w == FILL_SPACE) {
                 target_w = container->children_bounds.w;
@@ -143,6 +199,7 @@ void layout_vbox(AppClient *client, cairo_t *cr, Container *container, const Bou
             }
             if (child->wanted_bounds.w == DYNAMIC || child->wanted_bounds.h == DYNAMIC) {
                 child->when_layout(client, child, bounds, &target_w, &target_h);
+                reserved_generation++;
             }
             
             // Keep within horizontal bounds
@@ -226,6 +283,10 @@ void layout_vbox(AppClient *client, cairo_t *cr, Container *container, const Bou
 // Sum of non filler child widths and spacing
 double
 reserved_width(Container *box) {
+    bool memo = reserved_memo_usable(box);
+    if (memo && box->layout_cache.reserved_w_set)
+        return box->layout_cache.reserved_w;
+    
     double space = 0;
     for (auto child: box->children) {
         if (child) {
@@ -242,6 +303,10 @@ reserved_width(Container *box) {
         }
     }
     space -= box->spacing;// Remove spacing after last child
+    if (memo) {
+        box->layout_cache.reserved_w = space;
+        box->layout_cache.reserved_w_set = true;
+    }
     return space;
 }
 
@@ -282,8 +347,10 @@ void layout_hbox(AppClient *client, cairo_t *cr, Container *container, const Bou
             double target_w = child->wanted_pad.x + child->wanted_pad.w;
             double target_h = child->wanted_pad.y + child->wanted_pad.h;
     
-            if (child->before_layout)
+            if (child->before_layout) {
                 child->before_layout(client, child, bounds, &target_w, &target_h);
+                reserved_generation++;
+            }
     
             if (child->wanted_bounds.w == FILL_SPACE) {
                 target_w += fill_w;
@@ -301,6 +368,7 @@ void layout_hbox(AppClient *client, cairo_t *cr, Container *container, const Bou
             }
             if (child->wanted_bounds.w == DYNAMIC || child->wanted_bounds.h == DYNAMIC) {
                 child->when_layout(client, child, bounds, &target_w, &target_h);
+                reserved_generation++;
             }
             
             // Keep within horizontal bounds
@@ -474,6 +542,7 @@ void layout_scrollpane(AppClient *client, cairo_t *cr, Container *container, con
     }
     r_bar->exists = (r_w != 0);
     b_bar->exists = (b_h != 0);
+    reserved_generation++;
     
     if (!(options & ::scrollpane_inline_r) && !(options & ::scrollpane_inline_b)) {
         layout(client, cr, content_area, Bounds(bounds.x, bounds.y, bounds.w - r_w, bounds.h - b_h));
@@ -579,6 +648,7 @@ void layout_newscrollpane(AppClient *client, cairo_t *cr, ScrollContainer *scrol
                       bounds.h));
     } else {
         scroll->right->exists = false;
+        reserved_generation++;
     }
     if (create_bottom_scrollbar) {
         layout(client, cr, scroll->bottom,
@@ -586,10 +656,122 @@ void layout_newscrollpane(AppClient *client, cairo_t *cr, ScrollContainer *scrol
                       settings.bottom_height));
     } else {
         scroll->bottom->exists = false;
+        reserved_generation++;
     }
 }
 
-void layout(AppClient *client, cairo_t *cr, Container *container, const Bounds &bounds) {
+static void
+virtual_list_measure(VirtualList *list) {
+    if (list->measured && list->measured_spacing == list->spacing && list->offsets.size() == list->count + 1)
+        return;
+    list->measured = true;
+    list->measured_spacing = list->spacing;
+    list->heights.resize(list->count);
+    list->offsets.resize(list->count + 1);
+    double offset = 0;
+    for (int i = 0; i < list->count; i++) {
+        list->heights[i] = list->row_height ? list->row_height(list, i) : 0;
+        list->offsets[i] = offset;
+        offset += list->heights[i];
+        if (i != list->count - 1)
+            offset += list->spacing;
+    }
+    list->offsets[list->count] = offset;
+}
+
+static void
+reset_mouse_state(Container *container) {
+    container->state.reset();
+    for (auto child: container->children)
+        reset_mouse_state(child);
+}
+
+static void
+virtual_list_release(VirtualList *list, Container *row, int kind) {
+    // The row won't get the leave events it would have gotten if it stayed in the tree
+    reset_mouse_state(row);
+    list->pool.push_back(row);
+    list->pool_kinds.push_back(kind);
+}
+
+static Container *
+virtual_list_acquire(VirtualList *list, int kind) {
+    for (int i = list->pool.size() - 1; i >= 0; i--) {
+        if (list->pool_kinds[i] == kind) {
+            auto row = list->pool[i];
+            list->pool[i] = list->pool.back();
+            list->pool_kinds[i] = list->pool_kinds.back();
+            list->pool.pop_back();
+            list->pool_kinds.pop_back();
+            return row;
+        }
+    }
+    auto row = list->create_row(list, kind);
+    row->parent = list;
+    return row;
+}
+
+static void
+virtual_list_bind(VirtualList *list, Container *row, int index) {
+    if (row->paint_cached)
+        container_invalidate_paint_cache(row);
+    if (list->bind_row)
+        list->bind_row(list, row, index);
+}
+
+void layout_virtual_list(AppClient *client, cairo_t *cr, VirtualList *list, const Bounds &bounds) {
+    virtual_list_measure(list);
+    
+    // Only the part of the list inside the closest scroll pane is visible
+    Bounds view = list->real_bounds;
+    for (Container *c = list->parent; c; c = c->parent) {
+        if (c->type & layout_type::newscroll) {
+            view = c->real_bounds;
+            break;
+        }
+    }
+    double top = view.y - bounds.y;
+    double bottom = view.y + view.h - bounds.y;
+    auto begin = list->offsets.begin();
+    auto end = list->offsets.begin() + list->count;
+    int first = (int) (std::upper_bound(begin, end, top) - begin) - 1;
+    int last = (int) (std::lower_bound(begin, end, bottom) - begin) - 1;
+    first = std::max(0, first - list->overscan);
+    last = std::min(list->count - 1, last + list->overscan);
+    
+    // Rows which are still in range keep their binding, the rest go back to the pool
+    list->scratch.assign(std::max(0, last - first + 1), nullptr);
+    for (int i = 0; i < list->children.size(); i++) {
+        int index = list->row_indexes[i];
+        if (!list->needs_rebind && index >= first && index <= last && !list->scratch[index - first]) {
+            list->scratch[index - first] = list->children[i];
+        } else {
+            virtual_list_release(list, list->children[i], list->row_kinds[i]);
+        }
+    }
+    list->needs_rebind = false;
+    list->children.clear();
+    list->row_indexes.clear();
+    list->row_kinds.clear();
+    list->render_order_dirty = true;
+    
+    for (int index = first; index <= last; index++) {
+        int kind = list->row_kind ? list->row_kind(list, index) : 0;
+        auto row = list->scratch[index - first];
+        if (!row) {
+            row = virtual_list_acquire(list, kind);
+            virtual_list_bind(list, row, index);
+        }
+        list->children.push_back(row);
+        list->row_indexes.push_back(index);
+        list->row_kinds.push_back(kind);
+        
+        layout(client, cr, row, Bounds(bounds.x, bounds.y + list->offsets[index], bounds.w, list->heights[index]));
+    }
+}
+
+static void
+layout_container(AppClient *client, cairo_t *cr, Container *container, const Bounds &bounds) {
     container->real_bounds.x = bounds.x;
     container->real_bounds.y = bounds.y;
     
@@ -607,7 +789,11 @@ void layout(AppClient *client, cairo_t *cr, Container *container, const Bounds &
     
     if (container->type & layout_type::newscroll) {
         auto s = (ScrollContainer *) container;
-        if (s->content->children.empty()) {
+        reserved_generation++;
+        bool empty = s->content->children.empty();
+        if (s->content->type & layout_type::virtual_list)
+            empty = ((VirtualList *) s->content)->count == 0;
+        if (empty) {
             s->content->exists = false;
             s->right->exists = false;
             s->bottom->exists = false;
@@ -616,7 +802,7 @@ void layout(AppClient *client, cairo_t *cr, Container *container, const Bounds &
         s->content->exists = true;
         s->right->exists = true;
         s->bottom->exists = true;
-    } else if (container->children.empty()) {
+    } else if (container->children.empty() && !(container->type & layout_type::virtual_list)) {
         return;
     }
     if (!container->should_layout_children)
@@ -631,6 +817,7 @@ void layout(AppClient *client, cairo_t *cr, Container *container, const Bounds &
     } else if (container->type & layout_type::scrollpane) {
         layout_scrollpane(client, cr, container, container->children_bounds);
     } else if (container->type & layout_type::transition) {
+        reserved_generation++;
         for (int i = 0; i < container->children.size(); i++) {
             auto child = container->children[i];
             if (i == 0) {
@@ -644,6 +831,8 @@ void layout(AppClient *client, cairo_t *cr, Container *container, const Bounds &
         layout_newscrollpane(client, cr, (ScrollContainer *) container, container->children_bounds);
     } else if (container->type & layout_type::editable_label) {
     
+    } else if (container->type & layout_type::virtual_list) {
+        layout_virtual_list(client, cr, (VirtualList *) container, container->children_bounds);
     }
     
     // TODO: this only covers the first layer and not all of them
@@ -669,35 +858,315 @@ void layout(AppClient *client, cairo_t *cr, Container *container, const Bounds &
 //    }
 }
 
+// ScrollContainers keep their parts outside of children, so these are used to visit everything layout touches
+static int
+layout_child_count(Container *container) {
+    if (container->type & layout_type::newscroll)
+        return container->children.size() + 3;
+    return container->children.size();
+}
+
+static Container *
+layout_child(Container *container, int index) {
+    if (index < container->children.size())
+        return container->children[index];
+    auto s = (ScrollContainer *) container;
+    index -= container->children.size();
+    if (index == 0)
+        return s->content;
+    if (index == 1)
+        return s->right;
+    return s->bottom;
+}
+
+static size_t
+layout_shape(Container *container) {
+    size_t hash = container->children.size();
+    int count = layout_child_count(container);
+    for (int i = 0; i < count; i++) {
+        auto child = layout_child(container, i);
+        hash = hash * 31 + std::hash<Container *>()(child);
+        hash = hash * 31 + (child && child->exists);
+    }
+    if (container->type & layout_type::newscroll) {
+        auto &settings = ((ScrollContainer *) container)->settings;
+        hash = hash * 31 + settings.right_width;
+        hash = hash * 31 + settings.bottom_height;
+        hash = hash * 31 + settings.right_show_amount;
+        hash = hash * 31 + settings.bottom_show_amount;
+        hash = hash * 31 + settings.right_inline_track;
+        hash = hash * 31 + settings.bottom_inline_track;
+    }
+    return hash;
+}
+
+static bool
+same_bounds(const Bounds &a, const Bounds &b) {
+    return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+}
+
+// True if nothing layout reads in this container or below it changed since it was last recorded, including its
+// bounds being moved by hand, or a child being laid out by someone else in the meantime
+static bool
+layout_subtree_unchanged(Container *container) {
+    auto &cache = container->layout_cache;
+    if (cache.checked_pass == layout_pass)
+        return cache.unchanged;
+    cache.checked_pass = layout_pass;
+    cache.unchanged = false;
+    
+    // Which rows a virtual list has depends on where it is inside its scroll pane, so it always has to be laid out
+    if (!cache.valid || (container->type & layout_type::virtual_list) ||
+        !same_bounds(cache.wanted_bounds, container->wanted_bounds) ||
+        !same_bounds(cache.wanted_pad, container->wanted_pad) ||
+        !same_bounds(cache.real_bounds, container->real_bounds) ||
+        !same_bounds(cache.children_bounds, container->children_bounds) ||
+        cache.spacing != container->spacing ||
+        cache.scroll_v_real != container->scroll_v_real ||
+        cache.scroll_h_real != container->scroll_h_real ||
+        cache.scroll_v_visual != container->scroll_v_visual ||
+        cache.scroll_h_visual != container->scroll_h_visual ||
+        cache.type != container->type ||
+        cache.alignment != container->alignment ||
+        cache.exists != container->exists ||
+        cache.should_layout_children != container->should_layout_children ||
+        cache.shape != layout_shape(container))
+        return false;
+    
+    // Children are checked even if they aren't laid out by us since reserved_width and reserved_height still read them
+    bool lays_out_children = container->should_layout_children && !(container->type & layout_type::editable_label);
+    int count = layout_child_count(container);
+    for (int i = 0; i < count; i++) {
+        auto child = layout_child(container, i);
+        if (!child || !child->exists)
+            continue;
+        // Layout callbacks have to be called by the parent every time since they can change anything
+        if (child->before_layout || child->when_layout)
+            return false;
+        if (lays_out_children && child->layout_cache.parent_serial != cache.serial)
+            return false;
+        if (!layout_subtree_unchanged(child))
+            return false;
+    }
+    
+    cache.unchanged = true;
+    return true;
+}
+
+// Moves an already laid out subtree, which is only the same as laying it out again for whole pixel amounts because
+// of the rounding layout does
+static void
+layout_translate(Container *container, double x_change, double y_change) {
+    auto &cache = container->layout_cache;
+    container->real_bounds.x += x_change;
+    container->real_bounds.y += y_change;
+    container->children_bounds.x += x_change;
+    container->children_bounds.y += y_change;
+    cache.bounds.x += x_change;
+    cache.bounds.y += y_change;
+    cache.real_bounds.x += x_change;
+    cache.real_bounds.y += y_change;
+    cache.children_bounds.x += x_change;
+    cache.children_bounds.y += y_change;
+    
+    int count = layout_child_count(container);
+    for (int i = 0; i < count; i++) {
+        if (auto child = layout_child(container, i))
+            layout_translate(child, x_change, y_change);
+    }
+}
+
+static bool
+layout_reuse(Container *container, const Bounds &bounds) {
+    auto &cache = container->layout_cache;
+    if (parent_moves_children || !cache.valid || cache.bounds.w != bounds.w || cache.bounds.h != bounds.h)
+        return false;
+    double x_change = bounds.x - cache.bounds.x;
+    double y_change = bounds.y - cache.bounds.y;
+    if (x_change != std::floor(x_change) || y_change != std::floor(y_change))
+        return false;
+    if (!layout_subtree_unchanged(container))
+        return false;
+    
+    if (x_change != 0 || y_change != 0)
+        layout_translate(container, x_change, y_change);
+    return true;
+}
+
+// Called once the outermost layout call is done, so what's recorded includes the rounding and aligning parents do to
+// their children after laying them out
+static void
+layout_record(Container *container) {
+    auto &cache = container->layout_cache;
+    if (cache.laid_out_pass != layout_pass)
+        return;
+    
+    cache.valid = true;
+    cache.wanted_bounds = container->wanted_bounds;
+    cache.wanted_pad = container->wanted_pad;
+    cache.real_bounds = container->real_bounds;
+    cache.children_bounds = container->children_bounds;
+    cache.spacing = container->spacing;
+    cache.scroll_v_real = container->scroll_v_real;
+    cache.scroll_h_real = container->scroll_h_real;
+    cache.scroll_v_visual = container->scroll_v_visual;
+    cache.scroll_h_visual = container->scroll_h_visual;
+    cache.type = container->type;
+    cache.alignment = container->alignment;
+    cache.exists = container->exists;
+    cache.should_layout_children = container->should_layout_children;
+    cache.shape = layout_shape(container);
+    
+    int count = layout_child_count(container);
+    for (int i = 0; i < count; i++) {
+        if (auto child = layout_child(container, i))
+            layout_record(child);
+    }
+}
+
+// Subtrees whose inputs haven't changed since they were last laid out with the same size are skipped (or just
+// moved), so relayouts caused by a single animating container only cost as much as what that container affects
+void layout(AppClient *client, cairo_t *cr, Container *container, const Bounds &bounds) {
+    bool outermost = layout_depth == 0;
+    if (outermost) {
+        layout_pass++;
+        reserved_generation++;
+    }
+    auto &cache = container->layout_cache;
+    cache.parent_serial = current_layout_serial;
+    if (layout_reuse(container, bounds))
+        return;
+    
+    cache.valid = false;
+    cache.serial = ++layout_serial_counter;
+    cache.laid_out_pass = layout_pass;
+    cache.bounds = bounds;
+    
+    long previous_serial = current_layout_serial;
+    bool previous_moves_children = parent_moves_children;
+    current_layout_serial = cache.serial;
+    parent_moves_children = container->alignment & ALIGN_CENTER;
+    layout_depth++;
+    
+    layout_container(client, cr, container, bounds);
+    
+    layout_depth--;
+    current_layout_serial = previous_serial;
+    parent_moves_children = previous_moves_children;
+    
+    if (outermost)
+        layout_record(container);
+}
+
+void container_invalidate_layout(Container *container) {
+    container->layout_cache.valid = false;
+}
+
+void virtual_list_set_count(VirtualList *list, int count) {
+    list->count = std::max(0, count);
+    virtual_list_rebind(list);
+}
+
+void virtual_list_rebind(VirtualList *list) {
+    list->needs_rebind = true;
+    list->measured = false;
+}
+
 Container *
-container_by_name(std::string name, Container *root) {
+virtual_list_row(VirtualList *list, int index) {
+    for (int i = 0; i < list->children.size(); i++)
+        if (list->row_indexes[i] == index)
+            return list->children[i];
+    return nullptr;
+}
+
+double
+virtual_list_row_y(VirtualList *list, int index) {
+    virtual_list_measure(list);
+    if (index < 0 || index > list->count)
+        return list->children_bounds.y;
+    return list->children_bounds.y + list->offsets[index];
+}
+
+double
+virtual_list_height(VirtualList *list) {
+    virtual_list_measure(list);
+    return list->offsets[list->count];
+}
+
+// Children and z_index are modified directly all over the place, so besides the dirty bit, the cached order is
+// validated on use, which is a single pass over the children with no allocation
+static bool
+render_order_valid(Container *container) {
+    auto &order = container->render_order;
+    auto &children = container->children;
+    if (container->render_order_dirty || order.size() != children.size())
+        return false;
+    for (int i = 1; i < order.size(); i++) {
+        int previous_z = children[order[i - 1]]->z_index;
+        int z = children[order[i]]->z_index;
+        if (previous_z > z || (previous_z == z && order[i - 1] > order[i]))
+            return false;
+    }
+    return true;
+}
+
+const std::vector<int> &
+container_render_order(Container *container) {
+    if (render_order_valid(container))
+        return container->render_order;
+    
+    auto &order = container->render_order;
+    auto &children = container->children;
+    order.resize(children.size());
+    for (int i = 0; i < order.size(); i++)
+        order[i] = i;
+    
+    // Insertion sort since it's stable, in place, and z_index is almost always the same for every child
+    for (int i = 1; i < order.size(); i++) {
+        int index = order[i];
+        int z = children[index]->z_index;
+        int j = i - 1;
+        while (j >= 0 && children[order[j]]->z_index > z) {
+            order[j + 1] = order[j];
+            j--;
+        }
+        order[j + 1] = index;
+    }
+    container->render_order_dirty = false;
+    
+    return order;
+}
+
+static Container *
+container_by_name_walk(const std::string &name, Container *root) {
     if (!root) {
         return nullptr;
     }
     
     if (root->name == name) {
-        return root;;
+        return root;
     }
     
     if (root->type == layout_type::newscroll) {
         auto scroll = (ScrollContainer *) root;
-        auto possible = container_by_name(name, scroll->content);
+        auto possible = container_by_name_walk(name, scroll->content);
         if (possible)
             return possible;
-        possible = container_by_name(name, scroll->right);
+        possible = container_by_name_walk(name, scroll->right);
         if (possible)
             return possible;
-        possible = container_by_name(name, scroll->bottom);
+        possible = container_by_name_walk(name, scroll->bottom);
         if (possible)
             return possible;
         for (auto child: scroll->children) {
-            possible = container_by_name(name, child);
+            possible = container_by_name_walk(name, child);
             if (possible)
                 return possible;
         }
     } else {
         for (auto child: root->children) {
-            auto possible = container_by_name(name, child);
+            auto possible = container_by_name_walk(name, child);
             if (possible)
                 return possible;
         }
@@ -707,6 +1176,109 @@ container_by_name(std::string name, Container *root) {
     return nullptr;
 }
 
+// Every container with a non empty name, by name. Kept current by ContainerName and ~Container.
+static std::unordered_map<std::string, std::unordered_set<Container *>> containers_by_name;
+static std::mutex containers_by_name_mutex;
+
+// Every container which hasn't been destroyed. A container can be detached and outlive its parent, so container_by_name
+// checks parent pointers against this before following them.
+static std::unordered_set<Container *> live_containers;
+
+static void
+container_track(Container *container) {
+    std::lock_guard lock(containers_by_name_mutex);
+    live_containers.insert(container);
+}
+
+ContainerName &
+ContainerName::operator=(const std::string &value) {
+    if (value == *this)
+        return *this;
+    
+    std::lock_guard lock(containers_by_name_mutex);
+    if (!empty()) {
+        auto it = containers_by_name.find(*this);
+        if (it != containers_by_name.end()) {
+            it->second.erase(owner);
+            if (it->second.empty())
+                containers_by_name.erase(it);
+        }
+    }
+    std::string::operator=(value);
+    if (!empty())
+        containers_by_name[*this].insert(owner);
+    return *this;
+}
+
+// Where child comes in the order container_by_name_walk visits the children of parent, -1 if parent doesn't hold it
+static long
+container_child_position(Container *parent, Container *child) {
+    long offset = 0;
+    if (parent->type == layout_type::newscroll) {
+        auto scroll = (ScrollContainer *) parent;
+        if (scroll->content == child)
+            return 0;
+        if (scroll->right == child)
+            return 1;
+        if (scroll->bottom == child)
+            return 2;
+        offset = 3;
+    }
+    for (long i = 0; i < parent->children.size(); i++)
+        if (parent->children[i] == child)
+            return offset + i;
+    return -1;
+}
+
+// Fills path with the position of every container from root down to container, false if container isn't in root's
+// tree (parent pointers only say where a container was attached, so every step is checked)
+static bool
+container_path_from(Container *root, Container *container, std::vector<long> &path) {
+    path.clear();
+    while (container != root) {
+        Container *parent = container->parent;
+        if (!parent || live_containers.find(parent) == live_containers.end())
+            return false;
+        long position = container_child_position(parent, container);
+        if (position == -1)
+            return false;
+        path.push_back(position);
+        container = parent;
+    }
+    std::reverse(path.begin(), path.end());
+    return true;
+}
+
+Container *
+container_by_name(const std::string &name, Container *root) {
+    if (!root)
+        return nullptr;
+    if (root->name == name)
+        return root;
+    // Unnamed containers aren't indexed
+    if (name.empty())
+        return container_by_name_walk(name, root);
+    
+    std::lock_guard lock(containers_by_name_mutex);
+    auto it = containers_by_name.find(name);
+    if (it == containers_by_name.end())
+        return nullptr;
+    
+    // With duplicate names, the one the walk would reach first is the one with the lexicographically smallest path
+    Container *best = nullptr;
+    std::vector<long> best_path;
+    std::vector<long> path;
+    for (auto container: it->second) {
+        if (!container_path_from(root, container, path))
+            continue;
+        if (!best || path < best_path) {
+            best = container;
+            std::swap(best_path, path);
+        }
+    }
+    return best;
+}
+
 Container *
 container_by_container(Container *target, Container *root) {
     if (root == target) {
@@ -800,6 +1372,7 @@ Container::child(int wanted_width, int wanted_height) {
     Container *child_container = new Container(wanted_width, wanted_height);
     child_container->parent = this;
     this->children.push_back(child_container);
+    this->render_order_dirty = true;
     return child_container;
 }
 
@@ -809,26 +1382,32 @@ Container::child(int type, int wanted_width, int wanted_height) {
     child_container->type = type;
     child_container->parent = this;
     this->children.push_back(child_container);
+    this->render_order_dirty = true;
     return child_container;
 }
 
 Container::Container(layout_type type, double wanted_width, double wanted_height) {
+    container_track(this);
     this->type = type;
     wanted_bounds.w = wanted_width;
     wanted_bounds.h = wanted_height;
 }
 
 Container::Container(double wanted_width, double wanted_height) {
+    container_track(this);
     wanted_bounds.w = wanted_width;
     wanted_bounds.h = wanted_height;
 }
 
 Container::Container(const Container &c) {
+    container_track(this);
     parent = c.parent;
     name = c.name;
     
     for (auto child: c.children) {
-        children.push_back(new Container(*child));
+        auto copy = new Container(*child);
+        copy->parent = this;
+        children.push_back(copy);
     }
     
     type = c.type;
@@ -857,7 +1436,23 @@ Container::Container(const Container &c) {
     when_clicked = c.when_clicked;
 }
 
+static void paint_cache_forget(Container *container);
+
 Container::~Container() {
+    {
+        std::lock_guard lock(containers_by_name_mutex);
+        live_containers.erase(this);
+        auto it = name.empty() ? containers_by_name.end() : containers_by_name.find(name);
+        if (it != containers_by_name.end()) {
+            it->second.erase(this);
+            if (it->second.empty())
+                containers_by_name.erase(it);
+        }
+    }
+    if (paint_cache_id)
+        paint_cache_forget(this);
+    if (animation_damage_client)
+        client_forget_damaging_animations(animation_damage_client, this);
     for (auto child: children) {
         if (child->type == layout_type::newscroll) {
             delete (ScrollContainer *) child;
@@ -870,6 +1465,7 @@ Container::~Container() {
 }
 
 Container::Container() {
+    container_track(this);
     parent = nullptr;
     type = layout_type::hbox;
     z_index = 0;
@@ -878,6 +1474,357 @@ Container::Container() {
     user_data = nullptr;
 }
 
+struct PaintCacheEntry {
+    uint64_t id = 0;
+    cairo_surface_t *surface = nullptr;
+    int w = 0;
+    int h = 0;
+    int phase_x = 0;
+    int phase_y = 0;
+    float dpi = 1;
+    size_t bytes = 0;
+};
+
+// Front of the list is the most recently used
+static std::list<PaintCacheEntry> paint_cache_lru;
+// By Container::paint_cache_id rather than by pointer, so a container allocated where a cached one used to be can't
+// be handed the old one's surface
+static std::unordered_map<uint64_t, std::list<PaintCacheEntry>::iterator> paint_cache_index;
+static uint64_t paint_cache_next_id = 1;
+static PaintCacheStats paint_cache_counters = {0, 0, 0, 0, 32 * 1024 * 1024};
+
+static void
+paint_cache_erase(std::list<PaintCacheEntry>::iterator entry) {
+    paint_cache_counters.bytes -= entry->bytes;
+    cairo_surface_destroy(entry->surface);
+    paint_cache_index.erase(entry->id);
+    paint_cache_lru.erase(entry);
+}
+
+static void
+paint_cache_evict_until(size_t bytes) {
+    while (!paint_cache_lru.empty() && paint_cache_counters.bytes > bytes) {
+        paint_cache_erase(std::prev(paint_cache_lru.end()));
+        paint_cache_counters.evictions++;
+    }
+}
+
+static void
+paint_cache_forget(Container *container) {
+    auto it = paint_cache_index.find(container->paint_cache_id);
+    if (it != paint_cache_index.end())
+        paint_cache_erase(it->second);
+}
+
+// Where inside its first pixel x falls, in 1/256ths. Anti-aliased edges come out differently for every offset, so a
+// surface painted at one can't be reused at another.
+static int
+paint_cache_phase(double x) {
+    return (int) std::lround((x - std::floor(x)) * 256);
+}
+
+cairo_surface_t *
+paint_cache_lookup(Container *container, double x, double y, int w, int h, float dpi) {
+    auto it = container->paint_cache_id ? paint_cache_index.find(container->paint_cache_id) : paint_cache_index.end();
+    if (it == paint_cache_index.end()) {
+        paint_cache_counters.misses++;
+        return nullptr;
+    }
+    auto entry = it->second;
+    if (entry->w != w || entry->h != h || entry->dpi != dpi || entry->phase_x != paint_cache_phase(x) ||
+        entry->phase_y != paint_cache_phase(y)) {
+        paint_cache_erase(entry);
+        paint_cache_counters.misses++;
+        return nullptr;
+    }
+    paint_cache_lru.splice(paint_cache_lru.begin(), paint_cache_lru, entry);
+    paint_cache_counters.hits++;
+    return entry->surface;
+}
+
+bool paint_cache_store(Container *container, cairo_surface_t *surface, double x, double y, int w, int h, float dpi) {
+    paint_cache_forget(container);
+    if (!container->paint_cache_id)
+        container->paint_cache_id = paint_cache_next_id++;
+    
+    PaintCacheEntry entry;
+    entry.id = container->paint_cache_id;
+    entry.surface = surface;
+    entry.w = w;
+    entry.h = h;
+    entry.phase_x = paint_cache_phase(x);
+    entry.phase_y = paint_cache_phase(y);
+    entry.dpi = dpi;
+    entry.bytes = (size_t) w * h * 4;
+    
+    // Something bigger than the whole budget would just evict everything else and then itself
+    if (entry.bytes > paint_cache_counters.budget)
+        return false;
+    paint_cache_evict_until(paint_cache_counters.budget - entry.bytes);
+    
+    paint_cache_lru.push_front(entry);
+    paint_cache_index[entry.id] = paint_cache_lru.begin();
+    paint_cache_counters.bytes += entry.bytes;
+    return true;
+}
+
+void container_invalidate_paint_cache(Container *container) {
+    // Since the cached surface of a container includes its children, changing a child dirties every cached parent
+    for (Container *c = container; c; c = c->parent) {
+        if (c->paint_cache_id)
+            paint_cache_forget(c);
+    }
+}
+
+void paint_cache_set_budget(size_t bytes) {
+    paint_cache_counters.budget = bytes;
+    paint_cache_evict_until(bytes);
+}
+
+void paint_cache_clear() {
+    while (!paint_cache_lru.empty())
+        paint_cache_erase(paint_cache_lru.begin());
+}
+
+PaintCacheStats paint_cache_stats() {
+    return paint_cache_counters;
+}
+
+// Containers and UserData come out of slabs of same sized blocks, so opening, searching in and closing menus doesn't
+// go to malloc for every object. Each block starts with a header pointing back at its slab (nullptr for objects too
+// big for any size class, which use operator new directly).
+
+static const size_t pool_granularity = 64;
+static const int pool_classes = 32;
+static const size_t pool_slab_size = 64 * 1024;
+
+struct PoolSlab;
+
+struct alignas(alignof(std::max_align_t)) PoolHeader {
+    PoolSlab *slab;
+    size_t size;
+};
+
+struct PoolFreeBlock {
+    PoolFreeBlock *next;
+};
+
+struct PoolSlab {
+    int size_class = 0;
+    int live = 0;
+    char *memory = nullptr;
+    PoolFreeBlock *free = nullptr;
+    
+    // Siblings in the list of slabs of the same size class that still have free blocks
+    PoolSlab *prev = nullptr;
+    PoolSlab *next = nullptr;
+    bool linked = false;
+};
+
+struct ContainerPool {
+    std::mutex mutex;
+    PoolSlab *partial[pool_classes] = {};
+    // By where their memory starts, so container_tree_usage can tell whether a pointer is ours
+    std::map<char *, PoolSlab *> slabs;
+    std::unordered_set<PoolHeader *> large;
+    ContainerPoolStats stats;
+};
+
+// Never deleted so containers destroyed during exit still have somewhere to go back to
+static ContainerPool &
+container_pool() {
+    static auto pool = new ContainerPool;
+    return *pool;
+}
+
+static void
+pool_link(ContainerPool &pool, PoolSlab *slab) {
+    slab->prev = nullptr;
+    slab->next = pool.partial[slab->size_class];
+    if (slab->next)
+        slab->next->prev = slab;
+    pool.partial[slab->size_class] = slab;
+    slab->linked = true;
+}
+
+static void
+pool_unlink(ContainerPool &pool, PoolSlab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        pool.partial[slab->size_class] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->prev = nullptr;
+    slab->next = nullptr;
+    slab->linked = false;
+}
+
+static PoolSlab *
+pool_slab_new(ContainerPool &pool, int size_class) {
+    size_t block_size = (size_class + 1) * pool_granularity;
+    auto slab = new PoolSlab;
+    slab->size_class = size_class;
+    slab->memory = (char *) ::operator new(pool_slab_size);
+    size_t blocks = pool_slab_size / block_size;
+    for (size_t i = blocks; i-- > 0;) {
+        auto block = (PoolFreeBlock *) (slab->memory + i * block_size);
+        block->next = slab->free;
+        slab->free = block;
+    }
+    pool.slabs[slab->memory] = slab;
+    pool_link(pool, slab);
+    pool.stats.slabs++;
+    pool.stats.slab_bytes += pool_slab_size;
+    pool.stats.system_allocations++;
+    return slab;
+}
+
+static void *
+pool_allocate(size_t size) {
+    auto &pool = container_pool();
+    size_t block_size = sizeof(PoolHeader) + size;
+    int size_class = (int) ((block_size + pool_granularity - 1) / pool_granularity) - 1;
+    
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    PoolHeader *header;
+    if (size_class >= pool_classes) {
+        header = (PoolHeader *) ::operator new(block_size);
+        header->slab = nullptr;
+        header->size = block_size;
+        pool.large.insert(header);
+        pool.stats.system_allocations++;
+    } else {
+        PoolSlab *slab = pool.partial[size_class];
+        if (!slab)
+            slab = pool_slab_new(pool, size_class);
+        auto block = slab->free;
+        slab->free = block->next;
+        slab->live++;
+        if (!slab->free)
+            pool_unlink(pool, slab);
+        header = (PoolHeader *) block;
+        header->slab = slab;
+        header->size = (size_class + 1) * pool_granularity;
+    }
+    pool.stats.objects++;
+    pool.stats.bytes += header->size;
+    pool.stats.allocations++;
+    return header + 1;
+}
+
+static void
+pool_free(void *ptr) {
+    if (!ptr)
+        return;
+    auto &pool = container_pool();
+    auto header = ((PoolHeader *) ptr) - 1;
+    
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.stats.objects--;
+    pool.stats.bytes -= header->size;
+    auto slab = header->slab;
+    if (!slab) {
+        pool.large.erase(header);
+        ::operator delete(header);
+        return;
+    }
+    auto block = (PoolFreeBlock *) header;
+    block->next = slab->free;
+    slab->free = block;
+    slab->live--;
+    if (!slab->linked)
+        pool_link(pool, slab);
+}
+
+void *UserData::operator new(size_t size) {
+    return pool_allocate(size);
+}
+
+void UserData::operator delete(void *ptr) {
+    pool_free(ptr);
+}
+
+void *Container::operator new(size_t size) {
+    return pool_allocate(size);
+}
+
+void Container::operator delete(void *ptr) {
+    pool_free(ptr);
+}
+
+ContainerPoolStats container_pool_stats() {
+    auto &pool = container_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    return pool.stats;
+}
+
+static void
+pool_count(ContainerPool &pool, ContainerPoolStats &usage, void *ptr) {
+    auto header = ((PoolHeader *) ptr) - 1;
+    // Containers can also live on the stack or inside other objects, those aren't ours to count
+    if (!pool.large.count(header)) {
+        auto slab = pool.slabs.upper_bound((char *) header);
+        if (slab == pool.slabs.begin())
+            return;
+        slab--;
+        if ((char *) header >= slab->first + pool_slab_size)
+            return;
+    }
+    usage.objects++;
+    usage.bytes += header->size;
+}
+
+ContainerPoolStats container_tree_usage(Container *root) {
+    ContainerPoolStats usage;
+    if (!root)
+        return usage;
+    auto &pool = container_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    std::vector<Container *> stack = {root};
+    while (!stack.empty()) {
+        auto container = stack.back();
+        stack.pop_back();
+        pool_count(pool, usage, container);
+        if (container->user_data)
+            pool_count(pool, usage, container->user_data);
+        for (auto child: container->children)
+            stack.push_back(child);
+        if (container->type == ::newscroll) {
+            auto scroll = (ScrollContainer *) container;
+            if (scroll->content)
+                stack.push_back(scroll->content);
+            if (scroll->right)
+                stack.push_back(scroll->right);
+            if (scroll->bottom)
+                stack.push_back(scroll->bottom);
+        } else if (container->type == ::virtual_list) {
+            for (auto row: ((VirtualList *) container)->pool)
+                stack.push_back(row);
+        }
+    }
+    return usage;
+}
+
+void container_pool_trim() {
+    auto &pool = container_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    for (auto it = pool.slabs.begin(); it != pool.slabs.end();) {
+        auto slab = it->second;
+        if (slab->live != 0) {
+            it++;
+            continue;
+        }
+        if (slab->linked)
+            pool_unlink(pool, slab);
+        ::operator delete(slab->memory);
+        delete slab;
+        it = pool.slabs.erase(it);
+        pool.stats.slabs--;
+        pool.stats.slab_bytes -= pool_slab_size;
+    }
+}
+
 ScrollContainer *Container::scrollchild(const ScrollPaneSettings &scroll_pane_settings) {
     return make_newscrollpane_as_child(this, scroll_pane_settings);
 }
@@ -936,13 +1883,9 @@ void Subprocess::kill(bool warn) {
         if (this->function)
             this->function(this);
     }
-    for (int i = 0; i < app->descriptors_being_polled.size(); i++)
-        if (app->descriptors_being_polled[i].file_descriptor == outpipe[0])
-            app->descriptors_being_polled.erase(app->descriptors_being_polled.begin() + i);
+    remove_polled_descriptor(app, outpipe[0]);
     if (this->timeout_fd != -1)
-        for (int i = 0; i < app->descriptors_being_polled.size(); i++)
-            if (app->descriptors_being_polled[i].file_descriptor == this->timeout_fd)
-                app->descriptors_being_polled.erase(app->descriptors_being_polled.begin() + i);
+        remove_polled_descriptor(app, this->timeout_fd);
     for (int i = 0; i < this->client->commands.size(); i++) {
         if (this->client->commands[i] == this) {
             this->client->commands.erase(this->client->commands.begin() + i);
@@ -3,6 +3,7 @@
 
 #include <X11/keysym.h>
 #include <cairo.h>
+#include <cstdint>
 #include <string>
 #include <utility>
 #include <vector>
@@ -66,6 +67,8 @@ enum layout_type {
     newscroll = 1 << 12,
     
     editable_label = 1 << 13,
+    
+    virtual_list = 1 << 14,
 };
 
 enum container_alignment {
@@ -79,6 +82,11 @@ enum container_alignment {
 
 struct UserData {
     virtual ~UserData() {};
+    
+    // Comes from the container pool, see container_pool_stats
+    static void *operator new(size_t size);
+    
+    static void operator delete(void *ptr);
 };
 
 struct MouseState {
@@ -199,6 +207,27 @@ struct ClientAnimation {
     void (*finished)(AppClient *client) = nullptr;
     
     double delay;
+    
+    // If set, the animation only changes what this container paints, so frames can repaint just its bounds
+    Container *damage = nullptr;
+};
+
+#include <atomic>
+
+struct FrameStats {
+    // How many times client_paint actually painted the client
+    long frames_painted = 0;
+    
+    // Calls to request_refresh which were merged into a frame that was already queued
+    std::atomic<long> requests_coalesced = 0;
+    
+    // Queued frames that were painted later than one frame interval after being requested
+    long frames_dropped = 0;
+    
+    // Paints which satisfied a request_refresh, and the time between the request and that paint
+    long requests_painted = 0;
+    long total_latency_ms = 0;
+    long max_latency_ms = 0;
 };
 
 enum struct CommandStatus {
@@ -233,8 +262,6 @@ struct Subprocess {
     void kill(bool warn);
 };
 
-#include <atomic>
-
 struct AppClient {
     App *app = nullptr;
     
@@ -262,7 +289,7 @@ struct AppClient {
     
     bool mapped = true;
     
-    long last_repaint_time;
+    long last_repaint_time = 0;
     
     // Variables to limit how often we handle motion notify events
     float motion_events_per_second = 120;
@@ -270,7 +297,21 @@ struct AppClient {
     int motion_event_y = 0;
     Timeout *motion_event_timeout = nullptr;
 
+    // Set by request_refresh (from any thread) and cleared by client_paint. The main loop is woken through
+    // App::frame_event_fd and paints the client at most once per 1000 / fps milliseconds.
     std::atomic<bool> refresh_already_queued = false;
+    std::atomic<long> refresh_requested_time = 0;
+    Timeout *frame_timeout = nullptr;
+    FrameStats frame_stats;
+    
+    // Set by request_refresh, which means the next frame has to repaint everything regardless of damage
+    std::atomic<bool> full_repaint_queued = false;
+    
+    // Union of the areas reported through request_partial_refresh since the last paint, nullptr means none
+    cairo_region_t *damage = nullptr;
+    
+    // The region client_paint is currently clipped to, containers outside of it don't have when_paint called
+    cairo_region_t *paint_region = nullptr;
 
     std::vector<ClientAnimation> animations;
     int animations_running = 0;
@@ -334,13 +375,88 @@ struct AppClient {
 struct ScrollContainer;
 struct ScrollPaneSettings;
 
+// What a container looked like the last time layout finished with it, used to skip re-laying out subtrees which
+// haven't changed since, see layout in container.cpp
+struct LayoutCache {
+    bool valid = false;
+    
+    // The bounds layout was called with
+    Bounds bounds;
+    
+    // Inputs recorded once the outermost layout call finished
+    Bounds wanted_bounds;
+    Bounds wanted_pad;
+    double spacing = 0;
+    double scroll_v_real = 0;
+    double scroll_h_real = 0;
+    double scroll_v_visual = 0;
+    double scroll_h_visual = 0;
+    int type = 0;
+    int alignment = 0;
+    bool exists = true;
+    bool should_layout_children = true;
+    // Order sensitive hash of the children pointers and their exists flags (and scroll pane settings)
+    size_t shape = 0;
+    
+    // Outputs recorded at the same time, so bounds modified by hand after layout are noticed
+    Bounds real_bounds;
+    Bounds children_bounds;
+    
+    // Unique per layout call which actually laid this container out
+    long serial = 0;
+    // The serial of the parent layout call which laid this container out as a child, 0 if layout was called on it
+    // directly
+    long parent_serial = 0;
+    
+    // The last layout pass which laid this container out (instead of skipping it)
+    long laid_out_pass = 0;
+    
+    // Per layout pass memo of whether the subtree is unchanged
+    long checked_pass = 0;
+    bool unchanged = false;
+    
+    // Per layout pass memo of reserved_width and reserved_height
+    long reserved_generation = 0;
+    double reserved_w = 0;
+    double reserved_h = 0;
+    bool reserved_w_set = false;
+    bool reserved_h_set = false;
+};
+
+// Container::name. Assigning to it keeps the index container_by_name looks names up in current, so the string can
+// only be replaced as a whole.
+struct ContainerName : std::string {
+    Container *owner;
+    
+    explicit ContainerName(Container *owner) : owner(owner) {}
+    
+    ContainerName(const ContainerName &) = delete;
+    
+    ContainerName &operator=(const ContainerName &value) { return *this = (const std::string &) value; }
+    
+    ContainerName &operator=(const std::string &value);
+    
+    ContainerName &operator=(const char *value) { return *this = std::string(value); }
+    
+    // These would change the name behind the index's back
+    void operator+=(const std::string &) = delete;
+    
+    void append(const std::string &) = delete;
+    
+    void assign(const std::string &) = delete;
+    
+    void clear() = delete;
+    
+    void swap(std::string &) = delete;
+};
+
 struct Container {
     // The parent of this container which must be set by the user whenever a
     // relationship is added
-    Container *parent;
+    Container *parent = nullptr;
     
     // A user settable name that can be used for retrival
-    std::string name;
+    ContainerName name{this};
     
     // List of this containers children;
     std::vector<Container *> children;
@@ -351,6 +467,10 @@ struct Container {
     // A higher z_index will mean it will be rendered above everything else
     int z_index = 0;
     
+    // Indexes into children sorted by z_index (ties keep their child order), see container_render_order
+    std::vector<int> render_order;
+    bool render_order_dirty = true;
+    
     // Spacing between children when laying them out
     double spacing = 0;
     
@@ -423,6 +543,20 @@ struct Container {
     // Do children get painted
     bool automatically_paint_children = true;
     
+    // If true, this container and its children are painted once into an offscreen surface which is reused on every
+    // frame until the size, dpi or position within a pixel changes, or container_invalidate_paint_cache is called.
+    // Only for subtrees whose pixels rarely change and which don't paint outside their own bounds.
+    bool paint_cached = false;
+    
+    // Set the first time a surface is cached for this container, never reused and never copied
+    uint64_t paint_cache_id = 0;
+    
+    // Set while an animation of this client damages this container, so destroying it can drop those animations
+    AppClient *animation_damage_client = nullptr;
+    
+    // Used by layout to skip this container if nothing it depends on changed, see container_invalidate_layout
+    LayoutCache layout_cache;
+    
     void *user_data = nullptr;
     
     // Called when client needs to repaint itself
@@ -511,6 +645,11 @@ struct Container {
     
     virtual ~Container();
     
+    // Comes from the container pool, see container_pool_stats
+    static void *operator new(size_t size);
+    
+    static void operator delete(void *ptr);
+    
     ScrollContainer *scrollchild(const ScrollPaneSettings &scroll_pane_settings);
 };
 
@@ -565,6 +704,57 @@ struct ScrollContainer : public Container {
     }
 };
 
+// A vbox which only has containers for the rows that are visible (plus a few around them), so laying it out and
+// painting it costs the same no matter how many rows it has. Rows are made by create_row, recycled through a pool as
+// they go in and out of view, and bound to the index they show by bind_row. What's visible is decided by the closest
+// ScrollContainer above the list, usually the one it's the content of (see scrollpane_virtual_content).
+struct VirtualList : public Container {
+    // How many rows the list has, set with virtual_list_set_count
+    int count = 0;
+    
+    // How many rows past the visible ones are kept laid out in each direction
+    int overscan = 2;
+    
+    // Rows are only recycled into rows of the same kind, nullptr means every row is the same kind
+    int (*row_kind)(VirtualList *list, int index) = nullptr;
+    
+    double (*row_height)(VirtualList *list, int index) = nullptr;
+    
+    Container *(*create_row)(VirtualList *list, int kind) = nullptr;
+    
+    // Called when a row starts showing an index, and for every visible row after virtual_list_rebind
+    void (*bind_row)(VirtualList *list, Container *row, int index) = nullptr;
+    
+    // Parallel to children, the index and kind each row is bound to
+    std::vector<int> row_indexes;
+    std::vector<int> row_kinds;
+    
+    // Rows which aren't bound to anything
+    std::vector<Container *> pool;
+    std::vector<int> pool_kinds;
+    
+    // Where each row starts relative to children_bounds.y, offsets[count] is where the last one ends
+    std::vector<double> heights;
+    std::vector<double> offsets;
+    double measured_spacing = 0;
+    bool measured = false;
+    bool needs_rebind = false;
+    
+    // Reused by layout so scrolling doesn't allocate
+    std::vector<Container *> scratch;
+    
+    VirtualList() {
+        type = ::virtual_list;
+        wanted_bounds.w = FILL_SPACE;
+        wanted_bounds.h = FILL_SPACE;
+    }
+    
+    ~VirtualList() {
+        for (auto row: pool)
+            delete row;
+    }
+};
+
 struct EditableSelectableLabel : public Container {
     std::string font = "Segoe MDL2 Assets Mod";
     PangoWeight weight = PANGO_WEIGHT_NORMAL;
@@ -585,8 +775,14 @@ scroll_bounds(Container *container);
 
 void layout(AppClient *client, cairo_t *cr, Container *container, const Bounds &bounds);
 
+// Forces the next layout to lay out this container (and therefore its parents) again, for when something layout
+// can't see, like a user_data field read by a paint function which changes the size of the children, has changed
+void container_invalidate_layout(Container *container);
+
+// The first container named name which a depth first walk from root would reach. Looked up in an index by name, which
+// finds containers in root's tree through their parent pointers, so those have to be kept right.
 Container *
-container_by_name(std::string name, Container *root);
+container_by_name(const std::string &name, Container *root);
 
 Container *
 container_by_container(Container *target, Container *root);
@@ -615,4 +811,73 @@ actual_true_width(Container *box);
 
 void clamp_scroll(ScrollContainer *scrollpane);
 
+// Returns the order children should be painted in. Only re-sorts when children or their z_index changed since the
+// last call, so painting doesn't need to allocate.
+const std::vector<int> &
+container_render_order(Container *container);
+
+struct PaintCacheStats {
+    long hits = 0;
+    long misses = 0;
+    long evictions = 0;
+    size_t bytes = 0;
+    size_t budget = 0;
+};
+
+// x and y are where the container's bounds start, which the surface has to have been painted at to be reused
+cairo_surface_t *
+paint_cache_lookup(Container *container, double x, double y, int w, int h, float dpi);
+
+// Takes ownership of the surface if it returns true, false means it's bigger than the entire budget
+bool paint_cache_store(Container *container, cairo_surface_t *surface, double x, double y, int w, int h, float dpi);
+
+// Drops the cached surface of the container and of any cached container it's inside of
+void container_invalidate_paint_cache(Container *container);
+
+void paint_cache_set_budget(size_t bytes);
+
+void paint_cache_clear();
+
+PaintCacheStats paint_cache_stats();
+
+struct ContainerPoolStats {
+    // Containers and UserData alive, and the bytes they take up (rounded up to their size class)
+    long objects = 0;
+    size_t bytes = 0;
+    
+    // Memory held by slabs, including free blocks kept for reuse
+    long slabs = 0;
+    size_t slab_bytes = 0;
+    
+    // Objects handed out vs trips to the system allocator (new slabs and objects too big for a slab)
+    long allocations = 0;
+    long system_allocations = 0;
+};
+
+ContainerPoolStats container_pool_stats();
+
+// Objects and bytes used by the containers (and their user_data) under root, slab fields are left at zero
+ContainerPoolStats container_tree_usage(Container *root);
+
+// Gives slabs without any live objects back to the system, called after a client's root is deleted
+void container_pool_trim();
+
+// Changes how many rows the list has and rebinds the visible ones
+void virtual_list_set_count(VirtualList *list, int count);
+
+// Rebinds (and measures) every row on the next layout, for when what an index shows changed but the count didn't
+void virtual_list_rebind(VirtualList *list);
+
+// The row currently bound to index, or nullptr if that index isn't laid out because it's out of view
+Container *
+virtual_list_row(VirtualList *list, int index);
+
+// Where the row at index is (or would be if it was in view) laid out
+double
+virtual_list_row_y(VirtualList *list, int index);
+
+// The height of every row and the spacing between them
+double
+virtual_list_height(VirtualList *list);
+
 #endif
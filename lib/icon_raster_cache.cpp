@@ -0,0 +1,597 @@
+#include "icon_raster_cache.h"
+#include "../src/config.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <librsvg/rsvg.h>
+#include <list>
+#include <mutex>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#ifdef TRACY_ENABLE
+
+#include "../tracy/public/tracy/Tracy.hpp"
+
+#endif
+
+struct IconRaster {
+    std::string key;
+    struct timespec modified = {};
+    cairo_surface_t *surface = nullptr;
+    size_t bytes = 0;
+};
+
+// Icons can be loaded from other threads
+static std::mutex raster_mutex;
+// Most recently used first
+static std::list<IconRaster> rasters;
+static std::unordered_map<std::string, std::list<IconRaster>::iterator> raster_index;
+static size_t raster_bytes = 0;
+static size_t raster_budget = 8 * 1024 * 1024;
+static uint64_t raster_hits = 0;
+static uint64_t raster_misses = 0;
+static uint64_t raster_disk_hits = 0;
+
+// Bytes in the raster directory, -1 until it's first counted
+static std::mutex raster_disk_mutex;
+static long long raster_disk_bytes = -1;
+
+static const char raster_file_magic[8] = {'w', 'b', 'r', 'a', 's', 't', 'e', 'r'};
+static const uint32_t raster_file_version = 1;
+
+// Followed by the key and then size rows of size * 4 bytes
+struct RasterFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    int64_t modified_sec;
+    int64_t modified_nsec;
+    uint32_t key_length;
+    uint32_t padding;
+};
+
+static std::string
+raster_key(const std::string &path, IconFormat format, int target_size, const ArgbColor *dye) {
+    std::string key = path;
+    key.push_back('\0');
+    key.push_back(format == IconFormat::Svg ? 's' : 'p');
+    key.append(std::to_string(target_size));
+    if (dye != nullptr) {
+        // Only what dye_surface actually uses
+        key.push_back('#');
+        key.append(std::to_string((unsigned int) std::floor(dye->r * 255))).push_back(',');
+        key.append(std::to_string((unsigned int) std::floor(dye->g * 255))).push_back(',');
+        key.append(std::to_string((unsigned int) std::floor(dye->b * 255)));
+    }
+    return key;
+}
+
+static cairo_surface_t *
+rasterize_svg(const std::string &path, int target_size) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    GFile *gfile = g_file_new_for_path(path.c_str());
+    RsvgHandle *handle = rsvg_handle_new_from_gfile_sync(gfile, RSVG_HANDLE_FLAGS_NONE, NULL, NULL);
+    g_object_unref(gfile);
+    if (handle == nullptr)
+        return nullptr;
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, target_size, target_size);
+    auto *temp_context = cairo_create(surface);
+    const RsvgRectangle viewport{0, 0, (double) target_size, (double) target_size};
+    rsvg_handle_render_layer(handle, temp_context, NULL, &viewport, nullptr);
+    cairo_destroy(temp_context);
+    g_object_unref(handle);
+
+    return surface;
+}
+
+static cairo_surface_t *
+rasterize_png(const std::string &path, int target_size) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    auto *png_surface = cairo_image_surface_create_from_png(path.c_str());
+    if (cairo_surface_status(png_surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(png_surface);
+        return nullptr;
+    }
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, target_size, target_size);
+    auto *temp_context = cairo_create(surface);
+    int w = cairo_image_surface_get_width(png_surface);
+    if (target_size != w) {
+        double scale = ((double) target_size) / ((double) w);
+        cairo_scale(temp_context, scale, scale);
+    }
+    cairo_set_source_surface(temp_context, png_surface, 0, 0);
+    cairo_paint(temp_context);
+    cairo_destroy(temp_context);
+    cairo_surface_destroy(png_surface);
+
+    return surface;
+}
+
+static std::string
+raster_directory() {
+    const char *home_directory = getenv("HOME");
+    std::string path(home_directory ? home_directory : "");
+    path += "/.cache/winbar_icon_cache/rasters";
+    return path;
+}
+
+static std::string
+raster_file_path(const std::string &key) {
+    uint64_t hash = fnv1a(key.data(), key.size());
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.argb", (unsigned long long) hash);
+    return raster_directory() + "/" + name;
+}
+
+static cairo_surface_t *
+raster_read(const std::string &key, const struct timespec &modified, int target_size) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    int fd = open(raster_file_path(key).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return nullptr;
+
+    RasterFileHeader header = {};
+    std::string stored_key(key.size(), '\0');
+    bool matches = read(fd, &header, sizeof(header)) == sizeof(header) &&
+                   std::memcmp(header.magic, raster_file_magic, sizeof(raster_file_magic)) == 0 &&
+                   header.version == raster_file_version &&
+                   header.size == (uint32_t) target_size &&
+                   header.modified_sec == modified.tv_sec &&
+                   header.modified_nsec == modified.tv_nsec &&
+                   header.key_length == key.size() &&
+                   read(fd, stored_key.data(), key.size()) == (ssize_t) key.size() &&
+                   stored_key == key;
+    if (!matches) {
+        close(fd);
+        return nullptr;
+    }
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, target_size, target_size);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    ssize_t row_bytes = target_size * 4;
+    for (int y = 0; y < target_size; y++) {
+        if (read(fd, data + y * stride, row_bytes) != row_bytes) {
+            cairo_surface_destroy(surface);
+            close(fd);
+            return nullptr;
+        }
+    }
+    // Reading bumps the mtime, which is what pruning goes by
+    futimens(fd, nullptr);
+    close(fd);
+    cairo_surface_mark_dirty(surface);
+    return surface;
+}
+
+// Needs raster_disk_mutex. Counts what's on disk and, if that's over cap, deletes the least recently used files until
+// it's down to three quarters of it, so the next few writes don't have to count again.
+static void
+raster_disk_prune(long long cap) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    DIR *dir = opendir(raster_directory().c_str());
+    if (dir == nullptr)
+        return;
+    struct RasterFile {
+        std::string name;
+        struct timespec used;
+        long long bytes;
+    };
+    std::vector<RasterFile> files;
+    long long total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_name[0] == '.')
+            continue;
+        struct stat file_stat{};
+        if (fstatat(dirfd(dir), entry->d_name, &file_stat, 0) != 0 || !S_ISREG(file_stat.st_mode))
+            continue;
+        files.push_back({entry->d_name, file_stat.st_mtim, (long long) file_stat.st_size});
+        total += file_stat.st_size;
+    }
+    if (total > cap) {
+        std::sort(files.begin(), files.end(), [](const RasterFile &a, const RasterFile &b) {
+            if (a.used.tv_sec != b.used.tv_sec)
+                return a.used.tv_sec < b.used.tv_sec;
+            return a.used.tv_nsec < b.used.tv_nsec;
+        });
+        for (const auto &file: files) {
+            if (total <= cap / 4 * 3)
+                break;
+            if (unlinkat(dirfd(dir), file.name.c_str(), 0) == 0)
+                total -= file.bytes;
+        }
+    }
+    closedir(dir);
+    raster_disk_bytes = total;
+}
+
+static void
+raster_write(const std::string &key, const struct timespec &modified, cairo_surface_t *surface) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    std::string path = raster_file_path(key);
+    std::string directory = path.substr(0, path.rfind('/'));
+    if (mkdir(directory.c_str(), S_IRWXU) == -1 && errno != EEXIST)
+        return;
+
+    RasterFileHeader header = {};
+    std::memcpy(header.magic, raster_file_magic, sizeof(raster_file_magic));
+    header.version = raster_file_version;
+    header.size = cairo_image_surface_get_width(surface);
+    header.modified_sec = modified.tv_sec;
+    header.modified_nsec = modified.tv_nsec;
+    header.key_length = key.size();
+
+    std::string contents((const char *) &header, sizeof(header));
+    contents.append(key);
+    cairo_surface_flush(surface);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    for (uint32_t y = 0; y < header.size; y++)
+        contents.append((const char *) data + y * stride, header.size * 4);
+
+    // Written next to it and renamed over so a reader never sees half a file. The name is unique because other
+    // workers (and other winbars) can be writing the same icon at the same time.
+    std::string temp_path = path + ".XXXXXX";
+    int fd = mkostemp(temp_path.data(), O_CLOEXEC);
+    if (fd == -1)
+        return;
+    bool written = write(fd, contents.data(), contents.size()) == (ssize_t) contents.size();
+    close(fd);
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        return;
+    }
+
+    // Overwriting a file counts it twice, which only means counting again (and maybe pruning) a bit early
+    long long cap = (long long) config->icon_disk_cache_mb * 1024 * 1024;
+    if (cap <= 0)
+        return;
+    std::lock_guard lock(raster_disk_mutex);
+    if (raster_disk_bytes < 0 || raster_disk_bytes + (long long) contents.size() > cap)
+        raster_disk_prune(cap);
+    else
+        raster_disk_bytes += contents.size();
+}
+
+// Needs raster_mutex
+static void
+raster_forget(std::list<IconRaster>::iterator raster) {
+    raster_bytes -= raster->bytes;
+    cairo_surface_destroy(raster->surface);
+    raster_index.erase(raster->key);
+    rasters.erase(raster);
+}
+
+// Needs raster_mutex
+static void
+raster_evict() {
+    // The newest one stays even if it's over budget on its own
+    while (raster_bytes > raster_budget && rasters.size() > 1)
+        raster_forget(std::prev(rasters.end()));
+}
+
+// A new reference if it's in memory and still matches the file, counted as a hit or a miss either way
+static cairo_surface_t *
+raster_find(const std::string &key, const struct timespec &modified) {
+    std::lock_guard lock(raster_mutex);
+    auto found = raster_index.find(key);
+    if (found != raster_index.end()) {
+        auto raster = found->second;
+        if (raster->modified.tv_sec == modified.tv_sec && raster->modified.tv_nsec == modified.tv_nsec) {
+            raster_hits++;
+            rasters.splice(rasters.begin(), rasters, raster);
+            return cairo_surface_reference(raster->surface);
+        }
+        // The file changed since
+        raster_forget(raster);
+    }
+    raster_misses++;
+    return nullptr;
+}
+
+cairo_surface_t *
+icon_raster_get(const std::string &path, IconFormat format, int target_size, const ArgbColor *dye) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    if (target_size <= 0)
+        return nullptr;
+    struct stat file_stat{};
+    if (stat(path.c_str(), &file_stat) != 0)
+        return nullptr;
+    std::string key = raster_key(path, format, target_size, dye);
+    if (auto *surface = raster_find(key, file_stat.st_mtim))
+        return surface;
+
+    // Loaded without holding the lock, two threads asking for the same icon at once just both do the work
+    cairo_surface_t *surface = nullptr;
+    bool from_disk = false;
+    if (config->icon_disk_cache) {
+        surface = raster_read(key, file_stat.st_mtim, target_size);
+        from_disk = surface != nullptr;
+    }
+    if (surface == nullptr) {
+        surface = format == IconFormat::Svg ? rasterize_svg(path, target_size) : rasterize_png(path, target_size);
+        if (surface == nullptr)
+            return nullptr;
+        if (dye != nullptr)
+            dye_surface(surface, *dye);
+        cairo_surface_flush(surface);
+        if (config->icon_disk_cache)
+            raster_write(key, file_stat.st_mtim, surface);
+    }
+
+    std::lock_guard lock(raster_mutex);
+    if (from_disk)
+        raster_disk_hits++;
+    auto found = raster_index.find(key);
+    if (found != raster_index.end())
+        raster_forget(found->second);
+    IconRaster raster;
+    raster.key = key;
+    raster.modified = file_stat.st_mtim;
+    raster.surface = surface;
+    raster.bytes = (size_t) cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface);
+    rasters.push_front(std::move(raster));
+    raster_index[key] = rasters.begin();
+    raster_bytes += rasters.front().bytes;
+    raster_evict();
+
+    return cairo_surface_reference(surface);
+}
+
+void icon_raster_cache_set_budget(size_t bytes) {
+    std::lock_guard lock(raster_mutex);
+    raster_budget = bytes;
+    raster_evict();
+}
+
+void icon_raster_cache_clear() {
+    std::lock_guard lock(raster_mutex);
+    for (auto &raster: rasters)
+        cairo_surface_destroy(raster.surface);
+    rasters.clear();
+    raster_index.clear();
+    raster_bytes = 0;
+}
+
+IconRasterCacheStats icon_raster_cache_stats() {
+    std::lock_guard lock(raster_mutex);
+    IconRasterCacheStats stats;
+    stats.entries = rasters.size();
+    stats.bytes = raster_bytes;
+    stats.budget = raster_budget;
+    stats.hits = raster_hits;
+    stats.misses = raster_misses;
+    stats.disk_hits = raster_disk_hits;
+    std::lock_guard disk_lock(raster_disk_mutex);
+    stats.disk_bytes = std::max(raster_disk_bytes, 0ll);
+    return stats;
+}
+
+struct IconRasterJob {
+    std::string client_name;
+    std::string path;
+    IconFormat format = IconFormat::Svg;
+    int target_size = 0;
+    IconRasterCallback callback = nullptr;
+    // Set instead of the above for icon_raster_run
+    std::function<void()> work;
+    std::function<void(App *)> done;
+    void *user_data = nullptr;
+    bool cancelled = false;
+    cairo_surface_t *surface = nullptr;
+};
+
+static std::mutex job_mutex;
+static std::condition_variable job_condition;
+static std::deque<IconRasterJob> waiting_jobs;
+// Taken by a worker but not finished yet, so icon_raster_cancel can still reach them
+static std::list<IconRasterJob> running_jobs;
+static std::vector<IconRasterJob> finished_jobs;
+static std::vector<std::thread> raster_workers;
+static bool raster_workers_stopping = false;
+static App *raster_app = nullptr;
+// Written to by the workers whenever finished_jobs goes from empty to not
+static int raster_done_fd = -1;
+
+static void
+raster_worker() {
+    std::unique_lock lock(job_mutex);
+    while (true) {
+        job_condition.wait(lock, [] { return raster_workers_stopping || !waiting_jobs.empty(); });
+        if (raster_workers_stopping)
+            return;
+        running_jobs.push_back(std::move(waiting_jobs.front()));
+        waiting_jobs.pop_front();
+        auto job = std::prev(running_jobs.end());
+        
+        lock.unlock();
+        cairo_surface_t *surface = nullptr;
+        if (job->work)
+            job->work();
+        else
+            surface = icon_raster_get(job->path, job->format, job->target_size);
+        lock.lock();
+        
+        job->surface = surface;
+        bool wake = finished_jobs.empty();
+        finished_jobs.push_back(std::move(*job));
+        running_jobs.erase(job);
+        if (wake) {
+            uint64_t one = 1;
+            write(raster_done_fd, &one, sizeof(one));
+        }
+    }
+}
+
+static void
+raster_jobs_finished(App *app, int fd, void *) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+    std::vector<IconRasterJob> finished;
+    {
+        std::lock_guard lock(job_mutex);
+        finished.swap(finished_jobs);
+    }
+    
+    // However many icons came in, each client is only repainted once
+    std::vector<std::string> dirty_clients;
+    for (auto &job: finished) {
+        if (job.cancelled) {
+            if (job.surface)
+                cairo_surface_destroy(job.surface);
+            continue;
+        }
+        if (job.done)
+            job.done(app);
+        else
+            job.callback(app, job.surface, job.user_data);
+        if (std::find(dirty_clients.begin(), dirty_clients.end(), job.client_name) == dirty_clients.end())
+            dirty_clients.push_back(job.client_name);
+    }
+    for (const auto &name: dirty_clients)
+        if (auto *client = client_by_name(app, name))
+            request_refresh(app, client);
+}
+
+// Needs job_mutex
+static bool
+raster_workers_start(App *app) {
+    if (!raster_workers.empty())
+        return true;
+    raster_done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (raster_done_fd == -1)
+        return false;
+    if (!poll_descriptor(app, raster_done_fd, EPOLLIN, raster_jobs_finished, nullptr, "Icon rasterization")) {
+        close(raster_done_fd);
+        raster_done_fd = -1;
+        return false;
+    }
+    raster_app = app;
+    raster_workers_stopping = false;
+    
+    // Leave a core for the main thread, and past a few the disk is what's slow anyway
+    int thread_count = std::clamp((int) std::thread::hardware_concurrency() - 1, 1, 4);
+    for (int i = 0; i < thread_count; i++)
+        raster_workers.emplace_back(raster_worker);
+    return true;
+}
+
+void icon_raster_request(App *app, const std::string &client_name, const std::string &path, IconFormat format,
+                         int target_size, IconRasterCallback callback, void *user_data) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    struct stat file_stat{};
+    if (target_size <= 0 || stat(path.c_str(), &file_stat) != 0) {
+        callback(app, nullptr, user_data);
+        return;
+    }
+    if (auto *surface = raster_find(raster_key(path, format, target_size, nullptr), file_stat.st_mtim)) {
+        callback(app, surface, user_data);
+        return;
+    }
+    
+    std::unique_lock lock(job_mutex);
+    if (!raster_workers_start(app)) {
+        lock.unlock();
+        callback(app, icon_raster_get(path, format, target_size), user_data);
+        return;
+    }
+    IconRasterJob job;
+    job.client_name = client_name;
+    job.path = path;
+    job.format = format;
+    job.target_size = target_size;
+    job.callback = callback;
+    job.user_data = user_data;
+    waiting_jobs.push_back(std::move(job));
+    lock.unlock();
+    job_condition.notify_one();
+}
+
+void icon_raster_run(App *app, const std::string &client_name, std::function<void()> work,
+                     std::function<void(App *)> done, void *user_data) {
+    std::unique_lock lock(job_mutex);
+    if (!raster_workers_start(app)) {
+        lock.unlock();
+        work();
+        done(app);
+        return;
+    }
+    IconRasterJob job;
+    job.client_name = client_name;
+    job.work = std::move(work);
+    job.done = std::move(done);
+    job.user_data = user_data;
+    waiting_jobs.push_back(std::move(job));
+    lock.unlock();
+    job_condition.notify_one();
+}
+
+void icon_raster_cancel(void *user_data) {
+    std::lock_guard lock(job_mutex);
+    waiting_jobs.erase(std::remove_if(waiting_jobs.begin(), waiting_jobs.end(),
+                                      [user_data](const IconRasterJob &job) { return job.user_data == user_data; }),
+                       waiting_jobs.end());
+    for (auto &job: running_jobs)
+        if (job.user_data == user_data)
+            job.cancelled = true;
+    for (auto &job: finished_jobs)
+        if (job.user_data == user_data)
+            job.cancelled = true;
+}
+
+void icon_raster_stop() {
+    {
+        std::lock_guard lock(job_mutex);
+        raster_workers_stopping = true;
+        waiting_jobs.clear();
+    }
+    job_condition.notify_all();
+    for (auto &worker: raster_workers)
+        worker.join();
+    raster_workers.clear();
+    
+    // Nobody is waiting on these anymore
+    for (auto &job: finished_jobs)
+        if (job.surface)
+            cairo_surface_destroy(job.surface);
+    finished_jobs.clear();
+    if (raster_done_fd != -1) {
+        remove_polled_descriptor(raster_app, raster_done_fd);
+        close(raster_done_fd);
+        raster_done_fd = -1;
+    }
+    raster_app = nullptr;
+}
@@ -0,0 +1,65 @@
+#ifndef WINBAR_ICON_RASTER_CACHE_H
+#define WINBAR_ICON_RASTER_CACHE_H
+
+#include "utility.h"
+
+#include <cairo.h>
+#include <functional>
+#include <string>
+
+// Icons are rasterized once and shared by everything that shows them. They're keyed by file (and its mtime), format,
+// pixel size (which already has the dpi scale in it) and an optional dye color. They're kept in memory up to a byte
+// budget, least recently used going first, and when config->icon_disk_cache is set also on disk as premultiplied ARGB
+// so a cold start doesn't have to parse the SVGs again. The disk copies are capped at config->icon_disk_cache_mb, the
+// ones read least recently going first.
+
+enum class IconFormat {
+    Svg,
+    Png,
+};
+
+// A new reference to a target_size x target_size ARGB32 image surface, or nullptr if the file couldn't be loaded.
+// The surface is shared, so it must not be drawn to. Release it with cairo_surface_destroy.
+cairo_surface_t *
+icon_raster_get(const std::string &path, IconFormat format, int target_size, const ArgbColor *dye = nullptr);
+
+void icon_raster_cache_set_budget(size_t bytes);
+
+// Drops everything held in memory, surfaces still referenced elsewhere stay alive
+void icon_raster_cache_clear();
+
+struct IconRasterCacheStats {
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t budget = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Misses that were answered from disk instead of rasterizing
+    uint64_t disk_hits = 0;
+    // What the disk cache held when it was last counted, 0 before anything was written
+    size_t disk_bytes = 0;
+};
+
+IconRasterCacheStats icon_raster_cache_stats();
+
+// Called on the main thread with a new reference to the icon, or nullptr if it couldn't be loaded
+typedef void (*IconRasterCallback)(App *app, cairo_surface_t *surface, void *user_data);
+
+// Loads the icon on a worker thread so the caller can draw a placeholder in the meantime. When it's already in memory
+// the callback runs before this returns. Otherwise it runs from the main loop, after which the client called
+// client_name is repainted, once for however many icons finished together.
+void icon_raster_request(App *app, const std::string &client_name, const std::string &path, IconFormat format,
+                         int target_size, IconRasterCallback callback, void *user_data);
+
+// Runs work on one of the same worker threads and then done on the main thread, with the same cancelling and
+// repainting as icon_raster_request. For working out which file to load without holding up the main thread.
+void icon_raster_run(App *app, const std::string &client_name, std::function<void()> work,
+                     std::function<void(App *)> done, void *user_data);
+
+// No callback (or done) will be called with user_data after this, call it before freeing what it points to
+void icon_raster_cancel(void *user_data);
+
+// Joins the workers and drops whatever they hadn't finished
+void icon_raster_stop();
+
+#endif //WINBAR_ICON_RASTER_CACHE_H
@@ -20,7 +20,18 @@
 #include <sys/mman.h>
 #include <pango/pangocairo.h>
 #include <math.h>
+#include <set>
 #include <unordered_map>
+#include <unordered_set>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 
 #ifdef TRACY_ENABLE
 
@@ -28,7 +39,94 @@
 
 #endif
 
-static uint32_t cache_version = 3;
+static uint32_t cache_version = 6;
+
+// icon.cache is laid out so that it can be used straight out of the mapping without copying anything:
+//
+//   IconCacheHeader
+//   IconCacheParent parents[parent_count]
+//   uint32_t        themes[theme_count]       offsets into strings
+//   IconCacheName   names[name_count]
+//   uint32_t        buckets[bucket_count]     open addressing table over names (index + 1, zero is empty)
+//   IconCacheOption options[option_count]
+//   char            strings[strings_size]     zero terminated
+//
+// Everything is in native byte order and every section starts four byte aligned. The checksum covers everything after
+// the header.
+static const char icon_cache_magic[8] = {'w', 'b', 'i', 'c', 'o', 'n', 's', '\0'};
+
+struct IconCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t parent_count;
+    uint32_t theme_count;
+    uint32_t name_count;
+    uint32_t bucket_count; // Always a power of two
+    uint32_t option_count;
+    uint64_t strings_size;
+    uint64_t checksum;
+};
+
+// A directory that icons were found in, along with what its path says about them
+struct IconCacheParent {
+    uint32_t path; // Offset into strings
+    int32_t size;
+    int32_t scale;
+    uint32_t context; // IconContext
+};
+
+struct IconCacheName {
+    uint32_t hash;
+    uint32_t name;
+    uint32_t length;
+    uint32_t first_option;
+    uint32_t option_count;
+};
+
+struct IconCacheOption {
+    uint16_t parentIndexAndExtension;
+    uint8_t themeIndex;
+    uint8_t padding;
+};
+
+struct IconCacheMapping {
+    char *map = nullptr;
+    size_t size = 0;
+    
+    IconCacheMapping(char *map, size_t size) : map(map), size(size) {}
+    
+    ~IconCacheMapping() { munmap(map, size); }
+};
+
+// The currently mapped icon.cache
+struct IconCache {
+    std::shared_ptr<const IconCacheMapping> mapping;
+    char *map = nullptr;
+    size_t size = 0;
+    ino_t inode = 0;
+    struct timespec modified = {};
+
+    const IconCacheHeader *header = nullptr;
+    const IconCacheParent *parents = nullptr;
+    const uint32_t *themes = nullptr;
+    const IconCacheName *names = nullptr;
+    const uint32_t *buckets = nullptr;
+    const IconCacheOption *options = nullptr;
+    const char *strings = nullptr;
+};
+
+static IconCache cache;
+
+// Held shared while reading out of cache, and exclusively to replace it, since any thread that searches for icons can
+// end up loading a newer cache
+static std::shared_mutex cache_mutex;
+
+static uint32_t
+icon_name_hash(const char *name, size_t length) {
+    // Taken eight bytes at a time, the upper four of each eight never reach the low half, so it gets folded in
+    uint64_t hash = fnv1a(name, length);
+    return (uint32_t) (hash ^ (hash >> 32));
+}
 
 int getExtension(unsigned short int i) {
     // return the top two bits
@@ -53,19 +151,23 @@ struct OptionsData {
     // full path
     std::vector<std::string> parentPaths;
     
+    // index into themes for each of parentPaths
+    std::vector<unsigned short int> parentThemes;
+    
     std::vector<std::string> themes;
     
     // key is the name
     // we don't use an unordered map because we need to search by key when user is looking for icons
     std::map<std::string, std::vector<Option>> options;
     
-    unsigned short int parentIndexOf(const std::string &path) {
+    unsigned short int parentIndexOf(const std::string &path, unsigned short int theme_index) {
         for (int i = parentPaths.size() - 1; i >= 0; --i) {
             if (parentPaths[i] == path) {
                 return i;
             }
         }
         parentPaths.emplace_back(path);
+        parentThemes.emplace_back(theme_index);
         return parentPaths.size() - 1;
     }
     
@@ -83,25 +185,40 @@ struct OptionsData {
 static std::vector<std::string> icon_search_paths;
 static auto *data = new OptionsData;
 
-char *name_buffer = nullptr;
-char *option_buffer = nullptr;
-struct Range {
-    unsigned long start = -1;
-    unsigned long length = -1;
+// What a single directory contributed to the cache
+struct TraversedDirectory {
+    std::string path;
+    std::string theme;
+    // Icon name without its extension, and the extension (0 for svg, 1 for png)
+    std::vector<std::pair<std::string, int>> icons;
 };
-std::unordered_map<std::string_view, Range> ranges;
 
-void traverse_dir(const char *path) {
-    DIR *dir = opendir(path);
-    if (dir == nullptr) {
-        return;
-    }
+// Directories waiting to be read. Every thread has its own queue which it works through from the back, and a thread
+// that runs dry takes from the front of the others.
+struct TraversalQueue {
+    std::mutex mutex;
+    std::deque<std::string> paths;
+};
+
+struct Traversal {
+    std::vector<TraversalQueue> queues;
+    // Directories queued or being read, the traversal is done when this hits zero
+    std::atomic<long> pending{0};
+    
+    // Threads without work sleep here until a directory is pushed (which bumps pushes) or everything is done
+    std::mutex idle_mutex;
+    std::condition_variable idle_condition;
+    long pushes = 0;
     
-    std::string path_as_string(path);
+    explicit Traversal(int threads) : queues(threads) {}
+};
+
+static std::string
+theme_of_directory(const std::string &path) {
     std::string theme;
     for (const auto &item: icon_search_paths) {
-        if (path_as_string.find(item) == 0) {
-            theme = path_as_string.substr(item.size());
+        if (path.find(item) == 0) {
+            theme = path.substr(item.size());
             if (theme.empty()) {
                 theme = path;
             } else {
@@ -113,91 +230,275 @@ void traverse_dir(const char *path) {
             break;
         }
     }
-    unsigned short int current_theme_index = data->themeIndexOf(theme);
-    unsigned short int current_parent_index = data->parentIndexOf(path);
+    return theme;
+}
+
+static void
+traversal_push(Traversal *traversal, int thread, std::string path) {
+    traversal->pending++;
+    TraversalQueue &queue = traversal->queues[thread];
+    {
+        std::lock_guard lock(queue.mutex);
+        queue.paths.push_back(std::move(path));
+    }
+    {
+        std::lock_guard lock(traversal->idle_mutex);
+        traversal->pushes++;
+    }
+    traversal->idle_condition.notify_one();
+}
+
+static bool
+traversal_take(Traversal *traversal, int thread, std::string *path) {
+    int threads = traversal->queues.size();
+    for (int i = 0; i < threads; i++) {
+        TraversalQueue &queue = traversal->queues[(thread + i) % threads];
+        std::lock_guard lock(queue.mutex);
+        if (queue.paths.empty())
+            continue;
+        if (i == 0) {
+            *path = std::move(queue.paths.back());
+            queue.paths.pop_back();
+        } else {
+            *path = std::move(queue.paths.front());
+            queue.paths.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+static void
+traverse_dir(Traversal *traversal, int thread, const std::string &path, std::vector<TraversedDirectory> *shard) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    DIR *dir = fdopendir(fd);
+    if (dir == nullptr) {
+        close(fd);
+        return;
+    }
+    
+    TraversedDirectory directory;
+    directory.path = path;
+    directory.theme = theme_of_directory(path);
     
     struct dirent *entry;
-    struct stat entryStat;
     while ((entry = readdir(dir)) != nullptr) {
         size_t name_len = strlen(entry->d_name);
-        if (name_len > 5) {
-            if (entry->d_name[name_len - 4] == '.') {
-                size_t first = name_len - 3;
-                size_t second = name_len - 2;
-                size_t third = name_len - 1;
-        
-                int svgs = entry->d_name[first] == 's';
-                int svgv = entry->d_name[second] == 'v';
-                int svgg = entry->d_name[third] == 'g';
-                int svgsvg = svgs + svgv + svgg;
-        
-                if (svgsvg == 3) {
-                    Option option = {};
-                    option.parentIndexAndExtension = (current_parent_index & 0x3FFF) | (0 << 14);
-                    option.themeIndex = current_theme_index;
-                    entry->d_name[name_len - 4] = '\0';
-                    (&data->options[entry->d_name])->push_back(option);
-                    continue;
-                }
-        
-                int pngp = entry->d_name[first] == 'p';
-                int pngv = entry->d_name[second] == 'n';
-                int pngg = entry->d_name[third] == 'g';
-                int pngpng = pngg + pngv + pngp;
-        
-                if (pngpng == 3) {
-                    Option option = {};
-                    option.parentIndexAndExtension = (current_parent_index & 0x3FFF) | (1 << 14);
-                    option.themeIndex = current_theme_index;
-                    entry->d_name[name_len - 4] = '\0';
-                    (&data->options[entry->d_name])->push_back(option);
-                    continue;
-                }
+        if (name_len > 5 && entry->d_name[name_len - 4] == '.') {
+            const char *extension = entry->d_name + name_len - 3;
+            if (extension[0] == 's' && extension[1] == 'v' && extension[2] == 'g') {
+                directory.icons.emplace_back(std::string(entry->d_name, name_len - 4), 0);
+                continue;
+            }
+            if (extension[0] == 'p' && extension[1] == 'n' && extension[2] == 'g') {
+                directory.icons.emplace_back(std::string(entry->d_name, name_len - 4), 1);
+                continue;
             }
         }
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
             continue;
-    
-        char file[PATH_MAX];
-        snprintf(file, PATH_MAX, "%s/%s", path, entry->d_name);
-        if (stat(file, &entryStat) == -1)
+        
+        // readdir already says what most entries are, only links (which are followed) and filesystems that don't
+        // fill in d_type need a stat
+        bool is_directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            struct stat entry_stat{};
+            if (fstatat(fd, entry->d_name, &entry_stat, 0) == -1)
+                continue;
+            is_directory = S_ISDIR(entry_stat.st_mode);
+        }
+        if (!is_directory)
+            continue;
+        
+        std::string child = path;
+        child.append("/").append(entry->d_name, name_len);
+        if (child.size() >= PATH_MAX)
             continue;
-        if (S_ISDIR(entryStat.st_mode)) {
-            traverse_dir(file);
-        } else if (S_ISLNK(entryStat.st_mode)) {
-            char link[PATH_MAX];
-            ssize_t len = readlink(file, link, sizeof(link));
-            if (len != -1) {
-                link[len] = '\0';
-                traverse_dir(link);
+        traversal_push(traversal, thread, std::move(child));
+    }
+    closedir(dir);
+    
+    if (!directory.icons.empty())
+        shard->push_back(std::move(directory));
+}
+
+static void
+traversal_thread(Traversal *traversal, int thread, std::vector<TraversedDirectory> *shard) {
+    std::string path;
+    while (true) {
+        long pushes;
+        {
+            std::lock_guard lock(traversal->idle_mutex);
+            pushes = traversal->pushes;
+        }
+        if (traversal_take(traversal, thread, &path)) {
+            traverse_dir(traversal, thread, path, shard);
+            if (--traversal->pending == 0) {
+                std::lock_guard lock(traversal->idle_mutex);
+                traversal->idle_condition.notify_all();
             }
+        } else if (traversal->pending == 0) {
+            return;
+        } else {
+            // Someone is still reading a directory which might add more work. Anything pushed since pushes was read
+            // is noticed by the predicate, so a push between the failed take and the wait isn't missed.
+            std::unique_lock lock(traversal->idle_mutex);
+            traversal->idle_condition.wait(lock, [traversal, pushes] {
+                return traversal->pushes != pushes || traversal->pending == 0;
+            });
         }
     }
-    closedir(dir);
 }
 
+// Reads every directory under the given roots, spread over threads threads (0 for one per core)
+static std::vector<TraversedDirectory>
+traverse_icon_directories(const std::vector<std::string> &roots, int threads) {
+    if (threads <= 0)
+        threads = std::clamp((int) std::thread::hardware_concurrency(), 1, 16);
+    Traversal traversal(threads);
+    struct stat st{};
+    for (const auto &root: roots) {
+        if (stat(root.c_str(), &st) != 0)
+            continue;
+        traversal_push(&traversal, 0, root);
+    }
+    
+    std::vector<std::vector<TraversedDirectory>> shards(threads);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++)
+        workers.emplace_back(traversal_thread, &traversal, i, &shards[i]);
+    traversal_thread(&traversal, 0, &shards[0]);
+    for (auto &worker: workers)
+        worker.join();
+    
+    std::vector<TraversedDirectory> directories;
+    for (auto &shard: shards)
+        for (auto &directory: shard)
+            directories.push_back(std::move(directory));
+    return directories;
+}
+
+// Fills data from the directories
+static void
+index_directories(std::vector<TraversedDirectory> &directories) {
+    data->options.clear();
+    data->parentPaths.clear();
+    data->parentThemes.clear();
+    data->themes.clear();
+    
+    // Which thread read which directory is up to the scheduler, so everything is put in path order before it's
+    // numbered, that way the same icon folders always produce the same cache
+    std::sort(directories.begin(), directories.end(), [](const TraversedDirectory &a, const TraversedDirectory &b) {
+        return a.path < b.path;
+    });
+    
+    for (auto &directory: directories) {
+        std::sort(directory.icons.begin(), directory.icons.end());
+        unsigned short int theme_index = data->themeIndexOf(directory.theme);
+        unsigned short int parent_index = data->parentIndexOf(directory.path, theme_index);
+        for (const auto &icon: directory.icons) {
+            Option option = {};
+            option.parentIndexAndExtension = (parent_index & 0x3FFF) | (icon.second << 14);
+            option.themeIndex = theme_index;
+            data->options[icon.first].push_back(option);
+        }
+    }
+}
 
 void generate_data() {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    for (auto item: data->options)
-        item.second.clear();
-    data->options.clear();
-    data->parentPaths.clear();
-    data->themes.clear();
+    auto directories = traverse_icon_directories(icon_search_paths, 0);
+    index_directories(directories);
+}
+
+// Works out the size, scale and context of the icons in a directory from its path, e.g. hicolor/48x48@2/apps
+static void
+icon_directory_properties(const std::string &parent_path, const std::string &theme,
+                          int *size_out, int *scale_out, IconContext *context) {
+    *context = IconContext::NotSet;
+    // The following is to set the icon 'context' based on the parent_path
+    struct ICMap {
+        std::string name;
+        IconContext context;
+    };
+    std::vector<ICMap> ics = {{"/actions",    IconContext::Actions},
+                              {"/animations", IconContext::Animations},
+                              {"/apps",       IconContext::Apps},
+                              {"/categories", IconContext::Categories},
+                              {"/devices",    IconContext::Devices},
+                              {"/emblems",    IconContext::Emblems},
+                              {"/emotes",     IconContext::Emotes},
+                              {"/intl",       IconContext::Intl},
+                              {"/mimetypes",  IconContext::Mimetypes},
+                              {"/places",     IconContext::Places},
+                              {"/status",     IconContext::Statuses},
+                              {"/panel",      IconContext::Panel}};
+    std::string path_copy = parent_path;
+    for (char &t: path_copy)
+        t = std::tolower(t);
+    for (const auto &item: ics)
+        if (path_copy.find(item.name) != std::string::npos)
+            *context = item.context;
+
+    // The following is to determine the size and scale of the icon based on the parent path
+    unsigned long startIndex = parent_path.find(theme);
+    if (startIndex == std::string::npos)
+        startIndex = 0;
+    startIndex += theme.size() + 1;
     
-    const std::filesystem::directory_options searchOptions = (
-            std::filesystem::directory_options::follow_directory_symlink |
-            std::filesystem::directory_options::skip_permission_denied
-    );
-    struct stat st{};
-    for (const auto &search_path: icon_search_paths) {
-        if (stat(search_path.c_str(), &st) != 0)
-            continue;
+    char buffer[64];
+    int buffer_len = 0;
+    bool found_at = false;
+    int scale = 0;
+    int size = 0;
     
-        traverse_dir(search_path.data());
+    // Iterate through the characters in the path string
+    for (int i = startIndex; i < parent_path.length(); i++) {
+        if (scale != 0 && size != 0)
+            break;
+        
+        char c = parent_path[i];
+        if (isdigit(c)) {
+            // Save the digit character to the buffer
+            buffer[buffer_len] = c;
+            buffer_len++;
+        } else if (c == '@') {
+            if (buffer_len != 0) {
+                buffer[buffer_len] = '\0';
+                size = atoi(buffer);
+            }
+            found_at = true;
+            buffer_len = 0;
+        } else if (c == '/' || c == 'x' || c == 'X' || i == parent_path.length() - 1) {
+            if (found_at && buffer_len != 0) {
+                // Convert the buffer to an integer and save it to the scale variable
+                buffer[buffer_len] = '\0';
+                scale = atoi(buffer);
+            } else if (buffer_len != 0) {
+                // Convert the buffer to an integer and save it to the size variable
+                buffer[buffer_len] = '\0';
+                size = atoi(buffer);
+            }
+            // Reset the buffer and the found_at flag
+            buffer_len = 0;
+            found_at = false;
+        }
+    }
+    if (found_at && buffer_len != 0) {
+        // Convert the buffer to an integer and save it to the scale variable
+        buffer[buffer_len] = '\0';
+        scale = atoi(buffer);
+    } else if (buffer_len != 0) {
+        // Convert the buffer to an integer and save it to the size variable
+        buffer[buffer_len] = '\0';
+        size = atoi(buffer);
     }
+    *size_out = size;
+    *scale_out = scale;
 }
 
 //
@@ -236,65 +537,231 @@ void save_data() {
             return;
     }
     
-    // version (string)
-    cache_file << std::to_string(cache_version) << '\0';
-
-#define WRITE_NUM(num) \
-    reinterpret_cast<const char *>(&num), sizeof(num) \
-
-    // We will use this number when loading, so we can pre-allocate a buffer that will contain every option name
-    // We won't need to zero terminate the strings in the buffer since we're going make a string view of the names
-    // when we load them.
-    unsigned long option_names_buffer_size = 0;
-    for (const auto &item: data->options)
-        option_names_buffer_size += item.first.size();
-    cache_file.write(WRITE_NUM(option_names_buffer_size));
-
-    // We will use this number to pre-allocate a buffer which will store the parentIndexAndExtension and,
-    // themeIndex contiguously. We'll access the data via a hash_table (std::unordered_map) which will take
-    // a string view and return a Range{int index, int count}, into the pre-allocated buffer.
-    unsigned long option_data_buffer_size = 0;
-    for (const auto &item: data->options)
-        option_data_buffer_size +=
-                item.second.size() * (sizeof(Option::parentIndexAndExtension) + sizeof(Option::themeIndex));
-    cache_file.write(WRITE_NUM(option_data_buffer_size));
-
-    // parent paths size (int)
-    cache_file << std::to_string(data->parentPaths.size()) << '\0';
-    for (const auto &item: data->parentPaths) {
-        // parent paths (string)
-        cache_file << item << '\0';
-    }
+    IconCacheHeader header = {};
+    std::memcpy(header.magic, icon_cache_magic, sizeof(header.magic));
+    header.version = cache_version;
+    header.parent_count = data->parentPaths.size();
+    header.theme_count = data->themes.size();
+    header.name_count = data->options.size();
+    // At most half full so probes stay short
+    header.bucket_count = 1;
+    while (header.bucket_count < header.name_count * 2)
+        header.bucket_count <<= 1;
+    
+    std::string strings;
+    auto add_string = [&strings](const std::string &string) {
+        uint32_t offset = strings.size();
+        strings.append(string);
+        strings.push_back('\0');
+        return offset;
+    };
     
-    // themes paths size (int)
-    cache_file << std::to_string(data->themes.size()) << '\0';
-    for (const auto &item: data->themes) {
-        // parent paths (string)
-        cache_file << item << '\0';
+    std::vector<IconCacheParent> parents;
+    parents.reserve(data->parentPaths.size());
+    for (size_t i = 0; i < data->parentPaths.size(); i++) {
+        IconCacheParent parent = {};
+        parent.path = add_string(data->parentPaths[i]);
+        int size;
+        int scale;
+        IconContext context;
+        icon_directory_properties(data->parentPaths[i], data->themes[data->parentThemes[i]], &size, &scale, &context);
+        parent.size = size;
+        parent.scale = scale;
+        parent.context = context;
+        parents.push_back(parent);
     }
-
-    // options size (int)
-    cache_file << std::to_string(data->options.size()) << '\0';
+    
+    std::vector<uint32_t> themes;
+    themes.reserve(data->themes.size());
+    for (const auto &item: data->themes)
+        themes.push_back(add_string(item));
+    
+    std::vector<IconCacheName> names;
+    names.reserve(data->options.size());
+    std::vector<uint32_t> buckets(header.bucket_count, 0);
+    std::vector<IconCacheOption> options;
     for (const auto &item: data->options) {
-        // option name (string)
-        cache_file << item.first << '\0';
+        IconCacheName name = {};
+        name.hash = icon_name_hash(item.first.data(), item.first.size());
+        name.name = add_string(item.first);
+        name.length = item.first.size();
+        name.first_option = options.size();
+        name.option_count = item.second.size();
+        for (const auto &option: item.second)
+            options.push_back({option.parentIndexAndExtension, option.themeIndex, 0});
+        names.push_back(name);
         
-        // option size (unsigned short int)
-        unsigned short int optionsVectorSize = item.second.size();
-        cache_file.write(WRITE_NUM(optionsVectorSize));
-        
-        for (const auto &option: item.second) {
-            // (unsigned short int)
-            cache_file.write(WRITE_NUM(option.parentIndexAndExtension));
-//            cache_file << std::to_string(option.parentIndexAndExtension) << '\0';
-            // (char)
-            cache_file.write(WRITE_NUM(option.themeIndex));
-//            cache_file << std::to_string(option.themeIndex) << '\0';
-        }
+        uint32_t bucket = name.hash & (header.bucket_count - 1);
+        while (buckets[bucket] != 0)
+            bucket = (bucket + 1) & (header.bucket_count - 1);
+        buckets[bucket] = names.size();
     }
+    header.option_count = options.size();
+    header.strings_size = strings.size();
+    
+    std::string body;
+    body.reserve(parents.size() * sizeof(IconCacheParent) + themes.size() * sizeof(uint32_t) +
+                 names.size() * sizeof(IconCacheName) + buckets.size() * sizeof(uint32_t) +
+                 options.size() * sizeof(IconCacheOption) + strings.size());
+    body.append((const char *) parents.data(), parents.size() * sizeof(IconCacheParent));
+    body.append((const char *) themes.data(), themes.size() * sizeof(uint32_t));
+    body.append((const char *) names.data(), names.size() * sizeof(IconCacheName));
+    body.append((const char *) buckets.data(), buckets.size() * sizeof(uint32_t));
+    body.append((const char *) options.data(), options.size() * sizeof(IconCacheOption));
+    body.append(strings);
+    header.checksum = fnv1a(body.data(), body.size());
+    
+    cache_file.write((const char *) &header, sizeof(header));
+    cache_file.write(body.data(), body.size());
     
     cache_file.close();
     rename(icon_cache_temp_path.data(), icon_cache_path.data());
+    
+    // Lookups are answered from the mapped file, so nothing needs to keep these around
+    data->options.clear();
+    data->parentPaths.clear();
+    data->parentPaths.shrink_to_fit();
+    data->parentThemes.clear();
+    data->parentThemes.shrink_to_fit();
+    data->themes.clear();
+    data->themes.shrink_to_fit();
+}
+
+// data is shared by everything that rebuilds the cache, and those can run on different threads
+static std::mutex generate_mutex;
+
+static void
+regenerate_cache() {
+    std::lock_guard lock(generate_mutex);
+    generate_data();
+    save_data();
+}
+
+void icon_cache_build(const std::vector<std::string> &paths, int threads) {
+    std::lock_guard lock(generate_mutex);
+    // theme_of_directory goes by the search paths
+    icon_search_paths = paths;
+    auto directories = traverse_icon_directories(paths, threads);
+    index_directories(directories);
+    save_data();
+}
+
+static void
+icon_cache_unmap() {
+    IconCache previous;
+    std::unique_lock lock(cache_mutex);
+    std::swap(previous, cache);
+}
+
+// Maps the cache file and makes sure it is a complete, uncorrupted cache of cache_version before it's used
+static bool
+icon_cache_map(const std::string &icon_cache_path) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    int fd = open(icon_cache_path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat cache_stat{};
+    if (fstat(fd, &cache_stat) == -1 || cache_stat.st_size < (off_t) sizeof(IconCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = cache_stat.st_size;
+    char *map = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    
+    IconCache mapped;
+    mapped.mapping = std::make_shared<const IconCacheMapping>(map, size);
+    mapped.map = map;
+    mapped.size = size;
+    mapped.inode = cache_stat.st_ino;
+    mapped.modified = cache_stat.st_mtim;
+    mapped.header = (const IconCacheHeader *) map;
+    
+    const IconCacheHeader *header = mapped.header;
+    bool valid = std::memcmp(header->magic, icon_cache_magic, sizeof(icon_cache_magic)) == 0 &&
+                 header->version == cache_version &&
+                 header->bucket_count != 0 && (header->bucket_count & (header->bucket_count - 1)) == 0 &&
+                 header->bucket_count > header->name_count;
+    if (valid) {
+        uint64_t expected_size = sizeof(IconCacheHeader) +
+                                 (uint64_t) header->parent_count * sizeof(IconCacheParent) +
+                                 (uint64_t) header->theme_count * sizeof(uint32_t) +
+                                 (uint64_t) header->name_count * sizeof(IconCacheName) +
+                                 (uint64_t) header->bucket_count * sizeof(uint32_t) +
+                                 (uint64_t) header->option_count * sizeof(IconCacheOption) +
+                                 header->strings_size;
+        valid = expected_size == size &&
+                fnv1a(map + sizeof(IconCacheHeader), size - sizeof(IconCacheHeader)) == header->checksum;
+    }
+    if (valid) {
+        char *section = map + sizeof(IconCacheHeader);
+        mapped.parents = (const IconCacheParent *) section;
+        section += header->parent_count * sizeof(IconCacheParent);
+        mapped.themes = (const uint32_t *) section;
+        section += header->theme_count * sizeof(uint32_t);
+        mapped.names = (const IconCacheName *) section;
+        section += header->name_count * sizeof(IconCacheName);
+        mapped.buckets = (const uint32_t *) section;
+        section += header->bucket_count * sizeof(uint32_t);
+        mapped.options = (const IconCacheOption *) section;
+        section += header->option_count * sizeof(IconCacheOption);
+        mapped.strings = section;
+        
+        // The checksum only catches accidents, a file that lies about its own offsets still must not make us read
+        // outside the mapping
+        uint64_t strings_size = header->strings_size;
+        valid = strings_size != 0 && mapped.strings[strings_size - 1] == '\0';
+        for (uint32_t i = 0; valid && i < header->parent_count; i++)
+            valid = mapped.parents[i].path < strings_size && mapped.parents[i].context <= IconContext::NotSet;
+        for (uint32_t i = 0; valid && i < header->theme_count; i++)
+            valid = mapped.themes[i] < strings_size;
+        for (uint32_t i = 0; valid && i < header->name_count; i++) {
+            const IconCacheName &name = mapped.names[i];
+            valid = range_inside(name.name, (uint64_t) name.length + 1, strings_size) &&
+                    range_inside(name.first_option, name.option_count, header->option_count);
+        }
+        for (uint32_t i = 0; valid && i < header->bucket_count; i++)
+            valid = mapped.buckets[i] <= header->name_count;
+        for (uint32_t i = 0; valid && i < header->option_count; i++) {
+            const IconCacheOption &option = mapped.options[i];
+            valid = getParentIndex(option.parentIndexAndExtension) < header->parent_count &&
+                    option.themeIndex < header->theme_count;
+        }
+    }
+    if (!valid)
+        return false;
+    
+    // The old mapping goes once the last Candidate found in it does
+    IconCache previous;
+    {
+        std::unique_lock lock(cache_mutex);
+        previous = std::move(cache);
+        cache = std::move(mapped);
+    }
+    return true;
+}
+
+// Needs cache_mutex
+static const IconCacheName *
+icon_cache_find(const std::string &name) {
+    if (cache.map == nullptr)
+        return nullptr;
+    uint32_t hash = icon_name_hash(name.data(), name.size());
+    uint32_t mask = cache.header->bucket_count - 1;
+    // The table is never full, so there is always an empty bucket to stop at
+    for (uint32_t bucket = hash & mask;; bucket = (bucket + 1) & mask) {
+        uint32_t index = cache.buckets[bucket];
+        if (index == 0)
+            return nullptr;
+        const IconCacheName *entry = &cache.names[index - 1];
+        if (entry->hash == hash && entry->length == name.size() &&
+            std::memcmp(cache.strings + entry->name, name.data(), name.size()) == 0)
+            return entry;
+    }
 }
 
 static bool first_time_load_data = true;
@@ -303,128 +770,39 @@ void load_data() {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    for (auto item: data->options)
-        item.second.clear();
-    data->options.clear();
-    data->parentPaths.clear();
-    data->themes.clear();
-    if (name_buffer != nullptr)
-        free(name_buffer);
-    if (option_buffer != nullptr)
-        free(option_buffer);
-    ranges.clear();
-
-    // Load data from disk
     const char *home_directory = getenv("HOME");
     std::string icon_cache_path(home_directory);
     icon_cache_path += "/.cache/winbar_icon_cache/icon.cache";
-
+    
     struct stat cache_stat{};
-    if (stat(icon_cache_path.c_str(), &cache_stat) == 0) { // exists
-        // Open the file
-        int fd = open(icon_cache_path.c_str(), O_RDONLY);
-        if (fd == -1) {
-            fprintf(stderr, "Error opening file");
-            return;
-        }
-
-        off_t fileSize = cache_stat.st_size;
-
-        // Map the file into memory
-        char *icon_cache_data = (char *) mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (icon_cache_data == MAP_FAILED) {
-            fprintf(stderr, "Error mapping file");
-            close(fd);
-            return;
-        }
-
-        std::string versionString = std::string(icon_cache_data);
-        int version = atoi(versionString.data());
-        if (version < cache_version) {
-            if (first_time_load_data) {
-                munmap(icon_cache_data, fileSize);
-                close(fd);
-                first_time_load_data = false;
-                generate_data();
-                save_data();
-                load_data();
-                first_time_load_data = true;
-            }
+    if (stat(icon_cache_path.c_str(), &cache_stat) != 0)
+        return;
+    
+    // Still mapping the file that is on disk
+    {
+        std::shared_lock lock(cache_mutex);
+        if (cache.map != nullptr && cache.inode == cache_stat.st_ino && cache.size == (size_t) cache_stat.st_size &&
+            cache.modified.tv_sec == cache_stat.st_mtim.tv_sec &&
+            cache.modified.tv_nsec == cache_stat.st_mtim.tv_nsec)
             return;
+    }
+    
+    if (!icon_cache_map(icon_cache_path)) {
+        if (first_time_load_data) {
+            first_time_load_data = false;
+            regenerate_cache();
+            load_data();
+            first_time_load_data = true;
         }
-
-        unsigned long index_into_file = 0;
-        char buffer[NAME_MAX];
-        long len;
-
-#define READ_STRING(tess) \
-        strcpy(buffer, icon_cache_data + index_into_file); \
-        len = strlen(buffer); \
-        index_into_file += len + 1; \
-        std::string tess = std::string(buffer, std::max(len, (long) 0));
-
-#define READ_NUM(tem) \
-    *reinterpret_cast<tem *>((icon_cache_data + index_into_file)); \
-    index_into_file += sizeof(tem)
-        
-        // Version
-        READ_STRING(version_number)
-
-        unsigned long size_of_pre_allocated_string_buffer = READ_NUM(unsigned long);
-        name_buffer = new char[size_of_pre_allocated_string_buffer];
-        unsigned long size_of_pre_allocated_options_buffer = READ_NUM(unsigned long);
-        option_buffer = new char[size_of_pre_allocated_options_buffer];
-
-        READ_STRING(amountOfParentsString)
-        int amountOfParents = std::stoi(amountOfParentsString);
-        for (int i = 0; i < amountOfParents; ++i) {
-            READ_STRING(parentPath)
-            data->parentPaths.push_back(std::move(parentPath));
-        }
-        
-        READ_STRING(amountOfThemesString)
-        int amountOfThemes = std::stoi(amountOfThemesString);
-        for (int i = 0; i < amountOfThemes; ++i) {
-            READ_STRING(theme)
-            data->themes.push_back(std::move(theme));
-        }
-        
-        READ_STRING(optionsSizeString)
-        int optionsSize = std::stoi(optionsSizeString);
-
-        ranges.reserve(optionsSize);
-        unsigned long names_buffer_index = 0;
-        unsigned long option_data_index = 0;
-        for (int i = 0; i < optionsSize; ++i) {
-            strcpy(buffer, icon_cache_data + index_into_file);
-            len = strlen(buffer);
-            strncpy(name_buffer + names_buffer_index, icon_cache_data + index_into_file, len);
-            index_into_file += len + 1;
-            std::string name = std::string(buffer, std::max(len, (long) 0));
-
-            auto optionSize = READ_NUM(unsigned short int);
-            auto view = std::string_view(name_buffer + names_buffer_index, len);
-            names_buffer_index += len;
-            ranges[view] = {option_data_index, (unsigned long) optionSize * 3};
-
-            for (int j = 0; j < optionSize; ++j) {
-                std::memcpy(option_buffer + option_data_index, icon_cache_data + index_into_file,
-                            sizeof(unsigned short int));
-                std::memcpy(option_buffer + option_data_index + sizeof(unsigned short int),
-                            icon_cache_data + index_into_file + sizeof(unsigned short int),
-                            sizeof(unsigned char));
-                index_into_file += sizeof(unsigned short int) + sizeof(unsigned char);
-                option_data_index += sizeof(unsigned short int) + sizeof(unsigned char);
-            }
-        }
-
-        munmap(icon_cache_data, fileSize);
-        close(fd);
     }
 }
 
 
-void check_if_cache_needs_update(App *, AppClient *, Timeout *timeout, void *);
+static void
+icon_watch_start(App *app);
+
+static void
+icon_watch_stop();
 
 void check_cache_file();
 
@@ -432,6 +810,8 @@ void set_icons_path_and_possibly_update(App *app) {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
+    // The reindex thread reads the search paths
+    icon_watch_stop();
     if (data == nullptr)
         data = new OptionsData();
     icon_search_paths.clear();
@@ -467,13 +847,16 @@ void set_icons_path_and_possibly_update(App *app) {
     }
     icon_search_paths.emplace_back("/usr/share/pixmaps");
     
-    app_timeout_create(app, nullptr, 50000, check_if_cache_needs_update, nullptr, const_cast<char *>(__PRETTY_FUNCTION__));
-    
     check_cache_file();
+    
+    icon_watch_start(app);
 }
 
 static long last_time_cached_checked = -1;
 
+static void
+icon_cache_reload();
+
 static std::string first_message;
 static std::string second_message;
 static std::string third_message;
@@ -538,20 +921,18 @@ void check_cache_file() {
     if (stat(icon_cache_path.c_str(), &cache_stat) == 0) { // exists
         bool cache_version_on_disk_acceptable = true;
         FILE *fp;
-        char buf[1024];
         if ((fp = fopen(icon_cache_path.data(), "rb"))) {
-            fread(buf, 1, 10, fp);
-            std::string versionString = std::string(buf, std::max(strlen(buf), (unsigned long) 0));
-            int version = atoi(versionString.data());
-            if (version != cache_version)
+            IconCacheHeader header = {};
+            if (fread(&header, sizeof(header), 1, fp) != 1 ||
+                std::memcmp(header.magic, icon_cache_magic, sizeof(icon_cache_magic)) != 0 ||
+                header.version != cache_version)
                 cache_version_on_disk_acceptable = false;
             fclose(fp);
         }
         
         if (!cache_version_on_disk_acceptable) {
             std::thread t([icon_cache_path]() -> void {
-                generate_data();
-                save_data();
+                regenerate_cache();
             });
             App *temp_app = app_new();
             std::thread t2([&temp_app]() -> void {
@@ -573,14 +954,15 @@ void check_cache_file() {
                 temp_app->running = false;
                 t2.join();
             }
+            // save_data leaves nothing in memory, everything is read from the new file
+            icon_cache_reload();
         } else {
             load_data();
         }
     } else {
         // If no cache file exists, we are forced to do it on the main thread (a.k.a. the first launch will be slow)
         std::thread t([icon_cache_path]() -> void {
-            generate_data();
-            save_data();
+            regenerate_cache();
         });
         App *temp_app = app_new();
         std::thread t2([&temp_app]() -> void {
@@ -602,122 +984,43 @@ void check_cache_file() {
             temp_app->running = false;
             t2.join();
         }
+        icon_cache_reload();
     }
     
     last_time_cached_checked = get_current_time_in_ms();
 }
 
 void search_icons(std::vector<IconTarget> &targets) {
+    check_cache_file();
+    search_loaded_icons(targets);
+}
+
+void search_loaded_icons(std::vector<IconTarget> &targets) {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    check_cache_file();
-    
-    for (int i = 0; i < targets.size(); ++i) {
-        auto target = targets[i];
-
-        Range range = ranges[target.name.c_str()];
-        if (range.start == -1) // There was nothing with that name
+    std::shared_lock lock(cache_mutex);
+    for (auto &target: targets) {
+        const IconCacheName *entry = icon_cache_find(target.name);
+        if (entry == nullptr) // There was nothing with that name
             continue;
-
-        std::vector<Candidate> candidates;
-        for (int j = 0; j < (range.length / 3); ++j) {
-            unsigned long actual_index = range.start + j * 3;
-            unsigned short int parentIndexAndExtension = 0;
-            std::memcpy(&parentIndexAndExtension, option_buffer + actual_index, sizeof(unsigned short int));
-            unsigned char themeIndex = 0;
-            std::memcpy(&themeIndex, option_buffer + actual_index + sizeof(unsigned short int), sizeof(unsigned char));
-
-            Candidate candidate;
-            candidate.parent_path = data->parentPaths[getParentIndex(parentIndexAndExtension)];
-            candidate.filename = target.name;
-            candidate.theme = data->themes[themeIndex];
-            candidate.extension = getExtension(parentIndexAndExtension);
-            candidate.context = IconContext::NotSet;
-            // The following is to set the icon 'context' based on the parent_path
-            struct ICMap {
-                std::string name;
-                IconContext context;
-            };
-            std::vector<ICMap> ics = {{"/actions",    IconContext::Actions},
-                                      {"/animations", IconContext::Animations},
-                                      {"/apps",       IconContext::Apps},
-                                      {"/categories", IconContext::Categories},
-                                      {"/devices",    IconContext::Devices},
-                                      {"/emblems",    IconContext::Emblems},
-                                      {"/emotes",     IconContext::Emotes},
-                                      {"/intl",       IconContext::Intl},
-                                      {"/mimetypes",  IconContext::Mimetypes},
-                                      {"/places",     IconContext::Places},
-                                      {"/status",     IconContext::Statuses},
-                                      {"/panel",      IconContext::Panel}};
-            std::string path_copy = candidate.parent_path;
-            for (char &t: path_copy)
-                t = std::tolower(t);
-            for (const auto &item: ics)
-                if (path_copy.find(item.name) != std::string::npos)
-                    candidate.context = item.context;
-
-            // The following is to determine the size and scale of the icon based on the parent path
-            unsigned long startIndex = candidate.parent_path.find(candidate.theme);
-            if (startIndex == std::string::npos)
-                startIndex = 0;
-            startIndex += candidate.theme.size() + 1;
-            
-            char buffer[64];
-            int buffer_len = 0;
-            bool found_at = false;
-            int scale = 0;
-            int size = 0;
+        
+        target.candidates.reserve(target.candidates.size() + entry->option_count);
+        for (uint32_t j = 0; j < entry->option_count; ++j) {
+            const IconCacheOption &option = cache.options[entry->first_option + j];
+            const IconCacheParent &parent = cache.parents[getParentIndex(option.parentIndexAndExtension)];
             
-            // Iterate through the characters in the path string
-            for (int i = startIndex; i < candidate.parent_path.length(); i++) {
-                if (scale != 0 && size != 0)
-                    break;
-                
-                char c = candidate.parent_path[i];
-                if (isdigit(c)) {
-                    // Save the digit character to the buffer
-                    buffer[buffer_len] = c;
-                    buffer_len++;
-                } else if (c == '@') {
-                    if (buffer_len != 0) {
-                        buffer[buffer_len] = '\0';
-                        size = atoi(buffer);
-                    }
-                    found_at = true;
-                    buffer_len = 0;
-                } else if (c == '/' || c == 'x' || c == 'X' || i == candidate.parent_path.length() - 1) {
-                    if (found_at && buffer_len != 0) {
-                        // Convert the buffer to an integer and save it to the scale variable
-                        buffer[buffer_len] = '\0';
-                        scale = atoi(buffer);
-                    } else if (buffer_len != 0) {
-                        // Convert the buffer to an integer and save it to the size variable
-                        buffer[buffer_len] = '\0';
-                        size = atoi(buffer);
-                    }
-                    // Reset the buffer and the found_at flag
-                    buffer_len = 0;
-                    found_at = false;
-                }
-            }
-            if (found_at && buffer_len != 0) {
-                // Convert the buffer to an integer and save it to the scale variable
-                buffer[buffer_len] = '\0';
-                scale = atoi(buffer);
-            } else if (buffer_len != 0) {
-                // Convert the buffer to an integer and save it to the size variable
-                buffer[buffer_len] = '\0';
-                size = atoi(buffer);
-            }
-            candidate.size = size;
-            candidate.scale = scale;
-            candidates.push_back(candidate);
+            Candidate candidate;
+            candidate.mapping = cache.mapping;
+            candidate.parent_path = cache.strings + parent.path;
+            candidate.filename = std::string_view(cache.strings + entry->name, entry->length);
+            candidate.theme = cache.strings + cache.themes[option.themeIndex];
+            candidate.extension = getExtension(option.parentIndexAndExtension);
+            candidate.context = (IconContext) parent.context;
+            candidate.size = parent.size;
+            candidate.scale = parent.scale;
+            target.candidates.push_back(std::move(candidate));
         }
-        
-        for (const auto &item: candidates)
-            targets[i].candidates.push_back(item);
     }
 }
 
@@ -725,6 +1028,9 @@ static std::string get_current_theme_name() {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
+    // pick_best is called off the main thread too
+    static std::mutex theme_mutex;
+    std::lock_guard lock(theme_mutex);
     static std::string current_theme;
     static long previous_time_cached;
     if (!current_theme.empty()) {
@@ -820,7 +1126,7 @@ void pick_best(std::vector<IconTarget> &targets, int target_size, IconContext ta
             // Sort vector based on quality and size, and current theme
             // Set best_full_path equal to best top option
             std::sort(target->candidates.begin(), target->candidates.end(),
-                      [current_theme](Candidate lhs, Candidate rhs) {
+                      [](const Candidate &lhs, const Candidate &rhs) {
                           if (lhs.is_part_of_current_theme == rhs.is_part_of_current_theme) {
                               if (lhs.is_part_of_target_context == rhs.is_part_of_target_context) {
                                   if (lhs.size_index == rhs.size_index) {
@@ -845,71 +1151,321 @@ void pick_best(std::vector<IconTarget> &targets, int target_size, IconContext ta
     }
 }
 
-void check_if_cache_needs_update(App *app, AppClient *, Timeout *timeout, void *) {
-    std::thread t([app]() -> void {
+// Icon directories are watched with inotify. A change marks the theme it happened in as dirty, and after things have
+// been quiet for a moment only the dirty themes are read again (on their own thread) and merged with the rest of the
+// current cache. The main thread only maps the result once it's written.
+static App *icon_watch_app = nullptr;
+static int icon_watch_fd = -1;
+static std::unordered_map<int, std::string> icon_watches;
+static std::unordered_set<std::string> icon_watched_paths;
+// Subtrees that changed since they were last read
+static std::set<std::string> dirty_icon_trees;
+static Timeout *icon_reindex_timeout = nullptr;
+static std::thread icon_reindex_thread;
+// Written to by icon_reindex_thread when it's done
+static int icon_reindex_done_fd = -1;
+// What icon_reindex_thread is reading
+static std::vector<std::string> icon_reindex_trees;
+
+static const uint32_t icon_watch_mask =
+        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+static bool
+is_under(const std::string &path, const std::string &tree) {
+    return path.size() >= tree.size() && path.compare(0, tree.size(), tree) == 0 &&
+           (path.size() == tree.size() || path[tree.size()] == '/');
+}
+
+// The theme directory path is in (e.g. /usr/share/icons/hicolor), or the search path itself for anything directly
+// inside of one
+static std::string
+icon_tree_of(const std::string &path) {
+    for (const auto &search_path: icon_search_paths) {
+        if (!is_under(path, search_path))
+            continue;
+        if (path.size() == search_path.size())
+            return search_path;
+        size_t end = path.find('/', search_path.size() + 1);
+        return path.substr(0, end);
+    }
+    return path;
+}
+
+static void
+icon_watch_directory(const std::string &path) {
+    if (icon_watched_paths.count(path))
+        return;
+    int wd = inotify_add_watch(icon_watch_fd, path.c_str(), icon_watch_mask);
+    if (wd == -1)
+        return;
+    icon_watches[wd] = path;
+    icon_watched_paths.insert(path);
+}
+
+// Watches every directory under tree that the cache has icons in, along with the directories leading to them
+static void
+icon_watch_tree(const std::string &tree) {
 #ifdef TRACY_ENABLE
-        ZoneScopedN("icon directory timeout");
+    ZoneScoped;
 #endif
-        // TODO: this is crashin in some cases
-        const char *home_directory = getenv("HOME");
-        std::string icon_cache_path(home_directory);
-        icon_cache_path += "/.cache/winbar_icon_cache/icon.cache";
-        
-        struct stat cache_stat{};
-        if (stat(icon_cache_path.c_str(), &cache_stat) == 0) { // exists
-            bool found_newer_folder_than_cache_file = false;
-            
-            const std::filesystem::directory_options options = (
-                    std::filesystem::directory_options::follow_directory_symlink |
-                    std::filesystem::directory_options::skip_permission_denied
-            );
-            struct stat search_stat{};
-            for (const auto &search_path: icon_search_paths) {
-                // Check if the search path exists
-                if (stat(search_path.c_str(), &search_stat) != 0)
-                    continue;
-                
-                if (search_stat.st_mtim.tv_sec > cache_stat.st_mtim.tv_sec) {
-                    found_newer_folder_than_cache_file = true;
-                    break;
-                }
-                
-                for (auto i = std::filesystem::recursive_directory_iterator(search_path,
-                                                                            std::filesystem::directory_options(
-                                                                                    options));
-                     i != std::filesystem::recursive_directory_iterator();
-                     ++i) {
-                    if (i.depth() == 0 && i->is_directory() && i->exists()) {
-                        if (stat(i->path().string().data(), &search_stat) != 0)
-                            continue;
-    
-                        if (search_stat.st_mtim.tv_sec > cache_stat.st_mtim.tv_sec) {
-                            found_newer_folder_than_cache_file = true;
-                            break;
-                        }
-                    }
-                }
-                if (found_newer_folder_than_cache_file)
-                    break;
+    std::shared_lock lock(cache_mutex);
+    if (cache.map == nullptr)
+        return;
+    for (uint32_t i = 0; i < cache.header->parent_count; i++) {
+        std::string path = cache.strings + cache.parents[i].path;
+        if (!is_under(path, tree))
+            continue;
+        while (!icon_watched_paths.count(path)) {
+            icon_watch_directory(path);
+            bool is_search_path = std::find(icon_search_paths.begin(), icon_search_paths.end(), path) !=
+                                  icon_search_paths.end();
+            size_t slash = path.rfind('/');
+            if (is_search_path || slash == 0 || slash == std::string::npos)
+                break;
+            path.erase(slash);
+        }
+    }
+}
+
+static void
+icon_cache_reload() {
+    load_data();
+    // icon_watch_tree can only see the directories of a mapped cache
+    for (const auto &search_path: icon_search_paths)
+        icon_watch_tree(search_path);
+}
+
+static void
+icon_reindex_start(App *app, AppClient *, Timeout *, void *);
+
+static void
+mark_icon_tree_dirty(const std::string &tree) {
+    dirty_icon_trees.insert(tree);
+    if (icon_reindex_timeout == nullptr) {
+        icon_reindex_timeout = app_timeout_create(icon_watch_app, nullptr, 2000, icon_reindex_start, nullptr,
+                                                  const_cast<char *>(__PRETTY_FUNCTION__));
+    } else {
+        app_timeout_replace(icon_watch_app, nullptr, icon_reindex_timeout, 2000, icon_reindex_start, nullptr);
+    }
+}
+
+static void
+icon_watch_wakeup(App *app, int fd, void *) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        const struct inotify_event *event;
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost so there's no telling what changed
+                for (const auto &search_path: icon_search_paths)
+                    mark_icon_tree_dirty(search_path);
+                continue;
+            }
+            auto watch = icon_watches.find(event->wd);
+            if (watch == icon_watches.end())
+                continue;
+            if (event->mask & IN_IGNORED) {
+                icon_watched_paths.erase(watch->second);
+                icon_watches.erase(watch);
+                continue;
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                mark_icon_tree_dirty(icon_tree_of(watch->second));
+                continue;
             }
+            if (event->len == 0)
+                continue;
             
-            if (found_newer_folder_than_cache_file) {
-                std::lock_guard lock(app->running_mutex);
-                generate_data();
-                save_data();
+            // Only directories and the kinds of files the cache holds matter
+            size_t name_len = strlen(event->name);
+            bool is_icon = name_len > 5 && (strcmp(event->name + name_len - 4, ".svg") == 0 ||
+                                            strcmp(event->name + name_len - 4, ".png") == 0);
+            if (!is_icon && !(event->mask & IN_ISDIR))
+                continue;
+            
+            std::string path = watch->second;
+            if (event->mask & IN_ISDIR)
+                path.append("/").append(event->name);
+            mark_icon_tree_dirty(icon_tree_of(path));
+        }
+    }
+}
+
+static void
+icon_reindex(std::vector<std::string> trees) {
+#ifdef TRACY_ENABLE
+    ZoneScopedN("icon reindex");
+#endif
+    auto directories = traverse_icon_directories(trees, 0);
+    
+    // Everything outside the trees that were just read is taken from the cache as it is
+    std::shared_lock lock(cache_mutex);
+    const IconCache &previous = cache;
+    if (previous.map != nullptr) {
+        std::vector<TraversedDirectory> kept(previous.header->parent_count);
+        for (uint32_t i = 0; i < previous.header->name_count; i++) {
+            const IconCacheName &name = previous.names[i];
+            for (uint32_t j = 0; j < name.option_count; j++) {
+                const IconCacheOption &option = previous.options[name.first_option + j];
+                TraversedDirectory &directory = kept[getParentIndex(option.parentIndexAndExtension)];
+                if (directory.path.empty()) {
+                    directory.path = previous.strings + previous.parents[getParentIndex(
+                            option.parentIndexAndExtension)].path;
+                    directory.theme = previous.strings + previous.themes[option.themeIndex];
+                }
+                directory.icons.emplace_back(std::string(previous.strings + name.name, name.length),
+                                             getExtension(option.parentIndexAndExtension));
             }
         }
-    });
-    t.detach();
+        for (auto &directory: kept) {
+            if (directory.icons.empty())
+                continue;
+            bool was_read = std::any_of(trees.begin(), trees.end(), [&directory](const std::string &tree) {
+                return is_under(directory.path, tree);
+            });
+            if (!was_read)
+                directories.push_back(std::move(directory));
+        }
+    }
+    lock.unlock();
+    
+    {
+        std::lock_guard lock(generate_mutex);
+        index_directories(directories);
+        save_data();
+    }
+    
+    uint64_t done = 1;
+    write(icon_reindex_done_fd, &done, sizeof(done));
+}
+
+static void
+icon_reindex_start(App *app, AppClient *, Timeout *, void *) {
+    icon_reindex_timeout = nullptr;
+    if (icon_reindex_thread.joinable() || dirty_icon_trees.empty())
+        return; // icon_reindex_finished will come back for what's left
+    
+    // A tree inside another dirty tree is read as part of it
+    icon_reindex_trees.clear();
+    for (const auto &tree: dirty_icon_trees)
+        if (icon_reindex_trees.empty() || !is_under(tree, icon_reindex_trees.back()))
+            icon_reindex_trees.push_back(tree);
+    dirty_icon_trees.clear();
+    
+    icon_reindex_thread = std::thread(icon_reindex, icon_reindex_trees);
+}
+
+static void
+icon_reindex_finished(App *app, int fd, void *) {
+    uint64_t done;
+    read(fd, &done, sizeof(done));
+    if (icon_reindex_thread.joinable())
+        icon_reindex_thread.join();
+    
+    load_data();
+    for (const auto &tree: icon_reindex_trees)
+        icon_watch_tree(tree);
+    icon_reindex_trees.clear();
+    
+    if (!dirty_icon_trees.empty())
+        icon_reindex_start(app, nullptr, nullptr, nullptr);
+}
+
+static void
+icon_watch_stop() {
+    if (icon_reindex_timeout != nullptr && icon_watch_app != nullptr)
+        app_timeout_stop(icon_watch_app, nullptr, icon_reindex_timeout);
+    icon_reindex_timeout = nullptr;
+    if (icon_reindex_thread.joinable())
+        icon_reindex_thread.join();
+    if (icon_watch_fd != -1) {
+        if (icon_watch_app != nullptr)
+            remove_polled_descriptor(icon_watch_app, icon_watch_fd);
+        close(icon_watch_fd);
+    }
+    if (icon_reindex_done_fd != -1) {
+        if (icon_watch_app != nullptr)
+            remove_polled_descriptor(icon_watch_app, icon_reindex_done_fd);
+        close(icon_reindex_done_fd);
+    }
+    icon_watch_fd = -1;
+    icon_reindex_done_fd = -1;
+    icon_watches.clear();
+    icon_watched_paths.clear();
+    dirty_icon_trees.clear();
+    icon_reindex_trees.clear();
+    icon_watch_app = nullptr;
+}
+
+static void
+icon_watch_start(App *app) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    icon_watch_stop();
+    icon_watch_app = app;
+    icon_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    icon_reindex_done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (icon_watch_fd == -1 || icon_reindex_done_fd == -1 ||
+        !poll_descriptor(app, icon_watch_fd, EPOLLIN, icon_watch_wakeup, nullptr, "Icon directories") ||
+        !poll_descriptor(app, icon_reindex_done_fd, EPOLLIN, icon_reindex_finished, nullptr, "Icon reindex")) {
+        icon_watch_stop();
+        return;
+    }
+    
+    struct stat search_stat{};
+    for (const auto &search_path: icon_search_paths) {
+        if (stat(search_path.c_str(), &search_stat) != 0)
+            continue;
+        icon_watch_directory(search_path);
+        icon_watch_tree(search_path);
+    }
+    
+    // Whatever changed while we weren't running. Installing or removing a theme touches the search path or the
+    // theme directory, which is all the old periodic scan looked at as well
+    const char *home_directory = getenv("HOME");
+    std::string icon_cache_path(home_directory);
+    icon_cache_path += "/.cache/winbar_icon_cache/icon.cache";
+    struct stat cache_stat{};
+    if (stat(icon_cache_path.c_str(), &cache_stat) != 0)
+        return;
+    for (const auto &search_path: icon_search_paths) {
+        if (stat(search_path.c_str(), &search_stat) != 0)
+            continue;
+        if (search_stat.st_mtim.tv_sec > cache_stat.st_mtim.tv_sec) {
+            mark_icon_tree_dirty(search_path);
+            continue;
+        }
+        DIR *dir = opendir(search_path.c_str());
+        if (dir == nullptr)
+            continue;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            if (fstatat(dirfd(dir), entry->d_name, &search_stat, 0) != 0 || !S_ISDIR(search_stat.st_mode))
+                continue;
+            if (search_stat.st_mtim.tv_sec > cache_stat.st_mtim.tv_sec)
+                mark_icon_tree_dirty(search_path + "/" + entry->d_name);
+        }
+        closedir(dir);
+    }
 }
 
 void unload_icons() {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
+    icon_watch_stop();
     if (data != nullptr) {
         data->parentPaths.clear();
         data->parentPaths.shrink_to_fit();
+        data->parentThemes.clear();
+        data->parentThemes.shrink_to_fit();
         data->themes.clear();
         data->themes.shrink_to_fit();
         for (auto item: data->options)
@@ -917,10 +1473,8 @@ void unload_icons() {
         data->options.clear();
         delete data;
         data = nullptr;
-        free(name_buffer);
-        free(option_buffer);
-        ranges.clear();
     }
+    icon_cache_unmap();
     
     icon_search_paths.clear();
     icon_search_paths.shrink_to_fit();
@@ -1080,5 +1634,6 @@ c3ic_fix_wm_class(const std::string &given_wm_class) {
 }
 
 bool has_options(const std::string &name) {
-    return ranges[name.c_str()].start != -1;
+    std::shared_lock lock(cache_mutex);
+    return icon_cache_find(name) != nullptr;
 }
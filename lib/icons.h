@@ -10,7 +10,9 @@
 #include <utility>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <algorithm>
+#include <memory>
 
 // Load icons into memory
 void set_icons_path_and_possibly_update(App *app);
@@ -18,6 +20,13 @@ void set_icons_path_and_possibly_update(App *app);
 // Remove all icons from memory
 void unload_icons();
 
+// Writes icon.cache for the icons under paths instead of the usual directories, reading them on threads threads (0 for
+// one per core). Nothing is mapped or watched, for the benchmarks in tools/.
+void icon_cache_build(const std::vector<std::string> &paths, int threads);
+
+// Maps icon.cache, unless the file on disk is the one already mapped
+void load_data();
+
 enum IconContext {
     Actions,
     Animations,
@@ -35,10 +44,15 @@ enum IconContext {
     NotSet
 };
 
+// The mapped icon.cache, which is only unmapped once nothing points into it anymore
+struct IconCacheMapping;
+
+// Points into the icon.cache it was found in, and keeps that mapped for as long as it's around
 struct Candidate {
-    std::string parent_path;
-    std::string filename;
-    std::string theme;
+    std::shared_ptr<const IconCacheMapping> mapping;
+    std::string_view parent_path;
+    std::string_view filename;
+    std::string_view theme;
     int extension;
     int size;
     int scale;
@@ -78,6 +92,10 @@ struct IconTarget {
 
 void search_icons(std::vector<IconTarget> &targets);
 
+// search_icons without first checking whether the cache on disk changed, which is what makes it safe to call from
+// threads other than the main one. has_options and pick_best are safe as well.
+void search_loaded_icons(std::vector<IconTarget> &targets);
+
 void pick_best(std::vector<IconTarget> &targets, int size);
 
 void pick_best(std::vector<IconTarget> &targets, int size, IconContext target_context);
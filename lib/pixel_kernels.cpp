@@ -0,0 +1,265 @@
+#include "pixel_kernels.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+#endif
+
+static void
+dye_scalar(uint32_t *row, int count, uint32_t r, uint32_t g, uint32_t b) {
+    for (int x = 0; x < count; x++) {
+        uint32_t alpha = row[x] >> 24;
+        row[x] = (alpha << 24) | ((r * alpha / 255) << 16) | ((g * alpha / 255) << 8) | (b * alpha / 255);
+    }
+}
+
+static void
+remap_alpha_scalar(uint32_t *row, int count, const uint8_t alpha_map[256]) {
+    for (int x = 0; x < count; x++) {
+        uint32_t color = row[x];
+        uint32_t alpha = alpha_map[color >> 24];
+        uint32_t red = (color >> 16) & 0xFF;
+        uint32_t green = (color >> 8) & 0xFF;
+        uint32_t blue = color & 0xFF;
+        row[x] = (alpha << 24) | ((red * alpha / 255) << 16) | ((green * alpha / 255) << 8) | (blue * alpha / 255);
+    }
+}
+
+static void
+sum_scalar(const uint32_t *row, int count, PixelSums *sums) {
+    for (int x = 0; x < count; x++) {
+        uint32_t color = row[x];
+        uint32_t alpha = color >> 24;
+        if (alpha == 0)
+            continue;
+        sums->a += alpha;
+        sums->r += (color >> 16) & 0xFF;
+        sums->g += (color >> 8) & 0xFF;
+        sums->b += color & 0xFF;
+        sums->count++;
+    }
+}
+
+#if defined(__x86_64__)
+
+// The vector versions work on bytes widened to 16 bit lanes: a product of two bytes fits, and x / 255 for any such
+// product is exactly (x * 0x8081) >> 23, which is what keeps them bit for bit equal to the scalar versions
+
+static inline __m128i
+div255_sse2(__m128i x) {
+    return _mm_srli_epi16(_mm_mulhi_epu16(x, _mm_set1_epi16((short) 0x8081)), 7);
+}
+
+// The low byte of each pixel copied into all four of its bytes
+static inline __m128i
+broadcast_low_byte_sse2(__m128i v) {
+    v = _mm_or_si128(v, _mm_slli_epi32(v, 8));
+    return _mm_or_si128(v, _mm_slli_epi32(v, 16));
+}
+
+// Every byte of pixels times the same byte of weights, divided by 255
+static inline __m128i
+multiply_sse2(__m128i pixels, __m128i weights) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi8(weights, zero));
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi8(weights, zero));
+    return _mm_packus_epi16(div255_sse2(lo), div255_sse2(hi));
+}
+
+static void
+dye_sse2(uint32_t *row, int count, uint32_t r, uint32_t g, uint32_t b) {
+    // 255 in the alpha byte so the alpha comes out unchanged
+    __m128i color = _mm_set1_epi32((int) (0xFF000000 | (r << 16) | (g << 8) | b));
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128i pixels = _mm_loadu_si128((__m128i *) (row + x));
+        __m128i alphas = broadcast_low_byte_sse2(_mm_srli_epi32(pixels, 24));
+        _mm_storeu_si128((__m128i *) (row + x), multiply_sse2(color, alphas));
+    }
+    dye_scalar(row + x, count - x, r, g, b);
+}
+
+static void
+remap_alpha_sse2(uint32_t *row, int count, const uint8_t alpha_map[256]) {
+    __m128i opaque = _mm_set1_epi32((int) 0xFF000000);
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128i pixels = _mm_loadu_si128((__m128i *) (row + x));
+        __m128i alphas = _mm_setr_epi32(alpha_map[row[x] >> 24], alpha_map[row[x + 1] >> 24],
+                                        alpha_map[row[x + 2] >> 24], alpha_map[row[x + 3] >> 24]);
+        // 255 in the alpha byte so it comes out as the new alpha itself
+        pixels = _mm_or_si128(pixels, opaque);
+        _mm_storeu_si128((__m128i *) (row + x), multiply_sse2(pixels, broadcast_low_byte_sse2(alphas)));
+    }
+    remap_alpha_scalar(row + x, count - x, alpha_map);
+}
+
+static void
+sum_sse2(const uint32_t *row, int count, PixelSums *sums) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i channel_masks[4] = {_mm_set1_epi32(0xFF), _mm_set1_epi32(0xFF00), _mm_set1_epi32(0xFF0000),
+                                _mm_set1_epi32((int) 0xFF000000)};
+    __m128i totals[4] = {zero, zero, zero, zero};
+    uint64_t visible = 0;
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128i pixels = _mm_loadu_si128((__m128i *) (row + x));
+        __m128i transparent = _mm_cmpeq_epi32(_mm_srli_epi32(pixels, 24), zero);
+        pixels = _mm_andnot_si128(transparent, pixels);
+        visible += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(transparent)));
+        // Summing the bytes of one channel at a time, _mm_sad_epu8 adds up each half into a 64 bit lane
+        for (int c = 0; c < 4; c++)
+            totals[c] = _mm_add_epi64(totals[c], _mm_sad_epu8(_mm_and_si128(pixels, channel_masks[c]), zero));
+    }
+    uint64_t lanes[4][2];
+    for (int c = 0; c < 4; c++)
+        _mm_storeu_si128((__m128i *) lanes[c], totals[c]);
+    sums->b += lanes[0][0] + lanes[0][1];
+    sums->g += lanes[1][0] + lanes[1][1];
+    sums->r += lanes[2][0] + lanes[2][1];
+    sums->a += lanes[3][0] + lanes[3][1];
+    sums->count += visible;
+    sum_scalar(row + x, count - x, sums);
+}
+
+// The SSE2 versions that finish off the last few pixels aren't VEX encoded, so each AVX2 version clears the upper
+// halves first. Without that the compiler turns the call into a plain jump and every call pays for the switch.
+
+__attribute__((target("avx2"))) static inline __m256i
+div255_avx2(__m256i x) {
+    return _mm256_srli_epi16(_mm256_mulhi_epu16(x, _mm256_set1_epi16((short) 0x8081)), 7);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+broadcast_low_byte_avx2(__m256i v) {
+    v = _mm256_or_si256(v, _mm256_slli_epi32(v, 8));
+    return _mm256_or_si256(v, _mm256_slli_epi32(v, 16));
+}
+
+// Unpacking and packing both stay inside each 128 bit half, so the pixels come back out in order
+__attribute__((target("avx2"))) static inline __m256i
+multiply_avx2(__m256i pixels, __m256i weights) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(pixels, zero), _mm256_unpacklo_epi8(weights, zero));
+    __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(pixels, zero), _mm256_unpackhi_epi8(weights, zero));
+    return _mm256_packus_epi16(div255_avx2(lo), div255_avx2(hi));
+}
+
+__attribute__((target("avx2"))) static void
+dye_avx2(uint32_t *row, int count, uint32_t r, uint32_t g, uint32_t b) {
+    __m256i color = _mm256_set1_epi32((int) (0xFF000000 | (r << 16) | (g << 8) | b));
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256i pixels = _mm256_loadu_si256((__m256i *) (row + x));
+        __m256i alphas = broadcast_low_byte_avx2(_mm256_srli_epi32(pixels, 24));
+        _mm256_storeu_si256((__m256i *) (row + x), multiply_avx2(color, alphas));
+    }
+    _mm256_zeroupper();
+    dye_sse2(row + x, count - x, r, g, b);
+}
+
+__attribute__((target("avx2"))) static void
+remap_alpha_avx2(uint32_t *row, int count, const uint8_t alpha_map[256]) {
+    // Widened so it can be gathered from
+    int32_t alpha_map_wide[256];
+    for (int i = 0; i < 256; i++)
+        alpha_map_wide[i] = alpha_map[i];
+
+    __m256i opaque = _mm256_set1_epi32((int) 0xFF000000);
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256i pixels = _mm256_loadu_si256((__m256i *) (row + x));
+        __m256i alphas = _mm256_i32gather_epi32(alpha_map_wide, _mm256_srli_epi32(pixels, 24), 4);
+        pixels = _mm256_or_si256(pixels, opaque);
+        _mm256_storeu_si256((__m256i *) (row + x), multiply_avx2(pixels, broadcast_low_byte_avx2(alphas)));
+    }
+    _mm256_zeroupper();
+    remap_alpha_sse2(row + x, count - x, alpha_map);
+}
+
+__attribute__((target("avx2"))) static void
+sum_avx2(const uint32_t *row, int count, PixelSums *sums) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i channel_masks[4] = {_mm256_set1_epi32(0xFF), _mm256_set1_epi32(0xFF00), _mm256_set1_epi32(0xFF0000),
+                                _mm256_set1_epi32((int) 0xFF000000)};
+    __m256i totals[4] = {zero, zero, zero, zero};
+    uint64_t visible = 0;
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256i pixels = _mm256_loadu_si256((__m256i *) (row + x));
+        __m256i transparent = _mm256_cmpeq_epi32(_mm256_srli_epi32(pixels, 24), zero);
+        pixels = _mm256_andnot_si256(transparent, pixels);
+        visible += 8 - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(transparent)));
+        for (int c = 0; c < 4; c++)
+            totals[c] = _mm256_add_epi64(totals[c], _mm256_sad_epu8(_mm256_and_si256(pixels, channel_masks[c]), zero));
+    }
+    uint64_t lanes[4][4];
+    for (int c = 0; c < 4; c++)
+        _mm256_storeu_si256((__m256i *) lanes[c], totals[c]);
+    sums->b += lanes[0][0] + lanes[0][1] + lanes[0][2] + lanes[0][3];
+    sums->g += lanes[1][0] + lanes[1][1] + lanes[1][2] + lanes[1][3];
+    sums->r += lanes[2][0] + lanes[2][1] + lanes[2][2] + lanes[2][3];
+    sums->a += lanes[3][0] + lanes[3][1] + lanes[3][2] + lanes[3][3];
+    sums->count += visible;
+    _mm256_zeroupper();
+    sum_sse2(row + x, count - x, sums);
+}
+
+#endif
+
+struct PixelKernels {
+    void (*dye)(uint32_t *row, int count, uint32_t r, uint32_t g, uint32_t b);
+
+    void (*remap_alpha)(uint32_t *row, int count, const uint8_t alpha_map[256]);
+
+    void (*sum)(const uint32_t *row, int count, PixelSums *sums);
+};
+
+static PixelKernelLevel
+best_supported(PixelKernelLevel level) {
+#if defined(__x86_64__)
+    // SSE2 is part of x86_64, AVX2 has to be asked about
+    __builtin_cpu_init();
+    if (level == PixelKernelLevel::Avx2 && !__builtin_cpu_supports("avx2"))
+        level = PixelKernelLevel::Sse2;
+    return level;
+#else
+    return PixelKernelLevel::Scalar;
+#endif
+}
+
+static PixelKernels
+kernels_for(PixelKernelLevel level) {
+#if defined(__x86_64__)
+    if (level == PixelKernelLevel::Avx2)
+        return {dye_avx2, remap_alpha_avx2, sum_avx2};
+    if (level == PixelKernelLevel::Sse2)
+        return {dye_sse2, remap_alpha_sse2, sum_sse2};
+#endif
+    return {dye_scalar, remap_alpha_scalar, sum_scalar};
+}
+
+static PixelKernels &
+pixel_kernels() {
+    static PixelKernels kernels = kernels_for(best_supported(PixelKernelLevel::Avx2));
+    return kernels;
+}
+
+PixelKernelLevel pixel_kernels_use(PixelKernelLevel level) {
+    level = best_supported(level);
+    pixel_kernels() = kernels_for(level);
+    return level;
+}
+
+void pixels_dye(uint32_t *row, int count, uint32_t r, uint32_t g, uint32_t b) {
+    pixel_kernels().dye(row, count, r, g, b);
+}
+
+void pixels_remap_alpha(uint32_t *row, int count, const uint8_t alpha_map[256]) {
+    pixel_kernels().remap_alpha(row, count, alpha_map);
+}
+
+void pixels_sum(const uint32_t *row, int count, PixelSums *sums) {
+    pixel_kernels().sum(row, count, sums);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+// Loops over rows of premultiplied ARGB32 pixels (cairo's CAIRO_FORMAT_ARGB32) used by dye_surface, dye_opacity and
+// get_average_color. On x86_64 they use AVX2 or SSE2 depending on what the CPU supports (checked once at runtime),
+// elsewhere a plain loop. Every version produces exactly the same pixels.
+
+// Sets every pixel to the color (r, g, b between 0 and 255) at the pixel's own alpha, premultiplied
+void pixels_dye(uint32_t *row, int count, uint32_t r, uint32_t g, uint32_t b);
+
+// Replaces each pixel's alpha with alpha_map[alpha] and multiplies its channels by the new alpha
+void pixels_remap_alpha(uint32_t *row, int count, const uint8_t alpha_map[256]);
+
+struct PixelSums {
+    // Channel totals over the pixels whose alpha isn't zero, and how many of those there were
+    uint64_t a = 0;
+    uint64_t r = 0;
+    uint64_t g = 0;
+    uint64_t b = 0;
+    uint64_t count = 0;
+};
+
+// Adds the row to sums
+void pixels_sum(const uint32_t *row, int count, PixelSums *sums);
+
+enum class PixelKernelLevel {
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+// Makes the functions above use the given version, or the best one below it the CPU supports. Returns the one picked.
+// Only meant for checking the versions against each other, see tools/pixel_kernels_check.cpp.
+PixelKernelLevel pixel_kernels_use(PixelKernelLevel level);
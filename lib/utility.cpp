@@ -1,6 +1,8 @@
 
 #include "utility.h"
 #include "hsluv.h"
+#include "icon_raster_cache.h"
+#include "pixel_kernels.h"
 #include <stdio.h>
 #include <X11/Xlib.h>
 
@@ -13,6 +15,7 @@
 #include <chrono>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <librsvg/rsvg.h>
 #include <pango/pangocairo.h>
 #include <zconf.h>
@@ -35,30 +38,17 @@ void dye_surface(cairo_surface_t *surface, ArgbColor argb_color) {
     int height = cairo_image_surface_get_height(surface);
     int stride = cairo_image_surface_get_stride(surface);
     
+    // Kept to a byte so the vectorized loop can't overflow into the neighbouring channel
+    unsigned int red = std::clamp(std::floor(argb_color.r * 255), 0.0, 255.0);
+    unsigned int green = std::clamp(std::floor(argb_color.g * 255), 0.0, 255.0);
+    unsigned int blue = std::clamp(std::floor(argb_color.b * 255), 0.0, 255.0);
+    
+    // pre multiplied alpha
+    // https://microsoft.github.io/Win2D/html/PremultipliedAlpha.htm
+    // https://www.cairographics.org/manual/cairo-Image-Surfaces.html#cairo-format-t
     for (int y = 0; y < height; y++) {
-        auto row = (uint32_t *) data;
+        pixels_dye((uint32_t *) data, width, red, green, blue);
         data += stride;
-        
-        for (int x = 0; x < width; x++) {
-            unsigned int color = *row;
-            
-            unsigned int alpha = ((color >> 24) & 0xFF);
-            
-            unsigned int red = std::floor(argb_color.r * 255);
-            unsigned int green = std::floor(argb_color.g * 255);
-            unsigned int blue = std::floor(argb_color.b * 255);
-            
-            // pre multiplied alpha
-            // a r g b
-            // unsigned int set_argb = (0x44 << 24) | (0x44 << 16) | (0x00 << 8) |
-            // 0x44; https://microsoft.github.io/Win2D/html/PremultipliedAlpha.htm
-            // https://www.cairographics.org/manual/cairo-Image-Surfaces.html#cairo-format-t
-            unsigned int set_color = (alpha << 24) | ((red * alpha / 255) << 16) |
-                                     (green * alpha / 255 << 8) | blue * alpha / 255;
-            
-            *row = set_color;
-            row++;
-        }
     }
 }
 
@@ -75,40 +65,24 @@ void dye_opacity(cairo_surface_t *surface, double amount, int thresh_hold) {
     int height = cairo_image_surface_get_height(surface);
     int stride = cairo_image_surface_get_stride(surface);
     
-    for (int y = 0; y < height; y++) {
-        auto row = (uint32_t *) data;
-        data += stride;
-        
-        for (int x = 0; x < width; x++) {
-            unsigned int color = *row;
-            
-            unsigned int alpha = ((color >> 24) & 0xFF);
-            if (alpha != 0) {
-                if (alpha > thresh_hold) {
-                    alpha += (amount * 255);
-                    if (alpha > 255) {
-                        alpha = 255;
-                    }
-                    if (alpha < 0) {
-                        alpha = 0;
-                    }
+    // The new alpha only depends on the old one, so it's worked out once for each of the 256 possible values
+    uint8_t alpha_map[256];
+    for (unsigned int alpha = 0; alpha < 256; alpha++) {
+        unsigned int new_alpha = alpha;
+        if (alpha != 0) {
+            if (alpha > thresh_hold) {
+                new_alpha += (amount * 255);
+                if (new_alpha > 255) {
+                    new_alpha = 255;
                 }
             }
-            unsigned int red = ((color >> 16) & 0xFF);
-            unsigned int green = ((color >> 8) & 0xFF);
-            unsigned int blue = ((color >> 0) & 0xFF);
-            
-            // pre multiplied alpha
-            // a r g b
-            // unsigned int set_argb = (0x44 << 24) | (0x44 << 16) | (0x00 << 8) |
-            // 0x44; https://microsoft.github.io/Win2D/html/PremultipliedAlpha.htm
-            // https://www.cairographics.org/manual/cairo-Image-Surfaces.html#cairo-format-t
-            unsigned int set_color = (alpha << 24) | ((red * alpha / 255) << 16) |
-                                     (green * alpha / 255 << 8) | blue * alpha / 255;
-            
-            *row = set_color;
-            row++;
         }
+        alpha_map[alpha] = new_alpha;
+    }
+    
+    for (int y = 0; y < height; y++) {
+        pixels_remap_alpha((uint32_t *) data, width, alpha_map);
+        data += stride;
     }
 }
 
@@ -129,39 +103,18 @@ void get_average_color(cairo_surface_t *surface, ArgbColor *result) {
     int height = cairo_image_surface_get_height(surface);
     int stride = cairo_image_surface_get_stride(surface);
     
-    int total_pixels = width * height;
-    double a = 0;
-    double r = 0;
-    double g = 0;
-    double b = 0;
-    
+    // Fully transparent pixels aren't counted
+    PixelSums sums;
     for (int y = 0; y < height; y++) {
-        auto row = (uint32_t *) data;
+        pixels_sum((const uint32_t *) data, width, &sums);
         data += stride;
-        
-        for (int x = 0; x < width; x++) {
-            unsigned int color = *row;
-            
-            unsigned int alpha = ((color >> 24) & 0xFF);
-            unsigned int red = ((color >> 16) & 0xFF);
-            unsigned int green = ((color >> 8) & 0xFF);
-            unsigned int blue = ((color >> 0) & 0xFF);
-            if (alpha == 0) {
-                total_pixels--;
-            } else {
-                a += (((double) alpha) / 255);
-                r += (((double) red) / 255);
-                g += (((double) green) / 255);
-                b += (((double) blue) / 255);
-            }
-            
-            row++;
-        }
     }
-    result->a = a / (total_pixels);
-    result->r = r / (total_pixels);
-    result->g = g / (total_pixels);
-    result->b = b / (total_pixels);
+    
+    double total_pixels = sums.count;
+    result->a = ((double) sums.a) / 255 / total_pixels;
+    result->r = ((double) sums.r) / 255 / total_pixels;
+    result->g = ((double) sums.g) / 255 / total_pixels;
+    result->b = ((double) sums.b) / 255 / total_pixels;
 }
 
 ArgbColor
@@ -450,15 +403,10 @@ as_resource_path(std::string path) {
     return home;
 }
 
-bool paint_svg_to_surface(cairo_surface_t *surface, std::string path, int target_size) {
-#ifdef TRACY_ENABLE
-    ZoneScoped;
-#endif
-    GFile *gfile = g_file_new_for_path(path.c_str());
-    RsvgHandle *handle = rsvg_handle_new_from_gfile_sync(gfile, RSVG_HANDLE_FLAGS_NONE, NULL, NULL);
-    
-    // TODO: is this correct?
-    if (handle == nullptr)
+// Leaves surface the way rasterizing straight into it would: cleared, with the icon at the top left
+static bool
+paint_icon_raster(cairo_surface_t *surface, cairo_surface_t *raster) {
+    if (raster == nullptr)
         return false;
     
     auto *temp_context = cairo_create(surface);
@@ -467,50 +415,57 @@ bool paint_svg_to_surface(cairo_surface_t *surface, std::string path, int target
     cairo_paint(temp_context);
     cairo_restore(temp_context);
     
-    cairo_save(temp_context);
-    const RsvgRectangle viewport{0, 0, (double) target_size, (double) target_size};
-    rsvg_handle_render_layer(handle, temp_context, NULL, &viewport, nullptr);
-    cairo_restore(temp_context);
+    cairo_set_source_surface(temp_context, raster, 0, 0);
+    cairo_paint(temp_context);
     cairo_destroy(temp_context);
-    
-    g_object_unref(gfile);
-    g_object_unref(handle);
+    cairo_surface_destroy(raster);
     
     return true;
 }
 
+bool paint_svg_to_surface(cairo_surface_t *surface, std::string path, int target_size) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    return paint_icon_raster(surface, icon_raster_get(path, IconFormat::Svg, target_size));
+}
+
 bool paint_png_to_surface(cairo_surface_t *surface, std::string path, int target_size) {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    auto *png_surface = cairo_image_surface_create_from_png(path.c_str());
-    
-    if (cairo_surface_status(png_surface) != CAIRO_STATUS_SUCCESS) {
-        cairo_surface_destroy(png_surface);
-        return false;
+    return paint_icon_raster(surface, icon_raster_get(path, IconFormat::Png, target_size));
+}
+
+// Paints the icon request_icon_full_path asked for over the blank surface it left in its place
+static void
+icon_full_path_loaded(App *, cairo_surface_t *raster, void *user_data) {
+    auto **surface = (cairo_surface_t **) user_data;
+    if (*surface == nullptr) {
+        if (raster)
+            cairo_surface_destroy(raster);
+        return;
     }
-    
-    auto *temp_context = cairo_create(surface);
-    int w = cairo_image_surface_get_width(png_surface);
-    int h = cairo_image_surface_get_height(png_surface);
-    
-    cairo_save(temp_context);
-    cairo_set_operator(temp_context, CAIRO_OPERATOR_CLEAR);
-    cairo_paint(temp_context);
-    cairo_restore(temp_context);
-    
-    cairo_save(temp_context);
-    if (target_size != w) {
-        double scale = ((double) target_size) / ((double) w);
-        cairo_scale(temp_context, scale, scale);
+    paint_icon_raster(*surface, raster);
+}
+
+void request_icon_full_path(App *app, AppClient *client_entity, cairo_surface_t **surface, const std::string &path,
+                            int target_size) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    IconFormat format;
+    if (path.find("svg") != std::string::npos) {
+        format = IconFormat::Svg;
+    } else if (path.find("png") != std::string::npos) {
+        format = IconFormat::Png;
+    } else {
+        return;
     }
-    cairo_set_source_surface(temp_context, png_surface, 0, 0);
-    cairo_paint(temp_context);
-    cairo_restore(temp_context);
-    cairo_destroy(temp_context);
-    cairo_surface_destroy(png_surface);
-    
-    return true;
+    // A request still out for the same surface would paint the old icon over this one
+    icon_raster_cancel(surface);
+    *surface = accelerated_surface(app, client_entity, target_size, target_size);
+    icon_raster_request(app, client_entity->name, path, format, target_size, icon_full_path_loaded, surface);
 }
 
 bool
@@ -772,3 +727,22 @@ std::string clipboard() {
     }
 }
 
+uint64_t fnv1a(const char *bytes, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash ^= word;
+        hash *= 1099511628211ull;
+    }
+    for (; i < size; i++) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool range_inside(uint64_t start, uint64_t length, uint64_t size) {
+    return start <= size && length <= size - start;
+}
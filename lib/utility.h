@@ -256,6 +256,12 @@ void load_icon_full_path(App *app,
                          std::string path,
                          int target_size);
 
+// Like load_icon_full_path, except the surface starts out blank and the icon is painted into it once a raster worker
+// has loaded it, after which client_entity is repainted. Whoever owns surface has to pass it to icon_raster_cancel
+// before it goes away.
+void request_icon_full_path(App *app, AppClient *client_entity, cairo_surface_t **surface, const std::string &path,
+                            int target_size);
+
 bool screen_has_transparency(App *app);
 
 ArgbColor correct_opaqueness(AppClient *client, ArgbColor color);
@@ -278,4 +284,11 @@ std::string clipboard();
 void
 rounded_rect(cairo_t *cr, double corner_radius, double x, double y, double width, double height);
 
+// FNV-1a, eight bytes at a time where it can. For checksums and file names, nothing that has to hold up against someone
+// crafting collisions.
+uint64_t fnv1a(const char *bytes, size_t size);
+
+// Whether length things starting at start fit in size of them without overflowing, for offsets out of a mapped file
+bool range_inside(uint64_t start, uint64_t length, uint64_t size);
+
 #endif
@@ -437,7 +437,7 @@ static void fill_root(AppClient *client, Container *root) {
         
         if (auto icon_container = container_by_name("icon", notification_container)) {
             auto icon_data = (IconButton *) icon_container->user_data;
-            load_icon_full_path(app, client, &icon_data->surface, n->icon_path, 48 * config->dpi);
+            request_icon_full_path(app, client, &icon_data->surface, n->icon_path, 48 * config->dpi);
         }
     }
 }
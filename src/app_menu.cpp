@@ -13,6 +13,8 @@
 #include "components.h"
 #include "config.h"
 #include "icons.h"
+#include "icon_raster_cache.h"
+#include "launcher_index.h"
 #include "main.h"
 #include "search_menu.h"
 #include "taskbar.h"
@@ -21,10 +23,15 @@
 #include <cmath>
 #include <pango/pangocairo.h>
 #include <vector>
+#include <memory>
 #include <optional>
 #include <xcb/xcb_aux.h>
 #include <hsluv.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <unordered_set>
 #include "functional"
 #include "simple_dbus.h"
 #include "settings_menu.h"
@@ -46,6 +53,28 @@ struct TooltipMenuData : public UserData {
     std::string path;
 };
 
+// A row of the app list, which is a title if launcher is nullptr
+struct AppListEntry {
+    Launcher *launcher = nullptr;
+    std::string title;
+};
+
+// What the rows of the app list are bound to, filled when the menu opens
+static std::vector<AppListEntry> app_list;
+
+enum AppListRowKind {
+    ROW_TITLE,
+    ROW_ITEM,
+};
+
+static int
+app_list_title_index(const std::string &title) {
+    for (int i = 0; i < app_list.size(); i++)
+        if (!app_list[i].launcher && app_list[i].title == title)
+            return i;
+    return -1;
+}
+
 // the scrollbar should only open if the mouse is in the scrollbar
 static double scrollbar_openess = 0;
 // the scrollbar should only be visible if the mouse is in the container
@@ -311,9 +340,12 @@ clicked_grid(AppClient *client, cairo_t *cr, Container *container) {
 #endif
     // Set the correct scroll offset
     auto data = (ButtonData *) container->user_data;
-    if (auto c = container_by_name(data->text, client->root)) {
+    int title_index = app_list_title_index(data->text);
+    if (title_index != -1) {
         if (auto scroll_pane = (ScrollContainer *) container_by_name("scroll_pane", client->root)) {
-            int offset = -scroll_pane->scroll_v_real + c->real_bounds.y;
+            // The title is likely out of view and so not laid out, but the list knows where it would be
+            double title_y = virtual_list_row_y((VirtualList *) scroll_pane->content, title_index);
+            int offset = -scroll_pane->scroll_v_real + title_y;
             offset -= 5 * config->dpi;
             scroll_pane->scroll_v_real = -offset;
             scroll_pane->scroll_v_visual = scroll_pane->scroll_v_real;
@@ -646,10 +678,10 @@ when_scrollbar_mouse_leaves_slow(AppClient *client, cairo_t *cr, Container *cont
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    if (scrollbar_leave_fd == nullptr) {
+    // Replacing fails if the timeout is already gone
+    if (scrollbar_leave_fd == nullptr ||
+        !app_timeout_replace(app, client, scrollbar_leave_fd, 3000, scrollbar_leaves_timeout, container)) {
         scrollbar_leave_fd = app_timeout_create(app, client, 3000, scrollbar_leaves_timeout, container, const_cast<char *>(__PRETTY_FUNCTION__));
-    } else {
-        app_timeout_replace(app, client, scrollbar_leave_fd, 3000, scrollbar_leaves_timeout, container);
     }
 }
 
@@ -660,6 +692,7 @@ left_open_timeout(App *app, AppClient *client, Timeout *, void *data) {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
+    left_open_fd = nullptr;
     if (left_locked)
         return;
     auto *container = (Container *) data;
@@ -668,7 +701,6 @@ left_open_timeout(App *app, AppClient *client, Timeout *, void *data) {
         client_create_animation(
                 app, client, &container->wanted_bounds.w, 0, 100, nullptr, 256 * config->dpi, true);
     }
-    left_open_fd = nullptr;
 }
 
 static void
@@ -678,10 +710,9 @@ left_open(AppClient *client, cairo_t *cr, Container *container) {
 #endif
     if (left_locked)
         return;
-    if (left_open_fd == nullptr) {
+    if (left_open_fd == nullptr ||
+        !app_timeout_replace(client->app, client, left_open_fd, 160, left_open_timeout, container)) {
         left_open_fd = app_timeout_create(client->app, client, 160, left_open_timeout, container, const_cast<char *>(__PRETTY_FUNCTION__));
-    } else {
-        app_timeout_replace(client->app, client, left_open_fd, 160, left_open_timeout, container);
     }
 }
 
@@ -1209,6 +1240,43 @@ paint_grid_item(AppClient *client, cairo_t *cr, Container *container) {
     pango_cairo_show_layout(cr, layout);
 }
 
+static int
+app_list_row_kind(VirtualList *list, int index) {
+    return app_list[index].launcher ? ROW_ITEM : ROW_TITLE;
+}
+
+static double
+app_list_row_height(VirtualList *list, int index) {
+    return app_list[index].launcher ? 36 * config->dpi : 34 * config->dpi;
+}
+
+static Container *
+create_app_list_row(VirtualList *list, int kind) {
+    auto *row = new Container(FILL_SPACE, FILL_SPACE);
+    if (kind == ROW_TITLE) {
+        row->when_paint = paint_item_title;
+        row->when_clicked = clicked_title;
+        row->user_data = new ButtonData;
+    } else {
+        row->when_paint = paint_item;
+        row->when_clicked = clicked_item;
+        row->user_data = new ItemData;
+    }
+    return row;
+}
+
+static void
+bind_app_list_row(VirtualList *list, Container *row, int index) {
+    auto &entry = app_list[index];
+    if (entry.launcher) {
+        ((ItemData *) row->user_data)->launcher = entry.launcher;
+        row->name = entry.launcher->name;
+    } else {
+        ((ButtonData *) row->user_data)->text = entry.title;
+        row->name = entry.title;
+    }
+}
+
 static void
 fill_root(AppClient *client) {
 #ifdef TRACY_ENABLE
@@ -1326,13 +1394,18 @@ fill_root(AppClient *client) {
     bottom_data->text = "\uE972";
     bottom_arrow->user_data = bottom_data;
     
-    scroll->content->wanted_pad = Bounds(13 * config->dpi, 8 * config->dpi, (settings.right_width / 2) * config->dpi,
-                                         54 * config->dpi);
-    
-    Container *content = scroll->content;
+    // Only the rows in view get containers, which are recycled as the list is scrolled
+    VirtualList *content = scrollpane_virtual_content(scroll);
+    content->wanted_pad = Bounds(13 * config->dpi, 8 * config->dpi, (settings.right_width / 2) * config->dpi,
+                                 54 * config->dpi);
     content->spacing = 54 * config->dpi;
     client_create_animation(app, client, &content->spacing, 0, 130, nullptr, 2 * config->dpi, true);
+    content->row_kind = app_list_row_kind;
+    content->row_height = app_list_row_height;
+    content->create_row = create_app_list_row;
+    content->bind_row = bind_app_list_row;
 
+    app_list.clear();
     char previous_char = '\0';
     int previous_priority = 0;
     for (int i = 0; i < launchers.size(); i++) {
@@ -1343,56 +1416,29 @@ fill_root(AppClient *client) {
             if (previous_char != new_char) {
                 previous_char = new_char;
                 
-                auto *data = new ButtonData();
-                data->text = std::toupper(new_char);
-                auto *title = new Container();
-                title->parent = content;
-                title->name = data->text;
-                content->children.push_back(title);
-                
-                title->wanted_bounds.w = FILL_SPACE;
-                title->wanted_bounds.h = 34 * config->dpi;
-                title->when_paint = paint_item_title;
-                title->when_clicked = clicked_title;
-    
-                title->user_data = data;
-                title->name = data->text;
+                AppListEntry title;
+                title.title = std::toupper(new_char);
+                app_list.push_back(title);
             }
         } else if (previous_priority != l->app_menu_priority) {
             previous_priority = l->app_menu_priority;
             
-            auto *title = new Container();
-            title->parent = content;
-            content->children.push_back(title);
-            
-            title->wanted_bounds.w = FILL_SPACE;
-            title->wanted_bounds.h = 34 * config->dpi;
-            title->when_paint = paint_item_title;
-            title->when_clicked = clicked_title;
-            
-            auto *data = new ButtonData();
+            AppListEntry title;
             if (l->app_menu_priority == 1) {
-                title->name = "Recently added";
-                data->text = "Recently added";
+                title.title = "Recently added";
             } else if (l->app_menu_priority == 2) {
-                title->name = "&";
-                data->text = "&";
+                title.title = "&";
             } else if (l->app_menu_priority == 3) {
-                title->name = "#";
-                data->text = "#";
+                title.title = "#";
             }
-            title->user_data = data;
-            title->name = data->text;
+            app_list.push_back(title);
         }
         
-        auto *child = content->child(FILL_SPACE, 36 * config->dpi);
-        auto *data = new ItemData;
-        data->launcher = l;
-        child->user_data = data;
-        child->when_paint = paint_item;
-        child->when_clicked = clicked_item;
-        child->name = l->name;
+        AppListEntry item;
+        item.launcher = l;
+        app_list.push_back(item);
     }
+    virtual_list_set_count(content, app_list.size());
     
     int count = 0;
     for (int y = 0; y < 8; y++) {
@@ -1409,23 +1455,23 @@ fill_root(AppClient *client) {
             auto data = new ButtonData;
             c->user_data = data;
             if (count == 1) { // Recent
-                if (!container_by_name("Recently added", root)) {
+                if (app_list_title_index("Recently added") == -1) {
                     c->interactable = false;
                 }
                 data->text = "Recently added";
             } else if (count == 2) { // &
-                if (!container_by_name("&", root)) {
+                if (app_list_title_index("&") == -1) {
                     c->interactable = false;
                 }
                 data->text = "&";
             } else if (count == 3) { // Numbers
-                if (!container_by_name("#", root)) {
+                if (app_list_title_index("#") == -1) {
                     c->interactable = false;
                 }
                 data->text = "#";
             } else { // ASCII
                 data->text = (char) (61 + count);
-                if (!container_by_name(data->text, root)) {
+                if (app_list_title_index(data->text) == -1) {
                     c->interactable = false;
                 }
             }
@@ -1436,6 +1482,9 @@ fill_root(AppClient *client) {
 
 static void
 app_menu_closed(AppClient *client) {
+    // Closing the client frees its timeouts
+    scrollbar_leave_fd = nullptr;
+    left_open_fd = nullptr;
     if (auto c = client_by_name(app, "tooltip_popup"))
         client_close_threaded(app, c);
     if (auto c = client_by_name(app, "power_popup"))
@@ -1446,253 +1495,226 @@ app_menu_closed(AppClient *client) {
 }
 
 static void
-paint_desktop_files() {
+launcher_icon_16_loaded(App *, cairo_surface_t *surface, void *user_data) {
+    ((Launcher *) user_data)->icon_16 = surface;
+}
+
+static void
+launcher_icon_24_loaded(App *, cairo_surface_t *surface, void *user_data) {
+    ((Launcher *) user_data)->icon_24 = surface;
+}
+
+static void
+launcher_icon_32_loaded(App *, cairo_surface_t *surface, void *user_data) {
+    ((Launcher *) user_data)->icon_32 = surface;
+}
+
+static void
+launcher_icon_64_loaded(App *, cairo_surface_t *surface, void *user_data) {
+    ((Launcher *) user_data)->icon_64 = surface;
+}
+
+static void
+request_launcher_icon(const std::string &path, int size, IconRasterCallback callback, Launcher *launcher) {
+    IconFormat format;
+    if (path.find(".svg") != std::string::npos) {
+        format = IconFormat::Svg;
+    } else if (path.find(".png") != std::string::npos) {
+        format = IconFormat::Png;
+    } else {
+        return;
+    }
+    icon_raster_request(app, "app_menu", path, format, size * config->dpi, callback, launcher);
+}
+
+// Which icon a launcher ends up with, worked out on an icon raster worker from copies of its fields
+struct LauncherIconLookup {
+    std::string icon;
+    std::string name;
+    std::string wmclass;
+    std::string exec;
+    
+    std::string path16;
+    std::string path24;
+    std::string path32;
+    std::string path64;
+};
+
+static void
+resolve_launcher_icon(LauncherIconLookup *lookup) {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    std::lock_guard m(app->running_mutex); // No one is allowed to stop Winbar until this function finishes
-    
-    std::vector<IconTarget> targets;
-    for (auto *launcher: launchers) {
-        if (!launcher->icon.empty() && launcher->icon[0] != '/') {
-            if (!has_options(launcher->icon))
-                launcher->icon = "";
-        }
+    if (!lookup->icon.empty() && lookup->icon[0] != '/') {
+        if (!has_options(lookup->icon))
+            lookup->icon = "";
+    }
     
-        if (launcher->icon.empty() && !launcher->name.empty()) {
-            if (has_options(launcher->name))
-                launcher->icon = launcher->name;
-        }
+    if (lookup->icon.empty() && !lookup->name.empty()) {
+        if (has_options(lookup->name))
+            lookup->icon = lookup->name;
+    }
     
-        if (launcher->icon.empty() && !launcher->wmclass.empty()) {
-            if (has_options(launcher->wmclass))
-                launcher->icon = launcher->wmclass;
-        }
+    if (lookup->icon.empty() && !lookup->wmclass.empty()) {
+        if (has_options(lookup->wmclass))
+            lookup->icon = lookup->wmclass;
+    }
     
-        if (launcher->icon.empty() && !launcher->exec.empty()) {
-            if (has_options(launcher->exec))
-                launcher->icon = launcher->exec;
-        }
+    if (lookup->icon.empty() && !lookup->exec.empty()) {
+        if (has_options(lookup->exec))
+            lookup->icon = lookup->exec;
+    }
     
-        if (!launcher->icon.empty()) {
-            targets.emplace_back(IconTarget(launcher->icon, launcher));
-        }
+    if (lookup->icon.empty())
+        return;
+    if (lookup->icon[0] == '/') {
+        lookup->path16 = lookup->icon;
+        lookup->path24 = lookup->icon;
+        lookup->path32 = lookup->icon;
+        lookup->path64 = lookup->icon;
+        return;
     }
     
-    search_icons(targets);
+    std::vector<IconTarget> targets;
+    targets.emplace_back(lookup->icon);
+    search_loaded_icons(targets);
     pick_best(targets, 32 * config->dpi);
     
-    for (const auto &t: targets) {
-        if (t.user_data) {
-            auto launcher = (Launcher *) t.user_data;
-            launcher->icon_16 = accelerated_surface(app, client_by_name(app, "taskbar"), 16 * config->dpi,
-                                                    16 * config->dpi);
-            launcher->icon_24 = accelerated_surface(app, client_by_name(app, "taskbar"), 24 * config->dpi,
-                                                    24 * config->dpi);
-            launcher->icon_32 = accelerated_surface(app, client_by_name(app, "taskbar"), 32 * config->dpi,
-                                                    32 * config->dpi);
-            launcher->icon_64 = accelerated_surface(app, client_by_name(app, "taskbar"), 64 * config->dpi,
-                                                    64 * config->dpi);
-            
-            std::string path16;
-            std::string path24;
-            std::string path32;
-            std::string path64;
-            
-            if (!launcher->icon.empty()) {
-                if (launcher->icon[0] == '/') {
-                    path16 = launcher->icon;
-                    path24 = launcher->icon;
-                    path32 = launcher->icon;
-                    path64 = launcher->icon;
-                } else {
-                    for (const auto &icon: t.candidates) {
-                        if (!path16.empty() && !path24.empty() && !path32.empty() && !path64.empty())
-                            break;
-                        if ((icon.size == 16) && path16.empty()) {
-                            path16 = icon.full_path();
-                        } else if (icon.size == 24 && path24.empty()) {
-                            path24 = icon.full_path();
-                        } else if (icon.size == 32 && path32.empty()) {
-                            path32 = icon.full_path();
-                        } else if (icon.size == 64 && path64.empty()) {
-                            path64 = icon.full_path();
-                        }
-                    }
-                    for (const auto &icon: t.candidates) {
-                        if (icon.extension == 2) {
-                            if (path16.empty())
-                                path16 = icon.full_path();
-                            if (path24.empty())
-                                path24 = icon.full_path();
-                            if (path32.empty())
-                                path32 = icon.full_path();
-                            if (path64.empty())
-                                path64 = icon.full_path();
-                            break;
-                        }
-                    }
-                    for (const auto &icon: t.candidates) {
-                        if (!path16.empty() && !path24.empty() && !path32.empty() && !path64.empty())
-                            break;
-                        if (path16.empty())
-                            path16 = icon.full_path();
-                        if (path24.empty())
-                            path24 = icon.full_path();
-                        if (path32.empty())
-                            path32 = icon.full_path();
-                        if (path64.empty())
-                            path64 = icon.full_path();
-                    }
-                }
-            }
-            
-            if (!path16.empty() && !launcher->icon.empty()) {
-                paint_surface_with_image(launcher->icon_16, path16, 16 * config->dpi, nullptr);
-            } else {
-                paint_surface_with_image(
-                        launcher->icon_16, as_resource_path("unknown-16.svg"), 16 * config->dpi, nullptr);
-            }
-            
-            if (!path24.empty() && !launcher->icon.empty()) {
-                paint_surface_with_image(launcher->icon_24, path24, 24 * config->dpi, nullptr);
-            } else {
-                paint_surface_with_image(
-                        launcher->icon_24, as_resource_path("unknown-24.svg"), 24 * config->dpi, nullptr);
-            }
-            
-            if (!path32.empty() && !launcher->icon.empty()) {
-                paint_surface_with_image(launcher->icon_32, path32, 32 * config->dpi, nullptr);
-            } else {
-                paint_surface_with_image(
-                        launcher->icon_32, as_resource_path("unknown-32.svg"), 32 * config->dpi, nullptr);
-            }
-            
-            if (!path32.empty() && !launcher->icon.empty()) {
-                paint_surface_with_image(launcher->icon_64, path64, 64 * config->dpi, nullptr);
-            } else {
-                paint_surface_with_image(
-                        launcher->icon_64, as_resource_path("unknown-64.svg"), 64 * config->dpi, nullptr);
-            }
+    std::string &path16 = lookup->path16;
+    std::string &path24 = lookup->path24;
+    std::string &path32 = lookup->path32;
+    std::string &path64 = lookup->path64;
+    for (const auto &icon: targets[0].candidates) {
+        if (!path16.empty() && !path24.empty() && !path32.empty() && !path64.empty())
+            break;
+        if ((icon.size == 16) && path16.empty()) {
+            path16 = icon.full_path();
+        } else if (icon.size == 24 && path24.empty()) {
+            path24 = icon.full_path();
+        } else if (icon.size == 32 && path32.empty()) {
+            path32 = icon.full_path();
+        } else if (icon.size == 64 && path64.empty()) {
+            path64 = icon.full_path();
         }
     }
+    for (const auto &icon: targets[0].candidates) {
+        if (icon.extension == 2) {
+            if (path16.empty())
+                path16 = icon.full_path();
+            if (path24.empty())
+                path24 = icon.full_path();
+            if (path32.empty())
+                path32 = icon.full_path();
+            if (path64.empty())
+                path64 = icon.full_path();
+            break;
+        }
+    }
+    for (const auto &icon: targets[0].candidates) {
+        if (!path16.empty() && !path24.empty() && !path32.empty() && !path64.empty())
+            break;
+        if (path16.empty())
+            path16 = icon.full_path();
+        if (path24.empty())
+            path24 = icon.full_path();
+        if (path32.empty())
+            path32 = icon.full_path();
+        if (path64.empty())
+            path64 = icon.full_path();
+    }
 }
 
-static std::optional<int> ends_with(const char *str, const char *suffix) {
-    if (!str || !suffix)
-        return {};
-    size_t lenstr = strlen(str);
-    size_t lensuffix = strlen(suffix);
-    if (lensuffix > lenstr)
-        return {};
-    bool b = strncmp(str + lenstr - lensuffix, suffix, lensuffix) == 0;
-    if (!b) {
-        return {};
+// Only queues work, finding and loading the icons both happen on the icon raster workers. Until they come in (and if
+// they can't be loaded) the unknown icons are drawn in their place.
+static void
+paint_desktop_files(const std::vector<Launcher *> &to_paint) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    for (auto *launcher: to_paint) {
+        auto lookup = std::make_shared<LauncherIconLookup>();
+        lookup->icon = launcher->icon;
+        lookup->name = launcher->name;
+        lookup->wmclass = launcher->wmclass;
+        lookup->exec = launcher->exec;
+        icon_raster_run(app, "app_menu", [lookup]() { resolve_launcher_icon(lookup.get()); },
+                        [lookup, launcher](App *) {
+                            launcher->icon = lookup->icon;
+                            if (launcher->icon.empty())
+                                return;
+                            request_launcher_icon(lookup->path16, 16, launcher_icon_16_loaded, launcher);
+                            request_launcher_icon(lookup->path24, 24, launcher_icon_24_loaded, launcher);
+                            request_launcher_icon(lookup->path32, 32, launcher_icon_32_loaded, launcher);
+                            request_launcher_icon(lookup->path64, 64, launcher_icon_64_loaded, launcher);
+                        }, launcher);
     }
-    return lenstr - lensuffix;
 }
 
-void eraseAllSubStr(std::string &mainStr, const std::string &toErase) {
-    size_t pos = std::string::npos;
-    while ((pos = mainStr.find(toErase)) != std::string::npos) {
-        mainStr.erase(pos, toErase.length());
-    }
+static std::vector<std::string>
+desktop_file_directories() {
+    std::string home = getenv("HOME");
+    return {
+            "/usr/share/applications/",
+            home + "/.local/share/applications/",
+            "/var/lib/flatpak/exports/share/applications/",
+            home + "/.local/share/flatpak/exports/share/applications/",
+    };
 }
 
-void eraseSubStrings(std::string &mainStr, const std::vector<std::string> &strList) {
-    std::for_each(strList.begin(), strList.end(), std::bind(eraseAllSubStr, std::ref(mainStr), std::placeholders::_1));
+// The desktop files that should show up here, only the first desktop in XDG_CURRENT_DESKTOP is looked at
+static std::vector<DesktopFile>
+shown_desktop_files() {
+    const char *c = getenv("XDG_CURRENT_DESKTOP");
+    std::string current_desktop = c ? c : "";
+    current_desktop = current_desktop.substr(0, current_desktop.find(';'));
+    
+    std::vector<DesktopFile> files = load_desktop_file_index(desktop_file_directories());
+    files.erase(std::remove_if(files.begin(), files.end(), [&current_desktop](const DesktopFile &file) {
+        return !desktop_file_shown_in(file, current_desktop);
+    }), files.end());
+    return files;
 }
 
-void load_desktop_files(std::string directory) {
-    auto c = getenv("XDG_CURRENT_DESKTOP");
-    std::string paths;
-    if (c) paths = std::string(c);
-    std::stringstream input(paths);
-    std::string parsed;
-    std::vector<std::string> current_desktop;
-    if (getline(input, parsed, ';')) {
-        current_desktop.push_back(parsed);
+static void
+set_launcher_fields(Launcher *launcher, DesktopFile &file) {
+    launcher->full_path = std::move(file.full_path);
+    launcher->name = std::move(file.name);
+    launcher->lowercase_name = std::move(file.lowercase_name);
+    launcher->exec = std::move(file.exec);
+    launcher->wmclass = std::move(file.wmclass);
+    launcher->icon = std::move(file.icon);
+    launcher->time_modified = file.time_modified;
+}
+
+static void
+set_app_menu_priority(Launcher *l, time_t now) {
+    auto recently_added_threshold = 86400 * 2; // two days  in seconds
+    double diff = difftime(now, l->time_modified);
+    if (diff < recently_added_threshold) { // less than two days old
+        l->app_menu_priority = 1;
+    } else if (!l->name.empty()) {
+        if (!isalnum(l->name[0])) { // is symbol
+            l->app_menu_priority = 2;
+        } else if (isdigit(l->name[0])) { // is number
+            l->app_menu_priority = 3;
+        } else { // is ascii
+            l->app_menu_priority = 4;
+        }
     }
-    
-    DIR *dir;
-    struct dirent *ent;
-    if ((dir = opendir(directory.c_str())) != NULL) {
-        while ((ent = readdir(dir)) != NULL) {
-            if (!ends_with(ent->d_name, ".desktop")) {
-                continue;
-            }
-            std::string path = directory + ent->d_name;
-            struct stat buffer{};
-            if (stat(path.c_str(), &buffer) != 0) {
-                continue;
-            }
-            
-            // Parse desktop file
-            INIReader desktop_application(path);
-            if (desktop_application.ParseError() != 0) {
-                continue;
-            }
-            
-            std::string name = desktop_application.Get("Desktop Entry", "Name", "");
-            std::string wmclass = desktop_application.Get("Desktop Entry", "StartupWMClass", "");
-            std::string exec = desktop_application.Get("Desktop Entry", "Exec", "");
-            std::string icon = desktop_application.Get("Desktop Entry", "Icon", "");
-            std::string display = desktop_application.Get("Desktop Entry", "NoDisplay", "");
-            std::string not_show_in = desktop_application.Get("Desktop Entry", "NotShowIn", "");
-            std::string only_show_in = desktop_application.Get("Desktop Entry", "OnlyShowIn", "");
-            
-            if (exec.empty() || display == "True" ||
-                display == "true") // If we find no exec entry then there's nothing to run
-                continue;
-            
-            if (!current_desktop.empty()) {
-                if (!only_show_in.empty()) {
-                    std::stringstream only_input(only_show_in);
-                    bool found = false;
-                    if (getline(only_input, parsed, ';')) {
-                        for (const auto &s: current_desktop) {
-                            if (s == parsed)
-                                found = true;
-                        }
-                    }
-                    if (!found)
-                        continue;
-                } else if (!not_show_in.empty()) {
-                    std::stringstream not_input(not_show_in);
-                    bool found = false;
-                    if (getline(not_input, parsed, ';')) {
-                        for (const auto &s: current_desktop) {
-                            if (s == parsed)
-                                found = true;
-                        }
-                    }
-                    if (found)
-                        continue;
-                }
-            }
-            
-            // Remove all field codes
-            // https://specifications.freedesktop.org/desktop-entry-spec/desktop-entry-spec-latest.html#exec-variables
-            eraseSubStrings(exec, {"%f", "%F", "%u", "%U", "%d", "%D", "%n", "%N", "%i", "%c", "%k", "%v", "%m"});
-            
-            if (name.empty())// If no name was set, just give it the exec name
-                name = exec;
-            
-            auto *launcher = new Launcher();
-            launcher->full_path = path;
-            launcher->name = name;
-            launcher->lowercase_name = launcher->name;
-            std::transform(launcher->lowercase_name.begin(),
-                           launcher->lowercase_name.end(),
-                           launcher->lowercase_name.begin(),
-                           ::tolower);
-            launcher->exec = exec;
-            launcher->wmclass = wmclass;
-            launcher->icon = icon;
-            launcher->time_modified = buffer.st_mtim.tv_sec;
-            
-            launchers.push_back(launcher);
+}
+
+// Latest, &, #, A...Z
+static bool
+app_menu_order(const Launcher *lhs, const Launcher *rhs) {
+    if (lhs->app_menu_priority == rhs->app_menu_priority) {
+        if (lhs->app_menu_priority == 1) { // time based
+            return lhs->time_modified > rhs->time_modified;
         }
+        
+        // alphabetical order
+        return lhs->lowercase_name < rhs->lowercase_name;
+    } else {
+        return lhs->app_menu_priority < rhs->app_menu_priority;
     }
 }
 
@@ -1707,53 +1729,170 @@ void load_all_desktop_files() {
     launchers.clear();
     launchers.shrink_to_fit();
     
-    load_desktop_files("/usr/share/applications/");
-    std::string local_desktop_files = getenv("HOME");
-    local_desktop_files += "/.local/share/applications/";
-    load_desktop_files(local_desktop_files);
-    load_desktop_files("/var/lib/flatpak/exports/share/applications/");
-    std::string local_flatpak_files = getenv("HOME");
-    local_flatpak_files += "/.local/share/flatpak/exports/share/applications/";
-    load_desktop_files(local_flatpak_files);
+    for (auto &file: shown_desktop_files()) {
+        auto *launcher = new Launcher();
+        set_launcher_fields(launcher, file);
+        launchers.push_back(launcher);
+    }
     
     time_t now;
     time(&now);
+    for (auto l: launchers)
+        set_app_menu_priority(l, now);
     
-    auto recently_added_threshold = 86400 * 2; // two days  in seconds
-    for (auto l: launchers) {
-        double diff = difftime(now, l->time_modified);
-        if (diff < recently_added_threshold) { // less than two days old
-            l->app_menu_priority = 1;
-        } else if (!l->name.empty()) {
-            if (!isalnum(l->name[0])) { // is symbol
-                l->app_menu_priority = 2;
-            } else if (isdigit(l->name[0])) { // is number
-                l->app_menu_priority = 3;
-            } else { // is ascii
-                l->app_menu_priority = 4;
-            }
+    std::sort(launchers.begin(), launchers.end(), app_menu_order);
+    search_apps_changed();
+    paint_desktop_files(launchers);
+}
+
+static App *desktop_watch_app = nullptr;
+static int desktop_watch_fd = -1;
+// Watch descriptor to the directory it's on
+static std::unordered_map<int, std::string> desktop_watches;
+static Timeout *desktop_update_timeout = nullptr;
+
+static void
+update_desktop_files(App *app, AppClient *, Timeout *timeout, void *) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    // The open menus point at launchers, so nothing is touched until they're closed
+    if (client_by_name(app, "app_menu") || client_by_name(app, "search_menu")) {
+        desktop_update_timeout = app_timeout_replace(app, nullptr, timeout, 1000, update_desktop_files, nullptr);
+        return;
+    }
+    desktop_update_timeout = nullptr;
+    
+    std::vector<DesktopFile> files = shown_desktop_files();
+    
+    std::unordered_map<std::string, Launcher *> existing;
+    for (auto *l: launchers)
+        existing[l->full_path] = l;
+    
+    // Launchers that are new or changed are taken out and put back in where they sort to now
+    std::unordered_set<Launcher *> kept;
+    std::vector<Launcher *> to_insert;
+    for (auto &file: files) {
+        auto found = existing.find(file.full_path);
+        if (found == existing.end()) {
+            auto *launcher = new Launcher();
+            set_launcher_fields(launcher, file);
+            to_insert.push_back(launcher);
+            continue;
+        }
+        Launcher *launcher = found->second;
+        if (launcher->time_modified == file.time_modified && launcher->name == file.name &&
+            launcher->exec == file.exec && launcher->wmclass == file.wmclass) {
+            kept.insert(launcher);
+            continue;
+        }
+        // Its icon could be different now too
+        icon_raster_cancel(launcher);
+        for (auto **icon: {&launcher->icon_16, &launcher->icon_24, &launcher->icon_32, &launcher->icon_64}) {
+            if (*icon)
+                cairo_surface_destroy(*icon);
+            *icon = nullptr;
         }
+        set_launcher_fields(launcher, file);
+        to_insert.push_back(launcher);
     }
     
-    // TODO: sort in order latest, &, #, A...Z
-    std::sort(launchers.begin(), launchers.end(), [](const auto &lhs, const auto &rhs) {
-        if (lhs->app_menu_priority == rhs->app_menu_priority) {
-            if (lhs->app_menu_priority == 1) { // time based
-                return lhs->time_modified > rhs->time_modified;
+    std::unordered_set<Launcher *> reinserted(to_insert.begin(), to_insert.end());
+    launchers.erase(std::remove_if(launchers.begin(), launchers.end(), [&kept, &reinserted](Launcher *l) {
+        if (kept.count(l))
+            return false;
+        if (!reinserted.count(l))
+            delete l;
+        return true;
+    }), launchers.end());
+    
+    time_t now;
+    time(&now);
+    for (auto *launcher: to_insert) {
+        set_app_menu_priority(launcher, now);
+        launchers.insert(std::upper_bound(launchers.begin(), launchers.end(), launcher, app_menu_order), launcher);
+    }
+    search_apps_changed();
+    paint_desktop_files(to_insert);
+}
+
+// Every directory is looked through again by the update, so it doesn't matter which one changed
+static void
+desktop_files_changed() {
+    // Installing a package writes a burst of files, wait for it to settle
+    if (desktop_update_timeout == nullptr ||
+        !app_timeout_replace(desktop_watch_app, nullptr, desktop_update_timeout, 500, update_desktop_files, nullptr)) {
+        desktop_update_timeout = app_timeout_create(desktop_watch_app, nullptr, 500, update_desktop_files, nullptr,
+                                                    const_cast<char *>(__PRETTY_FUNCTION__));
+    }
+}
+
+static void
+desktop_watch_wakeup(App *app, int fd, void *) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        const struct inotify_event *event;
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost so there's no telling what changed
+                desktop_files_changed();
+                continue;
             }
-            
-            // alphabetical order
-            std::string first_name = lhs->name;
-            std::string second_name = rhs->name;
-            std::for_each(first_name.begin(), first_name.end(), [](char &c) { c = std::tolower(c); });
-            std::for_each(second_name.begin(), second_name.end(), [](char &c) { c = std::tolower(c); });
-            
-            return first_name < second_name;
-        } else {
-            return lhs->app_menu_priority < rhs->app_menu_priority;
+            auto watch = desktop_watches.find(event->wd);
+            if (watch == desktop_watches.end())
+                continue;
+            if (event->mask & IN_IGNORED) {
+                desktop_watches.erase(watch);
+                continue;
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                desktop_files_changed();
+                continue;
+            }
+            size_t name_len = event->len ? strlen(event->name) : 0;
+            if (name_len < 8 || strcmp(event->name + name_len - 8, ".desktop") != 0)
+                continue;
+            desktop_files_changed();
         }
-    });
-    std::thread(paint_desktop_files).detach();
+    }
+}
+
+void watch_desktop_files(App *app) {
+    stop_watching_desktop_files();
+    desktop_watch_app = app;
+    desktop_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (desktop_watch_fd == -1 ||
+        !poll_descriptor(app, desktop_watch_fd, EPOLLIN, desktop_watch_wakeup, nullptr, "Application directories")) {
+        stop_watching_desktop_files();
+        return;
+    }
+    
+    // Directories that don't exist yet aren't watched, new ones show up after a restart like before
+    for (const auto &directory: desktop_file_directories()) {
+        int wd = inotify_add_watch(desktop_watch_fd, directory.c_str(),
+                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE |
+                                   IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (wd != -1)
+            desktop_watches[wd] = directory;
+    }
+}
+
+void stop_watching_desktop_files() {
+    if (desktop_update_timeout != nullptr && desktop_watch_app != nullptr)
+        app_timeout_stop(desktop_watch_app, nullptr, desktop_update_timeout);
+    desktop_update_timeout = nullptr;
+    if (desktop_watch_fd != -1) {
+        if (desktop_watch_app != nullptr)
+            remove_polled_descriptor(desktop_watch_app, desktop_watch_fd);
+        close(desktop_watch_fd);
+    }
+    desktop_watch_fd = -1;
+    desktop_watches.clear();
+    desktop_watch_app = nullptr;
 }
 
 void start_app_menu() {
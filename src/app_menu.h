@@ -4,6 +4,7 @@
 #define APP_MENU_H
 
 #include "search_menu.h"
+#include "icon_raster_cache.h"
 
 #include <cairo.h>
 #include <string>
@@ -27,6 +28,7 @@ public:
     int app_menu_priority = 0;
     
     ~Launcher() {
+        icon_raster_cancel(this);
         if (icon_16)
             cairo_surface_destroy(icon_16);
         if (icon_32)
@@ -44,4 +46,9 @@ void start_app_menu();
 
 void load_all_desktop_files();
 
+// Keeps launchers up to date as .desktop files are added, changed and removed
+void watch_desktop_files(App *app);
+
+void stop_watching_desktop_files();
+
 #endif// APP_MENU_H
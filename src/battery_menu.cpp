@@ -324,39 +324,30 @@ scroll(AppClient *client, cairo_t *cr, Container *container, int scroll_x, int s
         set_brightness_visual(new_brightness);
         
         // Set the brightness but only every 500ms
-        static int file_descriptor = -1000000;
+        static Timeout *brightness_timeout = nullptr;
         
         auto *new_brigtness = new double;
         *new_brigtness = new_brightness;
         
-        if (file_descriptor == -1000000) {
-            Timeout *timeout = app_timeout_create(app, client, 200,
-                                                  [](App *, AppClient *, Timeout *, void *user_data) {
-                                                      file_descriptor = -1000000;
-                                                      auto *brightness = (double *) user_data;
-                                                      set_brightness(*brightness);
-                                                      delete brightness;
-                                                  }, new_brigtness, const_cast<char *>(__PRETTY_FUNCTION__));
-            file_descriptor = timeout->file_descriptor;
-        } else {            // check if file_descriptor exists
+        if (brightness_timeout != nullptr) {
+            // check if the timeout is still scheduled
             for (auto timeout: app->timeouts) {
-                if (timeout->file_descriptor == file_descriptor) {
+                if (timeout == brightness_timeout) {
                     delete (double *) timeout->user_data;
                     
                     timeout->user_data = new_brigtness;
                     return;
                 }
             }
-            
-            Timeout *timeout = app_timeout_create(app, client, 200,
-                                                  [](App *, AppClient *, Timeout *, void *user_data) {
-                                                      file_descriptor = -1000000;
-                                                      auto *brightness = (double *) user_data;
-                                                      set_brightness(*brightness);
-                                                      delete brightness;
-                                                  }, new_brigtness, const_cast<char *>(__PRETTY_FUNCTION__));
-            file_descriptor = timeout->file_descriptor;
         }
+        
+        brightness_timeout = app_timeout_create(app, client, 200,
+                                                [](App *, AppClient *, Timeout *, void *user_data) {
+                                                    brightness_timeout = nullptr;
+                                                    auto *brightness = (double *) user_data;
+                                                    set_brightness(*brightness);
+                                                    delete brightness;
+                                                }, new_brigtness, const_cast<char *>(__PRETTY_FUNCTION__));
     }
 }
 
@@ -1168,6 +1168,15 @@ ScrollContainer *make_newscrollpane_as_child(Container *parent, const ScrollPane
     return scrollpane;
 }
 
+VirtualList *
+scrollpane_virtual_content(ScrollContainer *scrollpane) {
+    auto list = new VirtualList;
+    list->parent = scrollpane;
+    delete scrollpane->content;
+    scrollpane->content = list;
+    return list;
+}
+
 void combobox_key_event(AppClient *client, cairo_t *cr, Container *self, bool is_string, xkb_keysym_t keysym,
                         char string[64],
                         uint16_t mods, xkb_key_direction direction) {
@@ -2458,12 +2467,11 @@ blink_on(App *app, AppClient *client, void *textarea) {
     auto *container = (Container *) textarea;
     auto *data = (TextAreaData *) container->user_data;
     
-    if (data->state->cursor_blink == nullptr) {
+    // The state can outlive the client (and so the timeout), in which case replacing fails
+    if (data->state->cursor_blink == nullptr ||
+        !app_timeout_replace(app, client, data->state->cursor_blink, CURSOR_BLINK_ON_TIME, blink_loop, textarea)) {
         data->state->cursor_blink = app_timeout_create(app, client, CURSOR_BLINK_ON_TIME, blink_loop, textarea,
                                                        const_cast<char *>(__PRETTY_FUNCTION__));
-    } else {
-        app_timeout_replace(app, client, data->state->cursor_blink,
-                            CURSOR_BLINK_ON_TIME, blink_loop, textarea);
     }
     data->state->cursor_on = true;
     request_refresh(app, client);
@@ -16,6 +16,10 @@ make_scrollpane(Container *parent, ScrollPaneSettings settings);
 ScrollContainer *
 make_newscrollpane_as_child(Container *parent, const ScrollPaneSettings &settings);
 
+// Replaces the content of the scrollpane with a VirtualList
+VirtualList *
+scrollpane_virtual_content(ScrollContainer *scrollpane);
+
 Bounds
 right_thumb_bounds(Container *scrollpane, Bounds thumb_area);
 
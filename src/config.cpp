@@ -70,6 +70,12 @@ void config_load() {
     
     success = cfg.lookupValue("date_single_line", config->date_single_line);
     
+    success = cfg.lookupValue("composite_thumbnails", config->composite_thumbnails);
+    
+    success = cfg.lookupValue("icon_disk_cache", config->icon_disk_cache);
+    success = cfg.lookupValue("icon_disk_cache_mb", config->icon_disk_cache_mb);
+    success = cfg.lookupValue("icon_memory_cache_mb", config->icon_memory_cache_mb);
+    
     std::string active_theme_name;
     success = cfg.lookupValue("active_theme_name", active_theme_name);
     
@@ -35,6 +35,16 @@ struct Config {
     
     bool date_single_line = false;
     
+    // Redirect windows with XComposite and only redraw their thumbnails where XDamage says they changed
+    bool composite_thumbnails = false;
+    
+    // Keep rasterized icons in ~/.cache so starting up doesn't have to parse every SVG again
+    bool icon_disk_cache = true;
+    int icon_disk_cache_mb = 64;
+    
+    // How much memory rasterized icons can keep
+    int icon_memory_cache_mb = 8;
+    
     ArgbColor color_taskbar_background = ArgbColor("#dd101010");
     ArgbColor color_taskbar_button_icons = ArgbColor("#ffffffff");
     ArgbColor color_taskbar_button_default = ArgbColor("#00ffffff");
@@ -0,0 +1,417 @@
+#include "launcher_index.h"
+#include "INIReader.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+#ifdef TRACY_ENABLE
+
+#include "../tracy/public/tracy/Tracy.hpp"
+
+#endif
+
+// launchers.index is laid out as:
+//
+//   LauncherIndexHeader
+//   LauncherIndexDirectory directories[directory_count]
+//   LauncherIndexEntry     entries[entry_count]          grouped by directory, in readdir order
+//   char                   strings[strings_size]         zero terminated
+//
+// Everything is in native byte order. The checksum covers everything after the header.
+static const char launcher_index_magic[8] = {'w', 'b', 'a', 'p', 'p', 's', '\0', '\0'};
+static const uint32_t launcher_index_version = 2;
+
+struct LauncherIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t directory_count;
+    uint32_t entry_count;
+    uint32_t padding;
+    uint64_t strings_size;
+    uint64_t checksum;
+};
+
+struct LauncherIndexDirectory {
+    uint32_t path; // Offset into strings
+    uint32_t first_entry;
+    uint32_t entry_count;
+    uint32_t padding; // Keeps the entries after it 8 byte aligned
+};
+
+// Offsets into strings, except for the stat fields. Files that can't be shown are kept too, so that they aren't
+// parsed again every time winbar starts.
+struct LauncherIndexEntry {
+    uint32_t file_name;
+    uint32_t name;
+    uint32_t lowercase_name;
+    uint32_t exec;
+    uint32_t wmclass;
+    uint32_t icon;
+    uint32_t only_show_in;
+    uint32_t not_show_in;
+    uint32_t hidden;
+    uint32_t padding;
+    uint64_t inode;
+    int64_t size;
+    int64_t modified_sec;
+    int64_t modified_nsec;
+};
+
+struct IndexedFile {
+    std::string file_name;
+    DesktopFile file;
+    bool hidden = false;
+    uint64_t inode = 0;
+    int64_t size = 0;
+    struct timespec modified = {};
+};
+
+struct IndexedDirectory {
+    std::string path;
+    std::vector<IndexedFile> files;
+};
+
+static std::string
+launcher_index_path() {
+    const char *home_directory = getenv("HOME");
+    std::string path(home_directory ? home_directory : "");
+    path += "/.cache/winbar/launchers.index";
+    return path;
+}
+
+// Maps the index and copies out whatever it holds, or nothing if it's missing or damaged
+static std::vector<IndexedDirectory>
+launcher_index_read() {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    std::vector<IndexedDirectory> directories;
+    int fd = open(launcher_index_path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return directories;
+    struct stat index_stat{};
+    if (fstat(fd, &index_stat) == -1 || index_stat.st_size < (off_t) sizeof(LauncherIndexHeader)) {
+        close(fd);
+        return directories;
+    }
+    size_t size = index_stat.st_size;
+    char *map = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return directories;
+
+    auto *header = (const LauncherIndexHeader *) map;
+    bool valid = std::memcmp(header->magic, launcher_index_magic, sizeof(launcher_index_magic)) == 0 &&
+                 header->version == launcher_index_version;
+    if (valid) {
+        uint64_t expected_size = sizeof(LauncherIndexHeader) +
+                                 (uint64_t) header->directory_count * sizeof(LauncherIndexDirectory) +
+                                 (uint64_t) header->entry_count * sizeof(LauncherIndexEntry) +
+                                 header->strings_size;
+        valid = expected_size == size && header->strings_size != 0 &&
+                fnv1a(map + sizeof(LauncherIndexHeader), size - sizeof(LauncherIndexHeader)) == header->checksum;
+    }
+    auto *indexed_directories = (const LauncherIndexDirectory *) (map + sizeof(LauncherIndexHeader));
+    auto *entries = (const LauncherIndexEntry *) (indexed_directories + (valid ? header->directory_count : 0));
+    const char *strings = (const char *) (entries + (valid ? header->entry_count : 0));
+    uint64_t strings_size = valid ? header->strings_size : 0;
+    valid = valid && strings[strings_size - 1] == '\0';
+
+    for (uint32_t i = 0; valid && i < header->directory_count; i++) {
+        const LauncherIndexDirectory &directory = indexed_directories[i];
+        valid = directory.path < strings_size &&
+                range_inside(directory.first_entry, directory.entry_count, header->entry_count);
+    }
+    for (uint32_t i = 0; valid && i < header->entry_count; i++) {
+        const LauncherIndexEntry &entry = entries[i];
+        valid = entry.file_name < strings_size && entry.name < strings_size && entry.lowercase_name < strings_size &&
+                entry.exec < strings_size && entry.wmclass < strings_size && entry.icon < strings_size &&
+                entry.only_show_in < strings_size && entry.not_show_in < strings_size;
+    }
+
+    if (valid) {
+        directories.reserve(header->directory_count);
+        for (uint32_t i = 0; i < header->directory_count; i++) {
+            const LauncherIndexDirectory &indexed = indexed_directories[i];
+            IndexedDirectory directory;
+            directory.path = strings + indexed.path;
+            directory.files.reserve(indexed.entry_count);
+            for (uint32_t e = indexed.first_entry; e < indexed.first_entry + indexed.entry_count; e++) {
+                const LauncherIndexEntry &entry = entries[e];
+                IndexedFile file;
+                file.file_name = strings + entry.file_name;
+                file.hidden = entry.hidden != 0;
+                file.inode = entry.inode;
+                file.size = entry.size;
+                file.modified.tv_sec = entry.modified_sec;
+                file.modified.tv_nsec = entry.modified_nsec;
+                file.file.full_path = directory.path + file.file_name;
+                file.file.name = strings + entry.name;
+                file.file.lowercase_name = strings + entry.lowercase_name;
+                file.file.exec = strings + entry.exec;
+                file.file.wmclass = strings + entry.wmclass;
+                file.file.icon = strings + entry.icon;
+                file.file.only_show_in = strings + entry.only_show_in;
+                file.file.not_show_in = strings + entry.not_show_in;
+                file.file.time_modified = entry.modified_sec;
+                directory.files.push_back(std::move(file));
+            }
+            directories.push_back(std::move(directory));
+        }
+    }
+    munmap(map, size);
+    return directories;
+}
+
+static void
+launcher_index_write(const std::vector<IndexedDirectory> &directories) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    std::string path = launcher_index_path();
+    std::string directory_path = path.substr(0, path.rfind('/'));
+    if (mkdir(directory_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1 && errno != EEXIST)
+        return;
+
+    std::string strings;
+    auto add_string = [&strings](const std::string &string) {
+        uint32_t offset = strings.size();
+        strings.append(string);
+        strings.push_back('\0');
+        return offset;
+    };
+
+    std::vector<LauncherIndexDirectory> indexed_directories;
+    std::vector<LauncherIndexEntry> entries;
+    for (const auto &directory: directories) {
+        LauncherIndexDirectory indexed = {};
+        indexed.path = add_string(directory.path);
+        indexed.first_entry = entries.size();
+        indexed.entry_count = directory.files.size();
+        indexed_directories.push_back(indexed);
+        for (const auto &file: directory.files) {
+            LauncherIndexEntry entry = {};
+            entry.file_name = add_string(file.file_name);
+            entry.name = add_string(file.file.name);
+            entry.lowercase_name = add_string(file.file.lowercase_name);
+            entry.exec = add_string(file.file.exec);
+            entry.wmclass = add_string(file.file.wmclass);
+            entry.icon = add_string(file.file.icon);
+            entry.only_show_in = add_string(file.file.only_show_in);
+            entry.not_show_in = add_string(file.file.not_show_in);
+            entry.hidden = file.hidden;
+            entry.inode = file.inode;
+            entry.size = file.size;
+            entry.modified_sec = file.modified.tv_sec;
+            entry.modified_nsec = file.modified.tv_nsec;
+            entries.push_back(entry);
+        }
+    }
+    if (strings.empty())
+        strings.push_back('\0');
+
+    LauncherIndexHeader header = {};
+    std::memcpy(header.magic, launcher_index_magic, sizeof(launcher_index_magic));
+    header.version = launcher_index_version;
+    header.directory_count = indexed_directories.size();
+    header.entry_count = entries.size();
+    header.strings_size = strings.size();
+
+    std::string contents;
+    contents.append((const char *) &header, sizeof(header));
+    contents.append((const char *) indexed_directories.data(),
+                    indexed_directories.size() * sizeof(LauncherIndexDirectory));
+    contents.append((const char *) entries.data(), entries.size() * sizeof(LauncherIndexEntry));
+    contents.append(strings);
+    header.checksum = fnv1a(contents.data() + sizeof(header), contents.size() - sizeof(header));
+    std::memcpy(contents.data(), &header, sizeof(header));
+
+    // Renamed over the old one so a reader never sees half a file
+    std::string temp_path = path + ".tmp" + std::to_string(getpid());
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return;
+    bool written = write(fd, contents.data(), contents.size()) == (ssize_t) contents.size();
+    close(fd);
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0)
+        unlink(temp_path.c_str());
+}
+
+static void
+erase_all(std::string &string, const char *to_erase) {
+    size_t length = strlen(to_erase);
+    size_t pos;
+    while ((pos = string.find(to_erase)) != std::string::npos)
+        string.erase(pos, length);
+}
+
+static void
+parse_desktop_file(const std::string &directory, IndexedFile *file) {
+    file->file.full_path = directory + file->file_name;
+    file->file.time_modified = file->modified.tv_sec;
+    file->hidden = true;
+
+    INIReader desktop_application(file->file.full_path);
+    if (desktop_application.ParseError() != 0)
+        return;
+
+    std::string name = desktop_application.Get("Desktop Entry", "Name", "");
+    std::string exec = desktop_application.Get("Desktop Entry", "Exec", "");
+    std::string display = desktop_application.Get("Desktop Entry", "NoDisplay", "");
+
+    if (exec.empty() || display == "True" || display == "true") // If we find no exec entry then there's nothing to run
+        return;
+    file->hidden = false;
+
+    // Remove all field codes
+    // https://specifications.freedesktop.org/desktop-entry-spec/desktop-entry-spec-latest.html#exec-variables
+    for (const char *code: {"%f", "%F", "%u", "%U", "%d", "%D", "%n", "%N", "%i", "%c", "%k", "%v", "%m"})
+        erase_all(exec, code);
+
+    if (name.empty())// If no name was set, just give it the exec name
+        name = exec;
+
+    file->file.name = name;
+    file->file.lowercase_name = name;
+    std::transform(file->file.lowercase_name.begin(), file->file.lowercase_name.end(),
+                   file->file.lowercase_name.begin(), ::tolower);
+    file->file.exec = exec;
+    file->file.wmclass = desktop_application.Get("Desktop Entry", "StartupWMClass", "");
+    file->file.icon = desktop_application.Get("Desktop Entry", "Icon", "");
+    file->file.only_show_in = desktop_application.Get("Desktop Entry", "OnlyShowIn", "");
+    file->file.not_show_in = desktop_application.Get("Desktop Entry", "NotShowIn", "");
+}
+
+struct ParseJob {
+    const std::string *directory;
+    IndexedFile *file;
+};
+
+static void
+parse_desktop_files(const std::vector<ParseJob> &jobs) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    std::atomic<size_t> next{0};
+    auto parse = [&jobs, &next]() {
+        for (size_t i = next++; i < jobs.size(); i = next++)
+            parse_desktop_file(*jobs[i].directory, jobs[i].file);
+    };
+
+    // Not worth starting threads for the handful that change between runs
+    int thread_count = std::clamp((int) std::thread::hardware_concurrency(), 1, 8);
+    thread_count = std::min(thread_count, (int) (jobs.size() / 16) + 1);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; i++)
+        threads.emplace_back(parse);
+    parse();
+    for (auto &thread: threads)
+        thread.join();
+}
+
+std::vector<DesktopFile>
+load_desktop_file_index(const std::vector<std::string> &directories) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    std::vector<IndexedDirectory> indexed = launcher_index_read();
+    std::unordered_map<std::string, IndexedDirectory *> indexed_by_path;
+    for (auto &directory: indexed)
+        indexed_by_path[directory.path] = &directory;
+
+    bool changed = indexed.size() != directories.size();
+    std::vector<IndexedDirectory> current;
+    current.reserve(directories.size());
+    for (const auto &path: directories) {
+        IndexedDirectory directory;
+        directory.path = path;
+
+        auto found = indexed_by_path.find(path);
+        IndexedDirectory *previous = found == indexed_by_path.end() ? nullptr : found->second;
+        std::unordered_map<std::string, IndexedFile *> previous_files;
+        if (previous)
+            for (auto &file: previous->files)
+                previous_files[file.file_name] = &file;
+        else
+            changed = true;
+
+        // Editing a file in place doesn't touch its directory's mtime, so every file is looked at, which is only a
+        // stat each
+        size_t reused = 0;
+        if (DIR *dir = opendir(path.c_str())) {
+            while (struct dirent *ent = readdir(dir)) {
+                size_t length = strlen(ent->d_name);
+                if (length < 8 || strcmp(ent->d_name + length - 8, ".desktop") != 0)
+                    continue;
+                struct stat file_stat{};
+                if (fstatat(dirfd(dir), ent->d_name, &file_stat, 0) != 0)
+                    continue;
+
+                IndexedFile file;
+                auto previous_file = previous_files.find(ent->d_name);
+                if (previous_file != previous_files.end() && previous_file->second->inode == file_stat.st_ino &&
+                    previous_file->second->size == file_stat.st_size &&
+                    previous_file->second->modified.tv_sec == file_stat.st_mtim.tv_sec &&
+                    previous_file->second->modified.tv_nsec == file_stat.st_mtim.tv_nsec) {
+                    file = std::move(*previous_file->second);
+                    reused++;
+                } else {
+                    file.file_name = ent->d_name;
+                    file.inode = file_stat.st_ino;
+                    file.size = file_stat.st_size;
+                    file.modified = file_stat.st_mtim;
+                    changed = true;
+                }
+                directory.files.push_back(std::move(file));
+            }
+            closedir(dir);
+        }
+        // Something was removed
+        if (reused != previous_files.size())
+            changed = true;
+        current.push_back(std::move(directory));
+    }
+
+    // Pointers into current are only taken once it's done growing
+    std::vector<ParseJob> jobs;
+    for (auto &directory: current)
+        for (auto &file: directory.files)
+            if (file.file.full_path.empty())
+                jobs.push_back({&directory.path, &file});
+    parse_desktop_files(jobs);
+
+    if (changed)
+        launcher_index_write(current);
+
+    std::vector<DesktopFile> files;
+    for (auto &directory: current)
+        for (auto &file: directory.files)
+            if (!file.hidden)
+                files.push_back(std::move(file.file));
+    return files;
+}
+
+static std::string
+first_desktop(const std::string &list) {
+    return list.substr(0, list.find(';'));
+}
+
+bool desktop_file_shown_in(const DesktopFile &file, const std::string &current_desktop) {
+    if (current_desktop.empty())
+        return true;
+    if (!file.only_show_in.empty())
+        return first_desktop(file.only_show_in) == current_desktop;
+    if (!file.not_show_in.empty())
+        return first_desktop(file.not_show_in) != current_desktop;
+    return true;
+}
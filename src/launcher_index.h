@@ -0,0 +1,32 @@
+#ifndef LAUNCHER_INDEX_H
+#define LAUNCHER_INDEX_H
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+// What load_all_desktop_files needs out of a .desktop file
+struct DesktopFile {
+    std::string full_path;
+    std::string name;
+    // Lowercased once here so sorting and searching don't have to
+    std::string lowercase_name;
+    std::string exec; // Field codes already removed
+    std::string wmclass;
+    std::string icon;
+    std::string only_show_in;
+    std::string not_show_in;
+    time_t time_modified = 0;
+};
+
+// Every .desktop file directly inside the directories (which end in '/') that has something to run and wants to be
+// shown, in directory order. The parsed files are kept in ~/.cache/winbar/launchers.index, and a file whose inode,
+// size and mtime match what's in there isn't parsed again. The rest are parsed on a few threads.
+std::vector<DesktopFile>
+load_desktop_file_index(const std::vector<std::string> &directories);
+
+// Whether OnlyShowIn and NotShowIn let the file be shown on current_desktop (the first one in XDG_CURRENT_DESKTOP).
+// Only the first desktop each of them lists is looked at.
+bool desktop_file_shown_in(const DesktopFile &file, const std::string &current_desktop);
+
+#endif // LAUNCHER_INDEX_H
@@ -1,7 +1,9 @@
 
 
 #include <pango/pangocairo.h>
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
 #include "main.h"
 #include "app_menu.h"
 #include "application.h"
@@ -15,6 +17,8 @@
 #include "wifi_backend.h"
 #include "simple_dbus.h"
 #include "icons.h"
+#include "icon_raster_cache.h"
+#include "search_menu.h"
 #include "dpi.h"
 #include "volume_menu.h"
 
@@ -26,6 +30,8 @@ void check_config_version();
 
 void load_in_fonts();
 
+void stats_start(App *app);
+
 int main() {
     global = new globals;
     
@@ -39,6 +45,7 @@ int main() {
     
     // Load the config
     config_load();
+    icon_raster_cache_set_budget((size_t) std::max(config->icon_memory_cache_mb, 0) * 1024 * 1024);
     
     // Set DPI if auto
     double total_time_waiting_for_primary_screen = 4000;
@@ -92,6 +99,7 @@ int main() {
     // We only want to load the desktop files once at the start of the program
     //std::thread(load_desktop_files).detach();
     load_all_desktop_files();
+    watch_desktop_files(app);
     load_historic_scripts();
     load_historic_apps();
     
@@ -106,18 +114,23 @@ int main() {
     
     wifi_start(app);
     
+    stats_start(app);
+    
     // Start our listening loop until the end of the program
     app_main(app);
     
+    stop_watching_desktop_files();
+    search_stop();
+    icon_raster_stop();
     unload_icons();
+    icon_raster_cache_clear();
+    wifi_stop();
     
     // Clean up
     app_clean(app);
     
     audio_stop();
     
-    wifi_stop();
-    
     for (auto l: launchers) {
         delete l;
     }
@@ -136,6 +149,52 @@ int main() {
     return 0;
 }
 
+static void
+print_stats(App *app, AppClient *, Timeout *timeout, void *) {
+    if (timeout)
+        timeout->keep_running = true;
+    
+    for (auto client: app->clients) {
+        auto &frames = client->frame_stats;
+        printf("stats: %s frames %ld coalesced %ld dropped %ld latency avg %.1f max %ld ms\n",
+               client->name.c_str(), frames.frames_painted, frames.requests_coalesced.load(), frames.frames_dropped,
+               frames.requests_painted ? (double) frames.total_latency_ms / frames.requests_painted : 0.0,
+               frames.max_latency_ms);
+        auto tree = container_tree_usage(client->root);
+        printf("stats: %s containers %ld %zu bytes\n", client->name.c_str(), tree.objects, tree.bytes);
+    }
+    
+    auto pool = container_pool_stats();
+    printf("stats: container pool %ld objects %zu bytes, %ld slabs %zu bytes, %ld allocations %ld from the system\n",
+           pool.objects, pool.bytes, pool.slabs, pool.slab_bytes, pool.allocations, pool.system_allocations);
+    
+    auto windows = window_introspection_stats();
+    printf("stats: window introspection %ld batches %ld windows %ld round trips %.1f us per window\n",
+           windows.batches, windows.windows, windows.round_trips,
+           windows.windows ? (double) windows.total_us / windows.windows : 0.0);
+    
+    auto icons = icon_raster_cache_stats();
+    printf("stats: icon rasters %zu %zu/%zu bytes, hits %llu misses %llu (%llu from disk), %zu bytes on disk\n",
+           icons.entries, icons.bytes, icons.budget, (unsigned long long) icons.hits,
+           (unsigned long long) icons.misses, (unsigned long long) icons.disk_hits, icons.disk_bytes);
+    
+    auto paint_cache = paint_cache_stats();
+    printf("stats: paint cache hits %ld misses %ld evictions %ld %zu/%zu bytes\n",
+           paint_cache.hits, paint_cache.misses, paint_cache.evictions, paint_cache.bytes, paint_cache.budget);
+    fflush(stdout);
+}
+
+// WINBAR_STATS=<seconds> prints what the caches and painting have been up to every that many seconds
+void stats_start(App *app) {
+    const char *interval = getenv("WINBAR_STATS");
+    if (interval == nullptr)
+        return;
+    int seconds = atoi(interval);
+    if (seconds <= 0)
+        seconds = 10;
+    app_timeout_create(app, nullptr, seconds * 1000, print_stats, nullptr, const_cast<char *>(__PRETTY_FUNCTION__));
+}
+
 static int acceptable_config_version = 8;
 
 std::string first_message;
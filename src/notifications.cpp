@@ -334,7 +334,7 @@ void show_notification(NotificationInfo *ni) {
     
     if (auto icon_container = container_by_name("icon", notification_container)) {
         auto icon_data = (IconButton *) icon_container->user_data;
-        load_icon_full_path(app, client, &icon_data->surface, ni->icon_path, 48 * config->dpi);
+        request_icon_full_path(app, client, &icon_data->surface, ni->icon_path, 48 * config->dpi);
     }
     
     client->when_closed = client_closed;
@@ -256,7 +256,7 @@ static void update_icon(AppClient *client) {
                 cairo_surface_destroy(icon_data->surface);
                 icon_data->surface = nullptr;
             }
-            load_icon_full_path(app, client, &icon_data->surface, icon_path, 64 * config->dpi);
+            request_icon_full_path(app, client, &icon_data->surface, icon_path, 64 * config->dpi);
             icon_search_state->text = "Found a match for: '" + icon_field_data->state->text + "'";
         } else {
             icon_search_state->text = "Didn't find a match for: '" + icon_field_data->state->text + "'";
@@ -351,7 +351,7 @@ static void fill_root(AppClient *client) {
         pick_best(targets, 64 * config->dpi);
         std::string icon_path = targets[0].best_full_path;
         if (!icon_path.empty()) {
-            load_icon_full_path(app, client, &icon_data->surface, icon_path, 64 * config->dpi);
+            request_icon_full_path(app, client, &icon_data->surface, icon_path, 64 * config->dpi);
             icon_search_state = new Label("Found a match for: '" + pinned_icon_data->icon_name + "'");
         } else {
             icon_search_state = new Label("Didn't find a match for: '" + pinned_icon_data->icon_name + "'");
@@ -0,0 +1,230 @@
+#include "search_history.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef TRACY_ENABLE
+
+#include "../tracy/public/tracy/Tracy.hpp"
+
+#endif
+
+// Something used every day for a week a month ago ends up below something used twice this week
+static const double search_history_half_life = 14 * 24 * 60 * 60;
+static const size_t search_history_max_entries = 100;
+
+static double
+decayed(const HistoryEntry &entry, int64_t now) {
+    if (now <= entry.last_used)
+        return entry.score;
+    return entry.score * std::exp2(-(double) (now - entry.last_used) / search_history_half_life);
+}
+
+static void
+add_use(SearchHistory *history, const std::string &name, int64_t when, double score) {
+    auto &entry = history->entries[name];
+    int64_t now = std::max(entry.last_used, when);
+    entry.score = decayed(entry, now) + score * std::exp2(-(double) (now - when) / search_history_half_life);
+    entry.last_used = now;
+}
+
+// Entries sorted best first, everything decayed to the same time so they can be compared
+static std::vector<std::pair<std::string, double>>
+best_first(const SearchHistory *history) {
+    int64_t latest = 0;
+    for (const auto &[name, entry]: history->entries)
+        latest = std::max(latest, entry.last_used);
+    std::vector<std::pair<std::string, double>> sorted;
+    sorted.reserve(history->entries.size());
+    for (const auto &[name, entry]: history->entries)
+        sorted.emplace_back(name, decayed(entry, latest));
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+        if (a.second != b.second)
+            return a.second > b.second;
+        return a.first < b.first;
+    });
+    return sorted;
+}
+
+static void
+drop_worst(SearchHistory *history) {
+    if (history->entries.size() <= search_history_max_entries)
+        return;
+    auto sorted = best_first(history);
+    for (size_t i = search_history_max_entries; i < sorted.size(); i++)
+        history->entries.erase(sorted[i].first);
+}
+
+static bool
+make_parent_directories(const std::string &path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        std::string directory = path.substr(0, slash);
+        if (mkdir(directory.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+            printf("Couldn't mkdir %s\n", directory.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+write_all(int fd, const std::string &contents) {
+    size_t written = 0;
+    while (written < contents.size()) {
+        ssize_t result = write(fd, contents.data() + written, contents.size() - written);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        written += result;
+    }
+    return true;
+}
+
+static void
+compact(SearchHistory *history) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    if (!make_parent_directories(history->path))
+        return;
+    std::string contents;
+    for (const auto &[name, entry]: history->entries) {
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "s %lld %.17g ", (long long) entry.last_used, entry.score);
+        contents += prefix + name + "\n";
+    }
+
+    // Renamed over the old one so a crash never loses the history
+    std::string temp_path = history->path + ".tmp" + std::to_string(getpid());
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return;
+    bool written = write_all(fd, contents);
+    close(fd);
+    if (!written || rename(temp_path.c_str(), history->path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        return;
+    }
+    history->log_lines = history->entries.size();
+}
+
+static void
+compact_if_long(SearchHistory *history) {
+    if (history->log_lines > 64 + 4 * (int) history->entries.size())
+        compact(history);
+}
+
+static bool
+parse_line(const std::string &line, char *kind, int64_t *when, double *score, std::string *name) {
+    long long time;
+    int consumed = 0;
+    if (line.size() > 2 && line[0] == 'u' && sscanf(line.c_str(), "u %lld %n", &time, &consumed) == 1) {
+        *score = 1;
+    } else if (line.size() > 2 && line[0] == 's' &&
+               sscanf(line.c_str(), "s %lld %lf %n", &time, score, &consumed) == 2) {
+        if (!std::isfinite(*score) || *score < 0)
+            return false;
+    } else {
+        return false;
+    }
+    if (consumed == 0 || consumed >= (int) line.size())
+        return false;
+    *kind = line[0];
+    *when = time;
+    *name = line.substr(consumed);
+    return true;
+}
+
+void search_history_load(SearchHistory *history, const std::string &path, const std::string &legacy_path) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    history->path = path;
+    history->entries.clear();
+    history->log_lines = 0;
+    history->ranks.reset();
+
+    std::ifstream log(path);
+    if (log.is_open()) {
+        std::string line;
+        char kind;
+        int64_t when;
+        double score;
+        std::string name;
+        while (getline(log, line)) {
+            history->log_lines++;
+            if (!parse_line(line, &kind, &when, &score, &name))
+                continue;
+            if (kind == 's')
+                history->entries[name] = {score, when};
+            else
+                add_use(history, name, when, score);
+            // Dropped as it was when the line was written, or what was dropped would come back with its old score
+            drop_worst(history);
+        }
+        compact_if_long(history);
+        return;
+    }
+
+    // The old history only kept the order, so the first name gets the most recent use
+    std::ifstream legacy(legacy_path);
+    if (!legacy.is_open())
+        return;
+    std::vector<std::string> names;
+    std::string line;
+    while (getline(legacy, line) && names.size() < search_history_max_entries)
+        if (!line.empty())
+            names.push_back(line);
+    if (names.empty())
+        return;
+    int64_t now = time(nullptr);
+    for (int i = names.size() - 1; i >= 0; i--)
+        add_use(history, names[i], now - i, 1);
+    compact(history);
+}
+
+void search_history_use(SearchHistory *history, const std::string &name, int64_t now) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    if (name.empty() || name.find('\n') != std::string::npos)
+        return;
+    add_use(history, name, now, 1);
+    drop_worst(history);
+    history->ranks.reset();
+
+    if (history->path.empty() || !make_parent_directories(history->path))
+        return;
+    int fd = open(history->path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return;
+    // One write with O_APPEND, so the line is never interleaved with another winbar's
+    bool written = write_all(fd, "u " + std::to_string(now) + " " + name + "\n");
+    close(fd);
+    if (written) {
+        history->log_lines++;
+        compact_if_long(history);
+    }
+}
+
+std::shared_ptr<const HistoryRanks> search_history_ranks(SearchHistory *history) {
+    // Everything decays at the same rate, so the order only changes when something is used
+    if (!history->ranks) {
+        auto ranks = std::make_shared<HistoryRanks>();
+        auto sorted = best_first(history);
+        for (int i = 0; i < (int) sorted.size(); i++)
+            (*ranks)[sorted[i].first] = i;
+        history->ranks = std::move(ranks);
+    }
+    return history->ranks;
+}
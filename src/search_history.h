@@ -0,0 +1,39 @@
+#ifndef SEARCH_HISTORY_H
+#define SEARCH_HISTORY_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+// Lowercased name -> place in the history (0 is the best), what searching ranks used items with
+typedef std::unordered_map<std::string, int> HistoryRanks;
+
+struct HistoryEntry {
+    // Every use adds 1, and the whole thing halves every search_history_half_life seconds after last_used
+    double score = 0;
+    int64_t last_used = 0;
+};
+
+// What was launched out of the search menu, by lowercased name. Kept in a log that every use appends one line to:
+//
+// u <time> <name>          used at time
+// s <time> <score> <name>  score as of time, what compaction writes
+//
+// The log is rewritten with one "s" line per entry once it holds a lot more lines than there are entries.
+struct SearchHistory {
+    std::string path;
+    std::unordered_map<std::string, HistoryEntry> entries;
+    int log_lines = 0;
+    // Rebuilt after something changed, the old one stays valid for whoever still holds it
+    std::shared_ptr<const HistoryRanks> ranks;
+};
+
+// Replays the log at path. If there isn't one yet, the most recent first list of names at legacy_path is taken over.
+void search_history_load(SearchHistory *history, const std::string &path, const std::string &legacy_path);
+
+void search_history_use(SearchHistory *history, const std::string &name, int64_t now);
+
+std::shared_ptr<const HistoryRanks> search_history_ranks(SearchHistory *history);
+
+#endif // SEARCH_HISTORY_H
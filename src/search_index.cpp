@@ -0,0 +1,239 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <cctype>
+
+#ifdef TRACY_ENABLE
+
+#include "../tracy/public/tracy/Tracy.hpp"
+
+#endif
+
+static inline uint32_t
+gram_key(const char *bytes, int length) {
+    uint32_t key = (uint32_t) length << 24;
+    for (int i = 0; i < length; i++)
+        key |= (uint32_t) (unsigned char) bytes[i] << (i * 8);
+    return key;
+}
+
+// Every distinct gram of text of the given length
+static void
+grams_of(const std::string &text, int length, std::vector<uint32_t> *grams) {
+    grams->clear();
+    for (size_t i = 0; i + length <= text.size(); i++)
+        grams->push_back(gram_key(text.data() + i, length));
+    std::sort(grams->begin(), grams->end());
+    grams->erase(std::unique(grams->begin(), grams->end()), grams->end());
+}
+
+static std::string
+lowercase(const std::string &text) {
+    std::string lower(text);
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    return lower;
+}
+
+void search_index_build(SearchIndex *index, std::vector<Sortable *> items) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    auto corpus = std::make_shared<SearchCorpus>();
+    corpus->names.reserve(items.size());
+    corpus->lowercase_names.reserve(items.size());
+    for (auto *item: items) {
+        corpus->names.push_back(item->name);
+        corpus->lowercase_names.push_back(item->lowercase_name);
+    }
+    corpus->history_ranks.assign(items.size(), -2);
+
+    std::vector<uint32_t> grams;
+    std::vector<uint32_t> more_grams;
+    for (uint32_t i = 0; i < items.size(); i++) {
+        // Whatever matches has the lowercased text in its lowercased name, usually that's lowercase_name already
+        std::string lower = lowercase(corpus->names[i]);
+        const std::string &lowercase_name = corpus->lowercase_names[i];
+        grams_of(lower, 1, &grams);
+        grams_of(lower, 3, &more_grams);
+        grams.insert(grams.end(), more_grams.begin(), more_grams.end());
+        if (lower != lowercase_name) {
+            grams_of(lowercase_name, 1, &more_grams);
+            grams.insert(grams.end(), more_grams.begin(), more_grams.end());
+            grams_of(lowercase_name, 3, &more_grams);
+            grams.insert(grams.end(), more_grams.begin(), more_grams.end());
+            std::sort(grams.begin(), grams.end());
+            grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+        }
+        for (uint32_t gram: grams)
+            corpus->postings[gram].push_back(i);
+    }
+
+    index->items = std::move(items);
+    index->corpus = std::move(corpus);
+    index->stale = false;
+}
+
+// Sort priority (this won't try to do anything smart when searching for multiple words at the same time: "Firefox Steam")
+//
+// -1: Perfect match comes before everything, even history
+// 0: launched before, in the order the history ranks them
+// 2: Start of string, correct capitalization, closest in length
+// 3: Start of string, any     capitalization, closest in length
+// 4: Any position in string, correct capitalization, closest in length
+// 5: Any position in string, any     capitalization, closest in length
+// 6 - 10: The same again for the lowercased text
+// 11: No match
+static int
+match_priority(const std::string &name, const std::string &lowercase_name, const std::string &text,
+               const std::string &lowercase_text) {
+    unsigned long normal_find = name.find(text);
+    unsigned long lowercase_find = lowercase_name.find(text);
+
+    if (normal_find == 0 && name.length() == text.length()) {
+        return -1;
+    } else if (normal_find == 0) {
+        return 2;
+    } else if (lowercase_find == 0) {
+        return 3;
+    } else if (normal_find != std::string::npos) {
+        return 4;
+    } else if (lowercase_find != std::string::npos) {
+        return 5;
+    }
+
+    normal_find = name.find(lowercase_text);
+    if (normal_find == 0 && name.length() == lowercase_text.length()) {
+        return 6;
+    } else if (normal_find == 0) {
+        return 7;
+    } else if ((lowercase_find = lowercase_name.find(lowercase_text)) == 0) {
+        return 8;
+    } else if (normal_find != std::string::npos) {
+        return 9;
+    } else if (lowercase_find != std::string::npos) {
+        return 10;
+    }
+    return 11;
+}
+
+static int
+history_rank(SearchCorpus *corpus, uint32_t i) {
+    int &rank = corpus->history_ranks[i];
+    if (rank == -2) {
+        auto found = corpus->history_seen->find(corpus->lowercase_names[i]);
+        rank = found == corpus->history_seen->end() ? -1 : found->second;
+    }
+    return rank;
+}
+
+static size_t
+shortest_posting(const SearchCorpus *corpus, const std::vector<uint32_t> &grams) {
+    size_t shortest = SIZE_MAX;
+    for (uint32_t gram: grams) {
+        auto found = corpus->postings.find(gram);
+        shortest = std::min(shortest, found == corpus->postings.end() ? 0 : found->second.size());
+    }
+    return shortest;
+}
+
+// The items that have every one of the grams, smallest list first so there's the least to go through
+static std::vector<uint32_t>
+candidates(const SearchCorpus *corpus, const std::vector<uint32_t> &grams) {
+    std::vector<const std::vector<uint32_t> *> lists;
+    for (uint32_t gram: grams) {
+        auto found = corpus->postings.find(gram);
+        if (found == corpus->postings.end())
+            return {};
+        lists.push_back(&found->second);
+    }
+    if (lists.empty())
+        return {};
+    std::sort(lists.begin(), lists.end(), [](const auto *a, const auto *b) { return a->size() < b->size(); });
+
+    std::vector<uint32_t> result = *lists[0];
+    std::vector<uint32_t> intersection;
+    for (size_t l = 1; l < lists.size() && !result.empty(); l++) {
+        intersection.clear();
+        std::set_intersection(result.begin(), result.end(), lists[l]->begin(), lists[l]->end(),
+                              std::back_inserter(intersection));
+        result.swap(intersection);
+    }
+    return result;
+}
+
+bool search_corpus_query(SearchCorpus *corpus, const std::string &text,
+                         const std::shared_ptr<const HistoryRanks> &history, size_t limit,
+                         std::vector<SearchMatch> *matches, const std::atomic<uint64_t> *latest, uint64_t generation) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    matches->clear();
+    if (text.empty())
+        return true;
+    std::string lowercase_text = lowercase(text);
+
+    if (!history) {
+        static const auto no_history = std::make_shared<const HistoryRanks>();
+        return search_corpus_query(corpus, text, no_history, limit, matches, latest, generation);
+    }
+    // Ranks only change together with the history, which always hands out a new one then
+    if (history != corpus->history_seen) {
+        corpus->history_seen = history;
+        corpus->history_ranks.assign(corpus->names.size(), -2);
+    }
+
+    // Anything that matches a text also matches every piece of it, so when the text only grew, what the last one
+    // matched is all that needs looking at. That's only used when there's fewer of them than in the shortest posting
+    // list, which can happen when the last text was short.
+    std::vector<uint32_t> grams;
+    grams_of(lowercase_text, lowercase_text.size() >= 3 ? 3 : 1, &grams);
+    std::vector<uint32_t> looked_at;
+    if (corpus->has_last && text.find(corpus->last_text) != std::string::npos &&
+        corpus->last_matches.size() <= shortest_posting(corpus, grams)) {
+        looked_at = corpus->last_matches;
+    } else {
+        looked_at = candidates(corpus, grams);
+    }
+
+    std::vector<uint32_t> matched;
+    for (size_t c = 0; c < looked_at.size(); c++) {
+        // Checked every so often so a query that's already been replaced stops early
+        if (latest && (c & 1023) == 0 && latest->load(std::memory_order_relaxed) != generation)
+            return false;
+        uint32_t i = looked_at[c];
+        int priority = match_priority(corpus->names[i], corpus->lowercase_names[i], text, lowercase_text);
+        if (priority == 11)
+            continue;
+        matched.push_back(i);
+        SearchMatch match = {i, priority, -1};
+        if (priority != -1) {
+            int rank = history_rank(corpus, i);
+            if (rank != -1) {
+                match.historical_ranking = rank;
+                match.priority = 0;
+            }
+        }
+        matches->push_back(match);
+    }
+    corpus->last_text = text;
+    corpus->last_matches = std::move(matched);
+    corpus->has_last = true;
+
+    auto compare_priority = [corpus](const SearchMatch &first, const SearchMatch &second) {
+        if (first.priority != second.priority) {
+            return first.priority < second.priority;
+        }
+        if (first.priority == 0) {
+            return first.historical_ranking < second.historical_ranking;
+        }
+        return corpus->names[first.item].length() < corpus->names[second.item].length();
+    };
+    // Nobody scrolls through thousands of results, so only the ones that can be shown are put in order
+    if (matches->size() > limit) {
+        std::partial_sort(matches->begin(), matches->begin() + limit, matches->end(), compare_priority);
+        matches->resize(limit);
+    } else {
+        std::sort(matches->begin(), matches->end(), compare_priority);
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include "search_history.h"
+#include "sortable.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Finds the Sortables whose name contains the search text without running find on every one of them. Every lowercased
+// name is broken into the bytes and the runs of three bytes it contains, and each of those keeps the (ascending)
+// indexes of the items that contain it. A query only looks at the items that have everything the text has, and ranks
+// them the same way searching always has.
+//
+// The names are copied in, so a corpus can be searched on another thread while the Sortables it was made from change.
+struct SearchCorpus {
+    std::vector<std::string> names;
+    std::vector<std::string> lowercase_names;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+
+    // Only one query may run on a corpus at a time, the rest is what they remember between each other.
+    // Everything the last text matched, a text that contains it can only match some of those.
+    std::string last_text;
+    std::vector<uint32_t> last_matches;
+    bool has_last = false;
+    // Each item's place in history_seen (-1 for none, -2 for not looked up yet)
+    std::shared_ptr<const HistoryRanks> history_seen;
+    std::vector<int> history_ranks;
+};
+
+struct SearchIndex {
+    std::vector<Sortable *> items;
+    std::shared_ptr<SearchCorpus> corpus;
+    // Set when the items changed, the index is rebuilt on the next query
+    bool stale = true;
+};
+
+void search_index_build(SearchIndex *index, std::vector<Sortable *> items);
+
+template<class T>
+void search_index_sync(SearchIndex *index, const std::vector<T> &items) {
+    if (!index->stale && index->corpus && index->items.size() == items.size())
+        return;
+    search_index_build(index, std::vector<Sortable *>(items.begin(), items.end()));
+}
+
+struct SearchMatch {
+    uint32_t item; // Into SearchIndex::items
+    int priority;
+    int historical_ranking;
+};
+
+// The items matching text, best first, at most limit of them. Items whose lowercase_name is in history come before the
+// rest, in the order history gives them. If latest is given the query gives up (returning false) as soon as it no
+// longer holds generation.
+bool search_corpus_query(SearchCorpus *corpus, const std::string &text,
+                         const std::shared_ptr<const HistoryRanks> &history, size_t limit,
+                         std::vector<SearchMatch> *matches, const std::atomic<uint64_t> *latest = nullptr,
+                         uint64_t generation = 0);
+
+#endif // SEARCH_INDEX_H
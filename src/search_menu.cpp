@@ -17,12 +17,20 @@
 #include "main.h"
 #include "taskbar.h"
 #include "globals.h"
+#include "icon_raster_cache.h"
+#include "search_index.h"
 #include "defer.h"
 #include "simple_dbus.h"
 
 #include <algorithm>
-#include <fstream>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
 #include <pango/pangocairo.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
 
 class Script : public Sortable {
 public:
@@ -36,13 +44,7 @@ public:
     Sortable *sortable = nullptr;
     void *user_data = nullptr;
     int item_number = 0;
-    bool delete_user_data_as_script = false;
-    
-    ~SearchItemData() {
-        if (delete_user_data_as_script) {
-            delete (Script *) user_data;
-        }
-    }
+    bool user_data_is_script = false;
 };
 
 class TitleData : public UserData {
@@ -50,16 +52,38 @@ public:
     std::string text;
 };
 
+struct SearchResult {
+    Sortable *sortable = nullptr;
+    void *user_data = nullptr;
+};
+
 std::vector<Script *> scripts;
 
 std::string active_tab = "Apps";
 static int active_item = 0;
-static int scroll_amount = 0;
+static bool reset_scroll = false;
+
+// The sorted matches of the current text which the rows of the "content" list are bound to
+static std::vector<SearchResult> results;
+
+// Only this many of the best matches are shown
+static const size_t search_result_limit = 500;
+
+static SearchIndex app_search_index;
+static SearchIndex script_search_index;
+
+// What the "Zero results" item runs
+static Script run_anyways;
 
 static cairo_surface_t *script_16 = nullptr;
 static cairo_surface_t *script_32 = nullptr;
 static cairo_surface_t *script_64 = nullptr;
 
+static void
+script_icon_loaded(App *, cairo_surface_t *surface, void *user_data) {
+    *((cairo_surface_t **) user_data) = surface;
+}
+
 class TabData : public UserData {
 public:
     std::string name;
@@ -90,77 +114,6 @@ paint_left_bg(AppClient *client, cairo_t *cr, Container *container) {
     cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 }
 
-static inline int
-determine_priority(Sortable *item,
-                   const std::string &text,
-                   const std::string &lowercase_text,
-                   const std::vector<HistoricalNameUsed *> &history) {
-#ifdef TRACY_ENABLE
-    ZoneScoped;
-#endif
-    if (text.empty())
-        return 11;
-    // Sort priority (this won't try to do anything smart when searching for multiple words at the same time: "Firefox Steam")
-    //
-    // 0: name found somewhere in history TODO: need to implement this
-    // 1: Perfect match is highest
-    // 2: Start of string, correct capitalization, closest in length
-    // 3: Start of string, any     capitalization, closest in length
-    // 4: Any position in string, correct capitalization, closest in length
-    // 5: Any position in string, any     capitalization, closets in length
-    //
-    // For normal text
-    
-    unsigned long normal_find = item->name.find(text);
-    unsigned long lowercase_find = item->lowercase_name.find(text);
-    
-    int prio = 11;
-    if (normal_find == 0 && item->name.length() == text.length()) {
-        prio = -1;// absolute perfect matches come before everything even historical
-    } else if (normal_find == 0) {
-        prio = 2;
-    } else if ((lowercase_find) == 0) {
-        prio = 3;
-    } else if (normal_find != std::string::npos) {
-        prio = 4;
-    } else if (lowercase_find != std::string::npos) {
-        prio = 5;
-    }
-    
-    // For lowercase_text
-    if (prio == 11) {
-        normal_find = item->name.find(lowercase_text);
-        if (normal_find == 0 && item->name.length() == lowercase_text.length()) {// perfect match
-            prio = 6;
-        } else if (normal_find == 0) {
-            prio = 7;
-        } else if ((lowercase_find = item->lowercase_name.find(lowercase_text)) == 0) {
-            prio = 8;
-        } else if (normal_find != std::string::npos) {
-            prio = 9;
-        } else if (lowercase_find != std::string::npos) {
-            prio = 10;
-        }
-    }
-    
-    // Find it in history and attach a ranking
-    if (prio != -1) {    // if it wasn't a perfect match
-        if (prio != 11) {// but it was a match
-            for (int i = 0; i < history.size(); i++) {
-                HistoricalNameUsed *h = (history)[i];
-                auto lowercase_historic_find = h->text.find(item->lowercase_name);
-                if (lowercase_historic_find != std::string::npos) {
-                    item->historical_ranking = i;
-                    prio = 0;
-                    return prio;
-                }
-            }
-        }
-    }
-    
-    return prio;
-}
-
 static inline int
 determine_priority_location(const Sortable &item,
                             const std::string &text,
@@ -602,7 +555,7 @@ paint_right_active_title(AppClient *client, cairo_t *cr, Container *container) {
     pango_cairo_show_layout(cr, layout);
     
     if (active_tab == "Scripts") {
-        if (script_32) {
+        if (script_64) {
             cairo_set_source_surface(cr,
                                      script_64,
                                      container->real_bounds.x + container->real_bounds.w / 2 - 32 * config->dpi,
@@ -675,7 +628,7 @@ paint_right_active_title_for_no_results(AppClient *client, cairo_t *cr, Containe
                   (int) (container->real_bounds.y + 106 * config->dpi + height - (height / 3)));
     pango_cairo_show_layout(cr, layout);
     
-    if (script_32) {
+    if (script_64) {
         cairo_set_source_surface(cr,
                                  script_64,
                                  container->real_bounds.x + container->real_bounds.w / 2 - 32 * config->dpi,
@@ -756,26 +709,11 @@ paint_open_in_folder(AppClient *client, cairo_t *cr, Container *container) {
 }
 
 static void
-launch_item(AppClient *client, Container *item) {
-    SearchItemData *data = (SearchItemData *) item->user_data;
-    if (active_tab == "Scripts" || data->delete_user_data_as_script) {
+launch_item(AppClient *client, SearchItemData *data) {
+    if (active_tab == "Scripts" || data->user_data_is_script) {
         Script *script = (Script *) data->user_data;
         
-        for (int i = 0; i < global->history_scripts.size(); i++) {
-            auto *historic_script = global->history_scripts[i];
-            if (historic_script->text == script->lowercase_name) {
-                delete historic_script;
-                global->history_scripts.erase(global->history_scripts.begin() + i);
-                break;
-            }
-        }
-        auto *historic_script = new HistoricalNameUsed;
-        historic_script->text = script->lowercase_name;
-        global->history_scripts.insert(global->history_scripts.begin(), historic_script);
-        if (global->history_scripts.size() > 100) {
-            delete global->history_scripts[global->history_scripts.size() - 1];
-            global->history_scripts.erase(global->history_scripts.end() - 1);
-        }
+        search_history_use(&global->history_scripts, script->lowercase_name, time(nullptr));
         
         if (script->path_is_full_command) {
             launch_command(script->path);
@@ -785,21 +723,7 @@ launch_item(AppClient *client, Container *item) {
     } else if (active_tab == "Apps") {
         Launcher *launcher = (Launcher *) data->user_data;
         
-        for (int i = 0; i < global->history_apps.size(); i++) {
-            auto *historic_app = global->history_apps[i];
-            if (historic_app->text == launcher->lowercase_name) {
-                delete historic_app;
-                global->history_apps.erase(global->history_apps.begin() + i);
-                break;
-            }
-        }
-        auto *historic_app = new HistoricalNameUsed;
-        historic_app->text = launcher->lowercase_name;
-        global->history_apps.insert(global->history_apps.begin(), historic_app);
-        if (global->history_apps.size() > 100) {
-            delete global->history_apps[global->history_apps.size() - 1];
-            global->history_apps.erase(global->history_apps.end() - 1);
-        }
+        search_history_use(&global->history_apps, launcher->lowercase_name, time(nullptr));
         
         launch_command(launcher->exec);
     }
@@ -820,18 +744,11 @@ launch_item(AppClient *client, Container *item) {
 static void
 launch_active_item() {
     if (AppClient *client = client_by_name(app, "search_menu")) {
-        if (Container *container = container_by_name("content", client->root)) {
-            for (int i = 0; i < container->children.size(); i++) {
-                if (i == 0 || i == 2) {
-                    continue;
-                }
-                Container *child = container->children[i];
-                SearchItemData *data = (SearchItemData *) child->user_data;
-                if (data->item_number == active_item) {
-                    launch_item(client, child);
-                    return;
-                }
-            }
+        // The active item might be scrolled out of view (and so not have a row), but right_fg always shows it
+        if (Container *right_fg = container_by_name("right_fg", client->root)) {
+            auto *data = (SearchItemData *) right_fg->user_data;
+            if (data && data->sortable)
+                launch_item(client, data);
         }
     }
 }
@@ -849,7 +766,7 @@ clicked_open_in_folder(AppClient *client, cairo_t *cr, Container *container) {
 
 static void
 clicked_item(AppClient *client, cairo_t *cr, Container *container) {
-    launch_item(client, container->parent);
+    launch_item(client, (SearchItemData *) container->parent->user_data);
 }
 
 static void
@@ -867,7 +784,10 @@ paint_content(AppClient *client, cairo_t *cr, Container *container) {
     
     for (auto *c: container->children) {
         if (overlaps(c->real_bounds, c->parent->parent->real_bounds)) {
-            if (c->when_paint) {
+            // Titles are paint_cached, which only paint_container knows about
+            if (c->paint_cached) {
+                paint_container(client->app, client, c);
+            } else if (c->when_paint) {
                 c->when_paint(client, cr, c);
             }
         }
@@ -888,7 +808,7 @@ paint_content(AppClient *client, cairo_t *cr, Container *container) {
 static void
 paint_hbox(AppClient *client, cairo_t *cr, Container *container) {
     for (auto *c: container->children) {
-        if (c->when_paint) {
+        if (c->exists && c->when_paint) {
             c->when_paint(client, cr, c);
         }
     }
@@ -1007,49 +927,70 @@ paint_tab(AppClient *client, cairo_t *cr, Container *container) {
 }
 
 static void
-clicked_right_item(AppClient *client, cairo_t *cr, Container *container) {
-    if (auto *content = container_by_name("content", client->root)) {
-        for (int i = 0; i < content->children.size(); i++) {
-            auto *child = content->children[i];
-            auto *data = (SearchItemData *) (child->user_data);
-            if (data && data->item_number == active_item) {
-                Container *right_item = child->child(49 * config->dpi, FILL_SPACE);
-                right_item->when_paint = paint_right_item;
-                right_item->when_clicked = clicked_right_item;
-            }
-        }
+bind_active_item(Container *right_fg) {
+    auto *data = (SearchItemData *) right_fg->user_data;
+    bool no_results = results.empty();
+    if (no_results) {
+        data->sortable = &run_anyways;
+        data->user_data = &run_anyways;
+        data->user_data_is_script = true;
+        data->item_number = 0;
+    } else {
+        data->sortable = results[active_item].sortable;
+        data->user_data = results[active_item].user_data;
+        data->user_data_is_script = false;
+        data->item_number = active_item;
     }
+    
+    right_fg->children[0]->when_paint = no_results ? paint_right_active_title_for_no_results : paint_right_active_title;
+    right_fg->children[3]->when_paint = no_results ? paint_run : paint_open;
+    right_fg->children[4]->exists = !no_results;
+}
+
+static void
+clicked_right_item(AppClient *client, cairo_t *cr, Container *container) {
     auto *data = (SearchItemData *) container->parent->user_data;
     active_item = data->item_number;
     
-    if (auto *content = container_by_name("content", client->root)) {
-        for (int i = 0; i < content->children.size(); i++) {
-            auto *child = content->children[i];
-            auto *data = (SearchItemData *) (child->user_data);
-            if (data && data->item_number == active_item) {
-                delete child->children[1];
-                child->children.erase(child->children.begin() + 1);
-                
-                if (auto *right_fg = container_by_name("right_fg", client->root)) {
-                    auto *right_fg_data = new SearchItemData;
-                    right_fg_data->user_data = data->user_data;
-                    right_fg_data->item_number = data->item_number;
-                    right_fg_data->sortable = data->sortable;
-                    right_fg->user_data = right_fg_data;
-                }
-            }
-        }
-    }
+    if (auto *content = container_by_name("content", client->root))
+        virtual_list_rebind((VirtualList *) content);
+    if (auto *right_fg = container_by_name("right_fg", client->root))
+        bind_active_item(right_fg);
     
     client_layout(app, client);
     request_refresh(app, client);
 }
 
-template<class T>
-void sort_and_add(std::vector<T> *sortables,
-                  Container *bottom,
-                  std::string text,
-                  const std::vector<HistoricalNameUsed *> &history);
+static void
+sort_and_add(SearchIndex *index, const std::string &text, SearchHistory *history);
+
+static void
+cancel_search();
+
+// Shows the results for text in bottom, or the "Start typing" message if there's no text
+static void
+update_results(Container *bottom, const std::string &text) {
+    if (text.empty()) {
+        cancel_search();
+        for (auto *c: bottom->children)
+            delete c;
+        bottom->children.clear();
+        bottom->children.shrink_to_fit();
+        if (auto *client = client_by_name(app, "search_menu")) {
+            client_layout(app, client);
+            client_paint(app, client);
+        }
+        return;
+    }
+    // The results are laid out and painted when the search comes back
+    if (active_tab == "Scripts") {
+        search_index_sync(&script_search_index, scripts);
+        sort_and_add(&script_search_index, text, &global->history_scripts);
+    } else if (active_tab == "Apps") {
+        search_index_sync(&app_search_index, launchers);
+        sort_and_add(&app_search_index, text, &global->history_apps);
+    }
+}
 
 static void
 clicked_tab_timeout(App *app, AppClient *client, Timeout *, void *user_data) {
@@ -1062,24 +1003,8 @@ clicked_tab_timeout(App *app, AppClient *client, Timeout *, void *user_data) {
         
         auto *bottom = container_by_name("bottom", client->root);
         if (bottom) {
-            for (auto *c: bottom->children)
-                delete c;
-            bottom->children.clear();
-            bottom->children.shrink_to_fit();
-            if (!data->state->text.empty()) {
-                if (active_tab == "Scripts") {
-                    sort_and_add<Script *>(&scripts, bottom, data->state->text, global->history_scripts);
-                } else if (active_tab == "Apps") {
-                    // We create a copy because app_menu relies on the order
-                    std::vector<Launcher *> launchers_copy;
-                    for (auto *l: launchers) {
-                        launchers_copy.push_back(l);
-                    }
-                    sort_and_add<Launcher *>(&launchers_copy, bottom, data->state->text, global->history_apps);
-                }
-            }
-            client_layout(app, client);
-            client_paint(app, client);
+            reset_scroll = true;
+            update_results(bottom, data->state->text);
         }
     }
 }
@@ -1109,71 +1034,331 @@ add_tab(AppClient *client, Container *tab_bar, std::string tab_name) {
     tab->when_clicked = clicked_tab;
 }
 
-static inline bool
-compare_priority(Sortable *first, Sortable *second) {
+static bool can_pop = false;
+
+enum SearchRowKind {
+    ROW_TITLE,
+    ROW_ITEM,
+};
+
+// Which result the item row at index shows
+static int
+result_index(int index) {
+    return index == 1 ? 0 : index - 2;
+}
+
+static int
+result_row_kind(VirtualList *list, int index) {
+    return (index == 0 || index == 2) ? ROW_TITLE : ROW_ITEM;
+}
+
+static double
+result_row_height(VirtualList *list, int index) {
+    if (result_row_kind(list, index) == ROW_TITLE)
+        return 32 * config->dpi;
+    return index == 1 ? 64 * config->dpi : 36 * config->dpi;
+}
+
+static Container *
+create_result_row(VirtualList *list, int kind) {
+    if (kind == ROW_TITLE) {
+        auto *title = new Container(::hbox, FILL_SPACE, FILL_SPACE);
+        title->when_paint = paint_title;
+        title->paint_cached = true;
+        title->user_data = new TitleData;
+        return title;
+    }
+    
+    auto *hbox = new Container(::hbox, FILL_SPACE, FILL_SPACE);
+    hbox->when_paint = paint_hbox;
+    hbox->user_data = new SearchItemData;
+    Container *item = hbox->child(FILL_SPACE, FILL_SPACE);
+    item->when_clicked = clicked_item;
+    Container *right_item = hbox->child(49 * config->dpi, FILL_SPACE);
+    right_item->when_paint = paint_right_item;
+    right_item->when_clicked = clicked_right_item;
+    return hbox;
+}
+
+static void
+bind_result_row(VirtualList *list, Container *row, int index) {
+    if (result_row_kind(list, index) == ROW_TITLE) {
+        auto *data = (TitleData *) row->user_data;
+        if (results.empty()) {
+            data->text = "Zero results";
+        } else {
+            data->text = index == 0 ? "Best match" : "Other results";
+        }
+        return;
+    }
+    
+    auto *data = (SearchItemData *) row->user_data;
+    Container *item = row->children[0];
+    Container *right_item = row->children[1];
+    if (results.empty()) {
+        data->sortable = &run_anyways;
+        data->user_data = &run_anyways;
+        data->user_data_is_script = true;
+        data->item_number = 0;
+        item->when_paint = paint_no_result_item;
+        right_item->exists = false;
+        return;
+    }
+    
+    int i = result_index(index);
+    data->sortable = results[i].sortable;
+    data->user_data = results[i].user_data;
+    data->user_data_is_script = false;
+    data->item_number = i;
+    item->when_paint = i == 0 ? paint_top_item : paint_item;
+    // The active item shows its options in right_fg instead
+    right_item->exists = i != active_item;
+}
+
+// Makes the containers results are shown in, which are kept until the text is cleared or the menu is closed
+static void
+build_results(Container *bottom) {
+    Container *hbox = bottom->child(::hbox, FILL_SPACE, FILL_SPACE);
+    Container *left = hbox->child(::vbox, 344 * config->dpi, FILL_SPACE);
+    left->when_paint = paint_left_bg;
+    Container *right = hbox->child(::vbox, FILL_SPACE, FILL_SPACE);
+    right->when_paint = paint_right_bg;
+    right->wanted_pad = Bounds(12 * config->dpi, 12 * config->dpi, 12 * config->dpi, 0);
+    
+    Container *right_fg = right->child(::vbox, FILL_SPACE, FILL_SPACE);
+    right_fg->when_paint = paint_right_fg;
+    right_fg->name = "right_fg";
+    right_fg->user_data = new SearchItemData;
+    
+    // bind_active_item depends on the order of these
+    Container *right_active_title = right_fg->child(FILL_SPACE, 176 * config->dpi);
+    right_active_title->when_clicked = clicked_right_active_title;
+    
+    auto *spacer = right_fg->child(FILL_SPACE, 2 * config->dpi);
+    spacer->when_paint = paint_spacer;
+    
+    right_fg->child(FILL_SPACE, 12 * config->dpi);
+    
+    Container *open = right_fg->child(FILL_SPACE, 32 * config->dpi);
+    open->when_clicked = clicked_open;
+    
+    Container *open_in_folder = right_fg->child(FILL_SPACE, 32 * config->dpi);
+    open_in_folder->when_paint = paint_open_in_folder;
+    open_in_folder->when_clicked = clicked_open_in_folder;
+    
+    right_fg->child(FILL_SPACE, 12 * config->dpi);
+    
+    ScrollPaneSettings settings(config->dpi);
+    settings.right_show_amount = 2;
+    ScrollContainer *scroll = make_newscrollpane_as_child(left, settings);
+    scroll->name = "scroll";
+    
+    VirtualList *content = scrollpane_virtual_content(scroll);
+    content->when_paint = paint_content;
+    content->clip_children =
+            false;// We have to do custom clipping so don't waste calls on this
+    content->automatically_paint_children = false;
+    content->name = "content";
+    content->row_kind = result_row_kind;
+    content->row_height = result_row_height;
+    content->create_row = create_result_row;
+    content->bind_row = bind_result_row;
+}
+
+// Ranking runs on its own thread so typing never waits for it. Only the newest query matters: each one takes the next
+// search_generation, and a query that no longer holds it gives up or has its results thrown away.
+struct SearchJob {
+    uint64_t generation = 0;
+    SearchIndex *index = nullptr;
+    std::shared_ptr<SearchCorpus> corpus;
+    std::string text;
+    std::shared_ptr<const HistoryRanks> history;
+    std::vector<SearchMatch> matches;
+};
+
+static std::atomic<uint64_t> search_generation{0};
+static std::mutex search_mutex;
+static std::condition_variable search_condition;
+static std::optional<SearchJob> waiting_search;
+static std::optional<SearchJob> finished_search;
+static bool search_running = false;
+static bool search_thread_stopping = false;
+static std::thread search_thread;
+static App *search_app = nullptr;
+// Written to by search_thread when finished_search is set
+static int search_done_fd = -1;
+
+static void
+search_worker() {
+    std::unique_lock lock(search_mutex);
+    while (true) {
+        search_condition.wait(lock, [] { return search_thread_stopping || waiting_search.has_value(); });
+        if (search_thread_stopping)
+            return;
+        SearchJob job = std::move(*waiting_search);
+        waiting_search.reset();
+        search_running = true;
+        
+        lock.unlock();
+        bool done = search_corpus_query(job.corpus.get(), job.text, job.history, search_result_limit, &job.matches,
+                                        &search_generation, job.generation);
+        lock.lock();
+        
+        search_running = false;
+        if (done && job.generation == search_generation) {
+            finished_search = std::move(job);
+            uint64_t one = 1;
+            write(search_done_fd, &one, sizeof(one));
+        }
+        // finish_pending_search could be waiting
+        search_condition.notify_all();
+    }
+}
+
+static void
+show_results(SearchJob &job);
+
+static void
+search_finished(App *app, int fd, void *) {
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+    std::optional<SearchJob> job;
+    {
+        std::lock_guard lock(search_mutex);
+        job.swap(finished_search);
+    }
+    if (job && job->generation == search_generation)
+        show_results(*job);
+}
+
+// Needs search_mutex
+static bool
+search_thread_start() {
+    if (search_thread.joinable())
+        return true;
+    search_done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (search_done_fd == -1)
+        return false;
+    if (!poll_descriptor(app, search_done_fd, EPOLLIN, search_finished, nullptr, "Search results")) {
+        close(search_done_fd);
+        search_done_fd = -1;
+        return false;
+    }
+    search_app = app;
+    search_thread_stopping = false;
+    search_thread = std::thread(search_worker);
+    return true;
+}
+
+static void
+sort_and_add(SearchIndex *index, const std::string &text, SearchHistory *history) {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    if (first->priority != second->priority) {
-        return first->priority < second->priority;
-    }
-    if (first->priority == 0) {
-        return first->historical_ranking < second->historical_ranking;
+    SearchJob job;
+    job.generation = ++search_generation;
+    job.index = index;
+    job.corpus = index->corpus;
+    job.text = text;
+    job.history = search_history_ranks(history);
+    
+    std::unique_lock lock(search_mutex);
+    finished_search.reset();
+    if (!search_thread_start()) {
+        lock.unlock();
+        search_corpus_query(job.corpus.get(), job.text, job.history, search_result_limit, &job.matches);
+        show_results(job);
+        return;
     }
-    return first->name.length() < second->name.length();
+    waiting_search = std::move(job);
+    lock.unlock();
+    search_condition.notify_all();
 }
 
-static bool can_pop = false;
+static void
+cancel_search() {
+    std::lock_guard lock(search_mutex);
+    search_generation++;
+    waiting_search.reset();
+    finished_search.reset();
+}
 
-template<class T>
-void sort_and_add(std::vector<T> *sortables,
-                  Container *bottom,
-                  std::string text,
-                  const std::vector<HistoricalNameUsed *> &history) {
-    std::vector<T> sorted;
-    
+static void
+finish_pending_search() {
+    std::unique_lock lock(search_mutex);
+    search_condition.wait(lock, [] { return !waiting_search.has_value() && !search_running; });
+    std::optional<SearchJob> job;
+    job.swap(finished_search);
+    lock.unlock();
+    if (job && job->generation == search_generation)
+        show_results(*job);
+}
+
+void search_stop() {
     {
+        std::lock_guard lock(search_mutex);
+        search_thread_stopping = true;
+        search_generation++;
+        waiting_search.reset();
+    }
+    search_condition.notify_all();
+    if (search_thread.joinable())
+        search_thread.join();
+    finished_search.reset();
+    if (search_done_fd != -1) {
+        remove_polled_descriptor(search_app, search_done_fd);
+        close(search_done_fd);
+        search_done_fd = -1;
+    }
+    search_app = nullptr;
+}
+
+static void
+show_results(SearchJob &job) {
 #ifdef TRACY_ENABLE
-        ZoneScopedN("sorting_options");
+    ZoneScoped;
 #endif
-        std::string lowercase_text(text);
-        std::transform(
-                lowercase_text.begin(), lowercase_text.end(), lowercase_text.begin(), ::tolower);
-        
-        for (auto *s: *sortables) {
-            s->priority = determine_priority(s, text, lowercase_text, history);
-            if (s->priority != 11) {
-                sorted.push_back(s);
-            }
-        }
-        
-        std::sort(sorted.begin(), sorted.end(), compare_priority);
-    }
+    auto *client = client_by_name(app, "search_menu");
+    if (!client)
+        return;
+    auto *bottom = container_by_name("bottom", client->root);
+    // The launchers or scripts changed after the search was started, and the search that follows that is coming
+    if (!bottom || job.index->stale || job.index->corpus != job.corpus)
+        return;
+    const std::string &text = job.text;
     
     {
 #ifdef TRACY_ENABLE
-        ZoneScopedN("create_containers_for_sorted_items");
+        ZoneScopedN("bind_sorted_items");
 #endif
-        Container *hbox = bottom->child(::hbox, FILL_SPACE, FILL_SPACE);
-        Container *left = hbox->child(::vbox, 344 * config->dpi, FILL_SPACE);
-        left->when_paint = paint_left_bg;
-        Container *right = hbox->child(::vbox, FILL_SPACE, FILL_SPACE);
-        right->when_paint = paint_right_bg;
-        right->wanted_pad = Bounds(12 * config->dpi, 12 * config->dpi, 12 * config->dpi, 0);
+        // The containers are only made the first time, after that the visible rows are just rebound to the new results
+        results.clear();
+        for (const auto &match: job.matches) {
+            Sortable *s = job.index->items[match.item];
+            s->priority = match.priority;
+            if (match.priority == 0)
+                s->historical_ranking = match.historical_ranking;
+            results.push_back({s, s});
+        }
         
-        Container *right_fg = right->child(::vbox, FILL_SPACE, FILL_SPACE);
-        right_fg->when_paint = paint_right_fg;
-        right_fg->name = "right_fg";
+        run_anyways.name = text;
+        run_anyways.lowercase_name = text;
+        run_anyways.priority = -1;
+        run_anyways.historical_ranking = -1;
+        run_anyways.path_is_full_command = true;
+        run_anyways.path = text;
         
-        ScrollPaneSettings settings(config->dpi);
-        settings.right_show_amount = 2;
-        ScrollContainer *scroll = make_newscrollpane_as_child(left, settings);
-        scroll->name = "scroll";
-        scroll->scroll_v_real = scroll_amount;
-        scroll->scroll_v_visual = scroll_amount;
+        if (bottom->children.empty())
+            build_results(bottom);
+        auto *scroll = container_by_name("scroll", bottom);
+        auto *content = (VirtualList *) container_by_name("content", bottom);
+        auto *right_fg = container_by_name("right_fg", bottom);
         
-        Container *content = scroll->content;
-        content->spacing = 0;
+        if (reset_scroll) {
+            reset_scroll = false;
+            scroll->scroll_v_real = 0;
+            scroll->scroll_v_visual = 0;
+        }
         if (auto client = client_by_name(app, "search_menu")) {
             if (can_pop) {
                 can_pop = false;
@@ -1181,137 +1366,21 @@ void sort_and_add(std::vector<T> *sortables,
                 client_create_animation(app, client, &content->spacing, 0, 120, nullptr, 0, true);
             }
         }
-
-        content->when_paint = paint_content;
-        content->clip_children =
-                false;// We have to do custom clipping so don't waste calls on this
-        content->automatically_paint_children = false;
-        content->name = "content";
+        
+        if (active_item > (int) results.size() - 1) {
+            active_item = results.size() - 1;
+        }
         if (active_item < 0) {
             active_item = 0;
         }
-        if (active_item > sorted.size() - 1) {
-            active_item = sorted.size() - 1;
-        }
-        
-        if (sorted.empty()) {
-            Container *title = content->child(::hbox, FILL_SPACE, 32 * config->dpi);
-            title->when_paint = paint_title;
-            auto *title_data = new TitleData;
-            title_data->text = "Zero results";
-            title->user_data = title_data;
-            
-            bool top_item = true;
-            Container *hbox = content->child(::hbox, FILL_SPACE, top_item ? 64 * config->dpi : 32 * config->dpi);
-            hbox->when_paint = paint_hbox;
-            Container *item = hbox->child(FILL_SPACE, FILL_SPACE);
-            
-            item->when_paint = paint_no_result_item;
-            item->when_clicked = clicked_item;
-            auto *data = new SearchItemData;
-            auto *sortable_data = new Script;
-            sortable_data->name = text;
-            sortable_data->lowercase_name = text;
-            sortable_data->priority = -1;
-            sortable_data->historical_ranking = -1;
-            sortable_data->path_is_full_command = true;
-            sortable_data->path = text;
-            
-            data->sortable = sortable_data;
-            data->user_data = sortable_data;
-            data->delete_user_data_as_script = true;
-            data->item_number = 0;
-            hbox->user_data = data;
-            
-            auto *right_data = new SearchItemData;
-            right_data->sortable = sortable_data;
-            right_data->user_data = sortable_data;
-            right_data->item_number = 0;
-            right_fg->user_data = right_data;
-            
-            Container *right_active_title = right_fg->child(FILL_SPACE, 176 * config->dpi);
-            right_active_title->when_paint = paint_right_active_title_for_no_results;
-            right_active_title->when_clicked = clicked_right_active_title;
-            
-            auto *spacer = right_fg->child(FILL_SPACE, 2 * config->dpi);
-            spacer->when_paint = paint_spacer;
-            
-            right_fg->child(FILL_SPACE, 12 * config->dpi);
-            
-            Container *open = right_fg->child(FILL_SPACE, 32 * config->dpi);
-            open->when_paint = paint_run;
-            open->when_clicked = clicked_open;
-            
-            right_fg->child(FILL_SPACE, 12 * config->dpi);
-            return;
-        }
         
-        for (int i = 0; i < sorted.size(); i++) {
-            if (i > 200) {
-                break;
-            }
-            
-            if (i == 0) {
-                Container *item = content->child(::hbox, FILL_SPACE, 32 * config->dpi);
-                item->when_paint = paint_title;
-                auto *data = new TitleData;
-                data->text = "Best match";
-                item->user_data = data;
-            } else if (i == 1) {
-                Container *item = content->child(::hbox, FILL_SPACE, 32 * config->dpi);
-                item->when_paint = paint_title;
-                auto *data = new TitleData;
-                data->text = "Other results";
-                item->user_data = data;
-            }
-            
-            bool top_item = i == 0;
-            
-            Container *hbox = content->child(::hbox, FILL_SPACE, top_item ? 64 * config->dpi : 36 * config->dpi);
-            hbox->when_paint = paint_hbox;
-            Container *item = hbox->child(FILL_SPACE, FILL_SPACE);
-            if (i == active_item) {
-                auto *right_data = new SearchItemData;
-                right_data->sortable = sorted[i];
-                right_data->sortable->full_path = sorted[i]->full_path;
-                right_data->user_data = sorted[i];
-                right_data->item_number = i;
-                right_fg->user_data = right_data;
-                
-                Container *right_active_title = right_fg->child(FILL_SPACE, 176 * config->dpi);
-                right_active_title->when_paint = paint_right_active_title;
-                right_active_title->when_clicked = clicked_right_active_title;
-                
-                auto *spacer = right_fg->child(FILL_SPACE, 2 * config->dpi);
-                spacer->when_paint = paint_spacer;
-                
-                right_fg->child(FILL_SPACE, 12 * config->dpi);
-                
-                Container *open = right_fg->child(FILL_SPACE, 32 * config->dpi);
-                open->when_paint = paint_open;
-                open->when_clicked = clicked_open;
-
-                Container *open_in_folder = right_fg->child(FILL_SPACE, 32 * config->dpi);
-                open_in_folder->when_paint = paint_open_in_folder;
-                open_in_folder->when_clicked = clicked_open_in_folder;
-
-                right_fg->child(FILL_SPACE, 12 * config->dpi);
-            } else {
-                Container *right_item = hbox->child(49 * config->dpi, FILL_SPACE);
-                right_item->when_paint = paint_right_item;
-                right_item->when_clicked = clicked_right_item;
-            }
-            
-            item->when_paint = top_item ? paint_top_item : paint_item;
-            item->when_clicked = clicked_item;
-            auto *data = new SearchItemData;
-            data->sortable = sorted[i];
-            data->sortable->full_path = sorted[i]->full_path;
-            data->user_data = sorted[i];
-            data->item_number = i;
-            hbox->user_data = data;
-        }
+        // Titles are at 0 and (if there is more than one result) 2, and with zero results, the item runs the text
+        virtual_list_set_count(content, results.size() <= 1 ? 2 : results.size() + 2);
+        bind_active_item(right_fg);
     }
+    
+    client_layout(app, client);
+    client_paint(app, client);
 }
 
 static void
@@ -1333,12 +1402,12 @@ when_key_event(AppClient *client,
     if (!is_string) {
         if (keysym == XKB_KEY_Up) {
             active_item--;
-            // TODO set correct scroll_amount
+            // TODO scroll the active item into view
             client_layout(app, search_menu_client);
             request_refresh(app, search_menu_client);
         } else if (keysym == XKB_KEY_Down) {
             active_item++;
-            // TODO set correct scroll_amount
+            // TODO scroll the active item into view
             client_layout(app, search_menu_client);
             request_refresh(app, search_menu_client);
         } else if (keysym == XKB_KEY_Escape) {
@@ -1352,29 +1421,14 @@ when_key_event(AppClient *client,
                 
                 auto *bottom = container_by_name("bottom", client->root);
                 if (bottom) {
-                    for (auto *c: bottom->children)
-                        delete c;
-                    bottom->children.clear();
-                    bottom->children.shrink_to_fit();
-                    if (!data->state->text.empty()) {
-                        if (active_tab == "Scripts") {
-                            sort_and_add<Script *>(&scripts, bottom, data->state->text, global->history_scripts);
-                        } else if (active_tab == "Apps") {
-                            // We create a copy because app_menu relies on the order
-                            std::vector<Launcher *> launchers_copy;
-                            for (auto *l: launchers) {
-                                launchers_copy.push_back(l);
-                            }
-                            sort_and_add<Launcher *>(&launchers_copy, bottom, data->state->text, global->history_apps);
-                        }
-                    }
-                    client_layout(app, client);
-                    client_paint(app, client);
+                    reset_scroll = true;
+                    update_results(bottom, data->state->text);
                 }
             }
             return;
         } else if (keysym == XKB_KEY_Return) {
-            // launch active item
+            // launch active item, out of what was actually typed
+            finish_pending_search();
             launch_active_item();
             client_layout(app, search_menu_client);
             request_refresh(app, search_menu_client);
@@ -1382,36 +1436,23 @@ when_key_event(AppClient *client,
         }
     } else {
         active_item = 0;
-        scroll_amount = 0;
     }
     
     if (auto *textarea = container_by_name("main_text_area", taskbar_client->root)) {
+        auto *data = (TextAreaData *) textarea->user_data;
+        std::string previous_text = data->state->text;
+        
         textarea_handle_keypress(client, textarea, is_string, keysym, string, mods, direction);
         client_layout(app, taskbar_client);
         request_refresh(app, taskbar_client);
         
-        auto *data = (TextAreaData *) textarea->user_data;
+        // A new query starts at the top, anything else (like moving the active item) keeps the scroll position
+        if (data->state->text != previous_text)
+            reset_scroll = true;
         
         auto *bottom = container_by_name("bottom", search_menu_client->root);
         if (bottom) {
-            for (auto *c: bottom->children)
-                delete c;
-            bottom->children.clear();
-            bottom->children.shrink_to_fit();
-            if (!data->state->text.empty()) {
-                if (active_tab == "Scripts") {
-                    sort_and_add<Script *>(&scripts, bottom, data->state->text, global->history_scripts);
-                } else if (active_tab == "Apps") {
-                    // We create a copy because app_menu relies on the order
-                    std::vector<Launcher *> launchers_copy;
-                    for (auto *l: launchers) {
-                        launchers_copy.push_back(l);
-                    }
-                    sort_and_add<Launcher *>(&launchers_copy, bottom, data->state->text, global->history_apps);
-                }
-            }
-            client_layout(app, search_menu_client);
-            client_paint(app, search_menu_client);
+            update_results(bottom, data->state->text);
         }
     }
 }
@@ -1440,144 +1481,39 @@ fill_root(AppClient *client) {
     bottom->name = "bottom";
     bottom->when_paint = paint_bottom;
     
-    script_16 = accelerated_surface(client->app, client, 16 * config->dpi, 16 * config->dpi);
-    paint_surface_with_image(script_16, as_resource_path("script-16.svg"), 16 * config->dpi, nullptr);
-    script_32 = accelerated_surface(client->app, client, 32 * config->dpi, 32 * config->dpi);
-    paint_surface_with_image(script_32, as_resource_path("script-32.svg"), 32 * config->dpi, nullptr);
-    script_64 = accelerated_surface(client->app, client, 64 * config->dpi, 64 * config->dpi);
-    paint_surface_with_image(script_64, as_resource_path("script-64.svg"), 64 * config->dpi, nullptr);
-}
-
-void load_historic_scripts() {
-    const char *home = getenv("HOME");
-    std::string scriptsPath(home);
-    scriptsPath += "/.config/winbar/historic/scripts.txt";
-    
-    std::ifstream status_file(scriptsPath);
-    if (status_file.is_open()) {
-        std::string line;
-        while (getline(status_file, line)) {
-            auto *h = new HistoricalNameUsed;
-            h->text = line;
-            global->history_scripts.push_back(h);
-            if (global->history_scripts.size() > 100) {
-                break;
-            }
-        }
-    }
-    status_file.close();
+    // Rows draw without them until they come in
+    icon_raster_request(client->app, "search_menu", as_resource_path("script-16.svg"), IconFormat::Svg,
+                        16 * config->dpi, script_icon_loaded, &script_16);
+    icon_raster_request(client->app, "search_menu", as_resource_path("script-32.svg"), IconFormat::Svg,
+                        32 * config->dpi, script_icon_loaded, &script_32);
+    icon_raster_request(client->app, "search_menu", as_resource_path("script-64.svg"), IconFormat::Svg,
+                        64 * config->dpi, script_icon_loaded, &script_64);
 }
 
-void load_historic_apps() {
+static std::string
+historic_path(const std::string &file_name) {
     const char *home = getenv("HOME");
-    std::string scriptsPath(home);
-    scriptsPath += "/.config/winbar/historic/apps.txt";
-    
-    std::ifstream status_file(scriptsPath);
-    if (status_file.is_open()) {
-        std::string line;
-        while (getline(status_file, line)) {
-            auto *h = new HistoricalNameUsed;
-            h->text = line;
-            global->history_apps.push_back(h);
-            if (global->history_apps.size() > 100) {
-                break;
-            }
-        }
-    }
-    status_file.close();
+    std::string path(home);
+    path += "/.config/winbar/historic/" + file_name;
+    return path;
 }
 
-#include <cerrno>
-#include <sys/stat.h> /* mkdir(2) */
-
-static void
-write_historic_scripts() {
-    const char *home = getenv("HOME");
-    std::string scriptsPath(home);
-    scriptsPath += "/.config/";
-    
-    if (mkdir(scriptsPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
-        if (errno != EEXIST) {
-            printf("Couldn't mkdir %s\n", scriptsPath.c_str());
-            return;
-        }
-    }
-    
-    scriptsPath += "/winbar/";
-    
-    if (mkdir(scriptsPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
-        if (errno != EEXIST) {
-            printf("Couldn't mkdir %s\n", scriptsPath.c_str());
-            return;
-        }
-    }
-    scriptsPath += "/historic/";
-    
-    if (mkdir(scriptsPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
-        if (errno != EEXIST) {
-            printf("Couldn't mkdir %s\n", scriptsPath.c_str());
-            return;
-        }
-    }
-    
-    scriptsPath += "scripts.txt";
-    
-    std::ofstream myfile;
-    myfile.open(scriptsPath);
-    for (HistoricalNameUsed *h: global->history_scripts) {
-        myfile << h->text + "\n";
-    }
-    myfile.close();
+void load_historic_scripts() {
+    search_history_load(&global->history_scripts, historic_path("scripts.log"), historic_path("scripts.txt"));
 }
 
-static void
-write_historic_apps() {
-    const char *home = getenv("HOME");
-    std::string scriptsPath(home);
-    scriptsPath += "/.config/";
-    
-    if (mkdir(scriptsPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
-        if (errno != EEXIST) {
-            printf("Couldn't mkdir %s\n", scriptsPath.c_str());
-            return;
-        }
-    }
-    
-    scriptsPath += "/winbar/";
-    
-    if (mkdir(scriptsPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
-        if (errno != EEXIST) {
-            printf("Couldn't mkdir %s\n", scriptsPath.c_str());
-            return;
-        }
-    }
-    scriptsPath += "/historic/";
-    
-    if (mkdir(scriptsPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
-        if (errno != EEXIST) {
-            printf("Couldn't mkdir %s\n", scriptsPath.c_str());
-            return;
-        }
-    }
-    
-    scriptsPath += "apps.txt";
-    
-    std::ofstream myfile;
-    myfile.open(scriptsPath);
-    for (HistoricalNameUsed *h: global->history_apps) {
-        myfile << h->text + "\n";
-    }
-    myfile.close();
+void load_historic_apps() {
+    search_history_load(&global->history_apps, historic_path("apps.log"), historic_path("apps.txt"));
 }
 
 static void
 search_menu_when_closed(AppClient *client) {
-    cairo_surface_destroy(script_16);
-    cairo_surface_destroy(script_32);
-    cairo_surface_destroy(script_64);
-    write_historic_scripts();
-    write_historic_apps();
+    for (auto **icon: {&script_16, &script_32, &script_64}) {
+        icon_raster_cancel(icon);
+        if (*icon)
+            cairo_surface_destroy(*icon);
+        *icon = nullptr;
+    }
     set_textarea_inactive();
 }
 
@@ -1628,6 +1564,7 @@ void start_search_menu() {
 }
 
 #include <dirent.h>
+#include <sys/stat.h>
 #include <sstream>
 
 void load_scripts() {
@@ -1718,12 +1655,17 @@ void load_scripts() {
         if (temp_scripts.empty())
             return;
 
+        // Built here so the first search doesn't have to, there can be thousands of them
+        SearchIndex index;
+        search_index_build(&index, std::vector<Sortable *>(temp_scripts.begin(), temp_scripts.end()));
+        
         std::lock_guard mtx(app->running_mutex);
         for (auto sc: scripts) {
             delete sc;
         }
         scripts.clear();
         scripts.shrink_to_fit();
+        script_search_index = std::move(index);
 
         for (auto sc: temp_scripts) {
             scripts.push_back(sc);
@@ -1736,28 +1678,9 @@ void load_scripts() {
 
                     auto *bottom = container_by_name("bottom", search_menu_client->root);
                     if (bottom) {
-                        for (auto *c: bottom->children)
-                            delete c;
-                        bottom->children.clear();
-                        bottom->children.shrink_to_fit();
-                        if (!data->state->text.empty()) {
-                            active_item = 0;
-                            scroll_amount = 0;
-
-                            if (active_tab == "Scripts") {
-                                sort_and_add<Script *>(&scripts, bottom, data->state->text, global->history_scripts);
-                            } else if (active_tab == "Apps") {
-                                // We create a copy because app_menu relies on the order
-                                std::vector<Launcher *> launchers_copy;
-                                for (auto *l: launchers) {
-                                    launchers_copy.push_back(l);
-                                }
-                                sort_and_add<Launcher *>(&launchers_copy, bottom, data->state->text,
-                                                         global->history_apps);
-                            }
-                        }
-                        client_layout(app, search_menu_client);
-                        client_paint(app, search_menu_client);
+                        // The scroll position is kept since the rows are only rebound to the re-sorted results
+                        active_item = 0;
+                        update_results(bottom, data->state->text);
                     }
                 }
             }
@@ -1773,4 +1696,6 @@ bool script_exists(const std::string &name) {
     return false;
 }
 
-
+void search_apps_changed() {
+    app_search_index.stale = true;
+}
@@ -5,19 +5,12 @@
 #ifndef APP_SEARCH_MENU_H
 #define APP_SEARCH_MENU_H
 
+#include "sortable.h"
+
 #include <application.h>
 #include <string>
 #include <xcb/xcb.h>
 
-class Sortable {
-public:
-    std::string name;
-    std::string lowercase_name;
-    int priority = -1;
-    int historical_ranking = -1;
-    std::string full_path;
-};
-
 extern std::string active_tab;
 
 void start_search_menu();
@@ -32,4 +25,10 @@ void load_historic_scripts();
 
 bool script_exists(const std::string &name);
 
+// Stops the thread searches are ranked on
+void search_stop();
+
+// Has to be called whenever launchers changes, the Apps search index is rebuilt on the next search
+void search_apps_changed();
+
 #endif// APP_SEARCH_MENU_H
@@ -424,6 +424,7 @@ fill_root(AppClient *client, Container *root) {
         auto data = new Label("Taskbar");
         data->size = 20 * config->dpi;
         title->when_paint = paint_label;
+        title->paint_cached = true;
         title->user_data = data;
     }
     
@@ -0,0 +1,16 @@
+#ifndef SORTABLE_H
+#define SORTABLE_H
+
+#include <string>
+
+// Something the search menu can rank by name (launchers and scripts)
+class Sortable {
+public:
+    std::string name;
+    std::string lowercase_name;
+    int priority = -1;
+    int historical_ranking = -1;
+    std::string full_path;
+};
+
+#endif // SORTABLE_H
@@ -41,11 +41,19 @@
 #include <fstream>
 #include <iomanip>
 #include <cassert>
+#include <chrono>
 #include <pango/pangocairo.h>
 #include <xcb/xproto.h>
 #include <dpi.h>
 #include <sys/inotify.h>
 #include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef WINBAR_COMPOSITE_THUMBNAILS
+#include <xcb/composite.h>
+#include <xcb/damage.h>
+#endif
 
 #define WIN7 false
 
@@ -135,26 +143,26 @@ paint_hoverable_button_background(AppClient *client, cairo_t *cr, Container *con
         if (container->state.mouse_pressing) {
             if (data->previous_state != 2) {
                 data->previous_state = 2;
-                client_create_animation(app, client, &data->color.r, 0, time, e, pressed_color.r);
-                client_create_animation(app, client, &data->color.g, 0, time, e, pressed_color.g);
-                client_create_animation(app, client, &data->color.b, 0, time, e, pressed_color.b);
-                client_create_animation(app, client, &data->color.a, 0, time, e, pressed_color.a);
+                client_create_animation_damaging(app, client, container, &data->color.r, 0, time, e, pressed_color.r);
+                client_create_animation_damaging(app, client, container, &data->color.g, 0, time, e, pressed_color.g);
+                client_create_animation_damaging(app, client, container, &data->color.b, 0, time, e, pressed_color.b);
+                client_create_animation_damaging(app, client, container, &data->color.a, 0, time, e, pressed_color.a);
             }
         } else if (data->previous_state != 1) {
             data->previous_state = 1;
-            client_create_animation(app, client, &data->color.r, 0, time, e, hovered_color.r);
-            client_create_animation(app, client, &data->color.g, 0, time, e, hovered_color.g);
-            client_create_animation(app, client, &data->color.b, 0, time, e, hovered_color.b);
-            client_create_animation(app, client, &data->color.a, 0, time, e, hovered_color.a);
+            client_create_animation_damaging(app, client, container, &data->color.r, 0, time, e, hovered_color.r);
+            client_create_animation_damaging(app, client, container, &data->color.g, 0, time, e, hovered_color.g);
+            client_create_animation_damaging(app, client, container, &data->color.b, 0, time, e, hovered_color.b);
+            client_create_animation_damaging(app, client, container, &data->color.a, 0, time, e, hovered_color.a);
         }
     } else if (data->previous_state != 0) {
         time = 100;
         data->previous_state = 0;
         e = getEasingFunction(easing_functions::EaseInCirc);
-        client_create_animation(app, client, &data->color.r, 0, time, e, default_color.r);
-        client_create_animation(app, client, &data->color.g, 0, time, e, default_color.g);
-        client_create_animation(app, client, &data->color.b, 0, time, e, default_color.b);
-        client_create_animation(app, client, &data->color.a, 0, time, e, default_color.a);
+        client_create_animation_damaging(app, client, container, &data->color.r, 0, time, e, default_color.r);
+        client_create_animation_damaging(app, client, container, &data->color.g, 0, time, e, default_color.g);
+        client_create_animation_damaging(app, client, container, &data->color.b, 0, time, e, default_color.b);
+        client_create_animation_damaging(app, client, container, &data->color.a, 0, time, e, default_color.a);
     }
     
     set_argb(cr, data->color);
@@ -959,13 +967,7 @@ paint_icon_background(AppClient *client, cairo_t *cr, Container *container) {
 // TODO order is not correct
 static void
 paint_all_icons(AppClient *client_entity, cairo_t *cr, Container *container) {
-    std::vector<int> render_order;
-    for (int i = 0; i < container->children.size(); i++) {
-        render_order.push_back(i);
-    }
-    std::sort(render_order.begin(), render_order.end(), [container](int a, int b) -> bool {
-        return container->children[a]->z_index < container->children[b]->z_index;
-    });
+    const std::vector<int> &render_order = container_render_order(container);
     
     for (auto index: render_order) {
         paint_icon_background(client_entity, cr, container->children[index]);
@@ -982,7 +984,7 @@ pinned_icon_mouse_enters(AppClient *client, cairo_t *cr, Container *container) {
 #endif
     LaunchableButton *data = (LaunchableButton *) container->user_data;
     possibly_open(app, container, data);
-    client_create_animation(app, client, &data->hover_amount, 0, 70, 0, 1);
+    client_create_animation_damaging(app, client, container, &data->hover_amount, 0, 70, 0, 1);
 }
 
 static void
@@ -992,7 +994,7 @@ pinned_icon_mouse_leaves(AppClient *client, cairo_t *cr, Container *container) {
 #endif
     LaunchableButton *data = (LaunchableButton *) container->user_data;
     possibly_close(app, container, data);
-    client_create_animation(app, client, &data->hover_amount, 0, 70, 0, 0);
+    client_create_animation_damaging(app, client, container, &data->hover_amount, 0, 70, 0, 0);
 }
 
 std::string
@@ -2810,43 +2812,111 @@ taskbar_on_screen_size_change(App *app, AppClient *client) {
     }*/
 }
 
+// Every window on the taskbar by id, filled in by add_window and emptied by ~WindowsData
+static std::unordered_map<xcb_window_t, RegisteredWindow> window_registry;
+
+// Windows add_window will never show (wrong type, or ours), so stacking changes don't fetch their properties again.
+// An id leaves once the window is gone from _NET_CLIENT_LIST_STACKING, which is when the window manager lets go of it.
+static std::unordered_set<xcb_window_t> ignored_windows;
+
+// Set when the config asks for it and the X server has Composite and Damage. Windows are then redirected so their
+// contents can be read even when covered, and thumbnails are only redrawn where the window was damaged.
+static bool composite_thumbnails = false;
+#ifdef WINBAR_COMPOSITE_THUMBNAILS
+static uint8_t damage_first_event = 0;
+#endif
+
+static void
+composite_thumbnails_init(App *app) {
+#ifdef WINBAR_COMPOSITE_THUMBNAILS
+    if (!config->composite_thumbnails)
+        return;
+    auto composite = xcb_get_extension_data(app->connection, &xcb_composite_id);
+    auto damage = xcb_get_extension_data(app->connection, &xcb_damage_id);
+    if (!composite || !composite->present || !damage || !damage->present)
+        return;
+    
+    // Both extensions have to be told which version we speak before they can be used
+    auto composite_cookie = xcb_composite_query_version(app->connection, 0, 2);
+    auto damage_cookie = xcb_damage_query_version(app->connection, 1, 1);
+    auto composite_reply = xcb_composite_query_version_reply(app->connection, composite_cookie, nullptr);
+    auto damage_reply = xcb_damage_query_version_reply(app->connection, damage_cookie, nullptr);
+    if (composite_reply && damage_reply) {
+        composite_thumbnails = composite_reply->major_version > 0 || composite_reply->minor_version >= 2;
+        damage_first_event = damage->first_event;
+    }
+    free(composite_reply);
+    free(damage_reply);
+#endif
+}
+
+static void
+thumbnail_watch(App *app, WindowsData *data) {
+#ifdef WINBAR_COMPOSITE_THUMBNAILS
+    xcb_composite_redirect_window(app->connection, data->id, XCB_COMPOSITE_REDIRECT_AUTOMATIC);
+    data->damage = xcb_generate_id(app->connection);
+    xcb_damage_create(app->connection, data->damage, data->id, XCB_DAMAGE_REPORT_LEVEL_BOUNDING_BOX);
+#endif
+}
+
+static void
+thumbnail_unwatch(App *app, WindowsData *data) {
+#ifdef WINBAR_COMPOSITE_THUMBNAILS
+    // The window may already be destroyed (which frees the damage too), the errors that causes are ignored
+    xcb_damage_destroy(app->connection, data->damage);
+    xcb_composite_unredirect_window(app->connection, data->id, XCB_COMPOSITE_REDIRECT_AUTOMATIC);
+    data->damage = 0;
+#endif
+}
+
+static void
+thumbnail_clear_damage(App *app, WindowsData *data) {
+#ifdef WINBAR_COMPOSITE_THUMBNAILS
+    xcb_damage_subtract(app->connection, data->damage, XCB_NONE, XCB_NONE);
+#endif
+}
+
+// Returns true if the event was a DamageNotify for one of our thumbnails
+static bool
+thumbnail_handle_damage(App *app, xcb_generic_event_t *event) {
+#ifdef WINBAR_COMPOSITE_THUMBNAILS
+    if (!composite_thumbnails || XCB_EVENT_RESPONSE_TYPE(event) != damage_first_event + XCB_DAMAGE_NOTIFY)
+        return false;
+    auto e = (xcb_damage_notify_event_t *) event;
+    auto registered = window_registry.find(e->drawable);
+    if (registered != window_registry.end()) {
+        registered->second.data->damaged(e->area.x, e->area.y, e->area.width, e->area.height);
+        if (auto selector = client_by_name(app, "windows_selector"))
+            request_refresh(app, selector);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void
 update_window_title_name(xcb_window_t window) {
-    if (auto client = client_by_name(app, "taskbar")) {
-        if (client->root) {
-            if (auto icons = container_by_name("icons", client->root)) {
-                for (auto icon: icons->children) {
-                    auto *data = static_cast<LaunchableButton *>(icon->user_data);
-                    for (auto windows_data: data->windows_data_list) {
-                        if (windows_data->id == window) {
-                            const xcb_get_property_cookie_t &propertyCookie = xcb_ewmh_get_wm_name(
-                                    &app->ewmh, window);
-                            xcb_ewmh_get_utf8_strings_reply_t data;
-                            uint8_t success = xcb_ewmh_get_wm_name_reply(&app->ewmh, propertyCookie, &data,
-                                                                         nullptr);
-                            if (success) {
-                                windows_data->title = strndup(data.strings, data.strings_len);
-                                xcb_ewmh_get_utf8_strings_reply_wipe(&data);
-                                return;
-                            }
-                            
-                            const xcb_get_property_cookie_t &cookie = xcb_icccm_get_wm_name(app->connection,
-                                                                                            window);
-                            xcb_icccm_get_text_property_reply_t reply;
-                            success = xcb_icccm_get_wm_name_reply(app->connection, cookie, &reply,
-                                                                  nullptr);
-                            if (success) {
-                                windows_data->title = std::string(reply.name, reply.name_len);
-                                xcb_icccm_get_text_property_reply_wipe(&reply);
-                                return;
-                            }
-                            
-                            return;
-                        }
-                    }
-                }
-            }
-        }
+    auto registered = window_registry.find(window);
+    if (registered == window_registry.end())
+        return;
+    auto windows_data = registered->second.data;
+    
+    const xcb_get_property_cookie_t &propertyCookie = xcb_ewmh_get_wm_name(&app->ewmh, window);
+    xcb_ewmh_get_utf8_strings_reply_t data;
+    uint8_t success = xcb_ewmh_get_wm_name_reply(&app->ewmh, propertyCookie, &data, nullptr);
+    if (success) {
+        windows_data->title = std::string(data.strings, data.strings_len);
+        xcb_ewmh_get_utf8_strings_reply_wipe(&data);
+        return;
+    }
+    
+    const xcb_get_property_cookie_t &cookie = xcb_icccm_get_wm_name(app->connection, window);
+    xcb_icccm_get_text_property_reply_t reply;
+    success = xcb_icccm_get_wm_name_reply(app->connection, cookie, &reply, nullptr);
+    if (success) {
+        windows_data->title = std::string(reply.name, reply.name_len);
+        xcb_icccm_get_text_property_reply_wipe(&reply);
     }
 }
 
@@ -2854,11 +2924,16 @@ void remove_window(App *app, xcb_window_t window);
 
 void add_window(App *app, xcb_window_t window);
 
+// Adds every window at once, with one round trip to the X server for the whole batch
+void add_windows(App *app, const std::vector<xcb_window_t> &windows);
+
 static bool
 window_event_handler(App *app, xcb_generic_event_t *event, xcb_window_t window) {
     for (auto c: app->clients)
         if (c->window == window)
             return false;
+    if (thumbnail_handle_damage(app, event))
+        return true;
     // This will listen to configure notify events and check if it's about a
     // window we need a thumbnail of and update its size if so.
     switch (XCB_EVENT_RESPONSE_TYPE(event)) {
@@ -2879,6 +2954,11 @@ window_event_handler(App *app, xcb_generic_event_t *event, xcb_window_t window)
                                         cairo_xcb_surface_set_size(windows_data->window_surface,
                                                                    windows_data->width, windows_data->height);
                                         
+                                        if (windows_data->damage) {
+                                            windows_data->damaged(0, 0, windows_data->width, windows_data->height);
+                                            return false;
+                                        }
+                                        
                                         cairo_surface_destroy(windows_data->raw_thumbnail_surface);
                                         cairo_destroy(windows_data->raw_thumbnail_cr);
                                         cairo_surface_destroy(windows_data->scaled_thumbnail_surface);
@@ -3295,6 +3375,7 @@ create_taskbar(App *app) {
     paint_surface_with_image(
             global->unknown_icon_64, as_resource_path("unknown-64.svg"), 64 * config->dpi, nullptr);
     
+    composite_thumbnails_init(app);
     app_create_custom_event_handler(app, INT_MAX, window_event_handler);
     app_timeout_create(app, taskbar, 500, screenshot_active_window, nullptr, const_cast<char *>(__PRETTY_FUNCTION__));
     
@@ -3327,6 +3408,34 @@ create_taskbar(App *app) {
     return taskbar;
 }
 
+// Takes ownership of the WM_CLASS reply
+static std::string
+class_name_from_reply(xcb_get_property_reply_t *r) {
+    if (!r)
+        return "";
+    xcb_icccm_get_wm_class_reply_t wm_class;
+    if (xcb_icccm_get_wm_class_from_reply(&wm_class, r)) {
+        std::string name;
+        
+        if (wm_class.class_name) {
+            name = std::string(wm_class.class_name);
+            if (name.empty()) {
+                name = std::string(wm_class.instance_name);
+            }
+        } else if (wm_class.instance_name) {
+            name = std::string(wm_class.instance_name);
+        } else {
+        }
+        xcb_icccm_get_wm_class_reply_wipe(&wm_class);
+        
+        std::for_each(name.begin(), name.end(), [](char &c) { c = std::tolower(c); });
+        
+        return name;
+    }
+    std::free(r);
+    return "";
+}
+
 std::string
 class_name(App *app, xcb_window_t window) {
 #ifdef TRACY_ENABLE
@@ -3338,93 +3447,222 @@ class_name(App *app, xcb_window_t window) {
     
     if (error) {
         std::free(error);
-    } else if (r) {
-        xcb_icccm_get_wm_class_reply_t wm_class;
-        if (xcb_icccm_get_wm_class_from_reply(&wm_class, r)) {
-            std::string name;
-            
-            if (wm_class.class_name) {
-                name = std::string(wm_class.class_name);
-                if (name.empty()) {
-                    name = std::string(wm_class.instance_name);
-                }
-            } else if (wm_class.instance_name) {
-                name = std::string(wm_class.instance_name);
-            } else {
-            }
-            xcb_icccm_get_wm_class_reply_wipe(&wm_class);
-            
-            std::for_each(name.begin(), name.end(), [](char &c) { c = std::tolower(c); });
-            
-            return name;
-        } else {
-            std::free(r);
-        }
-    }
-    return "";
-}
-
-std::string get_reply_string(xcb_ewmh_get_utf8_strings_reply_t *reply) {
-    std::string str;
-    if (reply) {
-        str = std::string(reply->strings, reply->strings_len);
-        xcb_ewmh_get_utf8_strings_reply_wipe(reply);
+        return "";
     }
-    return str;
-}
-
-std::string get_icon_name(xcb_window_t win) {
-    xcb_ewmh_get_utf8_strings_reply_t utf8_reply{};
-    if (xcb_ewmh_get_wm_icon_name_reply(&app->ewmh, xcb_ewmh_get_wm_icon_name(&app->ewmh, win), &utf8_reply, nullptr)) {
-        return get_reply_string(&utf8_reply);
-    }
-    return "";
+    return class_name_from_reply(r);
 }
 
 static inline void rtrim(std::string &s) {
     s.erase(std::find_if(s.rbegin(), s.rend(), [](int ch) { return !std::isspace(ch); }).base(), s.end());
 }
 
-std::string find_icon_string_from_window_properties(xcb_window_t window);
+// Everything add_window and WindowsData need to know about a window
+struct WindowProperties {
+    xcb_window_t window = 0;
+    
+    // _NET_WM_WINDOW_TYPE says it's not something a dock should display
+    bool unwanted_type = false;
+    
+    // _NET_WM_STATE asks to be left off the taskbar
+    bool skip_taskbar = false;
+    
+    uint32_t desktop = 0;
+    uint32_t pid = -1;
+    std::string class_name;
+    
+    // _NET_WM_NAME, falling back to WM_NAME
+    std::string title;
+    std::string net_wm_name;
+    
+    // WM_ICON_NAME, falling back to _NET_WM_ICON_NAME
+    std::string icon_name;
+    
+    std::string gtk_application_id;
+    
+    uint32_t gtk_frame_extents[4] = {0, 0, 0, 0};
+    
+    bool has_attributes = false;
+    bool viewable = false;
+    xcb_visualid_t visual = 0;
+    
+    bool has_geometry = false;
+    int width = 0;
+    int height = 0;
+};
+
+struct WindowPropertyCookies {
+    xcb_get_property_cookie_t type;
+    xcb_get_property_cookie_t state;
+    xcb_get_property_cookie_t desktop;
+    xcb_get_property_cookie_t pid;
+    xcb_get_property_cookie_t wm_class;
+    xcb_get_property_cookie_t net_wm_name;
+    xcb_get_property_cookie_t wm_name;
+    xcb_get_property_cookie_t icon_name;
+    xcb_get_property_cookie_t net_wm_icon_name;
+    xcb_get_property_cookie_t gtk_application_id;
+    xcb_get_property_cookie_t gtk_frame_extents;
+    xcb_get_window_attributes_cookie_t attributes;
+    xcb_get_geometry_cookie_t geometry;
+};
 
-void add_window(App *app, xcb_window_t window) {
+static WindowIntrospectionStats introspection_stats;
+
+WindowIntrospectionStats window_introspection_stats() {
+    return introspection_stats;
+}
+
+// Sends the requests for every window in the batch before waiting on any reply. The server answers them in order, so
+// the whole batch costs one round trip instead of a dozen per window.
+static std::vector<WindowProperties>
+window_properties_fetch(App *app, const std::vector<xcb_window_t> &windows) {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    // Exit the function if the window type is not something a dock should display
-    xcb_get_property_cookie_t cookie = xcb_ewmh_get_wm_window_type_unchecked(&app->ewmh, window);
-    xcb_ewmh_get_atoms_reply_t atoms_reply_data;
-    if (xcb_ewmh_get_wm_window_type_reply(&app->ewmh, cookie, &atoms_reply_data, nullptr)) {
-        for (unsigned short i = 0; i < atoms_reply_data.atoms_len; i++) {
-            if (atoms_reply_data.atoms[i] == get_cached_atom(app, "_NET_WM_WINDOW_TYPE_DESKTOP")) {
-                xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
-                return;
-            } else if (atoms_reply_data.atoms[i] == get_cached_atom(app, "_NET_WM_WINDOW_TYPE_DROPDOWN_MENU")) {
-                xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
-                return;
-            } else if (atoms_reply_data.atoms[i] == get_cached_atom(app, "_NET_WM_WINDOW_TYPE_POPUP_MENU")) {
-                xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
-                return;
-            } else if (atoms_reply_data.atoms[i] == get_cached_atom(app, "_NET_WM_WINDOW_TYPE_TOOLTIP")) {
-                xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
-                return;
-            } else if (atoms_reply_data.atoms[i] == get_cached_atom(app, "_NET_WM_WINDOW_TYPE_COMBO")) {
-                xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
-                return;
-            } else if (atoms_reply_data.atoms[i] == get_cached_atom(app, "_NET_WM_WINDOW_TYPE_DND")) {
-                xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
-                return;
-            } else if (atoms_reply_data.atoms[i] == get_cached_atom(app, "_NET_WM_WINDOW_TYPE_DOCK")) {
-                xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
-                return;
-            } else if (atoms_reply_data.atoms[i] == get_cached_atom(app, "_NET_WM_WINDOW_TYPE_NOTIFICATION")) {
-                xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
-                return;
+    std::vector<WindowPropertyCookies> cookies(windows.size());
+    for (int i = 0; i < windows.size(); i++) {
+        xcb_window_t window = windows[i];
+        auto &c = cookies[i];
+        c.type = xcb_ewmh_get_wm_window_type_unchecked(&app->ewmh, window);
+        c.state = xcb_get_property(app->connection, 0, window, get_cached_atom(app, "_NET_WM_STATE"), XCB_ATOM_ATOM,
+                                   0, BUFSIZ);
+        c.desktop = xcb_ewmh_get_wm_desktop(&app->ewmh, window);
+        c.pid = xcb_ewmh_get_wm_pid(&app->ewmh, window);
+        c.wm_class = xcb_icccm_get_wm_class_unchecked(app->connection, window);
+        c.net_wm_name = xcb_ewmh_get_wm_name(&app->ewmh, window);
+        c.wm_name = xcb_icccm_get_wm_name(app->connection, window);
+        c.icon_name = xcb_icccm_get_wm_icon_name(app->connection, window);
+        c.net_wm_icon_name = xcb_ewmh_get_wm_icon_name(&app->ewmh, window);
+        c.gtk_application_id = xcb_icccm_get_text_property_unchecked(app->connection, window,
+                                                                     get_cached_atom(app, "_GTK_APPLICATION_ID"));
+        c.gtk_frame_extents = xcb_get_property(app->connection, 0, window, get_cached_atom(app, "_GTK_FRAME_EXTENTS"),
+                                               XCB_ATOM_CARDINAL, 0, 4);
+        c.attributes = xcb_get_window_attributes(app->connection, window);
+        c.geometry = xcb_get_geometry(app->connection, window);
+    }
+    xcb_flush(app->connection);
+    
+    static const char *unwanted_types[] = {
+            "_NET_WM_WINDOW_TYPE_DESKTOP",
+            "_NET_WM_WINDOW_TYPE_DROPDOWN_MENU",
+            "_NET_WM_WINDOW_TYPE_POPUP_MENU",
+            "_NET_WM_WINDOW_TYPE_TOOLTIP",
+            "_NET_WM_WINDOW_TYPE_COMBO",
+            "_NET_WM_WINDOW_TYPE_DND",
+            "_NET_WM_WINDOW_TYPE_DOCK",
+            "_NET_WM_WINDOW_TYPE_NOTIFICATION",
+    };
+    
+    // Every reply has to be collected (even for windows that turn out to be unwanted) or xcb keeps them around
+    std::vector<WindowProperties> batch(windows.size());
+    for (int i = 0; i < windows.size(); i++) {
+        auto &c = cookies[i];
+        auto &p = batch[i];
+        p.window = windows[i];
+        
+        xcb_ewmh_get_atoms_reply_t atoms_reply_data;
+        if (xcb_ewmh_get_wm_window_type_reply(&app->ewmh, c.type, &atoms_reply_data, nullptr)) {
+            for (unsigned short a = 0; a < atoms_reply_data.atoms_len; a++)
+                for (auto type: unwanted_types)
+                    if (atoms_reply_data.atoms[a] == get_cached_atom(app, type))
+                        p.unwanted_type = true;
+            xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
+        }
+        
+        if (auto reply = xcb_get_property_reply(app->connection, c.state, nullptr)) {
+            if (reply->type == XCB_ATOM_ATOM) {
+                auto state_atoms = (xcb_atom_t *) xcb_get_property_value(reply);
+                int count = xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+                for (int a = 0; a < count; a++) {
+                    // TODO: on first launch xterm has this true????
+                    if (state_atoms[a] == get_cached_atom(app, "_NET_WM_STATE_SKIP_TASKBAR") ||
+                        state_atoms[a] == get_cached_atom(app, "_NET_WM_STATE_SKIP_PAGER")) {
+                        p.skip_taskbar = true;
+                    }
+                }
             }
+            free(reply);
+        }
+        
+        xcb_ewmh_get_wm_desktop_reply(&app->ewmh, c.desktop, &p.desktop, nullptr);
+        xcb_ewmh_get_wm_pid_reply(&app->ewmh, c.pid, &p.pid, nullptr);
+        p.class_name = class_name_from_reply(xcb_get_property_reply(app->connection, c.wm_class, nullptr));
+        
+        xcb_ewmh_get_utf8_strings_reply_t utf8_reply;
+        xcb_icccm_get_text_property_reply_t text_reply;
+        if (xcb_ewmh_get_wm_name_reply(&app->ewmh, c.net_wm_name, &utf8_reply, nullptr)) {
+            p.net_wm_name = std::string(utf8_reply.strings, utf8_reply.strings_len);
+            p.title = p.net_wm_name;
+            xcb_ewmh_get_utf8_strings_reply_wipe(&utf8_reply);
+        }
+        if (xcb_icccm_get_wm_name_reply(app->connection, c.wm_name, &text_reply, nullptr)) {
+            if (p.title.empty())
+                p.title = std::string(text_reply.name, text_reply.name_len);
+            xcb_icccm_get_text_property_reply_wipe(&text_reply);
+        }
+        
+        if (xcb_icccm_get_wm_icon_name_reply(app->connection, c.icon_name, &text_reply, nullptr)) {
+            p.icon_name = std::string(text_reply.name, text_reply.name_len);
+            xcb_icccm_get_text_property_reply_wipe(&text_reply);
+            xcb_discard_reply(app->connection, c.net_wm_icon_name.sequence);
+        } else if (xcb_ewmh_get_wm_icon_name_reply(&app->ewmh, c.net_wm_icon_name, &utf8_reply, nullptr)) {
+            p.icon_name = std::string(utf8_reply.strings, utf8_reply.strings_len);
+            xcb_ewmh_get_utf8_strings_reply_wipe(&utf8_reply);
+        }
+        
+        if (xcb_icccm_get_text_property_reply(app->connection, c.gtk_application_id, &text_reply, nullptr)) {
+            p.gtk_application_id = std::string(text_reply.name, text_reply.name_len);
+            xcb_icccm_get_text_property_reply_wipe(&text_reply);
+        }
+        
+        if (auto reply = xcb_get_property_reply(app->connection, c.gtk_frame_extents, nullptr)) {
+            if (xcb_get_property_value_length(reply) >= (int) sizeof(p.gtk_frame_extents))
+                memcpy(p.gtk_frame_extents, xcb_get_property_value(reply), sizeof(p.gtk_frame_extents));
+            free(reply);
+        }
+        
+        if (auto attributes = xcb_get_window_attributes_reply(app->connection, c.attributes, nullptr)) {
+            p.has_attributes = true;
+            p.viewable = attributes->map_state == XCB_MAP_STATE_VIEWABLE;
+            p.visual = attributes->visual;
+            free(attributes);
+        }
+        
+        if (auto geometry = xcb_get_geometry_reply(app->connection, c.geometry, nullptr)) {
+            p.has_geometry = true;
+            p.width = geometry->width;
+            p.height = geometry->height;
+            free(geometry);
         }
-        xcb_ewmh_get_atoms_reply_wipe(&atoms_reply_data);
     }
     
+    introspection_stats.batches++;
+    introspection_stats.windows += windows.size();
+    introspection_stats.round_trips++;
+    return batch;
+}
+
+std::string find_icon_string_from_window_properties(const WindowProperties &properties);
+
+enum AddedWindow {
+    WINDOW_IGNORED,
+    // Left off because of _NET_WM_STATE_SKIP_TASKBAR, which the window can still take back later
+    WINDOW_SKIPPED,
+    WINDOW_ADDED_TO_ICON,
+    WINDOW_ADDED_NEW_ICON,
+};
+
+static AddedWindow
+add_window(App *app, AppClient *client, Container *icons, const WindowProperties &properties) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    xcb_window_t window = properties.window;
+    
+    // Exit the function if the window type is not something a dock should display
+    if (properties.unwanted_type)
+        return WINDOW_IGNORED;
+    
     bool is_ours = false;
     bool skip_taskbar = true;
     for (auto c: app->clients) {
@@ -3437,26 +3675,9 @@ void add_window(App *app, xcb_window_t window) {
     // but the fix for now is just going to be to ignore every client that is ours. Eventually when we make a settings
     // app, we will have to add an exception for that window.
     if (is_ours && skip_taskbar)
-        return;
+        return WINDOW_IGNORED;
     
-    auto cookie_get_wm_desktop = xcb_ewmh_get_wm_desktop(&app->ewmh, window);
-    uint32_t desktop = 0;
-    xcb_ewmh_get_wm_desktop_from_reply(&desktop, NULL);
-    
-    std::vector<xcb_window_t> old_windows;
-    AppClient *client = client_by_name(app, "taskbar");
-    if (!client)
-        return;
-    auto *root = client->root;
-    if (!root)
-        return;
-    auto *icons = container_by_name("icons", root);
-    if (!icons)
-        return;
-    
-    xcb_get_property_cookie_t prop_cookie = xcb_ewmh_get_wm_pid(&app->ewmh, window);
-    uint32_t pid = -1;
-    xcb_ewmh_get_wm_pid_reply(&app->ewmh, prop_cookie, &pid, NULL);
+    uint32_t pid = properties.pid;
     std::string command_launched_by_line;
     if (pid != -1) {
         std::ifstream cmdline("/proc/" + std::to_string(pid) + "/cmdline");
@@ -3478,7 +3699,7 @@ void add_window(App *app, xcb_window_t window) {
     }
     rtrim(command_launched_by_line);
     
-    std::string window_class_name = class_name(app, window);
+    std::string window_class_name = properties.class_name;
     if (window_class_name.empty()) {
         window_class_name = command_launched_by_line;
         if (window_class_name.empty())
@@ -3493,48 +3714,21 @@ void add_window(App *app, xcb_window_t window) {
             if (!is_ours) {
                 const uint32_t values[] = {XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE};
                 xcb_change_window_attributes(app->connection, window, XCB_CW_EVENT_MASK, values);
-                xcb_flush(app->connection);
             }
             
-            data->windows_data_list.push_back(new WindowsData(app, window));
-            update_window_title_name(window);
-            update_minimize_icon_positions();
-            request_refresh(app, client);
-            return;
+            auto windows_data = new WindowsData(app, properties);
+            data->windows_data_list.push_back(windows_data);
+            window_registry[window] = {data, windows_data};
+            return WINDOW_ADDED_TO_ICON;
         }
     }
     
-    xcb_generic_error_t *err = nullptr;
-    cookie = xcb_get_property(app->connection, 0, window, get_cached_atom(app, "_NET_WM_STATE"), XCB_ATOM_ATOM, 0,
-                              BUFSIZ);
-    xcb_get_property_reply_t *reply = xcb_get_property_reply(app->connection, cookie, &err);
-    if (reply) {
-        if (reply->type == XCB_ATOM_ATOM) {
-            xcb_atom_t *state_atoms = (xcb_atom_t *) xcb_get_property_value(reply);
-            for (unsigned int a = 0; a < sizeof(xcb_atom_t); a++) {
-                // TODO: on first launch xterm has this true????
-                if (state_atoms[a] == get_cached_atom(app, "_NET_WM_STATE_SKIP_TASKBAR")) {
-                    free(reply);
-                    return;
-                } else if (state_atoms[a] == get_cached_atom(app, "_NET_WM_STATE_SKIP_PAGER")) {
-                    free(reply);
-                    return;
-                } else if (state_atoms[a] ==
-                           get_cached_atom(app, "_NET_WM_STATE_DEMANDS_ATTENTION")) {
-                }
-            }
-        }
-        free(reply);
-    }
-    if (err) {
-        free(err);
-        err = nullptr;
-    }
+    if (properties.skip_taskbar)
+        return WINDOW_SKIPPED;
     
     if (!is_ours) {
         const uint32_t values[] = {XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE};
         xcb_change_window_attributes(app->connection, window, XCB_CW_EVENT_MASK, values);
-        xcb_flush(app->connection);
     }
     
     Container *a = icons->child(50 * config->dpi, FILL_SPACE);
@@ -3549,11 +3743,12 @@ void add_window(App *app, xcb_window_t window) {
     a->when_drag_start = pinned_icon_drag_start;
     a->when_drag = pinned_icon_drag;
     LaunchableButton *data = new LaunchableButton();
-    data->windows_data_list.push_back(new WindowsData(app, window));
+    auto windows_data = new WindowsData(app, properties);
+    data->windows_data_list.push_back(windows_data);
+    window_registry[window] = {data, windows_data};
     data->class_name = window_class_name;
     data->icon_name = window_class_name;
     a->user_data = data;
-    update_window_title_name(window);
     
     if (pid != -1) {
         data->has_launchable_info = true;
@@ -3561,10 +3756,9 @@ void add_window(App *app, xcb_window_t window) {
     }
     
     std::string path;
-    std::string icon_name;
     
     if (path.empty()) {
-        std::string icon = find_icon_string_from_window_properties(window);
+        std::string icon = find_icon_string_from_window_properties(properties);
         if (!icon.empty()) {
             std::vector<IconTarget> targets;
             targets.emplace_back(IconTarget(icon));
@@ -3576,38 +3770,23 @@ void add_window(App *app, xcb_window_t window) {
     }
     
     if (path.empty()) {
-        auto get_wm_icon_name_cookie = xcb_icccm_get_wm_icon_name(app->connection, window);
-        xcb_icccm_get_text_property_reply_t prop;
-        uint8_t success = xcb_icccm_get_wm_icon_name_reply(app->connection, get_wm_icon_name_cookie, &prop, nullptr);
-        if (success) {
-            icon_name = prop.name;
-            xcb_icccm_get_text_property_reply_wipe(&prop);
-        } else {
-            icon_name = get_icon_name(window);
-        }
-        if (!icon_name.empty()) {
+        if (!properties.icon_name.empty()) {
             std::vector<IconTarget> targets;
-            targets.emplace_back(IconTarget(icon_name));
+            targets.emplace_back(IconTarget(properties.icon_name));
             search_icons(targets);
             pick_best(targets, 24 * config->dpi);
             path = targets[0].best_full_path;
-            data->icon_name = icon_name;
+            data->icon_name = properties.icon_name;
         }
     }
     if (path.empty()) {
-        xcb_generic_error_t *error = NULL;
-        xcb_get_property_cookie_t c = xcb_icccm_get_text_property_unchecked(app->connection, window,
-                                                                            get_cached_atom(app,
-                                                                                            "_GTK_APPLICATION_ID"));
-        xcb_icccm_get_text_property_reply_t props;
-        if (xcb_icccm_get_text_property_reply(app->connection, c, &props, nullptr)) {
-            data->icon_name = std::string(props.name, props.name_len);
+        if (!properties.gtk_application_id.empty()) {
+            data->icon_name = properties.gtk_application_id;
             std::vector<IconTarget> targets;
             targets.emplace_back(IconTarget(data->icon_name));
             search_icons(targets);
             pick_best(targets, 24 * config->dpi);
             path = targets[0].best_full_path;
-            xcb_icccm_get_text_property_reply_wipe(&props);
         }
     }
     if (path.empty()) {
@@ -3620,8 +3799,10 @@ void add_window(App *app, xcb_window_t window) {
     }
     
     if (!path.empty()) {
-        load_icon_full_path(app, client, &data->surface, path, 24 * config->dpi);
+        request_icon_full_path(app, client, &data->surface, path, 24 * config->dpi);
     } else {
+        // _NET_WM_ICON can be megabytes so it's only asked for when nothing else worked
+        introspection_stats.round_trips++;
         xcb_generic_error_t *error;
         xcb_get_property_cookie_t c = xcb_ewmh_get_wm_icon(&app->ewmh, window);
         
@@ -3678,11 +3859,56 @@ void add_window(App *app, xcb_window_t window) {
         }
     }
     
-    update_minimize_icon_positions();
-    update_pinned_items_file(false);
+    return WINDOW_ADDED_NEW_ICON;
+}
+
+void add_windows(App *app, const std::vector<xcb_window_t> &windows) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    if (windows.empty())
+        return;
+    AppClient *client = client_by_name(app, "taskbar");
+    if (!client)
+        return;
+    auto *root = client->root;
+    if (!root)
+        return;
+    auto *icons = container_by_name("icons", root);
+    if (!icons)
+        return;
     
-    client_layout(app, client);
-    request_refresh(app, client);
+    auto start = std::chrono::steady_clock::now();
+    auto batch = window_properties_fetch(app, windows);
+    bool added = false;
+    bool added_icon = false;
+    for (auto &properties: batch) {
+        auto result = add_window(app, client, icons, properties);
+        if (result == WINDOW_IGNORED)
+            ignored_windows.insert(properties.window);
+        else
+            ignored_windows.erase(properties.window);
+        added |= result != WINDOW_IGNORED && result != WINDOW_SKIPPED;
+        added_icon |= result == WINDOW_ADDED_NEW_ICON;
+    }
+    xcb_flush(app->connection);
+    
+    // The taskbar is only updated once the whole batch is in
+    if (added) {
+        update_minimize_icon_positions();
+        if (added_icon) {
+            update_pinned_items_file(false);
+            client_layout(app, client);
+        }
+        request_refresh(app, client);
+    }
+    
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    introspection_stats.total_us += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+void add_window(App *app, xcb_window_t window) {
+    add_windows(app, {window});
 }
 
 void remove_window(App *app, xcb_window_t window) {
@@ -3701,9 +3927,16 @@ void remove_window(App *app, xcb_window_t window) {
     if (!icons)
         return;
     
-    for (int j = 0; j < icons->children.size(); j++) {
+    LaunchableButton *button = nullptr;
+    auto registered = window_registry.find(window);
+    if (registered != window_registry.end())
+        button = registered->second.button;
+    
+    for (int j = 0; button && j < icons->children.size(); j++) {
         Container *container = icons->children[j];
         LaunchableButton *data = (LaunchableButton *) container->user_data;
+        if (data != button)
+            continue;
         for (int i = 0; i < data->windows_data_list.size(); i++) {
             if (data->windows_data_list[i]->id == window) {
                 if (auto windows_selector_client = client_by_name(app, "windows_selector")) {
@@ -3755,6 +3988,7 @@ void remove_window(App *app, xcb_window_t window) {
                 break;
             }
         }
+        break;
     }
     
     // TODO: mark handler as remove at end of loop
@@ -3770,54 +4004,42 @@ void remove_window(App *app, xcb_window_t window) {
     request_refresh(app, entity);
 }
 
-void stacking_order_changed(xcb_window_t *all_windows, int windows_count) {
+void stacking_diff(const xcb_window_t *all_windows, int windows_count,
+                   const std::unordered_map<xcb_window_t, RegisteredWindow> &registry,
+                   std::unordered_set<xcb_window_t> *ignored, std::vector<xcb_window_t> *added,
+                   std::vector<xcb_window_t> *removed) {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
+    std::unordered_set<xcb_window_t> new_windows(all_windows, all_windows + windows_count);
     
-    std::vector<xcb_window_t> new_windows;
-    for (int i = 0; i < windows_count; i++) {
-        new_windows.push_back(all_windows[i]);
+    for (auto it = ignored->begin(); it != ignored->end();) {
+        if (new_windows.find(*it) == new_windows.end())
+            it = ignored->erase(it);
+        else
+            ++it;
     }
     
-    std::vector<xcb_window_t> old_windows;
-    AppClient *entity = client_by_name(app, "taskbar");
-    if (!entity)
-        return;
-    auto *root = entity->root;
-    if (!root)
-        return;
-    auto *icons = container_by_name("icons", root);
-    if (!icons)
-        return;
-    
-    for (auto icon: icons->children) {
-        auto *data = static_cast<LaunchableButton *>(icon->user_data);
-        for (auto window_data: data->windows_data_list) {
-            old_windows.emplace_back(window_data->id);
-        }
-    }
+    for (int i = 0; i < windows_count; i++)
+        if (registry.find(all_windows[i]) == registry.end() && ignored->find(all_windows[i]) == ignored->end())
+            added->push_back(all_windows[i]);
     
-    for (auto new_window: new_windows) {
-        bool found = false;
-        for (auto old_window: old_windows)
-            if (old_window == new_window)
-                found = true;
-        if (!found) {
-            add_window(app, new_window);
-        }
-    }
+    for (const auto &registered: registry)
+        if (new_windows.find(registered.first) == new_windows.end())
+            removed->push_back(registered.first);
+}
+
+void stacking_order_changed(xcb_window_t *all_windows, int windows_count) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    std::vector<xcb_window_t> added_windows;
+    std::vector<xcb_window_t> removed_windows;
+    stacking_diff(all_windows, windows_count, window_registry, &ignored_windows, &added_windows, &removed_windows);
     
-    for (int i = 0; i < old_windows.size(); i++) {
-        xcb_window_t old_window = old_windows[i];
-        bool found = false;
-        for (auto new_window: new_windows)
-            if (old_window == new_window)
-                found = true;
-        if (!found) {
-            remove_window(app, old_window);
-        }
-    }
+    add_windows(app, added_windows);
+    for (auto window: removed_windows)
+        remove_window(app, window);
 }
 
 void remove_non_pinned_icons() {
@@ -3940,10 +4162,9 @@ void update_pinned_items_file(bool force_update) {
     if (auto client = client_by_name(app, "taskbar")) {
         if (force_update) {
             update_pinned_items_timeout(app, client, nullptr, nullptr);
-        } else if (pinned_timeout == nullptr) {
+        } else if (pinned_timeout == nullptr ||
+                   !app_timeout_replace(app, client, pinned_timeout, 1000, update_pinned_items_timeout, nullptr)) {
             pinned_timeout = app_timeout_create(app, client, 1000, update_pinned_items_timeout, nullptr, const_cast<char *>(__PRETTY_FUNCTION__));
-        } else {
-            app_timeout_replace(app, client, pinned_timeout, 1000, update_pinned_items_timeout, nullptr);
         }
     }
 }
@@ -4050,7 +4271,7 @@ load_pinned_icons() {
         }
         
         if (!path.empty()) {
-            load_icon_full_path(app, client_entity, &data->surface, path, 24 * config->dpi);
+            request_icon_full_path(app, client_entity, &data->surface, path, 24 * config->dpi);
         } else {
             data->surface = accelerated_surface(app, client_entity, 24 * config->dpi, 24 * config->dpi);
             char *string = getenv("HOME");
@@ -4154,6 +4375,7 @@ void update_pinned_items_icon() {
             if (auto icons = container_by_name("icons", client->root)) {
                 for (auto icon: icons->children) {
                     auto *data = static_cast<LaunchableButton *>(icon->user_data);
+                    icon_raster_cancel(&data->surface);
                     if (data->surface) {
                         cairo_surface_destroy(data->surface);
                         data->surface = nullptr;
@@ -4173,7 +4395,7 @@ void update_pinned_items_icon() {
                         path = targets[1].best_full_path;
                     }
                     if (!path.empty()) {
-                        load_icon_full_path(app, client, &data->surface, path, 24 * config->dpi);
+                        request_icon_full_path(app, client, &data->surface, path, 24 * config->dpi);
                     } else {
                         data->surface = accelerated_surface(app, client, 24 * config->dpi, 24 * config->dpi);
                         char *string = getenv("HOME");
@@ -4191,65 +4413,55 @@ void update_pinned_items_icon() {
     }
 }
 
-WindowsData::WindowsData(App *app, xcb_window_t window) {
+WindowsData::WindowsData(App *app, const WindowProperties &properties) {
     option_width = 217 * 1.2 * config->dpi;
     option_height = 144 * 1.2 * config->dpi;
     
-    id = window;
+    id = properties.window;
+    title = properties.title;
+    on_desktop = properties.desktop;
     
-    auto cookie = xcb_get_property(app->connection, 0, id, get_cached_atom(app, "_GTK_FRAME_EXTENTS"),
-                                   XCB_ATOM_CARDINAL, 0, 4);
-    auto reply = xcb_get_property_reply(app->connection, cookie, nullptr);
+    gtk_left_margin = (int) properties.gtk_frame_extents[0];
+    gtk_right_margin = (int) properties.gtk_frame_extents[1];
+    gtk_top_margin = (int) properties.gtk_frame_extents[2];
+    gtk_bottom_margin = (int) properties.gtk_frame_extents[3];
     
-    if (reply) {
-        int length = xcb_get_property_value_length(reply);
-        if (length != 0) {
-            auto gtkFrameExtents = static_cast<uint32_t *>(xcb_get_property_value(reply));
-            gtk_left_margin = (int) gtkFrameExtents[0];
-            gtk_right_margin = (int) gtkFrameExtents[1];
-            gtk_top_margin = (int) gtkFrameExtents[2];
-            gtk_bottom_margin = (int) gtkFrameExtents[3];
-        }
-        free(reply);
-    }
-    
-    const xcb_get_window_attributes_cookie_t &attributesCookie = xcb_get_window_attributes(
-            app->connection, window);
-    xcb_get_window_attributes_reply_t *attributes = xcb_get_window_attributes_reply(app->connection,
-                                                                                    attributesCookie,
-                                                                                    nullptr);
-    if (attributes) {
-        mapped = attributes->map_state == XCB_MAP_STATE_VIEWABLE;
+    if (properties.has_attributes) {
+        mapped = properties.viewable;
         // TODO: screen should be found using the window somehow I think
         xcb_screen_t *screen = xcb_setup_roots_iterator(xcb_get_setup(app->connection)).data;
-        xcb_visualtype_t *visual = xcb_aux_find_visual_by_id(screen, attributes->visual);
-        
-        xcb_get_geometry_cookie_t geomCookie = xcb_get_geometry(app->connection,
-                                                                window);  // window is a xcb_drawable_t
-        xcb_get_geometry_reply_t *geom = xcb_get_geometry_reply(app->connection, geomCookie, NULL);
+        xcb_visualtype_t *visual = xcb_aux_find_visual_by_id(screen, properties.visual);
         
-        if (geom) {
+        if (properties.has_geometry) {
             window_surface = cairo_xcb_surface_create(app->connection,
-                                                      window,
+                                                      id,
                                                       visual,
-                                                      (width = geom->width),
-                                                      (height = geom->height));
+                                                      (width = properties.width),
+                                                      (height = properties.height));
             
-            raw_thumbnail_surface = accelerated_surface(app, client_by_name(app, "taskbar"),
-                                                        width, height);
-            raw_thumbnail_cr = cairo_create(raw_thumbnail_surface);
             scaled_thumbnail_surface = accelerated_surface(app, client_by_name(app, "taskbar"),
                                                            option_width,
                                                            option_height);
             scaled_thumbnail_cr = cairo_create(scaled_thumbnail_surface);
-            take_screenshot();
-            free(geom);
+            
+            if (composite_thumbnails) {
+                thumbnail_watch(app, this);
+            } else {
+                raw_thumbnail_surface = accelerated_surface(app, client_by_name(app, "taskbar"),
+                                                            width, height);
+                raw_thumbnail_cr = cairo_create(raw_thumbnail_surface);
+                take_screenshot();
+            }
         }
-        free(attributes);
     }
 }
 
 WindowsData::~WindowsData() {
+    auto registered = window_registry.find(id);
+    if (registered != window_registry.end() && registered->second.data == this)
+        window_registry.erase(registered);
+    if (damage)
+        thumbnail_unwatch(app, this);
     if (window_surface) {
         cairo_surface_destroy(window_surface);
         cairo_surface_destroy(raw_thumbnail_surface);
@@ -4263,7 +4475,8 @@ void WindowsData::take_screenshot() {
 #ifdef TRACY_ENABLE
     ZoneScoped;
 #endif
-    if (!mapped)
+    // Redirected windows keep their contents offscreen, so there's nothing to save
+    if (!mapped || damage)
         return;
     
     if (gtk_left_margin == 0 && gtk_right_margin == 0 && gtk_top_margin == 0 && gtk_bottom_margin == 0) {
@@ -4297,6 +4510,73 @@ void WindowsData::rescale(double scale_w, double scale_h) {
     cairo_set_source(scaled_thumbnail_cr, pattern);
     cairo_paint(scaled_thumbnail_cr);
     cairo_restore(scaled_thumbnail_cr);
+    cairo_pattern_destroy(pattern);
+}
+
+void WindowsData::damaged(int x, int y, int w, int h) {
+    if (!thumbnail_damaged) {
+        damage_x = x;
+        damage_y = y;
+        damage_w = w;
+        damage_h = h;
+        thumbnail_damaged = true;
+        return;
+    }
+    int x2 = std::max(damage_x + damage_w, x + w);
+    int y2 = std::max(damage_y + damage_h, y + h);
+    damage_x = std::min(damage_x, x);
+    damage_y = std::min(damage_y, y);
+    damage_w = x2 - damage_x;
+    damage_h = y2 - damage_y;
+}
+
+void WindowsData::update_thumbnail(double scale_w, double scale_h) {
+#ifdef TRACY_ENABLE
+    ZoneScoped;
+#endif
+    if (!damage) {
+        if ((get_current_time_in_ms() - last_rescale_timestamp) > 1000) {
+            if (screen_has_transparency(app)) {
+                take_screenshot();
+            }
+            rescale(scale_w, scale_h);
+        }
+        return;
+    }
+    
+    bool scale_changed = scale_w != thumbnail_scale_w || scale_h != thumbnail_scale_h;
+    if (!window_surface || !mapped || (!thumbnail_damaged && !scale_changed))
+        return;
+    last_rescale_timestamp = get_current_time_in_ms();
+    
+    // Cleared before reading so anything drawn while we copy gets reported again
+    thumbnail_clear_damage(app, this);
+    
+    cairo_save(scaled_thumbnail_cr);
+    if (!scale_changed) {
+        // Grown by a pixel so the filter blends the edges of the damage with what's around it
+        cairo_rectangle(scaled_thumbnail_cr,
+                        std::floor(damage_x * scale_w) - 1, std::floor(damage_y * scale_h) - 1,
+                        std::ceil(damage_w * scale_w) + 2, std::ceil(damage_h * scale_h) + 2);
+        cairo_clip(scaled_thumbnail_cr);
+    }
+    cairo_scale(scaled_thumbnail_cr, scale_w, scale_h);
+    if (gtk_left_margin != 0 || gtk_right_margin != 0 || gtk_top_margin != 0 || gtk_bottom_margin != 0) {
+        cairo_rectangle(scaled_thumbnail_cr, gtk_left_margin, gtk_top_margin,
+                        width - (gtk_right_margin + gtk_left_margin), height - (gtk_bottom_margin + gtk_top_margin));
+        cairo_clip(scaled_thumbnail_cr);
+    }
+    cairo_pattern_t *pattern = cairo_pattern_create_for_surface(window_surface);
+    cairo_pattern_set_filter(pattern, CAIRO_FILTER_GOOD);
+    cairo_set_source(scaled_thumbnail_cr, pattern);
+    cairo_set_operator(scaled_thumbnail_cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(scaled_thumbnail_cr);
+    cairo_restore(scaled_thumbnail_cr);
+    cairo_pattern_destroy(pattern);
+    
+    thumbnail_scale_w = scale_w;
+    thumbnail_scale_h = scale_h;
+    thumbnail_damaged = false;
 }
 
 void taskbar_launch_index(int index) {
@@ -4331,58 +4611,8 @@ xcb_window_t get_active_window() {
     return active_window;
 }
 
-std::string find_icon_string_from_window_properties(xcb_window_t window) {
-    std::string wm_name;
-    std::string net_wm_name;
-    std::string icon_name;
-    std::string wm_class;
-    std::string gtk_application_id;
-    std::string kde_application_id;
-    xcb_icccm_get_text_property_reply_t reply;
-    xcb_ewmh_get_utf8_strings_reply_t data;
-    
-    const xcb_get_property_cookie_t &name_cookie = xcb_icccm_get_wm_icon_name(app->connection, window);
-    const xcb_get_property_cookie_t &net_name_cookie = xcb_ewmh_get_wm_name(&app->ewmh, window);
-    const xcb_get_property_cookie_t &icon_cookie = xcb_icccm_get_wm_icon_name(app->connection, window);
-    const xcb_get_property_cookie_t &wm_class_cookie = xcb_icccm_get_wm_class(app->connection, window);
-    xcb_get_property_cookie_t gtk_coookie = xcb_icccm_get_text_property_unchecked(app->connection, window,
-                                                                                  get_cached_atom(app,
-                                                                                                  "_GTK_APPLICATION_ID"));
-    xcb_get_property_cookie_t kde_cookie = xcb_icccm_get_text_property_unchecked(app->connection, window,
-                                                                                 get_cached_atom(app,
-                                                                                                 "_KDE_NET_WM_DESKTOP_FILE"));
-    
-    // _GTK_APPLICATION_ID
-    if (xcb_icccm_get_text_property_reply(app->connection, gtk_coookie, &reply, nullptr)) {
-        gtk_application_id = std::string(reply.name, reply.name_len);
-        xcb_icccm_get_text_property_reply_wipe(&reply);
-    }
-    
-    // _KDE_NET_WM_DESKTOP_FILE
-    if (xcb_icccm_get_text_property_reply(app->connection, kde_cookie, &reply, nullptr)) {
-        kde_application_id = std::string(reply.name, reply.name_len);
-        xcb_icccm_get_text_property_reply_wipe(&reply);
-    }
-    
-    uint8_t success = xcb_icccm_get_wm_name_reply(app->connection, net_name_cookie, &reply, nullptr);
-    if (success) {
-        net_wm_name = std::string(reply.name, reply.name_len);
-        xcb_icccm_get_text_property_reply_wipe(&reply);
-    }
-    
+std::string find_icon_string_from_window_properties(const WindowProperties &properties) {
     // try to use properties to find matching desktop file, and if the icon specified, has options, or is a '/' return that
-    success = xcb_ewmh_get_wm_name_reply(&app->ewmh, name_cookie, &data, nullptr);
-    if (success) {
-        wm_name = strndup(data.strings, data.strings_len);
-        xcb_ewmh_get_utf8_strings_reply_wipe(&data);
-    }
-    
-    success = xcb_icccm_get_text_property_reply(app->connection, wm_class_cookie, &reply, nullptr);
-    if (success) {
-        wm_class = strndup(reply.name, reply.name_len);
-        xcb_icccm_get_text_property_reply_wipe(&reply);
-    }
-    
     
     // then check each property individually to see if it has options
     
@@ -4390,15 +4620,11 @@ std::string find_icon_string_from_window_properties(xcb_window_t window) {
     
     // then check if we have a raw icon saved with the wm_class name, and return that path if so
     for (auto &l: launchers) {
-        if (!net_wm_name.empty() && !l->name.empty() && l->name == net_wm_name) {
+        if (!properties.net_wm_name.empty() && !l->name.empty() && l->name == properties.net_wm_name) {
             printf("%s\n\n", l->icon.c_str());
             return l->icon;
         }
     }
-
-//    printf("WM_NAME: %s, NET_WM_NAME: %s, ICON_NAME: %s, WM_CLASS: %s, GTK_APPLICATION_ID: %s, KDE_APPLICATION_ID: %s\n",
-//           wm_name.c_str(), net_wm_name.c_str(), icon_name.c_str(), wm_class.c_str(), gtk_application_id.c_str(),
-//           kde_application_id.c_str());
     
     return "";
 }
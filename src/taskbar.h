@@ -4,6 +4,7 @@
 #define TASKBAR_H
 
 #include <utility.h>
+#include "icon_raster_cache.h"
 #include <xcb/xcb_aux.h>
 #include "application.h"
 
@@ -29,7 +30,10 @@ public:
     bool invalid_button_down = false;
     long timestamp = 0;
     
-    ~IconButton() { cairo_surface_destroy(surface); }
+    ~IconButton() {
+        icon_raster_cancel(&surface);
+        cairo_surface_destroy(surface);
+    }
 };
 
 struct ActionCenterButtonData : public IconButton {
@@ -37,6 +41,8 @@ struct ActionCenterButtonData : public IconButton {
     double slide_anim = 0;
 };
 
+struct WindowProperties;
+
 class WindowsData {
 public:
     
@@ -69,17 +75,34 @@ public:
     cairo_surface_t *scaled_thumbnail_surface = nullptr;
     cairo_t *scaled_thumbnail_cr = nullptr;
     
+    // With composite thumbnails the window is redirected and watched by this damage object instead of being copied
+    // into raw_thumbnail_surface, and the scaled thumbnail is only redrawn where the window was damaged
+    uint32_t damage = 0;
+    bool thumbnail_damaged = true;
+    int damage_x = 0;
+    int damage_y = 0;
+    int damage_w = 0;
+    int damage_h = 0;
+    double thumbnail_scale_w = 0;
+    double thumbnail_scale_h = 0;
+    
     bool marked_to_close = false;
     
     ScreenInformation *on_screen = nullptr;
     int on_desktop = 0;
     
-    WindowsData(App *app, xcb_window_t window);
+    WindowsData(App *app, const WindowProperties &properties);
     
     void take_screenshot();
     
     void rescale(double scale_w, double scale_h);
     
+    // Brings scaled_thumbnail_surface up to date for drawing at this scale, as cheaply as the mode allows
+    void update_thumbnail(double scale_w, double scale_h);
+    
+    // Adds an area of the window (in window coordinates) that changed since the thumbnail was last drawn
+    void damaged(int x, int y, int w, int h);
+    
     ~WindowsData();
 };
 
@@ -138,6 +161,32 @@ create_taskbar(App *app);
 
 void stacking_order_changed(xcb_window_t *all_windows, int windows_count);
 
+struct RegisteredWindow {
+    LaunchableButton *button = nullptr;
+    WindowsData *data = nullptr;
+};
+
+// What a new _NET_CLIENT_LIST_STACKING changes: the windows in it which are neither in registry nor ignored, and the
+// ones in registry which aren't in it anymore. Ignored windows which left it are forgotten.
+void stacking_diff(const xcb_window_t *all_windows, int windows_count,
+                   const std::unordered_map<xcb_window_t, RegisteredWindow> &registry,
+                   std::unordered_set<xcb_window_t> *ignored, std::vector<xcb_window_t> *added,
+                   std::vector<xcb_window_t> *removed);
+
+struct WindowIntrospectionStats {
+    // Batches of new windows whose properties were fetched together, and how many windows were in them
+    long batches = 0;
+    long windows = 0;
+    
+    // Times the taskbar waited on the X server: one per batch, plus one per window that needed _NET_WM_ICON
+    long round_trips = 0;
+    
+    // From sending a batch's requests to the taskbar being updated with it, divide by windows for the time per window
+    long total_us = 0;
+};
+
+WindowIntrospectionStats window_introspection_stats();
+
 void active_window_changed(xcb_window_t new_active_window);
 
 void remove_non_pinned_icons();
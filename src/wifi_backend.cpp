@@ -3,6 +3,7 @@
 //
 
 #include "wifi_backend.h"
+#include "main.h"
 #include "search_menu.h"
 
 #include <wpa_ctrl.h>
@@ -251,9 +252,10 @@ void wifi_networks_and_cached_scan(void (*function_called_when_results_are_retur
 
 void wifi_stop() {
     if (wifi_data->type == 1) {
+        remove_polled_descriptor(app, wpa_ctrl_get_fd(wifi_data->wpa_message_listener));
+        wpa_ctrl_detach(wifi_data->wpa_message_listener);
         wpa_ctrl_close(wifi_data->wpa_message_sender);
         wpa_ctrl_close(wifi_data->wpa_message_listener);
-        wpa_ctrl_detach(wifi_data->wpa_message_listener);
     }
     
     delete wifi_data;
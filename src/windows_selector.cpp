@@ -181,6 +181,7 @@ static void option_hover_clicked(App *, AppClient *client, Timeout *, void *user
 static void
 option_entered(AppClient *client, cairo_t *, Container *container) {
     if (drag_and_dropping) {
+        app_timeout_stop(app, client, drag_and_drop_timeout);
         drag_and_drop_timeout = app_timeout_create(app, client, 600, option_hover_clicked, container, const_cast<char *>(__PRETTY_FUNCTION__));
     }
 }
@@ -189,6 +190,7 @@ static void
 option_exited(AppClient *client, cairo_t *, Container *) {
     if (drag_and_drop_timeout != nullptr) {
         app_timeout_stop(app, client, drag_and_drop_timeout);
+        drag_and_drop_timeout = nullptr;
     }
 }
 
@@ -441,13 +443,7 @@ paint_body(AppClient *client_entity, cairo_t *cr, Container *container) {
         scale_w = scale_h;
     }
     
-    long currrent_time = get_current_time_in_ms();
-    if ((currrent_time - data->last_rescale_timestamp) > 1000) {
-        if (screen_has_transparency(app)) {
-            data->take_screenshot();
-        }
-        data->rescale(scale_w, scale_h);
-    }
+    data->update_thumbnail(scale_w, scale_h);
     if (data->scaled_thumbnail_surface) {
         double width = data->width * scale_w;
         double height = data->height * scale_h;
@@ -569,6 +565,8 @@ static void when_closed(AppClient *client) {
     app_timeout_stop(client->app, client, pii->data->possibly_open_timeout);
     pii->data->possibly_stop_timeout = nullptr;
     pii->data->possibly_open_timeout = nullptr;
+    app_timeout_stop(client->app, client, drag_and_drop_timeout);
+    drag_and_drop_timeout = nullptr;
     if (auto c = client_by_name(app, "taskbar")) {
         request_refresh(app, c);
     }
@@ -0,0 +1,375 @@
+// Makes up an icon tree (4 themes, 40,000 names, about 150,000 files) and measures what starting up with its icon.cache
+// costs: how long load_data takes to map and check it, and how much memory that adds. The same is measured for the
+// version 3 cache, which copied every name and option onto the heap when loading (its writer and loader are copied in
+// below). Each is measured in a forked child so neither sees the other's memory. Then 10,000 lookups are timed, and
+// every name has to come back with as many candidates as it has files. Built with -DICON_CACHE_BENCH=ON, exits with 1
+// if a lookup is wrong.
+
+#include "icons.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <malloc.h>
+#include <map>
+#include <random>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+
+App *app = nullptr;
+bool restart = false;
+
+static const int name_count = 40000;
+static const int lookup_count = 10000;
+
+struct BenchDirectory {
+    std::string path;
+    std::string theme;
+    // Name and extension (0 for svg, 1 for png)
+    std::vector<std::pair<std::string, int>> icons;
+};
+
+struct Usage {
+    double load_ms = 0;
+    long heap_kb = 0;
+    long file_kb = 0;
+    double lookup_ns = 0;
+    bool lookups_right = true;
+};
+
+static std::string
+icon_name(int i) {
+    static const char *prefixes[] = {"application-x-", "org.example.app", "folder-", "media-", "dialog-",
+                                     "text-x-", "network-", "input-"};
+    return prefixes[i % 8] + std::to_string(i);
+}
+
+// Every name goes in one context, in one or two of the themes, at two or three of the sizes
+static std::vector<BenchDirectory>
+make_tree(const std::string &root, std::mt19937 &random, std::unordered_map<std::string, int> *files_per_name) {
+    static const char *themes[] = {"Adwaita", "breeze", "Papirus", "hicolor"};
+    static const char *sizes[] = {"16x16", "22x22", "24x24", "32x32", "48x48", "64x64", "128x128", "scalable"};
+    static const char *contexts[] = {"apps", "mimetypes", "actions", "status", "places"};
+
+    std::map<std::string, BenchDirectory> directories;
+    for (int i = 0; i < name_count; i++) {
+        std::string name = icon_name(i);
+        const char *context = contexts[i % 5];
+        int theme_count = 1 + random() % 2;
+        int first_theme = random() % 4;
+        for (int t = 0; t < theme_count; t++) {
+            const char *theme = themes[(first_theme + t) % 4];
+            int size_count = 2 + random() % 2;
+            int first_size = random() % 8;
+            for (int s = 0; s < size_count; s++) {
+                const char *size = sizes[(first_size + s) % 8];
+                std::string path = root + "/" + theme + "/" + size + "/" + context;
+                auto &directory = directories[path];
+                directory.path = path;
+                directory.theme = theme;
+                directory.icons.emplace_back(name, strcmp(size, "scalable") == 0 ? 0 : 1);
+                (*files_per_name)[name]++;
+            }
+        }
+    }
+
+    std::vector<BenchDirectory> result;
+    for (auto &item: directories) {
+        for (size_t slash = item.first.find('/', 1); slash != std::string::npos;
+             slash = item.first.find('/', slash + 1))
+            mkdir(item.first.substr(0, slash).c_str(), 0755);
+        mkdir(item.first.c_str(), 0755);
+        for (const auto &icon: item.second.icons) {
+            std::string file = item.first + "/" + icon.first + (icon.second == 0 ? ".svg" : ".png");
+            close(open(file.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644));
+        }
+        result.push_back(std::move(item.second));
+    }
+    return result;
+}
+
+// Heap in use goes by malloc, since a forked child reuses pages the parent freed and its RssAnon wouldn't grow
+static void
+read_memory(long *heap_kb, long *file_kb) {
+    struct mallinfo2 info = mallinfo2();
+    *heap_kb = (long) ((info.uordblks + info.hblkhd) / 1024);
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.rfind("RssFile:", 0) == 0)
+            *file_kb = atol(line.c_str() + 8);
+}
+
+// Runs measure in a child process, so memory it takes doesn't stay around for the next measurement
+static bool
+measure_in_child(Usage (*measure)(void *), void *argument, Usage *usage) {
+    int fds[2];
+    if (pipe(fds) == -1)
+        return false;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        Usage child_usage = measure(argument);
+        write(fds[1], &child_usage, sizeof(child_usage));
+        _exit(0);
+    }
+    close(fds[1]);
+    bool read_all = read(fds[0], usage, sizeof(*usage)) == sizeof(*usage);
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+    return read_all;
+}
+
+struct Lookups {
+    std::vector<std::string> names;
+    const std::unordered_map<std::string, int> *files_per_name;
+    std::string old_cache_path;
+};
+
+static Usage
+measure_current(void *argument) {
+    auto lookups = (Lookups *) argument;
+    Usage usage;
+    long heap_before = 0, file_before = 0;
+    read_memory(&heap_before, &file_before);
+    auto start = std::chrono::steady_clock::now();
+    load_data();
+    auto end = std::chrono::steady_clock::now();
+    read_memory(&usage.heap_kb, &usage.file_kb);
+    usage.heap_kb -= heap_before;
+    usage.file_kb -= file_before;
+    usage.load_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+    std::vector<IconTarget> targets;
+    for (const auto &name: lookups->names)
+        targets.emplace_back(name);
+    start = std::chrono::steady_clock::now();
+    search_loaded_icons(targets);
+    end = std::chrono::steady_clock::now();
+    usage.lookup_ns = std::chrono::duration<double, std::nano>(end - start).count() / targets.size();
+
+    for (const auto &target: targets) {
+        auto found = lookups->files_per_name->find(target.name);
+        size_t expected = found == lookups->files_per_name->end() ? 0 : found->second;
+        if (target.candidates.size() != expected)
+            usage.lookups_right = false;
+    }
+    return usage;
+}
+
+// The version 3 cache, as save_data wrote it
+static void
+write_old_cache(const std::string &path, const std::vector<BenchDirectory> &directories) {
+    std::vector<std::string> parent_paths;
+    std::vector<std::string> themes;
+    std::map<std::string, std::vector<std::pair<unsigned short, unsigned char>>> options;
+    for (const auto &directory: directories) {
+        auto theme = std::find(themes.begin(), themes.end(), directory.theme);
+        unsigned char theme_index = theme - themes.begin();
+        if (theme == themes.end())
+            themes.push_back(directory.theme);
+        unsigned short parent_index = parent_paths.size();
+        parent_paths.push_back(directory.path);
+        for (const auto &icon: directory.icons)
+            options[icon.first].emplace_back((parent_index & 0x3FFF) | (icon.second << 14), theme_index);
+    }
+
+    std::ofstream cache_file(path, std::ios_base::out | std::ios_base::binary);
+    cache_file << "3" << '\0';
+    unsigned long names_size = 0;
+    unsigned long options_size = 0;
+    for (const auto &item: options) {
+        names_size += item.first.size();
+        options_size += item.second.size() * 3;
+    }
+    cache_file.write((const char *) &names_size, sizeof(names_size));
+    cache_file.write((const char *) &options_size, sizeof(options_size));
+    cache_file << std::to_string(parent_paths.size()) << '\0';
+    for (const auto &item: parent_paths)
+        cache_file << item << '\0';
+    cache_file << std::to_string(themes.size()) << '\0';
+    for (const auto &item: themes)
+        cache_file << item << '\0';
+    cache_file << std::to_string(options.size()) << '\0';
+    for (const auto &item: options) {
+        cache_file << item.first << '\0';
+        unsigned short count = item.second.size();
+        cache_file.write((const char *) &count, sizeof(count));
+        for (const auto &option: item.second) {
+            cache_file.write((const char *) &option.first, sizeof(option.first));
+            cache_file.write((const char *) &option.second, sizeof(option.second));
+        }
+    }
+}
+
+struct OldRange {
+    unsigned long start = -1;
+    unsigned long length = -1;
+};
+
+// Candidate as it was, with its own copies of the strings
+struct OldCandidate {
+    std::string parent_path;
+    std::string filename;
+    std::string theme;
+    int extension;
+};
+
+// What load_data and search_icons did with the version 3 cache
+static Usage
+measure_old(void *argument) {
+    auto lookups = (Lookups *) argument;
+    Usage usage;
+    long heap_before = 0, file_before = 0;
+    read_memory(&heap_before, &file_before);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::string> parent_paths;
+    std::vector<std::string> themes;
+    std::unordered_map<std::string_view, OldRange> ranges;
+    char *name_buffer;
+    char *option_buffer;
+    {
+        int fd = open(lookups->old_cache_path.c_str(), O_RDONLY);
+        struct stat cache_stat{};
+        fstat(fd, &cache_stat);
+        char *map = (char *) mmap(NULL, cache_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        unsigned long index = 0;
+        char buffer[NAME_MAX];
+        auto read_string = [&]() {
+            strcpy(buffer, map + index);
+            long length = strlen(buffer);
+            index += length + 1;
+            return std::string(buffer, length);
+        };
+        read_string();
+        unsigned long names_size = *(unsigned long *) (map + index);
+        index += sizeof(unsigned long);
+        name_buffer = new char[names_size];
+        unsigned long options_size = *(unsigned long *) (map + index);
+        index += sizeof(unsigned long);
+        option_buffer = new char[options_size];
+        int parent_count = std::stoi(read_string());
+        for (int i = 0; i < parent_count; i++)
+            parent_paths.push_back(read_string());
+        int theme_count = std::stoi(read_string());
+        for (int i = 0; i < theme_count; i++)
+            themes.push_back(read_string());
+        int option_count = std::stoi(read_string());
+        ranges.reserve(option_count);
+        unsigned long names_index = 0;
+        unsigned long options_index = 0;
+        for (int i = 0; i < option_count; i++) {
+            strcpy(buffer, map + index);
+            long length = strlen(buffer);
+            strncpy(name_buffer + names_index, map + index, length);
+            index += length + 1;
+            std::string name(buffer, length);
+            unsigned short count = *(unsigned short *) (map + index);
+            index += sizeof(unsigned short);
+            ranges[std::string_view(name_buffer + names_index, length)] = {options_index, (unsigned long) count * 3};
+            names_index += length;
+            std::memcpy(option_buffer + options_index, map + index, count * 3);
+            index += count * 3;
+            options_index += count * 3;
+        }
+        munmap(map, cache_stat.st_size);
+        close(fd);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    read_memory(&usage.heap_kb, &usage.file_kb);
+    usage.heap_kb -= heap_before;
+    usage.file_kb -= file_before;
+    usage.load_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+    // Only the lookup and the strings every candidate got, search_icons also worked out size and context from the
+    // path of each of them
+    std::vector<std::pair<std::string, std::vector<OldCandidate>>> targets;
+    for (const auto &name: lookups->names)
+        targets.emplace_back(name, std::vector<OldCandidate>());
+    start = std::chrono::steady_clock::now();
+    for (auto &target: targets) {
+        auto found = ranges.find(target.first);
+        if (found == ranges.end())
+            continue;
+        for (unsigned long j = 0; j < found->second.length / 3; j++) {
+            unsigned short parent_and_extension;
+            std::memcpy(&parent_and_extension, option_buffer + found->second.start + j * 3, 2);
+            unsigned char theme = option_buffer[found->second.start + j * 3 + 2];
+            OldCandidate candidate;
+            candidate.parent_path = parent_paths[parent_and_extension & 0x3FFF];
+            candidate.filename = target.first;
+            candidate.theme = themes[theme];
+            candidate.extension = parent_and_extension >> 14;
+            target.second.push_back(candidate);
+        }
+    }
+    end = std::chrono::steady_clock::now();
+    usage.lookup_ns = std::chrono::duration<double, std::nano>(end - start).count() / targets.size();
+    return usage;
+}
+
+int main() {
+    char directory_template[] = "/tmp/winbar_icon_cache_bench.XXXXXX";
+    if (!mkdtemp(directory_template)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string directory = directory_template;
+    std::string home = directory + "/home";
+    std::string root = directory + "/icons";
+    mkdir(home.c_str(), 0755);
+    mkdir(root.c_str(), 0755);
+    setenv("HOME", home.c_str(), 1);
+
+    std::mt19937 random(15);
+    std::unordered_map<std::string, int> files_per_name;
+    auto directories = make_tree(root, random, &files_per_name);
+    size_t files = 0;
+    for (const auto &item: files_per_name)
+        files += item.second;
+    printf("%zu files, %zu names, %zu directories\n", files, files_per_name.size(), directories.size());
+
+    auto start = std::chrono::steady_clock::now();
+    icon_cache_build({root}, 0);
+    auto end = std::chrono::steady_clock::now();
+    printf("icon.cache built in %.0f ms\n", std::chrono::duration<double, std::milli>(end - start).count());
+
+    Lookups lookups;
+    lookups.files_per_name = &files_per_name;
+    lookups.old_cache_path = directory + "/icon.cache.v3";
+    write_old_cache(lookups.old_cache_path, directories);
+    for (int i = 0; i < lookup_count; i++)
+        lookups.names.push_back(i % 5 == 0 ? "missing-" + std::to_string(i) : icon_name(random() % name_count));
+
+    struct stat current_stat{}, old_stat{};
+    stat((home + "/.cache/winbar_icon_cache/icon.cache").c_str(), &current_stat);
+    stat(lookups.old_cache_path.c_str(), &old_stat);
+
+    Usage old_usage, current_usage;
+    if (!measure_in_child(measure_old, &lookups, &old_usage) ||
+        !measure_in_child(measure_current, &lookups, &current_usage)) {
+        printf("A measurement didn't finish\n");
+        return 1;
+    }
+
+    printf("%-10s %10s %10s %10s %14s %12s\n", "", "file (KB)", "load (ms)", "heap (KB)", "file RSS (KB)",
+           "lookup (ns)");
+    printf("%-10s %10ld %10.2f %10ld %14ld %12.0f\n", "version 3", (long) old_stat.st_size / 1024, old_usage.load_ms,
+           old_usage.heap_kb, old_usage.file_kb, old_usage.lookup_ns);
+    printf("%-10s %10ld %10.2f %10ld %14ld %12.0f\n", "mapped", (long) current_stat.st_size / 1024,
+           current_usage.load_ms, current_usage.heap_kb, current_usage.file_kb, current_usage.lookup_ns);
+
+    std::string remove = "rm -rf '" + directory + "'";
+    system(remove.c_str());
+
+    printf(current_usage.lookups_right ? "Every lookup found every file\n" : "Lookups came back wrong\n");
+    return current_usage.lookups_right ? 0 : 1;
+}
@@ -0,0 +1,204 @@
+// Makes up an icon tree of 200,000 files (6 themes, 864 directories, with an index.theme and icon-theme.cache in every
+// theme like the real ones) and times building icon.cache from it on 1, 2, 4 and 8 threads and one per core. For
+// reference the old traverse_dir is timed too, which walked everything on one thread and stat'd every entry that
+// wasn't an icon (it's copied in below, and only reads, nothing is written). Every build has to write the same bytes.
+// The page cache is dropped before each run when that's allowed (as root), otherwise everything is read warm. Built
+// with -DICON_TRAVERSAL_BENCH=ON, exits with 1 if two builds differ.
+
+#include "icons.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+App *app = nullptr;
+bool restart = false;
+
+static const int file_count = 200000;
+
+static void
+make_tree(const std::string &root) {
+    static const char *themes[] = {"Adwaita", "breeze", "breeze-dark", "Papirus", "elementary", "hicolor"};
+    static const char *sizes[] = {"8x8", "16x16", "22x22", "24x24", "32x32", "36x36", "48x48", "64x64", "96x96",
+                                  "128x128", "256x256", "scalable"};
+    static const char *contexts[] = {"actions", "animations", "apps", "categories", "devices", "emblems", "emotes",
+                                     "intl", "mimetypes", "places", "status", "panel"};
+
+    std::vector<std::string> directories;
+    for (const char *theme: themes) {
+        std::string theme_path = root + "/" + theme;
+        mkdir(theme_path.c_str(), 0755);
+        close(open((theme_path + "/index.theme").c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644));
+        close(open((theme_path + "/icon-theme.cache").c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644));
+        for (const char *size: sizes) {
+            std::string size_path = theme_path + "/" + size;
+            mkdir(size_path.c_str(), 0755);
+            for (const char *context: contexts) {
+                directories.push_back(size_path + "/" + context);
+                mkdir(directories.back().c_str(), 0755);
+            }
+        }
+    }
+
+    // Names repeat across directories the way one icon comes in many sizes and themes
+    for (int i = 0; i < file_count; i++) {
+        const std::string &directory = directories[i % directories.size()];
+        bool scalable = directory.find("/scalable/") != std::string::npos;
+        std::string file = directory + "/icon-" + std::to_string(i / 37) + (scalable ? ".svg" : ".png");
+        close(open(file.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644));
+    }
+}
+
+static bool
+drop_page_cache() {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool dropped = write(fd, "3", 1) == 1;
+    close(fd);
+    return dropped;
+}
+
+struct OldData {
+    std::vector<std::string> parent_paths;
+    std::vector<std::string> themes;
+    std::map<std::string, std::vector<std::pair<unsigned short, unsigned char>>> options;
+    std::vector<std::string> search_paths;
+};
+
+static unsigned short
+index_of(std::vector<std::string> &list, const std::string &item) {
+    auto found = std::find(list.begin(), list.end(), item);
+    if (found != list.end())
+        return found - list.begin();
+    list.push_back(item);
+    return list.size() - 1;
+}
+
+// What traverse_dir did, minus following symlinks (the made up tree has none)
+static void
+old_traverse_dir(OldData *data, const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == nullptr)
+        return;
+
+    std::string path_as_string(path);
+    std::string theme;
+    for (const auto &item: data->search_paths) {
+        if (path_as_string.find(item) == 0) {
+            theme = path_as_string.substr(item.size());
+            if (theme.empty()) {
+                theme = path;
+            } else {
+                theme = theme.substr(1);
+                theme = theme.substr(0, theme.find('/'));
+            }
+            break;
+        }
+    }
+    unsigned char theme_index = index_of(data->themes, theme);
+    unsigned short parent_index = index_of(data->parent_paths, path);
+
+    struct dirent *entry;
+    struct stat entry_stat{};
+    while ((entry = readdir(dir)) != nullptr) {
+        size_t name_length = strlen(entry->d_name);
+        if (name_length > 5 && entry->d_name[name_length - 4] == '.') {
+            const char *extension = entry->d_name + name_length - 3;
+            int type = strcmp(extension, "svg") == 0 ? 0 : strcmp(extension, "png") == 0 ? 1 : -1;
+            if (type != -1) {
+                entry->d_name[name_length - 4] = '\0';
+                data->options[entry->d_name].emplace_back((parent_index & 0x3FFF) | (type << 14), theme_index);
+                continue;
+            }
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char file[PATH_MAX];
+        snprintf(file, PATH_MAX, "%s/%s", path, entry->d_name);
+        if (stat(file, &entry_stat) == -1)
+            continue;
+        if (S_ISDIR(entry_stat.st_mode))
+            old_traverse_dir(data, file);
+    }
+    closedir(dir);
+}
+
+static std::string
+read_file(const std::string &path) {
+    std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+int main() {
+    char directory_template[] = "/tmp/winbar_icon_traversal_bench.XXXXXX";
+    if (!mkdtemp(directory_template)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string directory = directory_template;
+    std::string home = directory + "/home";
+    std::string root = directory + "/icons";
+    std::string cache_path = home + "/.cache/winbar_icon_cache/icon.cache";
+    mkdir(home.c_str(), 0755);
+    mkdir(root.c_str(), 0755);
+    setenv("HOME", home.c_str(), 1);
+
+    make_tree(root);
+    bool cold = drop_page_cache();
+    printf("%d files, read %s\n", file_count, cold ? "cold (page cache dropped before each run)" : "warm");
+
+    printf("%-22s %10s\n", "", "time (ms)");
+    {
+        OldData data;
+        data.search_paths = {root};
+        drop_page_cache();
+        auto start = std::chrono::steady_clock::now();
+        old_traverse_dir(&data, root.c_str());
+        auto end = std::chrono::steady_clock::now();
+        printf("%-22s %10.1f   (%zu names, nothing written)\n", "old, 1 thread",
+               std::chrono::duration<double, std::milli>(end - start).count(), data.options.size());
+    }
+
+    std::string first_cache;
+    bool all_same = true;
+    int cores = std::clamp((int) std::thread::hardware_concurrency(), 1, 16);
+    for (int threads: {1, 2, 4, 8, 0}) {
+        drop_page_cache();
+        auto start = std::chrono::steady_clock::now();
+        icon_cache_build({root}, threads);
+        auto end = std::chrono::steady_clock::now();
+
+        int used = threads == 0 ? cores : threads;
+        std::string label = std::to_string(used) + (used == 1 ? " thread" : " threads");
+        if (threads == 0)
+            label = "one per core, " + label;
+        printf("%-22s %10.1f\n", label.c_str(), std::chrono::duration<double, std::milli>(end - start).count());
+
+        std::string cache = read_file(cache_path);
+        if (first_cache.empty()) {
+            first_cache = cache;
+        } else if (cache != first_cache) {
+            printf("%s wrote a different icon.cache\n", label.c_str());
+            all_same = false;
+        }
+    }
+
+    std::string remove = "rm -rf '" + directory + "'";
+    system(remove.c_str());
+
+    printf(all_same && !first_cache.empty() ? "Every build wrote the same icon.cache\n" : "The builds differ\n");
+    return all_same && !first_cache.empty() ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+// Checks that every version of the pixel kernels gives exactly what the plain formulas give, on random rows of 0 to
+// 299 pixels, and times them. Built with -DPIXEL_KERNELS_CHECK=ON, exits with 1 if anything differs.
+
+#include "pixel_kernels.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static const int guard_pixels = 8;
+static const uint32_t guard_value = 0xDEADBEEF;
+
+static uint32_t
+dye_reference(uint32_t color, uint32_t r, uint32_t g, uint32_t b) {
+    uint32_t alpha = color >> 24;
+    return (alpha << 24) | ((r * alpha / 255) << 16) | ((g * alpha / 255) << 8) | (b * alpha / 255);
+}
+
+static uint32_t
+remap_alpha_reference(uint32_t color, const uint8_t alpha_map[256]) {
+    uint32_t alpha = alpha_map[color >> 24];
+    uint32_t red = (color >> 16) & 0xFF;
+    uint32_t green = (color >> 8) & 0xFF;
+    uint32_t blue = color & 0xFF;
+    return (alpha << 24) | ((red * alpha / 255) << 16) | ((green * alpha / 255) << 8) | (blue * alpha / 255);
+}
+
+static uint32_t
+random_pixel(std::mt19937 &random) {
+    // Plenty of fully transparent and fully opaque pixels, since those are the edges of every formula
+    uint32_t pixel = random();
+    switch (random() % 4) {
+        case 0:
+            return pixel & 0x00FFFFFF;
+        case 1:
+            return pixel | 0xFF000000;
+        default:
+            return pixel;
+    }
+}
+
+// The row with guard pixels on both sides, so writing outside of it is caught
+static std::vector<uint32_t>
+random_row(std::mt19937 &random, int count) {
+    std::vector<uint32_t> row(count + guard_pixels * 2, guard_value);
+    for (int x = 0; x < count; x++)
+        row[guard_pixels + x] = random_pixel(random);
+    return row;
+}
+
+static bool
+guards_intact(const std::vector<uint32_t> &row, int count) {
+    for (int i = 0; i < guard_pixels; i++)
+        if (row[i] != guard_value || row[guard_pixels + count + i] != guard_value)
+            return false;
+    return true;
+}
+
+static int
+check(const char *name, int rows) {
+    std::mt19937 random(1234);
+    int failures = 0;
+    for (int i = 0; i < rows; i++) {
+        int count = random() % 300;
+        
+        auto row = random_row(random, count);
+        auto expected = row;
+        uint32_t r = random() % 256, g = random() % 256, b = random() % 256;
+        for (int x = 0; x < count; x++)
+            expected[guard_pixels + x] = dye_reference(expected[guard_pixels + x], r, g, b);
+        pixels_dye(row.data() + guard_pixels, count, r, g, b);
+        if (row != expected || !guards_intact(row, count)) {
+            printf("%s: pixels_dye differs on a row of %d pixels\n", name, count);
+            failures++;
+        }
+        
+        row = random_row(random, count);
+        expected = row;
+        uint8_t alpha_map[256];
+        for (auto &alpha: alpha_map)
+            alpha = random() % 256;
+        for (int x = 0; x < count; x++)
+            expected[guard_pixels + x] = remap_alpha_reference(expected[guard_pixels + x], alpha_map);
+        pixels_remap_alpha(row.data() + guard_pixels, count, alpha_map);
+        if (row != expected || !guards_intact(row, count)) {
+            printf("%s: pixels_remap_alpha differs on a row of %d pixels\n", name, count);
+            failures++;
+        }
+        
+        row = random_row(random, count);
+        PixelSums sums;
+        PixelSums expected_sums;
+        pixels_sum(row.data() + guard_pixels, count, &sums);
+        for (int x = 0; x < count; x++) {
+            uint32_t color = row[guard_pixels + x];
+            if ((color >> 24) == 0)
+                continue;
+            expected_sums.a += color >> 24;
+            expected_sums.r += (color >> 16) & 0xFF;
+            expected_sums.g += (color >> 8) & 0xFF;
+            expected_sums.b += color & 0xFF;
+            expected_sums.count++;
+        }
+        if (sums.a != expected_sums.a || sums.r != expected_sums.r || sums.g != expected_sums.g ||
+            sums.b != expected_sums.b || sums.count != expected_sums.count) {
+            printf("%s: pixels_sum differs on a row of %d pixels\n", name, count);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static void
+time_kernels(const char *name) {
+    // About what dyeing every icon of a full taskbar and start menu at 2x touches
+    const int width = 64;
+    const int rows = 200000;
+    std::mt19937 random(99);
+    std::vector<uint32_t> image(width * 64);
+    for (auto &pixel: image)
+        pixel = random_pixel(random);
+    uint8_t alpha_map[256];
+    for (int i = 0; i < 256; i++)
+        alpha_map[i] = 255 - i;
+    
+    auto per_pixel = [&](auto &&kernel) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rows; i++)
+            kernel(image.data() + (i % 64) * width, width);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return (double) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (rows * width);
+    };
+    PixelSums sums;
+    double dye = per_pixel([](uint32_t *row, int count) { pixels_dye(row, count, 12, 34, 56); });
+    double remap = per_pixel([&](uint32_t *row, int count) { pixels_remap_alpha(row, count, alpha_map); });
+    double sum = per_pixel([&](uint32_t *row, int count) { pixels_sum(row, count, &sums); });
+    printf("%-6s dye %.3f  remap_alpha %.3f  sum %.3f ns/pixel (%llu)\n", name, dye, remap, sum,
+           (unsigned long long) sums.count);
+}
+
+int main() {
+    struct Level {
+        PixelKernelLevel level;
+        const char *name;
+    };
+    Level levels[] = {{PixelKernelLevel::Scalar, "scalar"},
+                      {PixelKernelLevel::Sse2,   "sse2"},
+                      {PixelKernelLevel::Avx2,   "avx2"}};
+    
+    int failures = 0;
+    for (const auto &level: levels) {
+        if (pixel_kernels_use(level.level) != level.level) {
+            printf("%s: not supported here, skipped\n", level.name);
+            continue;
+        }
+        int level_failures = check(level.name, 20000);
+        if (level_failures == 0)
+            printf("%s: matches on 20000 rows\n", level.name);
+        failures += level_failures;
+        time_kernels(level.name);
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+// Paints a tree of 2,000 containers into an image surface with paint_container, the walk client_paint does every frame,
+// and counts the heap allocations it makes. Once every container's render order is cached there should be none, also
+// right after z_indexes changed. Built with -DRENDER_ORDER_BENCH=ON, exits with 1 if the walk allocated.
+
+#include "application.h"
+#include "container.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+App *app = nullptr;
+bool restart = false;
+
+static long allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    if (void *memory = malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    allocations++;
+    if (void *memory = malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    free(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+    free(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept {
+    free(memory);
+}
+
+static long containers_painted = 0;
+
+static void
+paint_cell(AppClient *, cairo_t *cr, Container *container) {
+    containers_painted++;
+    cairo_rectangle(cr, container->real_bounds.x, container->real_bounds.y, 1, 1);
+}
+
+// 40 rows of 49 cells under a root, 2,001 containers. Every seventh cell is raised so the rows don't paint in child
+// order.
+static Container *
+make_tree() {
+    auto root = new Container(::vbox, FILL_SPACE, FILL_SPACE);
+    root->when_paint = paint_cell;
+    for (int r = 0; r < 40; r++) {
+        auto row = root->child(::hbox, FILL_SPACE, FILL_SPACE);
+        row->when_paint = paint_cell;
+        for (int c = 0; c < 49; c++) {
+            auto cell = row->child(FILL_SPACE, FILL_SPACE);
+            cell->when_paint = paint_cell;
+            if (c % 7 == 0)
+                cell->z_index = 1;
+        }
+    }
+    return root;
+}
+
+// Allocations and microseconds per walk
+static void
+walk(AppClient *client, Container *root, int times, long *allocated, double *us) {
+    long before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < times; i++)
+        paint_container(app, client, root);
+    auto end = std::chrono::steady_clock::now();
+    *allocated = allocations - before;
+    *us = std::chrono::duration<double, std::micro>(end - start).count() / times;
+}
+
+int main() {
+    app = new App;
+    auto client = new AppClient;
+    client->app = app;
+    app->clients.push_back(client);
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 980, 800);
+    client->cr = cairo_create(surface);
+    client->root = make_tree();
+    layout(client, client->cr, client->root, Bounds(0, 0, 980, 800));
+
+    long allocated;
+    double us;
+    walk(client, client->root, 1, &allocated, &us);
+    long painted_per_walk = containers_painted;
+    printf("first walk: %ld containers painted, %ld allocations (building the render orders)\n", painted_per_walk,
+           allocated);
+
+    const int times = 1000;
+    walk(client, client->root, times, &allocated, &us);
+    printf("cached:     %.1f us per walk, %ld allocations over %d walks\n", us, allocated, times);
+    bool allocation_free = allocated == 0;
+
+    // Raising other cells makes every row sort again, into the vectors it already has
+    for (auto row: client->root->children)
+        for (int c = 0; c < row->children.size(); c++)
+            row->children[c]->z_index = c % 5 == 0 ? 2 : 0;
+    walk(client, client->root, 1, &allocated, &us);
+    printf("re-sorted:  %.1f us for the walk, %ld allocations\n", us, allocated);
+    allocation_free = allocation_free && allocated == 0;
+
+    printf(allocation_free ? "The paint walk didn't allocate\n" : "The paint walk allocated\n");
+    return allocation_free ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+// Times typing into the search menu against 10k to 100k made up names, once the way sort_and_add used to do it (the
+// priority of every item, then sorting all of the matches) and once through the search index. Every keystroke's top
+// results are checked to rank the same both ways. Built with -DSEARCH_INDEX_BENCH=ON, exits with 1 if any differ.
+
+#include "search_index.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static const size_t result_limit = 500;
+
+// What determine_priority gave, with history looked up the way search_history ranks it
+static int
+old_priority(const Sortable &item, const std::string &text, const std::string &lowercase_text,
+             const HistoryRanks &history, int *historical_ranking) {
+    unsigned long normal_find = item.name.find(text);
+    unsigned long lowercase_find = item.lowercase_name.find(text);
+
+    int prio = 11;
+    if (normal_find == 0 && item.name.length() == text.length()) {
+        prio = -1;
+    } else if (normal_find == 0) {
+        prio = 2;
+    } else if (lowercase_find == 0) {
+        prio = 3;
+    } else if (normal_find != std::string::npos) {
+        prio = 4;
+    } else if (lowercase_find != std::string::npos) {
+        prio = 5;
+    }
+
+    if (prio == 11) {
+        normal_find = item.name.find(lowercase_text);
+        if (normal_find == 0 && item.name.length() == lowercase_text.length()) {
+            prio = 6;
+        } else if (normal_find == 0) {
+            prio = 7;
+        } else if ((lowercase_find = item.lowercase_name.find(lowercase_text)) == 0) {
+            prio = 8;
+        } else if (normal_find != std::string::npos) {
+            prio = 9;
+        } else if (lowercase_find != std::string::npos) {
+            prio = 10;
+        }
+    }
+
+    if (prio != -1 && prio != 11) {
+        auto found = history.find(item.lowercase_name);
+        if (found != history.end()) {
+            *historical_ranking = found->second;
+            return 0;
+        }
+    }
+    return prio;
+}
+
+struct OldMatch {
+    const Sortable *item;
+    int priority;
+    int historical_ranking;
+};
+
+static void
+old_search(const std::vector<Sortable *> &items, const std::string &text, const HistoryRanks &history,
+           std::vector<OldMatch> *matches) {
+    matches->clear();
+    std::string lowercase_text(text);
+    std::transform(lowercase_text.begin(), lowercase_text.end(), lowercase_text.begin(), ::tolower);
+    for (auto *item: items) {
+        int historical_ranking = -1;
+        int priority = old_priority(*item, text, lowercase_text, history, &historical_ranking);
+        if (priority != 11)
+            matches->push_back({item, priority, historical_ranking});
+    }
+    std::sort(matches->begin(), matches->end(), [](const OldMatch &first, const OldMatch &second) {
+        if (first.priority != second.priority)
+            return first.priority < second.priority;
+        if (first.priority == 0)
+            return first.historical_ranking < second.historical_ranking;
+        return first.item->name.length() < second.item->name.length();
+    });
+}
+
+// Something like the names of $PATH executables and desktop files: lowercase words with dashes, digits, and now and
+// then a capitalized one
+static std::vector<Sortable *>
+make_items(std::mt19937 &random, int count) {
+    static const char *parts[] = {"gnome", "kde", "x", "fire", "fox", "steam", "lib", "config", "term", "code",
+                                  "py", "thon", "git", "mail", "calc", "view", "edit", "net", "work", "audio",
+                                  "video", "qt", "gtk", "manager", "settings", "panel", "bar", "win", "shell", "d"};
+    const int part_count = sizeof(parts) / sizeof(parts[0]);
+    std::vector<Sortable *> items;
+    for (int i = 0; i < count; i++) {
+        auto *item = new Sortable;
+        int words = 1 + random() % 3;
+        for (int w = 0; w < words; w++) {
+            std::string part = parts[random() % part_count];
+            if (random() % 8 == 0)
+                part[0] = toupper(part[0]);
+            if (w != 0)
+                item->name += random() % 2 ? "-" : "";
+            item->name += part;
+        }
+        if (random() % 4 == 0)
+            item->name += std::to_string(random() % 100);
+        item->lowercase_name = item->name;
+        std::transform(item->lowercase_name.begin(), item->lowercase_name.end(), item->lowercase_name.begin(),
+                       ::tolower);
+        items.push_back(item);
+    }
+    return items;
+}
+
+// Every keystroke of typing out some of the names, and a few texts in other capitalizations or that match nothing
+static std::vector<std::string>
+make_keystrokes(std::mt19937 &random, const std::vector<Sortable *> &items) {
+    std::vector<std::string> keystrokes;
+    for (int word = 0; word < 40; word++) {
+        std::string name = items[random() % items.size()]->name;
+        if (word % 10 == 0)
+            std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        for (size_t length = 1; length <= name.size(); length++)
+            keystrokes.push_back(name.substr(0, length));
+    }
+    for (const char *text: {"zzq", "Fox", "x-", "9"})
+        keystrokes.emplace_back(text);
+    return keystrokes;
+}
+
+static bool
+same_ranking(const std::vector<OldMatch> &old_matches, const std::vector<SearchMatch> &matches,
+             const SearchCorpus *corpus, const std::string &text) {
+    size_t expected = std::min(old_matches.size(), result_limit);
+    if (matches.size() != expected) {
+        printf("\"%s\": %zu results instead of %zu\n", text.c_str(), matches.size(), expected);
+        return false;
+    }
+    // Items which tie can come in any order (neither sort is stable), so what has to agree is what each place ranks by
+    for (size_t i = 0; i < expected; i++) {
+        const OldMatch &old_match = old_matches[i];
+        const SearchMatch &match = matches[i];
+        bool same = old_match.priority == match.priority &&
+                    (match.priority != 0 || old_match.historical_ranking == match.historical_ranking) &&
+                    old_match.item->name.length() == corpus->names[match.item].length();
+        if (!same) {
+            printf("\"%s\": place %zu is %s (%d) instead of %s (%d)\n", text.c_str(), i,
+                   corpus->names[match.item].c_str(), match.priority, old_match.item->name.c_str(),
+                   old_match.priority);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    std::mt19937 random(23);
+    bool all_same = true;
+
+    printf("%8s %10s %14s %14s %14s %14s\n", "items", "keystrokes", "old avg (us)", "old max (us)", "index avg (us)",
+           "index max (us)");
+    for (int count: {10000, 25000, 50000, 100000}) {
+        std::vector<Sortable *> items = make_items(random, count);
+        std::vector<std::string> keystrokes = make_keystrokes(random, items);
+
+        auto history = std::make_shared<HistoryRanks>();
+        for (int i = 0; i < 200; i++)
+            history->emplace(items[random() % items.size()]->lowercase_name, (int) history->size());
+        std::shared_ptr<const HistoryRanks> ranks = history;
+
+        SearchIndex index;
+        search_index_sync(&index, items);
+
+        double old_total = 0, old_max = 0, index_total = 0, index_max = 0;
+        std::vector<OldMatch> old_matches;
+        std::vector<SearchMatch> matches;
+        for (const auto &text: keystrokes) {
+            auto start = std::chrono::steady_clock::now();
+            old_search(items, text, *ranks, &old_matches);
+            auto middle = std::chrono::steady_clock::now();
+            search_corpus_query(index.corpus.get(), text, ranks, result_limit, &matches);
+            auto end = std::chrono::steady_clock::now();
+
+            double old_us = std::chrono::duration<double, std::micro>(middle - start).count();
+            double index_us = std::chrono::duration<double, std::micro>(end - middle).count();
+            old_total += old_us;
+            old_max = std::max(old_max, old_us);
+            index_total += index_us;
+            index_max = std::max(index_max, index_us);
+
+            if (!same_ranking(old_matches, matches, index.corpus.get(), text))
+                all_same = false;
+        }
+        printf("%8d %10zu %14.1f %14.1f %14.1f %14.1f\n", count, keystrokes.size(), old_total / keystrokes.size(),
+               old_max, index_total / keystrokes.size(), index_max);
+
+        for (auto *item: items)
+            delete item;
+    }
+
+    printf(all_same ? "Every keystroke ranked the same\n" : "Rankings differ\n");
+    return all_same ? 0 : 1;
+}
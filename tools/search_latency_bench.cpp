@@ -0,0 +1,199 @@
+// Types into a search over 50,000 made up names the way the search menu does it: every keystroke is handed to a ranking
+// thread under the next generation, a newer keystroke cancels whatever is still ranking, and finished results come back
+// over an eventfd the main loop polls. What's timed is keystroke to results in the main loop, for the keystrokes whose
+// results got shown, typing at 150 ms, 40 ms and 1 ms a key (the last like a held down key, which can outrun ranking
+// and have queries cancelled, so fewer get shown). Laying out and painting the 500 rows afterwards isn't included.
+// Built with -DSEARCH_LATENCY_BENCH=ON, exits with 1 if the 95th percentile at any speed is over a 60 Hz frame.
+
+#include "search_index.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <random>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+static const size_t result_limit = 500;
+static const int item_count = 50000;
+static const double frame_ms = 1000.0 / 60;
+
+typedef std::chrono::steady_clock Clock;
+
+// The same hand off as search_worker and search_finished in the search menu
+struct SearchJob {
+    uint64_t generation = 0;
+    std::string text;
+    Clock::time_point typed;
+    std::vector<SearchMatch> matches;
+};
+
+static std::shared_ptr<SearchCorpus> corpus;
+static std::shared_ptr<const HistoryRanks> ranks;
+static std::atomic<uint64_t> search_generation{0};
+static std::mutex search_mutex;
+static std::condition_variable search_condition;
+static std::optional<SearchJob> waiting_search;
+static std::optional<SearchJob> finished_search;
+static bool search_thread_stopping = false;
+static int search_done_fd = -1;
+
+static void
+search_worker() {
+    std::unique_lock lock(search_mutex);
+    while (true) {
+        search_condition.wait(lock, [] { return search_thread_stopping || waiting_search.has_value(); });
+        if (search_thread_stopping)
+            return;
+        SearchJob job = std::move(*waiting_search);
+        waiting_search.reset();
+
+        lock.unlock();
+        bool done = search_corpus_query(corpus.get(), job.text, ranks, result_limit, &job.matches,
+                                        &search_generation, job.generation);
+        lock.lock();
+
+        if (done && job.generation == search_generation) {
+            finished_search = std::move(job);
+            uint64_t one = 1;
+            write(search_done_fd, &one, sizeof(one));
+        }
+    }
+}
+
+static void
+type_key(const std::string &text) {
+    SearchJob job;
+    job.generation = ++search_generation;
+    job.text = text;
+    job.typed = Clock::now();
+    {
+        std::lock_guard lock(search_mutex);
+        finished_search.reset();
+        waiting_search = std::move(job);
+    }
+    search_condition.notify_all();
+}
+
+// Polls the eventfd until deadline, recording how long every shown result took since its keystroke
+static void
+run_main_loop(Clock::time_point deadline, std::vector<double> *latencies) {
+    while (true) {
+        auto now = Clock::now();
+        if (now >= deadline)
+            return;
+        int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        pollfd descriptor = {search_done_fd, POLLIN, 0};
+        if (poll(&descriptor, 1, timeout) <= 0)
+            continue;
+        uint64_t count;
+        read(search_done_fd, &count, sizeof(count));
+        std::optional<SearchJob> job;
+        {
+            std::lock_guard lock(search_mutex);
+            job.swap(finished_search);
+        }
+        if (job && job->generation == search_generation)
+            latencies->push_back(std::chrono::duration<double, std::milli>(Clock::now() - job->typed).count());
+    }
+}
+
+static std::vector<Sortable *>
+make_items(std::mt19937 &random, int count) {
+    static const char *parts[] = {"gnome", "kde", "x", "fire", "fox", "steam", "lib", "config", "term", "code",
+                                  "py", "thon", "git", "mail", "calc", "view", "edit", "net", "work", "audio",
+                                  "video", "qt", "gtk", "manager", "settings", "panel", "bar", "win", "shell", "d"};
+    const int part_count = sizeof(parts) / sizeof(parts[0]);
+    std::vector<Sortable *> items;
+    for (int i = 0; i < count; i++) {
+        auto *item = new Sortable;
+        int words = 1 + random() % 3;
+        for (int w = 0; w < words; w++) {
+            std::string part = parts[random() % part_count];
+            if (random() % 8 == 0)
+                part[0] = toupper(part[0]);
+            if (w != 0)
+                item->name += random() % 2 ? "-" : "";
+            item->name += part;
+        }
+        if (random() % 4 == 0)
+            item->name += std::to_string(random() % 100);
+        item->lowercase_name = item->name;
+        std::transform(item->lowercase_name.begin(), item->lowercase_name.end(), item->lowercase_name.begin(),
+                       ::tolower);
+        items.push_back(item);
+    }
+    return items;
+}
+
+static double
+percentile(std::vector<double> values, double fraction) {
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t) (fraction * values.size()))];
+}
+
+int main() {
+    std::mt19937 random(24);
+    std::vector<Sortable *> items = make_items(random, item_count);
+    auto history = std::make_shared<HistoryRanks>();
+    for (int i = 0; i < 200; i++)
+        history->emplace(items[random() % items.size()]->lowercase_name, (int) history->size());
+    ranks = history;
+
+    SearchIndex index;
+    search_index_sync(&index, items);
+    corpus = index.corpus;
+
+    std::vector<std::string> words;
+    for (int i = 0; i < 30; i++)
+        words.push_back(items[random() % items.size()]->name);
+
+    search_done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (search_done_fd == -1) {
+        perror("eventfd");
+        return 1;
+    }
+    std::thread search_thread(search_worker);
+
+    bool within_frame = true;
+    printf("%d items, one frame is %.1f ms\n", item_count, frame_ms);
+    printf("%12s %10s %8s %10s %10s %10s\n", "ms per key", "keys", "shown", "p50 (ms)", "p95 (ms)", "max (ms)");
+    for (int key_ms: {150, 40, 1}) {
+        std::vector<double> latencies;
+        int keys = 0;
+        for (const auto &word: words) {
+            for (size_t length = 1; length <= word.size(); length++) {
+                type_key(word.substr(0, length));
+                keys++;
+                run_main_loop(Clock::now() + std::chrono::milliseconds(key_ms), &latencies);
+            }
+            // Stop typing long enough for the last keystroke to come back, then clear the search bar
+            run_main_loop(Clock::now() + std::chrono::milliseconds(200), &latencies);
+        }
+        double p95 = percentile(latencies, 0.95);
+        printf("%12d %10d %8zu %10.2f %10.2f %10.2f\n", key_ms, keys, latencies.size(), percentile(latencies, 0.5),
+               p95, latencies.empty() ? 0 : *std::max_element(latencies.begin(), latencies.end()));
+        if (latencies.empty() || p95 > frame_ms)
+            within_frame = false;
+    }
+
+    {
+        std::lock_guard lock(search_mutex);
+        search_thread_stopping = true;
+    }
+    search_condition.notify_all();
+    search_thread.join();
+    close(search_done_fd);
+    for (auto *item: items)
+        delete item;
+
+    printf(within_frame ? "Results came back within a frame\n" : "Results took longer than a frame\n");
+    return within_frame ? 0 : 1;
+}
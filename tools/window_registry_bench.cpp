@@ -0,0 +1,131 @@
+// Times working out which windows a new _NET_CLIENT_LIST_STACKING adds and removes, for 500 windows on the taskbar, the
+// way stacking_order_changed used to (every id against every other one) and with stacking_diff. Both have to agree.
+// Built with -DWINDOW_REGISTRY_BENCH=ON, exits with 1 if they don't.
+
+#include "taskbar.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+App *app = nullptr;
+bool restart = false;
+
+static const int window_count = 500;
+static const int ignored_count = 20;
+static const int repeats = 2000;
+
+// What the old nested loops gave. They had no ignored windows, so those came out as added every time.
+static void
+old_diff(const std::vector<xcb_window_t> &new_windows, const std::vector<xcb_window_t> &old_windows,
+         std::vector<xcb_window_t> *added, std::vector<xcb_window_t> *removed) {
+    for (auto new_window: new_windows) {
+        bool found = false;
+        for (auto old_window: old_windows)
+            if (old_window == new_window)
+                found = true;
+        if (!found)
+            added->push_back(new_window);
+    }
+    for (auto old_window: old_windows) {
+        bool found = false;
+        for (auto new_window: new_windows)
+            if (old_window == new_window)
+                found = true;
+        if (!found)
+            removed->push_back(old_window);
+    }
+}
+
+struct Scenario {
+    const char *name;
+    std::vector<xcb_window_t> stacking;
+};
+
+int main() {
+    std::mt19937 random(12);
+
+    // Registered windows are 1..500, the ignored ones (docks, our own windows) come after them
+    std::unordered_map<xcb_window_t, RegisteredWindow> registry;
+    std::vector<xcb_window_t> registered;
+    for (xcb_window_t id = 1; id <= window_count; id++) {
+        registry[id] = {};
+        registered.push_back(id);
+    }
+    std::unordered_set<xcb_window_t> ignored;
+    std::vector<xcb_window_t> stacking = registered;
+    for (xcb_window_t id = window_count + 1; id <= window_count + ignored_count; id++) {
+        ignored.insert(id);
+        stacking.push_back(id);
+    }
+    std::shuffle(stacking.begin(), stacking.end(), random);
+
+    std::vector<Scenario> scenarios;
+    {
+        // Focusing a window raises it to the top
+        Scenario focus = {"focus switch", stacking};
+        std::rotate(focus.stacking.begin() + 100, focus.stacking.begin() + 101, focus.stacking.end());
+        scenarios.push_back(focus);
+
+        Scenario opened = {"window opened", stacking};
+        opened.stacking.push_back(10000);
+        scenarios.push_back(opened);
+
+        Scenario closed = {"window closed", stacking};
+        closed.stacking.erase(std::find(closed.stacking.begin(), closed.stacking.end(), (xcb_window_t) 250));
+        scenarios.push_back(closed);
+
+        // 50 windows gone and 50 new ones
+        Scenario replaced = {"50 replaced", {}};
+        for (auto id: stacking)
+            if (id > 50)
+                replaced.stacking.push_back(id);
+        for (xcb_window_t id = 20000; id < 20050; id++)
+            replaced.stacking.push_back(id);
+        scenarios.push_back(replaced);
+    }
+
+    bool all_same = true;
+    printf("%-14s %10s %12s %12s\n", "", "windows", "old (us)", "diff (us)");
+    for (const auto &scenario: scenarios) {
+        std::vector<xcb_window_t> old_added, old_removed, added, removed;
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; i++) {
+            old_added.clear();
+            old_removed.clear();
+            old_diff(scenario.stacking, registered, &old_added, &old_removed);
+        }
+        auto middle = std::chrono::steady_clock::now();
+        // Every ignored window stays in the list, so nothing is taken out of it
+        std::unordered_set<xcb_window_t> still_ignored = ignored;
+        for (int i = 0; i < repeats; i++) {
+            added.clear();
+            removed.clear();
+            stacking_diff(scenario.stacking.data(), scenario.stacking.size(), registry, &still_ignored, &added,
+                          &removed);
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        old_added.erase(std::remove_if(old_added.begin(), old_added.end(),
+                                       [&ignored](xcb_window_t id) { return ignored.count(id) != 0; }),
+                        old_added.end());
+        std::sort(old_added.begin(), old_added.end());
+        std::sort(old_removed.begin(), old_removed.end());
+        std::sort(added.begin(), added.end());
+        std::sort(removed.begin(), removed.end());
+        if (added != old_added || removed != old_removed) {
+            printf("%s: %zu added and %zu removed instead of %zu and %zu\n", scenario.name, added.size(),
+                   removed.size(), old_added.size(), old_removed.size());
+            all_same = false;
+        }
+
+        printf("%-14s %10zu %12.2f %12.2f\n", scenario.name, scenario.stacking.size(),
+               std::chrono::duration<double, std::micro>(middle - start).count() / repeats,
+               std::chrono::duration<double, std::micro>(end - middle).count() / repeats);
+    }
+
+    printf(all_same ? "Both diffs agree\n" : "The diffs differ\n");
+    return all_same ? 0 : 1;
+}